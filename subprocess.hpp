@@ -35,20 +35,33 @@ Documentation for C++ subprocessing libraray.
 #define SUBPROCESS_HPP
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <functional>
 #include <future>
 #include <initializer_list>
 #include <iostream>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #if (defined _MSC_VER) || (defined __MINGW32__)
@@ -69,14 +82,89 @@ extern "C" {
   #define open _open
   #define fileno _fileno
 #else
+  #include <poll.h>
+  #include <sys/stat.h>
+  #include <sys/resource.h>
   #include <sys/wait.h>
   #include <unistd.h>
+#endif
+#ifdef __linux__
+  #include <dirent.h>
+  #include <linux/futex.h>
+  #include <sched.h>
+  #include <sys/mman.h>
+  #include <sys/prctl.h>
+  #include <sys/sendfile.h>
+  #include <sys/syscall.h>
 #endif
   #include <csignal>
   #include <fcntl.h>
   #include <sys/types.h>
 }
 
+/*!
+ * Static probes for bpftrace and SystemTap, compiled in when
+ * <sys/sdt.h> is found and SUBPROCESS_NO_PROBES is not defined.
+ * An untraced probe is a nop. Provider "subprocess":
+ *   spawn(pid, exe, spawn_ns)                 The child exec'd
+ *   spawn__failure(pid, exe, stage, errno)    It did not, pid -1 if
+ *                                             it was not created
+ *   child__error(stage, errno)                Fired in the forked child
+ *   exit(pid, code, signaled, wall_ns)        The child was reaped
+ *   read(fd, bytes, ns)                       A pipe of the child read till EOF
+ *   send(fd, bytes, ns)                       Popen::send
+ * The latencies come from Popen::stats(), and are -1 when it is
+ * not recorded.
+ *
+ * When _SDT_HAS_SEMAPHORES is defined before sdt.h is included,
+ * each probe gets a semaphore and its arguments are evaluated
+ * only while a tracer is attached to it.
+ *
+ * Eg:
+ *   bpftrace -e 'usdt:./app:subprocess:spawn
+ *                { @us[str(arg1)] = hist(arg2 / 1000); }'
+ */
+#if !defined(SUBPROCESS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+  #include <sys/sdt.h>
+  #define SUBPROCESS_HAVE_PROBES
+#endif
+#endif
+
+#ifdef SUBPROCESS_HAVE_PROBES
+#ifdef _SDT_HAS_SEMAPHORES
+  // Raised by the tracer while it is attached. Weak, so that
+  // every translation unit can define them.
+  extern "C" {
+  #define SUBPROCESS_SEMAPHORE(name) \
+    __extension__ volatile unsigned short subprocess_##name##_semaphore \
+      __attribute__((weak, unused, section(".probes")))
+    SUBPROCESS_SEMAPHORE(spawn);
+    SUBPROCESS_SEMAPHORE(spawn__failure);
+    SUBPROCESS_SEMAPHORE(child__error);
+    SUBPROCESS_SEMAPHORE(exit);
+    SUBPROCESS_SEMAPHORE(read);
+    SUBPROCESS_SEMAPHORE(send);
+  #undef SUBPROCESS_SEMAPHORE
+  }
+  #define SUBPROCESS_PROBE_ENABLED(name) \
+    __builtin_expect(subprocess_##name##_semaphore != 0, 0)
+#else
+  #define SUBPROCESS_PROBE_ENABLED(name) true
+#endif
+  #define SUBPROCESS_PROBE2(name, a, b) \
+    do { if (SUBPROCESS_PROBE_ENABLED(name)) STAP_PROBE2(subprocess, name, a, b); } while (0)
+  #define SUBPROCESS_PROBE3(name, a, b, c) \
+    do { if (SUBPROCESS_PROBE_ENABLED(name)) STAP_PROBE3(subprocess, name, a, b, c); } while (0)
+  #define SUBPROCESS_PROBE4(name, a, b, c, d) \
+    do { if (SUBPROCESS_PROBE_ENABLED(name)) STAP_PROBE4(subprocess, name, a, b, c, d); } while (0)
+#else
+  #define SUBPROCESS_PROBE_ENABLED(name) false
+  #define SUBPROCESS_PROBE2(name, a, b) do {} while (0)
+  #define SUBPROCESS_PROBE3(name, a, b, c) do {} while (0)
+  #define SUBPROCESS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
 /*!
  * Getting started with reading this source code.
  * The source is mainly divided into four parts:
@@ -111,6 +199,26 @@ static const size_t SP_MAX_ERR_BUF_SIZ = 1024;
 // by 1.5 times its previous capacity
 static const size_t DEFAULT_BUF_CAP_BYTES = 8192;
 
+// Time a timed out child is given to exit on SIGTERM
+// before it is sent SIGKILL
+static const int DEFAULT_KILL_GRACE_MS = 1000;
+
+// Define SUBPROCESS_NO_STATS to compile out the recording
+// of the timings and byte counts of Popen::stats()
+#ifdef SUBPROCESS_NO_STATS
+static constexpr bool STATS_ENABLED = false;
+#else
+static constexpr bool STATS_ENABLED = true;
+#endif
+
+// Define SUBPROCESS_NO_METRICS to compile out the
+// recording into MetricsRegistry::global()
+#ifdef SUBPROCESS_NO_METRICS
+static constexpr bool METRICS_ENABLED = false;
+#else
+static constexpr bool METRICS_ENABLED = true;
+#endif
+
 
 /*-----------------------------------------------
  *    EXCEPTION CLASSES
@@ -147,9 +255,91 @@ public:
 class OSError: public std::runtime_error
 {
 public:
+  int err_code;
   OSError(const std::string& err_msg, int err_code):
-    std::runtime_error( err_msg + ": " + std::strerror(err_code) )
+    std::runtime_error( err_msg + ": " + std::strerror(err_code) ),
+    err_code(err_code)
+  {}
+};
+
+
+/*!
+ * class: TimeoutExpired
+ * Thrown when the child did not complete the requested
+ * operation within the allotted time.
+ * When thrown by wait() or communicate() the child has
+ * been terminated and reaped, and what it wrote before
+ * that is kept in `output` and `error`.
+ */
+class TimeoutExpired: public std::runtime_error
+{
+public:
+  TimeoutExpired(const std::string& msg):
+    std::runtime_error(msg)
+  {}
+  TimeoutExpired(const std::string& msg, int retcode,
+                 std::vector<char> output, std::vector<char> error):
+    std::runtime_error(msg), retcode(retcode),
+    output(std::move(output)), error(std::move(error))
   {}
+
+  // Exit status of the terminated child, -1 if unknown
+  int retcode = -1;
+  // Partial output and error of the child
+  std::vector<char> output;
+  std::vector<char> error;
+};
+
+/*!
+ * The steps of spawning a child, as reported in SpawnError.
+ * SPAWN_SETUP covers the work done in the parent (pipes, fork).
+ */
+enum SpawnStage {
+  SPAWN_SETUP = 1,
+  SPAWN_DUP2,
+  SPAWN_PASS_FDS,
+  SPAWN_CLOSE_FDS,
+  SPAWN_CHDIR,
+  SPAWN_PREEXEC,
+  SPAWN_SETSID,
+  SPAWN_SETPGID,
+  SPAWN_PDEATHSIG,
+  SPAWN_SCHED,
+  SPAWN_RLIMIT,
+  SPAWN_EXEC,
+  // Talking to the child once it was spawned
+  SPAWN_IO,
+};
+
+/*!
+ * struct: SpawnError
+ * Why a child could not be started: the step which failed and
+ * its errno. A child which fails before exec writes this as is
+ * to the parent, so it is kept trivially copyable.
+ * It converts to true if there was an error.
+ */
+struct SpawnError
+{
+  int32_t stage = 0;
+  int32_t err = 0;
+
+  explicit operator bool() const { return err != 0; }
+
+  std::error_code code() const { return std::error_code(err, std::generic_category()); }
+
+  // Same text as the CalledProcessError thrown for it,
+  // Eg: "execve failed: No such file or directory"
+  std::string message() const
+  {
+    static const char* names[] = {
+      "spawn failed", "spawn setup failed", "dup2 failed", "pass_fds failed",
+      "close_fds failed", "chdir failed", "preexec_func failed",
+      "setsid failed", "setpgid failed", "pdeathsig failed",
+      "scheduling setup failed", "setrlimit failed", "execve failed", "communicate failed",
+    };
+    int idx = (stage >= SPAWN_SETUP && stage <= SPAWN_IO) ? stage : 0;
+    return std::string(names[idx]) + ": " + std::strerror(err);
+  }
 };
 
 //--------------------------------------------------------------------
@@ -449,6 +639,101 @@ namespace util
   }
 
 
+  /*!
+   * Function: fnv1a
+   * Parameters:
+   * [in] data : Bytes to be hashed.
+   * [in] length : Number of bytes in `data`.
+   * [in] seed : Initial value of the hash. Defaults to the FNV offset basis.
+   * [out] uint64_t : The 64 bit FNV-1a hash of the data.
+   *
+   * NOTE: Used to build keys for caches and the like,
+   * it is not a cryptographic hash.
+   */
+  static inline
+  uint64_t fnv1a(const char* data, size_t length,
+                 uint64_t seed = 14695981039346656037ULL)
+  {
+    uint64_t h = seed;
+    for (size_t i = 0; i < length; i++) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  /*!
+   * Function: sha256
+   * Parameters:
+   * [in] data : Bytes to be hashed.
+   * [in] length : Number of bytes in `data`.
+   * [out] string : The SHA-256 digest of the data, in hex.
+   *
+   * NOTE: Used where a collision would hand out wrong data,
+   * such as the keys of cached command outputs.
+   */
+  static inline std::string sha256(const char* data, size_t length)
+  {
+    static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    auto compress = [&](const unsigned char* blk) {
+      uint32_t w[64];
+      for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t(blk[4 * i]) << 24) | (uint32_t(blk[4 * i + 1]) << 16) |
+               (uint32_t(blk[4 * i + 2]) << 8) | uint32_t(blk[4 * i + 3]);
+      }
+      for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+      uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+      for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                      ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+      h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t full = length - length % 64;
+    for (size_t i = 0; i < full; i += 64) compress(bytes + i);
+
+    // The tail, the 0x80 marker and the bit length fill one
+    // or two more blocks
+    unsigned char tail[128] = {};
+    size_t rest = length - full;
+    if (rest) std::memcpy(tail, bytes + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(length) * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    for (size_t i = 0; i < tail_len; i += 64) compress(tail + i);
+
+    char hex[65];
+    for (int i = 0; i < 8; i++) snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    return std::string(hex, 64);
+  }
+
+
 #ifndef __USING_WINDOWS__
   /*!
    * Function: set_clo_on_exec
@@ -519,6 +804,56 @@ namespace util
     return nwritten;
   }
 
+#ifndef __USING_WINDOWS__
+  /*!
+   * Function: send_file_range
+   * Writes `length` bytes starting at `offset` of the file
+   * referred by `in_fd` to the descriptor `out_fd`.
+   * On linux the data is moved in-kernel with sendfile, else
+   * it is copied through a stack buffer with pread.
+   * Parameters:
+   * [in] in_fd : A regular file opened for reading.
+   * [in] offset : Offset in the file from where to start.
+   * [in] length : The number of bytes to be written.
+   * [in] out_fd : The descriptor to write to. Usually a pipe.
+   * [out] ssize_t : Number of bytes written or -1 in case of failure.
+   */
+  static inline
+  ssize_t send_file_range(int in_fd, off_t offset, size_t length, int out_fd)
+  {
+    size_t nwritten = 0;
+#ifdef __linux__
+    while (nwritten < length) {
+      ssize_t sent = sendfile(out_fd, in_fd, &offset, length - nwritten);
+      if (sent == -1) {
+        if (errno == EINTR) continue;
+        // Not supported for this pair of descriptors,
+        // fallback to copying the remaining data.
+        if ((errno == EINVAL || errno == ENOSYS) && nwritten == 0) break;
+        return -1;
+      }
+      if (sent == 0) return nwritten;
+      nwritten += sent;
+    }
+    if (nwritten == length) return nwritten;
+#endif
+    char buf[8192];
+    while (nwritten < length) {
+      size_t want = std::min(sizeof(buf), length - nwritten);
+      ssize_t rd = pread(in_fd, buf, want, offset);
+      if (rd == -1) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      if (rd == 0) break;
+      if (write_n(out_fd, buf, rd) == -1) return -1;
+      offset += rd;
+      nwritten += rd;
+    }
+    return nwritten;
+  }
+#endif
+
 
   /*!
    * Function: read_atmost_n
@@ -563,6 +898,16 @@ namespace util
   }
 
 
+  // Nanoseconds from `from` to `to`, -1 if either is unset.
+  // The latency argument of the static probes.
+  static inline long long ns_between(std::chrono::steady_clock::time_point from,
+                                     std::chrono::steady_clock::time_point to)
+  {
+    if (from == std::chrono::steady_clock::time_point() ||
+        to == std::chrono::steady_clock::time_point()) return -1;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+  }
+
   /*!
    * Function: read_all
    * Reads all the available data from `fp` into
@@ -578,6 +923,10 @@ namespace util
 
   static inline int read_all(FILE* fp, std::vector<char>& buf)
   {
+#ifdef SUBPROCESS_HAVE_PROBES
+    std::chrono::steady_clock::time_point start;
+    if (SUBPROCESS_PROBE_ENABLED(read)) start = std::chrono::steady_clock::now();
+#endif
     auto buffer = buf.data();
     int total_bytes_read = 0;
     int fill_sz = buf.size();
@@ -607,6 +956,8 @@ namespace util
       }
     }
     buf.erase(buf.begin()+total_bytes_read, buf.end()); // remove extra nulls
+    SUBPROCESS_PROBE3(read, fileno(fp), total_bytes_read,
+                      ns_between(start, std::chrono::steady_clock::now()));
     return total_bytes_read;
   }
 
@@ -617,6 +968,8 @@ namespace util
    * and returns its status.
    * Parameters:
    * [in] pid : The pid of the process.
+   * [out] usage : If not null, filled with the resource
+   *               usage of the reaped child.
    * [out] pair<int, int>:
    *    pair.first : Return code of the waitpid call.
    *    pair.second : Exit status of the process.
@@ -625,12 +978,12 @@ namespace util
    *  till the child is exited.
    */
   static inline
-  std::pair<int, int> wait_for_child_exit(int pid)
+  std::pair<int, int> wait_for_child_exit(int pid, struct rusage* usage = nullptr)
   {
     int status = 0;
     int ret = -1;
     while (1) {
-      ret = waitpid(pid, &status, 0);
+      ret = wait4(pid, &status, 0, usage);
       if (ret == -1) break;
       if (ret == 0) continue;
       return std::make_pair(ret, status);
@@ -638,1469 +991,8046 @@ namespace util
 
     return std::make_pair(ret, status);
   }
+
+  /*!
+   * Function: wait_for_child_exit_until
+   * Waits for the child with pid `pid` to exit, but not past
+   * `deadline`. The child is not reaped.
+   * Parameters:
+   * [in] pid : The pid of the child.
+   * [in] deadline : When to give up.
+   * [out] bool : true if the child has exited (or was already
+   *              reaped), false if the deadline passed.
+   *
+   *  NOTE: On linux the wait sleeps on a pidfd of the child,
+   *  elsewhere the child is polled with a growing interval.
+   */
+  static inline
+  bool wait_for_child_exit_until(int pid, std::chrono::steady_clock::time_point deadline)
+  {
+    using clock = std::chrono::steady_clock;
+    auto remaining_ms = [&deadline]() -> int {
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - clock::now()).count() + 1;
+      return static_cast<int>(std::max<long long>(0, std::min<long long>(ms, 60000)));
+    };
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd != -1) {
+      struct pollfd pfd = {pidfd, POLLIN, 0};
+      int ret;
+      do {
+        ret = ::poll(&pfd, 1, remaining_ms());
+      } while ((ret == -1 && errno == EINTR) ||
+               (ret == 0 && clock::now() < deadline));
+      close(pidfd);
+      return ret == 1;
+    }
+    if (errno == ESRCH) return true;
 #endif
+    std::chrono::milliseconds backoff(1);
+    while (true) {
+      siginfo_t info;
+      info.si_pid = 0;
+      if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1) {
+        if (errno == EINTR) continue;
+        return true;
+      }
+      if (info.si_pid != 0) return true;
+      if (clock::now() >= deadline) return false;
+      std::this_thread::sleep_for(std::min(backoff, std::chrono::milliseconds(remaining_ms())));
+      backoff = std::min(backoff * 2, std::chrono::milliseconds(50));
+    }
+  }
 
-} // end namespace util
+  /*!
+   * Function: child_stopped
+   * True while the child `pid` is stopped by a signal.
+   * The stop is left unreported, so it can be checked again.
+   */
+  static inline bool child_stopped(int pid)
+  {
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, pid, &info, WSTOPPED | WNOHANG | WNOWAIT) == 0 &&
+           info.si_pid != 0;
+  }
 
+  /*!
+   * Function: find_executable
+   * Resolves `name` to a path the same way execvp would
+   * by looking through `path_env` (a PATH like string).
+   * Names containing a '/' are returned as is.
+   * Returns an empty string if nothing is found.
+   */
+  static inline std::string find_executable(const std::string& name,
+                                            const std::string& path_env)
+  {
+    if (name.empty() || name.find('/') != std::string::npos) return name;
+    for (auto& dir : split(path_env, ":")) {
+      auto candidate = (dir.empty() ? std::string(".") : dir) + "/" + name;
+      if (access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    return std::string();
+  }
 
+  /*!
+   * Function: split_simple_command
+   * Checks if `cmd` can be run without a shell: a plain list
+   * of words with no quoting, expansion, redirection, control
+   * operator or comment, whose first word is neither a builtin
+   * nor an assignment. If so, the words are returned, else an
+   * empty vector, in which case `cmd` needs /bin/sh.
+   */
+  static inline std::vector<std::string> split_simple_command(const std::string& cmd)
+  {
+    static const char* meta = "|&;<>()$`\\\"'*?[]{}#~\n";
+    static const std::set<std::string> builtins = {
+      "!", ".", ":", "alias", "bg", "break", "case", "cd", "command",
+      "continue", "declare", "do", "done", "elif", "else", "esac", "eval",
+      "exec", "exit", "export", "fc", "fg", "fi", "for", "function",
+      "getopts", "hash", "if", "jobs", "let", "local", "read", "readonly",
+      "return", "select", "set", "shift", "source", "then", "time",
+      "times", "trap", "type", "typeset", "ulimit", "umask", "unalias",
+      "unset", "until", "wait", "while",
+    };
+
+    if (cmd.find_first_of(meta) != std::string::npos) return {};
+    auto words = split(cmd, " \t");
+    words.erase(std::remove(words.begin(), words.end(), std::string()), words.end());
+    if (words.empty()) return {};
+    if (words[0].find('=') != std::string::npos) return {};
+    if (builtins.count(words[0])) return {};
+    return words;
+  }
 
-/* -------------------------------
- *     Popen Arguments
- * -------------------------------
- */
+  /*!
+   * Function: shell_command_name
+   * The program a shell command line starts with, or "sh" if
+   * it does not start with a plain word, as it does with an
+   * assignment, a quote or a compound command.
+   */
+  static inline std::string shell_command_name(const std::string& cmd)
+  {
+    auto start = cmd.find_first_not_of(" \t\n");
+    if (start == std::string::npos) return "sh";
+    auto end = cmd.find_first_of(" \t\n|&;<>()", start);
+    auto word = cmd.substr(start, end == std::string::npos ? end : end - start);
+    if (word.empty() || word.find_first_of("=$`\\\"'{}!#~") != std::string::npos) return "sh";
+    return word;
+  }
 
-/*!
- * The buffer size of the stdin/stdout/stderr
- * streams of the child process.
- * Default value is 0.
- */
-struct bufsize {
-  explicit bufsize(int siz): bufsiz(siz) {}
-  int  bufsiz = 0;
-};
+#ifdef __linux__
+  /*!
+   * Function: parse_cpu_list
+   * Parses a list like "0-3,8,10-11" as found in sysfs.
+   */
+  static inline std::vector<int> parse_cpu_list(const std::string& str)
+  {
+    std::vector<int> res;
+    const char* p = str.c_str();
+    while (*p) {
+      char* end;
+      long lo = strtol(p, &end, 10);
+      if (end == p) break;
+      long hi = lo;
+      if (*end == '-') {
+        p = end + 1;
+        hi = strtol(p, &end, 10);
+        if (end == p) break;
+      }
+      for (long cpu = lo; cpu <= hi; cpu++) res.push_back(static_cast<int>(cpu));
+      p = end;
+      if (*p == ',') p++;
+    }
+    return res;
+  }
 
-/*!
- * Option to defer spawning of the child process
- * till `Popen::start_process` API is called.
- * Default value is false.
- */
-struct defer_spawn {
-  explicit defer_spawn(bool d): defer(d) {}
-  bool defer  = false;
-};
+  // Reads a cpu list file of sysfs, empty if it is not there
+  static inline std::vector<int> read_cpu_list(const std::string& path)
+  {
+    char line[4096];
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) return {};
+    bool ok = fgets(line, sizeof(line), fp) != nullptr;
+    fclose(fp);
+    return ok ? parse_cpu_list(line) : std::vector<int>();
+  }
 
-/*!
- * Option to close all file descriptors
- * when the child process is spawned.
- * The close fd list does not include
- * input/output/error if they are explicitly
- * set as part of the Popen arguments.
- *
- * Default value is false.
- */
-struct close_fds {
-  explicit close_fds(bool c): close_all(c) {}
-  bool close_all = false;
-};
+  // A live process as found in /proc
+  struct ProcLink {
+    int pid;
+    int ppid;
+    unsigned long long start;   // Clock ticks after boot
+  };
 
-/*!
- * Option to make the child process as the
- * session leader and thus the process
- * group leader.
- * Default value is false.
- */
-struct session_leader {
-  explicit session_leader(bool sl): leader_(sl) {}
-  bool leader_ = false;
-};
+  /*!
+   * Function: read_proc_links
+   * Returns the parent and the start time of every
+   * live process, read from /proc/<pid>/stat.
+   */
+  static inline std::vector<ProcLink> read_proc_links()
+  {
+    std::vector<ProcLink> links;
+    DIR* dir = opendir("/proc");
+    if (!dir) return links;
+    while (struct dirent* ent = readdir(dir)) {
+      char* end;
+      long child = strtol(ent->d_name, &end, 10);
+      if (*end || child <= 0) continue;
+
+      char path[64], line[512];
+      snprintf(path, sizeof(path), "/proc/%ld/stat", child);
+      FILE* fp = fopen(path, "r");
+      if (!fp) continue;
+      bool ok = fgets(line, sizeof(line), fp) != nullptr;
+      fclose(fp);
+      // The command name may hold anything, parse past it
+      const char* rparen = ok ? strrchr(line, ')') : nullptr;
+      ProcLink l;
+      l.pid = static_cast<int>(child);
+      if (rparen && sscanf(rparen + 1,
+                           " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                           " %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                           &l.ppid, &l.start) == 2) {
+        links.push_back(l);
+      }
+    }
+    closedir(dir);
+    return links;
+  }
 
-struct shell {
-  explicit shell(bool s): shell_(s) {}
-  bool shell_ = false;
-};
+  /*!
+   * Function: list_descendants
+   * Returns the pids of all the descendants of `roots` in
+   * `links`, parents before their children.
+   */
+  static inline std::vector<int> list_descendants(const std::vector<ProcLink>& links,
+                                                  std::vector<int> roots)
+  {
+    std::multimap<int, int> children;
+    for (auto& l : links) children.emplace(l.ppid, l.pid);
+
+    std::vector<int> res;
+    for (size_t i = 0; i < roots.size(); i++) {
+      auto range = children.equal_range(roots[i]);
+      for (auto it = range.first; it != range.second; ++it) {
+        res.push_back(it->second);
+        roots.push_back(it->second);
+      }
+    }
+    return res;
+  }
 
-/*!
- * Base class for all arguments involving string value.
- */
-struct string_arg
-{
-  string_arg(const char* arg): arg_value(arg) {}
-  string_arg(std::string&& arg): arg_value(std::move(arg)) {}
-  string_arg(std::string arg): arg_value(std::move(arg)) {}
-  std::string arg_value;
-};
+  // Same, for the live descendants of `pid`
+  static inline std::vector<int> list_descendants(int pid)
+  {
+    return list_descendants(read_proc_links(), {pid});
+  }
+#endif
 
-/*!
- * Option to specify the executable name seperately
- * from the args sequence.
- * In this case the cmd args must only contain the
- * options required for this executable.
- *
- * Eg: executable{"ls"}
+#endif
+
+} // end namespace util
+
+#ifdef __linux__
+/*-----------------------------------------------------------
+ *    SHARED MEMORY CHANNEL
+ *-----------------------------------------------------------
  */
-struct executable: string_arg
+
+// Default data capacity of each direction of a shm_channel
+static const size_t DEFAULT_SHM_RING_BYTES = 1 << 20;
+
+// Environment variable through which the child learns
+// the descriptor of its shared memory channel
+static const char* const SHM_FD_ENV = "SUBPROCESS_SHM_FD";
+
+namespace util
 {
-  template <typename T>
-  executable(T&& arg): string_arg(std::forward<T>(arg)) {}
-};
+  /*!
+   * Function: futex_wait
+   * Sleeps while the word at `addr` holds `val`.
+   * The futex is not private as the word lives in a
+   * mapping shared with another process.
+   * Parameters:
+   * [in] timeout_ms : Upper bound on the sleep. Negative means forever.
+   * [out] long : 0 on wakeup or -1 with errno set (EAGAIN, ETIMEDOUT, EINTR).
+   */
+  static inline
+  long futex_wait(std::atomic<uint32_t>* addr, uint32_t val, int timeout_ms)
+  {
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT,
+                   val, timeout_ms < 0 ? nullptr : &ts, nullptr, 0);
+  }
 
-/*!
- * Option to set the current working directory
- * of the spawned process.
- *
- * Eg: cwd{"/som/path/x"}
- */
-struct cwd: string_arg
+  static inline
+  void futex_wake(std::atomic<uint32_t>* addr)
+  {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE,
+            1, nullptr, nullptr, 0);
+  }
+}
+
+namespace detail
 {
-  template <typename T>
-  cwd(T&& arg): string_arg(std::forward<T>(arg)) {}
-};
+  // Layout at the start of the shared mapping
+  struct ShmChannelHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_bytes;
+  };
+
+  static const uint32_t SHM_MAGIC = 0x53505348; // "SPSH"
+  static const uint32_t SHM_VERSION = 1;
+
+  // Control block of one ring. The producer and consumer
+  // positions live on separate cache lines.
+  struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head; // Consumer position
+    alignas(64) std::atomic<uint64_t> tail; // Producer position
+    alignas(64) std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> data_waiters;
+    std::atomic<uint32_t> space_waiters;
+    std::atomic<uint32_t> closed;
+  };
+
+  inline size_t shm_align(size_t n) { return (n + 63) & ~size_t(63); }
+}
 
 /*!
- * Option to specify environment variables required by
- * the spawned process.
+ * class: ShmRing
+ * One direction of a shm_channel. A lock-free single
+ * producer/single consumer byte ring living in memory
+ * shared by the parent and the child. Data is copied
+ * once into the ring and once out of it, and the peers
+ * only enter the kernel (futex) when one of them has to
+ * sleep on an empty or full ring.
  *
- * Eg: environment{{ {"K1", "V1"}, {"K2", "V2"},... }}
+ * Either side may close() the ring. The reader still
+ * drains what was written before seeing end of stream.
+ * A side blocked on a peer which exited without closing
+ * the ring notices it within SHM_PEER_CHECK_MS.
  */
-struct environment
+class ShmRing
 {
-  environment(env_map_t&& env):
-    env_(std::move(env)) {}
-  explicit environment(const env_map_t& env):
-    env_(env) {}
-  env_map_t env_;
-};
+public:
+  // Interval at which a blocked side checks if the peer is alive
+  static const int SHM_PEER_CHECK_MS = 50;
 
+  ShmRing(detail::ShmRingHeader* hdr, char* data, size_t cap):
+    hdr_(hdr), data_(data), cap_(cap)
+  {}
+  ShmRing(const ShmRing&) = delete;
+  void operator=(const ShmRing&) = delete;
 
-/*!
- * Used for redirecting input/output/error
- */
-enum IOTYPE {
-  STDOUT = 1,
-  STDERR,
-  PIPE,
-};
+  /*!
+   * Writes `len` bytes, blocking while the ring is full.
+   * Returns the number of bytes written which is less than
+   * `len` only if the ring was closed or the peer is gone.
+   */
+  size_t write(const void* buf, size_t len);
 
-//TODO: A common base/interface for below stream structures ??
+  /*!
+   * Reads at most `len` bytes, blocking till at least one
+   * is available. Returns 0 at end of stream.
+   */
+  size_t read(void* buf, size_t len);
 
-/*!
- * Option to specify the input channel for the child
- * process. It can be:
- * 1. An already open file descriptor.
- * 2. A file name.
- * 3. IOTYPE. Usual a PIPE
- *
- * Eg: input{PIPE}
- * OR in case of redirection, output of another Popen
- * input{popen.output()}
- */
-struct input
-{
-  // For an already existing file descriptor.
-  explicit input(int fd): rd_ch_(fd) {}
+  // Reads exactly `len` bytes unless end of stream is hit first
+  size_t read_n(void* buf, size_t len);
 
-  // FILE pointer.
-  explicit input (FILE* fp):input(fileno(fp)) { assert(fp); }
+  void close();
 
-  explicit input(const char* filename) {
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) throw OSError("File not found: ", errno);
-    rd_ch_ = fd;
-  }
-  explicit input(IOTYPE typ) {
-    assert (typ == PIPE && "STDOUT/STDERR not allowed");
-#ifndef __USING_WINDOWS__
-    std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
-#endif
+  bool closed() const { return hdr_->closed.load(std::memory_order_acquire); }
+  size_t capacity() const { return cap_; }
+  size_t readable() const
+  {
+    return hdr_->tail.load(std::memory_order_acquire) -
+           hdr_->head.load(std::memory_order_acquire);
   }
 
-  int rd_ch_ = -1;
-  int wr_ch_ = -1;
-};
-
-
-/*!
- * Option to specify the output channel for the child
- * process. It can be:
- * 1. An already open file descriptor.
- * 2. A file name.
- * 3. IOTYPE. Usually a PIPE.
- *
- * Eg: output{PIPE}
- * OR output{"output.txt"}
- */
-struct output
-{
-  explicit output(int fd): wr_ch_(fd) {}
-
-  explicit output (FILE* fp):output(fileno(fp)) { assert(fp); }
-
-  explicit output(const char* filename) {
-    int fd = open(filename, O_APPEND | O_CREAT | O_RDWR, 0640);
-    if (fd == -1) throw OSError("File not found: ", errno);
-    wr_ch_ = fd;
+  void set_peer(pid_t pid, bool is_child)
+  {
+    peer_ = pid;
+    peer_is_child_ = is_child;
   }
-  explicit output(IOTYPE typ) {
-    assert (typ == PIPE && "STDOUT/STDERR not allowed");
-#ifndef __USING_WINDOWS__
-    std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
-#endif
+
+private:
+  bool has_data() const { return readable() != 0 || closed(); }
+  bool has_space() const { return readable() < cap_ || closed(); }
+  bool peer_alive() const;
+  bool wait_for(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiters,
+                bool (ShmRing::*ready)() const);
+  void notify(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiters)
+  {
+    seq.fetch_add(1);
+    if (waiters.load()) util::futex_wake(&seq);
   }
 
-  int rd_ch_ = -1;
-  int wr_ch_ = -1;
+private:
+  detail::ShmRingHeader* hdr_;
+  char* data_;
+  size_t cap_;
+  pid_t peer_ = -1;
+  bool peer_is_child_ = false;
 };
 
-
-/*!
- * Option to specify the error channel for the child
- * process. It can be:
- * 1. An already open file descriptor.
- * 2. A file name.
- * 3. IOTYPE. Usually a PIPE or STDOUT
- *
- */
-struct error
+inline bool ShmRing::peer_alive() const
 {
-  explicit error(int fd): wr_ch_(fd) {}
+  if (peer_ <= 0) return true;
+  if (!peer_is_child_) return getppid() == peer_;
+
+  // Peek without reaping, the exit status belongs to Popen
+  siginfo_t info;
+  info.si_pid = 0;
+  if (waitid(P_PID, peer_, &info, WEXITED | WNOHANG | WNOWAIT) == -1) {
+    return errno == EINTR;
+  }
+  return info.si_pid == 0;
+}
 
-  explicit error(FILE* fp):error(fileno(fp)) { assert(fp); }
+inline bool ShmRing::wait_for(std::atomic<uint32_t>& seq,
+                              std::atomic<uint32_t>& waiters,
+                              bool (ShmRing::*ready)() const)
+{
+  bool alive = true;
+  waiters.fetch_add(1);
+  uint32_t cur = seq.load();
+  if (!(this->*ready)()) {
+    if (util::futex_wait(&seq, cur, SHM_PEER_CHECK_MS) == -1 &&
+        errno == ETIMEDOUT) {
+      alive = peer_alive();
+    }
+  }
+  waiters.fetch_sub(1);
+  return alive;
+}
 
-  explicit error(const char* filename) {
-    int fd = open(filename, O_APPEND | O_CREAT | O_RDWR, 0640);
-    if (fd == -1) throw OSError("File not found: ", errno);
-    wr_ch_ = fd;
+inline size_t ShmRing::write(const void* buf, size_t len)
+{
+  const char* src = static_cast<const char*>(buf);
+  uint64_t tail = hdr_->tail.load(std::memory_order_relaxed);
+  size_t done = 0;
+
+  while (done < len && !closed()) {
+    uint64_t head = hdr_->head.load(std::memory_order_acquire);
+    size_t space = cap_ - (tail - head);
+    if (space == 0) {
+      if (!wait_for(hdr_->space_seq, hdr_->space_waiters, &ShmRing::has_space)) break;
+      continue;
+    }
+    size_t n = std::min(space, len - done);
+    size_t off = tail & (cap_ - 1);
+    size_t first = std::min(n, cap_ - off);
+    std::memcpy(data_ + off, src + done, first);
+    std::memcpy(data_, src + done + first, n - first);
+
+    tail += n;
+    done += n;
+    hdr_->tail.store(tail, std::memory_order_release);
+    notify(hdr_->data_seq, hdr_->data_waiters);
   }
-  explicit error(IOTYPE typ) {
-    assert ((typ == PIPE || typ == STDOUT) && "STDERR not aloowed");
-    if (typ == PIPE) {
-#ifndef __USING_WINDOWS__
-      std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
-#endif
-    } else {
-      // Need to defer it till we have checked all arguments
-      deferred_ = true;
+  return done;
+}
+
+inline size_t ShmRing::read(void* buf, size_t len)
+{
+  char* dst = static_cast<char*>(buf);
+  uint64_t head = hdr_->head.load(std::memory_order_relaxed);
+
+  while (len) {
+    uint64_t tail = hdr_->tail.load(std::memory_order_acquire);
+    if (tail != head) {
+      size_t n = std::min<size_t>(tail - head, len);
+      size_t off = head & (cap_ - 1);
+      size_t first = std::min(n, cap_ - off);
+      std::memcpy(dst, data_ + off, first);
+      std::memcpy(dst + first, data_, n - first);
+
+      hdr_->head.store(head + n, std::memory_order_release);
+      notify(hdr_->space_seq, hdr_->space_waiters);
+      return n;
+    }
+    // Anything written before close is visible once
+    // closed is, so recheck the tail before giving up
+    if (closed()) {
+      if (hdr_->tail.load(std::memory_order_acquire) != head) continue;
+      break;
+    }
+    if (!wait_for(hdr_->data_seq, hdr_->data_waiters, &ShmRing::has_data)) {
+      if (hdr_->tail.load(std::memory_order_acquire) != head) continue;
+      break;
     }
   }
+  return 0;
+}
 
-  bool deferred_ = false;
-  int rd_ch_ = -1;
-  int wr_ch_ = -1;
-};
+inline size_t ShmRing::read_n(void* buf, size_t len)
+{
+  char* dst = static_cast<char*>(buf);
+  size_t done = 0;
+  while (done < len) {
+    size_t n = read(dst + done, len - done);
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
 
-// Impoverished, meager, needy, truly needy
-// version of type erasure to store function pointers
-// needed to provide the functionality of preexec_func
-// ATTN: Can be used only to execute functions with no
-// arguments and returning void.
-// Could have used more efficient methods, ofcourse, but
-// that wont yield me the consistent syntax which I am
-// aiming for. If you know, then please do let me know.
+inline void ShmRing::close()
+{
+  hdr_->closed.store(1, std::memory_order_release);
+  notify(hdr_->data_seq, hdr_->data_waiters);
+  notify(hdr_->space_seq, hdr_->space_waiters);
+}
 
-class preexec_func
+/*!
+ * class: ShmChannel
+ * A memfd mapping holding two ShmRing's, `input` flowing
+ * from the parent to the child and `output` flowing back.
+ * The parent side is created by the shm_channel option and
+ * reached through Popen::shm_input() and Popen::shm_output().
+ * The child, if it is built against this header, picks up
+ * its side with ShmChannel::attach_from_env():
+ *
+ *   auto ch = subprocess::ShmChannel::attach_from_env();
+ *   while ((n = ch->input().read(buf, sizeof(buf))))
+ *     ch->output().write(buf, n);
+ *   ch->output().close();
+ */
+class ShmChannel
 {
 public:
-  preexec_func() {}
+  /*!
+   * Creates a channel whose rings hold `capacity` bytes
+   * each, rounded up to a power of two.
+   */
+  static std::shared_ptr<ShmChannel> create(size_t capacity = DEFAULT_SHM_RING_BYTES);
 
-  template <typename Func>
-  explicit preexec_func(Func f): holder_(new FuncHolder<Func>(std::move(f)))
-  {}
+  /*!
+   * Maps the channel handed down by the parent.
+   * Throws std::runtime_error if the process was not
+   * spawned with a shm_channel.
+   */
+  static std::shared_ptr<ShmChannel> attach_from_env();
 
-  void operator()() {
-    (*holder_)();
-  }
+  ShmChannel(const ShmChannel&) = delete;
+  void operator=(const ShmChannel&) = delete;
 
-private:
-  struct HolderBase {
-    virtual void operator()() const = 0;
-    virtual ~HolderBase(){};
-  };
-  template <typename T>
-  struct FuncHolder: HolderBase {
-    FuncHolder(T func): func_(std::move(func)) {}
-    void operator()() const override { func_(); }
-    // The function pointer/reference
-    T func_;
-  };
+  ~ShmChannel()
+  {
+    if (base_ != MAP_FAILED) munmap(base_, size_);
+    release_fd();
+  }
 
-  std::unique_ptr<HolderBase> holder_ = nullptr;
-};
+  ShmRing& input()  { return *input_; }
+  ShmRing& output() { return *output_; }
 
-// ~~~~ End Popen Args ~~~~
+  // The memfd, open only till the child has been spawned
+  int fd() const { return fd_; }
 
+  void release_fd()
+  {
+    if (fd_ != -1) ::close(fd_);
+    fd_ = -1;
+  }
 
-/*!
- * class: Buffer
- * This class is a very thin wrapper around std::vector<char>
- * This is basically used to determine the length of the actual
- * data stored inside the dynamically resized vector.
- *
- * This is what is returned as the output to communicate and check_output
- * functions, so, users must know about this class.
- *
- * OutBuffer and ErrBuffer are just different typedefs to this class.
- */
-class Buffer
-{
-public:
-  Buffer() {}
-  explicit Buffer(size_t cap) { buf.resize(cap); }
-  void add_cap(size_t cap) { buf.resize(cap); }
+  void set_peer(pid_t pid, bool is_child)
+  {
+    input_->set_peer(pid, is_child);
+    output_->set_peer(pid, is_child);
+  }
 
-#if 0
-  Buffer(const Buffer& other):
-    buf(other.buf),
-    length(other.length)
+  void close()
   {
-    std::cout << "COPY" << std::endl;
+    input_->close();
+    output_->close();
   }
 
-  Buffer(Buffer&& other):
-    buf(std::move(other.buf)),
-    length(other.length)
+private:
+  ShmChannel(int fd, void* base, size_t size, size_t ring_bytes);
+
+  static size_t mapping_size(size_t ring_bytes)
   {
-    std::cout << "MOVE" << std::endl;
+    return detail::shm_align(sizeof(detail::ShmChannelHeader)) +
+           2 * (detail::shm_align(sizeof(detail::ShmRingHeader)) + ring_bytes);
   }
-#endif
 
-public:
-  std::vector<char> buf;
-  size_t length = 0;
+private:
+  int fd_ = -1;
+  void* base_ = MAP_FAILED;
+  size_t size_ = 0;
+  std::unique_ptr<ShmRing> input_;
+  std::unique_ptr<ShmRing> output_;
 };
 
-// Buffer for storing output written to output fd
-using OutBuffer = Buffer;
-// Buffer for storing output written to error fd
-using ErrBuffer = Buffer;
+inline ShmChannel::ShmChannel(int fd, void* base, size_t size, size_t ring_bytes):
+  fd_(fd), base_(base), size_(size)
+{
+  char* p = static_cast<char*>(base) + detail::shm_align(sizeof(detail::ShmChannelHeader));
+  for (int i = 0; i < 2; i++) {
+    auto hdr = reinterpret_cast<detail::ShmRingHeader*>(p);
+    p += detail::shm_align(sizeof(detail::ShmRingHeader));
+    std::unique_ptr<ShmRing> ring(new ShmRing(hdr, p, ring_bytes));
+    (i == 0 ? input_ : output_) = std::move(ring);
+    p += ring_bytes;
+  }
+}
 
+inline std::shared_ptr<ShmChannel> ShmChannel::create(size_t capacity)
+{
+  size_t ring_bytes = 4096;
+  while (ring_bytes < capacity) ring_bytes <<= 1;
+  size_t size = mapping_size(ring_bytes);
+
+  int fd = memfd_create("subprocess-shm", MFD_CLOEXEC);
+  if (fd == -1) throw OSError("memfd_create failed", errno);
+  if (ftruncate(fd, size) == -1) {
+    int err = errno;
+    ::close(fd);
+    throw OSError("ftruncate failed", err);
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    int err = errno;
+    ::close(fd);
+    throw OSError("mmap failed", err);
+  }
 
-// Fwd Decl.
-class Popen;
+  // The memfd starts zero filled, which is the initial
+  // state of every ring; only the header needs writing.
+  auto hdr = static_cast<detail::ShmChannelHeader*>(base);
+  hdr->magic = detail::SHM_MAGIC;
+  hdr->version = detail::SHM_VERSION;
+  hdr->ring_bytes = ring_bytes;
 
-/*---------------------------------------------------
- *      DETAIL NAMESPACE
- *---------------------------------------------------
- */
+  return std::shared_ptr<ShmChannel>(new ShmChannel(fd, base, size, ring_bytes));
+}
 
-namespace detail {
+inline std::shared_ptr<ShmChannel> ShmChannel::attach_from_env()
+{
+  const char* val = getenv(SHM_FD_ENV);
+  if (!val) throw std::runtime_error("No shared memory channel in the environment");
+  int fd = std::atoi(val);
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) throw OSError("fstat failed", errno);
+  size_t size = st.st_size;
+  if (size < mapping_size(0)) throw std::runtime_error("Bad shared memory channel");
+
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) throw OSError("mmap failed", errno);
+
+  auto hdr = static_cast<detail::ShmChannelHeader*>(base);
+  if (hdr->magic != detail::SHM_MAGIC || hdr->version != detail::SHM_VERSION ||
+      mapping_size(hdr->ring_bytes) != size) {
+    munmap(base, size);
+    throw std::runtime_error("Bad shared memory channel");
+  }
 
-// Metaprogram for searching a type within
-// a variadic parameter pack
-// This is particularly required to do a compile time
-// checking of the arguments provided to 'check_ouput' function
-// wherein the user is not expected to provide an 'ouput' option.
+  std::shared_ptr<ShmChannel> ch(new ShmChannel(fd, base, size, hdr->ring_bytes));
+  ch->release_fd();
+  ch->set_peer(getppid(), false);
+  unsetenv(SHM_FD_ENV);
+  return ch;
+}
+#endif
 
-template <typename... T> struct param_pack{};
 
-template <typename F, typename T> struct has_type;
+/* -------------------------------
+ *     Popen Arguments
+ * -------------------------------
+ */
 
-template <typename F>
-struct has_type<F, param_pack<>> {
-  static constexpr bool value = false;
+/*!
+ * The buffer size of the stdin/stdout/stderr
+ * streams of the child process.
+ * Default value is 0.
+ */
+struct bufsize {
+  explicit bufsize(int siz): bufsiz(siz) {}
+  int  bufsiz = 0;
 };
 
-template <typename F, typename... T>
-struct has_type<F, param_pack<F, T...>> {
-  static constexpr bool value = true;
+/*!
+ * Option to defer spawning of the child process
+ * till `Popen::start_process` API is called.
+ * Default value is false.
+ */
+struct defer_spawn {
+  explicit defer_spawn(bool d): defer(d) {}
+  bool defer  = false;
+};
+
+/*!
+ * Option to close all file descriptors
+ * when the child process is spawned.
+ * The close fd list does not include
+ * input/output/error if they are explicitly
+ * set as part of the Popen arguments.
+ *
+ * Default value is false.
+ */
+struct close_fds {
+  explicit close_fds(bool c): close_all(c) {}
+  bool close_all = false;
+};
+
+/*!
+ * Option to make the child process as the
+ * session leader and thus the process
+ * group leader.
+ * Default value is false.
+ */
+struct session_leader {
+  explicit session_leader(bool sl): leader_(sl) {}
+  bool leader_ = false;
+};
+
+struct shell {
+  explicit shell(bool s): shell_(s) {}
+  bool shell_ = false;
+};
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Option to put the child in a process group: a new one
+ * which it leads with the default `pgid` of 0, else the
+ * existing group `pgid`. kill() then signals the whole
+ * group, so that grandchildren do not escape it.
+ * Cannot be combined with session_leader, which already
+ * makes the child lead its own group.
+ *
+ * Eg: Popen({"make", "-j8"}, process_group{})
+ */
+struct process_group {
+  explicit process_group(int pgid = 0): pgid_(pgid) {}
+  int pgid_ = 0;
+};
+#endif
+
+#ifdef __linux__
+/*!
+ * Option to have `sig` sent to the child when its parent
+ * dies (PR_SET_PDEATHSIG), so that it does not outlive a
+ * crashed service.
+ * NOTE: The parent here is the thread which spawned the
+ * child, so spawn from a thread which outlives it.
+ */
+struct pdeathsig {
+  explicit pdeathsig(int sig = SIGKILL): sig_(sig) {}
+  int sig_ = SIGKILL;
+};
+#endif
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Option to cap the resources of the child with setrlimit,
+ * right before exec. Each entry is a resource with its soft
+ * limit and a hard limit, which defaults to the soft one.
+ * Raising a hard limit needs privileges, else the spawn fails
+ * with "setrlimit failed".
+ * See Popen::exceeded_rlimit() for the limit a child was
+ * killed for.
+ *
+ * Eg: rlimits{{RLIMIT_AS, 512 << 20}, {RLIMIT_CPU, 5, 6}, {RLIMIT_CORE, 0}}
+ */
+struct rlimits {
+  struct limit {
+    limit(int res, rlim_t soft_lim): resource(res), soft(soft_lim), hard(soft_lim) {}
+    limit(int res, rlim_t soft_lim, rlim_t hard_lim):
+      resource(res), soft(soft_lim), hard(hard_lim) {}
+    int resource;
+    rlim_t soft;
+    rlim_t hard;
+  };
+
+  rlimits(std::initializer_list<limit> lims): limits_(lims) {
+    for (auto& l : limits_) {
+      if (l.soft > l.hard) throw std::runtime_error("rlimits: soft limit above the hard one");
+    }
+  }
+  std::vector<limit> limits_;
+};
+#endif
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Option to run the child at the nice value `value`, from
+ * -20 (favoured) to 19 (least favoured). Going below the
+ * value of this process needs privileges.
+ *
+ * Eg: niceness{10}
+ */
+struct niceness {
+  explicit niceness(int value): value_(value) {}
+  int value_;
+};
+#endif
+
+#ifdef __linux__
+/*!
+ * Option to pin the child to the given CPUs.
+ * spread() and the NUMA helpers build the set for one of
+ * several children sharing the CPUs of this process.
+ *
+ * Eg: cpu_affinity{2, 3}
+ *     for (size_t i = 0; i < n; i++)
+ *       jobs.emplace_back(cmd, cpu_affinity::spread(i, n));
+ */
+struct cpu_affinity {
+  cpu_affinity(std::initializer_list<int> cpus): cpu_affinity(std::vector<int>(cpus)) {}
+  explicit cpu_affinity(std::vector<int> cpus): cpus_(std::move(cpus)) {
+    if (cpus_.empty()) throw std::runtime_error("cpu_affinity: no cpu given");
+    for (int cpu : cpus_) {
+      if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        throw std::runtime_error("cpu_affinity: invalid cpu " + std::to_string(cpu));
+      }
+    }
+  }
+
+  // The `index`th of `count` contiguous slices of the CPUs this
+  // process may run on, so that each child keeps to neighbouring
+  // cores. With more children than CPUs, they share them.
+  static cpu_affinity spread(size_t index, size_t count);
+  // The CPUs of NUMA node `node`
+  static cpu_affinity numa_node(int node);
+  // The CPUs of the online NUMA nodes, taken round robin by `index`
+  static cpu_affinity spread_numa(size_t index);
+
+  std::vector<int> cpus_;
+};
+
+/*!
+ * Option to run the child under the scheduling policy
+ * `policy`: SCHED_BATCH for CPU bound jobs, or SCHED_IDLE
+ * for ones which should only get otherwise idle CPUs.
+ * `priority` is for the real time policies, which need
+ * privileges.
+ *
+ * Eg: sched_policy{SCHED_IDLE}
+ */
+struct sched_policy {
+  explicit sched_policy(int policy, int priority = 0):
+    policy_(policy), priority_(priority) {}
+  int policy_;
+  int priority_;
+};
+
+// I/O scheduling classes of io_priority
+enum IoClass {
+  IO_CLASS_RT = 1,    // Real time, needs privileges
+  IO_CLASS_BE = 2,    // Best effort, the default
+  IO_CLASS_IDLE = 3,  // Only when no other process uses the disk
+};
+
+/*!
+ * Option to set the I/O priority of the child (ioprio_set):
+ * a class and, for the RT and BE ones, a level from 0
+ * (highest) to 7.
+ *
+ * Eg: io_priority{IO_CLASS_IDLE}
+ *     io_priority{IO_CLASS_BE, 7}
+ */
+struct io_priority {
+  explicit io_priority(IoClass cls, int level = 4): class_(cls), level_(level) {
+    if (level < 0 || level > 7) throw std::runtime_error("io_priority: level must be within 0-7");
+  }
+  IoClass class_;
+  int level_;
+};
+
+inline cpu_affinity cpu_affinity::spread(size_t index, size_t count)
+{
+  if (count == 0) throw std::runtime_error("cpu_affinity: no slice to spread over");
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+    throw OSError("sched_getaffinity failed", errno);
+  }
+  std::vector<int> allowed;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+  }
+  size_t n = allowed.size();
+  index %= count;
+  if (count >= n) return cpu_affinity({allowed[index % n]});
+  return cpu_affinity(std::vector<int>(allowed.begin() + index * n / count,
+                                       allowed.begin() + (index + 1) * n / count));
+}
+
+inline cpu_affinity cpu_affinity::numa_node(int node)
+{
+  auto cpus = util::read_cpu_list("/sys/devices/system/node/node" +
+                                  std::to_string(node) + "/cpulist");
+  if (cpus.empty()) {
+    throw std::runtime_error("cpu_affinity: no cpu found for numa node " + std::to_string(node));
+  }
+  return cpu_affinity(std::move(cpus));
+}
+
+inline cpu_affinity cpu_affinity::spread_numa(size_t index)
+{
+  auto nodes = util::read_cpu_list("/sys/devices/system/node/online");
+  // Without NUMA, all the CPUs form a single node
+  if (nodes.empty()) return spread(0, 1);
+  return numa_node(nodes[index % nodes.size()]);
+}
+#endif
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Option to bound the time wait() and communicate() may take,
+ * and so check_output and call, counted from the spawn of the
+ * child. On expiry the child is sent SIGTERM, then SIGKILL if
+ * it is still alive after `grace`. With `session_leader` the
+ * whole process group is signalled. TimeoutExpired is then
+ * thrown with the output read so far.
+ */
+struct timeout {
+  explicit timeout(std::chrono::milliseconds limit,
+                   std::chrono::milliseconds grace =
+                     std::chrono::milliseconds(DEFAULT_KILL_GRACE_MS)):
+    limit_(limit), grace_(grace) {}
+  std::chrono::milliseconds limit_;
+  std::chrono::milliseconds grace_;
+};
+
+/*!
+ * Same as `timeout`, but with a point in time, which lets
+ * a series of calls share a budget.
+ */
+struct deadline {
+  explicit deadline(std::chrono::steady_clock::time_point at,
+                    std::chrono::milliseconds grace =
+                      std::chrono::milliseconds(DEFAULT_KILL_GRACE_MS)):
+    at_(at), grace_(grace) {}
+  std::chrono::steady_clock::time_point at_;
+  std::chrono::milliseconds grace_;
+};
+#endif
+
+/*!
+ * Option to hand extra open file descriptors to the child,
+ * next to its standard streams. Each entry maps a descriptor
+ * of the parent to the number it gets in the child; a bare
+ * descriptor keeps its number. The child numbers must be
+ * above 2 and are left open by `close_fds`. The parent's
+ * descriptors are not closed.
+ *
+ * Eg: pass_fds{sock_fd}
+ *     pass_fds{{listen_fd, 3}, {event_fd, 4}}
+ */
+struct pass_fds {
+  pass_fds(std::initializer_list<int> fds) {
+    for (int fd : fds) fds_.emplace_back(fd, fd);
+  }
+  pass_fds(std::initializer_list<std::pair<int, int>> fds): fds_(fds) {}
+  explicit pass_fds(const std::map<int, int>& fds): fds_(fds.begin(), fds.end()) {}
+  std::vector<std::pair<int, int>> fds_;
+};
+
+namespace detail
+{
+  // Checks and adds the entries of `fds` to `pass`
+  inline void append_pass_fds(std::vector<std::pair<int, int>>& pass,
+                              const pass_fds& fds)
+  {
+    for (auto& entry : fds.fds_) {
+      if (entry.first < 0 || entry.second < 3) {
+        throw std::runtime_error("pass_fds: child descriptors must be above 2");
+      }
+      for (auto& other : pass) {
+        if (other.second == entry.second) {
+          throw std::runtime_error("pass_fds: child descriptor " +
+                                   std::to_string(entry.second) + " given twice");
+        }
+      }
+      pass.push_back(entry);
+    }
+  }
+}
+
+/*!
+ * Per spawn option of a Popen made from a Command.
+ * The values fill, in order, the arguments of the command
+ * which are exactly "{}". The pointers must stay valid till
+ * the child is spawned.
+ *
+ * Eg: Popen(gzip, substitute{"a.log"})
+ */
+struct substitute {
+  substitute(std::initializer_list<const char*> v): values(v) {}
+  explicit substitute(std::vector<const char*> v): values(std::move(v)) {}
+  std::vector<const char*> values;
+};
+
+#ifdef __linux__
+/*!
+ * Option to set up a shared memory channel next to the
+ * standard streams, for bulk data that is too costly to
+ * push through a pipe. `capacity` is the size of the ring
+ * in each direction.
+ * See Popen::shm_input(), Popen::shm_output() and
+ * ShmChannel::attach_from_env() for the child side.
+ *
+ * Eg: shm_channel{64 << 20}
+ */
+struct shm_channel {
+  explicit shm_channel(size_t cap = DEFAULT_SHM_RING_BYTES): capacity(cap) {}
+  size_t capacity = DEFAULT_SHM_RING_BYTES;
+};
+#endif
+
+/*!
+ * Base class for all arguments involving string value.
+ */
+struct string_arg
+{
+  string_arg(const char* arg): arg_value(arg) {}
+  string_arg(std::string&& arg): arg_value(std::move(arg)) {}
+  string_arg(std::string arg): arg_value(std::move(arg)) {}
+  std::string arg_value;
+};
+
+/*!
+ * An executable image held in memory, typically a helper
+ * binary embedded in the calling program. The data is not
+ * copied by this struct and is expected to stay valid and
+ * unchanged for the lifetime of the process, as the image
+ * is keyed on its address. `name` is used as argv[0].
+ */
+struct memory_image
+{
+  memory_image(const void* d, size_t len, std::string nm = "memfd"):
+    data(d), length(len), name(std::move(nm))
+  {}
+  const void* data;
+  size_t length;
+  std::string name;
+};
+
+#ifdef __linux__
+namespace detail
+{
+  /*!
+   * Returns a sealed memfd holding `img`. The image is copied
+   * on first use only; the descriptor is cached for the
+   * lifetime of the process so later spawns of the same
+   * image touch neither the filesystem nor the data.
+   */
+  inline int memory_image_fd(const memory_image& img)
+  {
+    static std::mutex mtx;
+    static std::map<std::pair<const void*, size_t>, int> cache;
+
+    std::lock_guard<std::mutex> lk(mtx);
+    auto key = std::make_pair(img.data, img.length);
+    auto it = cache.find(key);
+    if (it != cache.end()) return it->second;
+
+    int fd = memfd_create(img.name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) throw OSError("memfd_create failed", errno);
+
+    if (util::write_n(fd, static_cast<const char*>(img.data), img.length) == -1 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                               F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+      int err = errno;
+      close(fd);
+      throw OSError("memfd image setup failed", err);
+    }
+    cache.emplace(key, fd);
+    return fd;
+  }
+}
+#endif
+
+/*!
+ * Option to specify the executable name seperately
+ * from the args sequence.
+ * In this case the cmd args must only contain the
+ * options required for this executable.
+ *
+ * On linux the executable may also be a memory_image,
+ * which is run with fexecve from a sealed memfd. The
+ * image must be a binary: as the memfd is close-on-exec,
+ * "#!" scripts can not be run this way.
+ *
+ * Eg: executable{"ls"}
+ *     executable{memory_image{helper_start, helper_len, "helper"}}
+ */
+struct executable: string_arg
+{
+  template <typename T, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<T>::type, memory_image>::value>::type>
+  executable(T&& arg): string_arg(std::forward<T>(arg)) {}
+
+#ifdef __linux__
+  executable(const memory_image& img):
+    string_arg(img.name), image_fd(detail::memory_image_fd(img))
+  {}
+#endif
+
+  // Descriptor of the memory image, if any
+  int image_fd = -1;
+};
+
+/*!
+ * Option to set the current working directory
+ * of the spawned process.
+ *
+ * Eg: cwd{"/som/path/x"}
+ */
+struct cwd: string_arg
+{
+  template <typename T>
+  cwd(T&& arg): string_arg(std::forward<T>(arg)) {}
+};
+
+/*!
+ * Option to specify environment variables required by
+ * the spawned process.
+ *
+ * Eg: environment{{ {"K1", "V1"}, {"K2", "V2"},... }}
+ */
+struct environment
+{
+  environment(env_map_t&& env):
+    env_(std::move(env)) {}
+  explicit environment(const env_map_t& env):
+    env_(env) {}
+  env_map_t env_;
+};
+
+
+/*!
+ * Used for redirecting input/output/error
+ */
+enum IOTYPE {
+  STDOUT = 1,
+  STDERR,
+  PIPE,
 };
 
-template <typename F, typename H, typename... T>
-struct has_type<F, param_pack<H,T...>> {
-  static constexpr bool value =
-    std::is_same<F, typename std::decay<H>::type>::value ? true : has_type<F, param_pack<T...>>::value;
-};
+//TODO: A common base/interface for below stream structures ??
+
+/*!
+ * Option to specify the input channel for the child
+ * process. It can be:
+ * 1. An already open file descriptor.
+ * 2. A file name.
+ * 3. IOTYPE. Usual a PIPE
+ *
+ * Eg: input{PIPE}
+ * OR in case of redirection, output of another Popen
+ * input{popen.output()}
+ */
+struct input
+{
+  // For an already existing file descriptor.
+  explicit input(int fd): rd_ch_(fd) {}
+
+  // FILE pointer.
+  explicit input (FILE* fp):input(fileno(fp)) { assert(fp); }
+
+  explicit input(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) throw OSError("File not found: ", errno);
+    rd_ch_ = fd;
+  }
+  explicit input(IOTYPE typ) {
+    assert (typ == PIPE && "STDOUT/STDERR not allowed");
+#ifndef __USING_WINDOWS__
+    std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
+#endif
+  }
+
+  int rd_ch_ = -1;
+  int wr_ch_ = -1;
+};
+
+
+/*!
+ * Option to specify the output channel for the child
+ * process. It can be:
+ * 1. An already open file descriptor.
+ * 2. A file name.
+ * 3. IOTYPE. Usually a PIPE.
+ *
+ * Eg: output{PIPE}
+ * OR output{"output.txt"}
+ */
+struct output
+{
+  explicit output(int fd): wr_ch_(fd) {}
+
+  explicit output (FILE* fp):output(fileno(fp)) { assert(fp); }
+
+  explicit output(const char* filename) {
+    int fd = open(filename, O_APPEND | O_CREAT | O_RDWR, 0640);
+    if (fd == -1) throw OSError("File not found: ", errno);
+    wr_ch_ = fd;
+  }
+  explicit output(IOTYPE typ) {
+    assert (typ == PIPE && "STDOUT/STDERR not allowed");
+#ifndef __USING_WINDOWS__
+    std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
+#endif
+  }
+
+  int rd_ch_ = -1;
+  int wr_ch_ = -1;
+};
+
+
+/*!
+ * Option to specify the error channel for the child
+ * process. It can be:
+ * 1. An already open file descriptor.
+ * 2. A file name.
+ * 3. IOTYPE. Usually a PIPE or STDOUT
+ *
+ */
+struct error
+{
+  explicit error(int fd): wr_ch_(fd) {}
+
+  explicit error(FILE* fp):error(fileno(fp)) { assert(fp); }
+
+  explicit error(const char* filename) {
+    int fd = open(filename, O_APPEND | O_CREAT | O_RDWR, 0640);
+    if (fd == -1) throw OSError("File not found: ", errno);
+    wr_ch_ = fd;
+  }
+  explicit error(IOTYPE typ) {
+    assert ((typ == PIPE || typ == STDOUT) && "STDERR not aloowed");
+    if (typ == PIPE) {
+#ifndef __USING_WINDOWS__
+      std::tie(rd_ch_, wr_ch_) = util::pipe_cloexec();
+#endif
+    } else {
+      // Need to defer it till we have checked all arguments
+      deferred_ = true;
+    }
+  }
+
+  bool deferred_ = false;
+  int rd_ch_ = -1;
+  int wr_ch_ = -1;
+};
+
+// Impoverished, meager, needy, truly needy
+// version of type erasure to store function pointers
+// needed to provide the functionality of preexec_func
+// ATTN: Can be used only to execute functions with no
+// arguments and returning void.
+// Could have used more efficient methods, ofcourse, but
+// that wont yield me the consistent syntax which I am
+// aiming for. If you know, then please do let me know.
+
+class preexec_func
+{
+public:
+  preexec_func() {}
+
+  template <typename Func>
+  explicit preexec_func(Func f): holder_(new FuncHolder<Func>(std::move(f)))
+  {}
+
+  void operator()() {
+    (*holder_)();
+  }
+
+private:
+  struct HolderBase {
+    virtual void operator()() const = 0;
+    virtual ~HolderBase(){};
+  };
+  template <typename T>
+  struct FuncHolder: HolderBase {
+    FuncHolder(T func): func_(std::move(func)) {}
+    void operator()() const override { func_(); }
+    // The function pointer/reference
+    T func_;
+  };
+
+  std::unique_ptr<HolderBase> holder_ = nullptr;
+};
+
+// ~~~~ End Popen Args ~~~~
+
+
+/*!
+ * class: Buffer
+ * This class is a very thin wrapper around std::vector<char>
+ * This is basically used to determine the length of the actual
+ * data stored inside the dynamically resized vector.
+ *
+ * This is what is returned as the output to communicate and check_output
+ * functions, so, users must know about this class.
+ *
+ * OutBuffer and ErrBuffer are just different typedefs to this class.
+ */
+class Buffer
+{
+public:
+  Buffer() {}
+  explicit Buffer(size_t cap) { buf.resize(cap); }
+  void add_cap(size_t cap) { buf.resize(cap); }
+
+#if 0
+  Buffer(const Buffer& other):
+    buf(other.buf),
+    length(other.length)
+  {
+    std::cout << "COPY" << std::endl;
+  }
+
+  Buffer(Buffer&& other):
+    buf(std::move(other.buf)),
+    length(other.length)
+  {
+    std::cout << "MOVE" << std::endl;
+  }
+#endif
+
+public:
+  std::vector<char> buf;
+  size_t length = 0;
+};
+
+// Buffer for storing output written to output fd
+using OutBuffer = Buffer;
+// Buffer for storing output written to error fd
+using ErrBuffer = Buffer;
+
+/*!
+ * Resources used by a child, as reported by wait4 when it
+ * is reaped. Everything stays at 0 until then, and on
+ * Windows.
+ */
+struct ResourceUsage
+{
+  double user_time = 0;         // CPU time in user mode, seconds
+  double sys_time = 0;          // CPU time in kernel mode, seconds
+  long max_rss_kb = 0;          // Peak resident set size
+  long minor_faults = 0;
+  long major_faults = 0;
+  long voluntary_switches = 0;  // Context switches while blocking
+  long involuntary_switches = 0;
+
+  double cpu_time() const { return user_time + sys_time; }
+};
+
+#ifndef __USING_WINDOWS__
+namespace util
+{
+  static inline ResourceUsage to_resource_usage(const struct rusage& ru)
+  {
+    ResourceUsage res;
+    res.user_time = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    res.sys_time = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    // Reported in bytes there
+    res.max_rss_kb = ru.ru_maxrss / 1024;
+#else
+    res.max_rss_kb = ru.ru_maxrss;
+#endif
+    res.minor_faults = ru.ru_minflt;
+    res.major_faults = ru.ru_majflt;
+    res.voluntary_switches = ru.ru_nvcsw;
+    res.involuntary_switches = ru.ru_nivcsw;
+    return res;
+  }
+}
+#endif
+
+/*!
+ * When a child went through each phase of its life, and the
+ * bytes moved through its pipes by send() and communicate(),
+ * as returned by Popen::stats(). Phases not reached, or not
+ * seen because the pipes were read directly, are left at the
+ * epoch of the clock. All zero with SUBPROCESS_NO_STATS.
+ */
+struct SpawnStats
+{
+  using time_point = std::chrono::steady_clock::time_point;
+
+  time_point start;         // Spawn started
+  time_point forked;        // fork/clone returned in the parent
+  time_point exec;          // The child exec'd
+  time_point first_byte;    // First byte read from stdout
+  time_point eof;           // stdout hit EOF
+  time_point reaped;
+  size_t bytes_in = 0;      // Written to stdin
+  size_t bytes_out = 0;     // Read from stdout
+  size_t bytes_err = 0;     // Read from stderr
+
+  // Seconds from `from` to `to`, -1 if either was not reached
+  static double seconds(time_point from, time_point to)
+  {
+    if (from == time_point() || to == time_point()) return -1;
+    return std::chrono::duration<double>(to - from).count();
+  }
+};
+
+/*!
+ * What try_check_output and try_call return in place of
+ * throwing: the exit status of the child, its output and
+ * why it could not be run, if it could not.
+ */
+struct ProcessResult
+{
+  // Exit status of the child, -1 if it did not run to completion
+  int retcode = -1;
+  OutBuffer output;
+  // Set if the child could not be spawned or talked to, or
+  // timed out (SPAWN_IO with ETIMEDOUT)
+  SpawnError error;
+  // Resources used by the child, if it was reaped
+  ResourceUsage usage;
+
+  bool ok() const { return !error && retcode == 0; }
+};
+
+
+// Fwd Decl.
+class Popen;
+
+/*---------------------------------------------------
+ *      DETAIL NAMESPACE
+ *---------------------------------------------------
+ */
+
+namespace detail {
+
+// Metaprogram for searching a type within
+// a variadic parameter pack
+// This is particularly required to do a compile time
+// checking of the arguments provided to 'check_ouput' function
+// wherein the user is not expected to provide an 'ouput' option.
+
+template <typename... T> struct param_pack{};
+
+template <typename F, typename T> struct has_type;
+
+template <typename F>
+struct has_type<F, param_pack<>> {
+  static constexpr bool value = false;
+};
+
+template <typename F, typename... T>
+struct has_type<F, param_pack<F, T...>> {
+  static constexpr bool value = true;
+};
+
+template <typename F, typename H, typename... T>
+struct has_type<F, param_pack<H,T...>> {
+  static constexpr bool value =
+    std::is_same<F, typename std::decay<H>::type>::value ? true : has_type<F, param_pack<T...>>::value;
+};
+
+//----
+
+#ifndef __USING_WINDOWS__
+/*!
+ * The argv to run the shell{true} command `cmd`. Commands
+ * which need no shell, such as "ls -l", are exec'd directly
+ * as the shell would have done, saving a shell startup.
+ * They must also be found on PATH, so that a missing command
+ * still gets the usual exit status of 127 from the shell.
+ */
+inline std::vector<std::string> shell_argv(const std::string& cmd, bool fast_path,
+                                           const env_map_t& env)
+{
+  if (fast_path) {
+    auto words = util::split_simple_command(cmd);
+    if (words.size()) {
+      auto it = env.find("PATH");
+      const char* path_env = it != env.end() ? it->second.c_str() : getenv("PATH");
+      if (util::find_executable(words[0], path_env ? path_env : "/bin:/usr/bin").size()) {
+        return words;
+      }
+    }
+  }
+  return {"/bin/sh", "-c", cmd};
+}
+#endif
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Where the child is to run, as given by niceness,
+ * cpu_affinity, sched_policy and io_priority.
+ * Applying it does not allocate, so that the child of a
+ * plan spawn can do it as well.
+ */
+struct SchedOptions
+{
+  std::vector<int> cpus_;
+  int policy_ = -1;
+  int priority_ = 0;
+  int ioprio_ = -1;
+  int nice_ = 0;
+  bool has_nice_ = false;
+
+  void set(niceness&& n) { nice_ = n.value_; has_nice_ = true; }
+#ifdef __linux__
+  void set(cpu_affinity&& a) { cpus_ = std::move(a.cpus_); }
+  void set(sched_policy&& p) { policy_ = p.policy_; priority_ = p.priority_; }
+  // As packed by the IOPRIO_PRIO_VALUE macro of the kernel
+  void set(io_priority&& p) { ioprio_ = (p.class_ << 13) | p.level_; }
+#endif
+
+  // Returns -1 with errno set if a step failed
+  int apply() const
+  {
+#ifdef __linux__
+    if (!cpus_.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : cpus_) CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1) return -1;
+    }
+    if (policy_ != -1) {
+      struct sched_param param;
+      param.sched_priority = priority_;
+      if (sched_setscheduler(0, policy_, &param) == -1) return -1;
+    }
+    if (ioprio_ != -1) {
+      // IOPRIO_WHO_PROCESS, glibc has no wrapper
+      if (syscall(SYS_ioprio_set, 1, 0, ioprio_) == -1) return -1;
+    }
+#endif
+    if (has_nice_ && setpriority(PRIO_PROCESS, 0, nice_) == -1) return -1;
+    return 0;
+  }
+};
+#endif
+
+/*!
+ * The part of the Popen state which is only needed till the
+ * child has been spawned. It is kept out of line and freed
+ * right after the spawn so that a running Popen stays small.
+ */
+struct SpawnConfig
+{
+  std::string exe_name_;
+  // Set when the executable is a memory_image
+  int exe_fd_ = -1;
+  std::string cwd_;
+  env_map_t env_;
+  preexec_func preexec_fn_;
+  // {parent fd, child fd} pairs wired up in the child
+  std::vector<std::pair<int, int>> pass_fds_;
+  // Values for the placeholders of a Command
+  std::vector<const char*> subst_;
+
+  // Command provided as sequence
+  std::vector<std::string> vargs_;
+  std::vector<char*> cargv_;
+
+  // Turned into the deadline of the Popen at spawn
+  std::chrono::milliseconds timeout_{0};
+  // Signal for PR_SET_PDEATHSIG, 0 if none
+  int pdeathsig_ = 0;
+  // Process which spawned the child, for pdeathsig
+  int parent_pid_ = -1;
+#ifndef __USING_WINDOWS__
+  std::vector<rlimits::limit> rlimits_;
+  SchedOptions sched_;
+#endif
+
+  bool close_fds_ = false;
+  bool has_preexec_fn_ = false;
+  bool shell_ = false;
+};
+
+/*!
+ * A helper class to Popen class for setting
+ * options as provided in the Popen constructor
+ * or in check_ouput arguments.
+ * This design allows us to _not_ have any fixed position
+ * to any arguments and specify them in a way similar to what
+ * can be done in python.
+ */
+struct ArgumentDeducer
+{
+  ArgumentDeducer(Popen* p): popen_(p) {}
+
+  void set_option(executable&& exe);
+  void set_option(cwd&& cwdir);
+  void set_option(bufsize&& bsiz);
+  void set_option(environment&& env);
+  void set_option(defer_spawn&& defer);
+  void set_option(shell&& sh);
+  void set_option(input&& inp);
+  void set_option(output&& out);
+  void set_option(error&& err);
+  void set_option(close_fds&& cfds);
+  void set_option(preexec_func&& prefunc);
+  void set_option(session_leader&& sleader);
+  void set_option(pass_fds&& fds);
+#ifndef __USING_WINDOWS__
+  void set_option(substitute&& subst);
+  void set_option(timeout&& tmo);
+  void set_option(deadline&& dl);
+  void set_option(process_group&& pg);
+  void set_option(rlimits&& lims);
+  void set_option(niceness&& n);
+#endif
+#ifdef __linux__
+  void set_option(shm_channel&& shm);
+  void set_option(pdeathsig&& sig);
+  void set_option(cpu_affinity&& aff);
+  void set_option(sched_policy&& pol);
+  void set_option(io_priority&& prio);
+#endif
+
+private:
+  Popen* popen_ = nullptr;
+};
+
+/*!
+ * A helper class to Popen.
+ * This takes care of all the fork-exec logic
+ * in the execute_child API.
+ */
+class Child
+{
+public:
+  Child(Popen* p, int err_wr_pipe):
+    parent_(p),
+    err_wr_pipe_(err_wr_pipe)
+  {}
+
+  void execute_child();
+
+private:
+  // Lets call it parent even though
+  // technically a bit incorrect
+  Popen* parent_ = nullptr;
+  int err_wr_pipe_ = -1;
+};
+
+// Fwd Decl.
+class Streams;
+
+/*!
+ * A helper class to Streams.
+ * This takes care of management of communicating
+ * with the child process with the means of the correct
+ * file descriptor.
+ */
+class Communication
+{
+public:
+  // The streams are passed in rather than pointed to,
+  // so that Streams, and thus Popen, stay movable.
+  int send(Streams& stream, const char* msg, size_t length);
+  int send(Streams& stream, const std::vector<char>& msg);
+
+  std::pair<OutBuffer, ErrBuffer> communicate(Streams& stream, const char* msg, size_t length);
+  std::pair<OutBuffer, ErrBuffer> communicate(Streams& stream, const std::vector<char>& msg)
+  { return communicate(stream, msg.data(), msg.size()); }
+
+#ifndef __USING_WINDOWS__
+  // Same as communicate, but multiplexes the pipes with poll()
+  // and gives up once `deadline` has passed, leaving what was
+  // read so far in `obuf` and `ebuf`. The streams still open
+  // are left so. Returns false if it gave up.
+  bool communicate_until(Streams& stream, const char* msg, size_t length,
+                         std::chrono::steady_clock::time_point deadline,
+                         OutBuffer& obuf, ErrBuffer& ebuf);
+#endif
+
+  void set_out_buf_cap(size_t cap) { out_buf_cap_ = cap; }
+  void set_err_buf_cap(size_t cap) { err_buf_cap_ = cap; }
+
+private:
+  std::pair<OutBuffer, ErrBuffer> communicate_threaded(
+      Streams& stream, const char* msg, size_t length);
+
+  // Blocks till stdout is readable, to time its first byte
+  static void wait_first_byte(Streams& stream);
+
+private:
+  size_t out_buf_cap_ = DEFAULT_BUF_CAP_BYTES;
+  size_t err_buf_cap_ = DEFAULT_BUF_CAP_BYTES;
+};
+
+// Closes the FILE's owned by Streams
+struct FileCloser {
+  void operator()(FILE* fp) const { fclose(fp); }
+};
+
+
+
+/*!
+ * This is a helper class to Popen.
+ * It takes care of management of all the file descriptors
+ * and file pointers.
+ * It dispatches of the communication aspects to the
+ * Communication class.
+ * Read through the data members to understand about the
+ * various file descriptors used.
+ */
+class Streams
+{
+public:
+  Streams() {}
+  Streams(const Streams&) = delete;
+  void operator=(const Streams&) = delete;
+  Streams(Streams&&) = default;
+  Streams& operator=(Streams&&) = default;
+
+public:
+  void setup_comm_channels();
+
+  void cleanup_fds()
+  {
+    if (write_to_child_ != -1 && read_from_parent_ != -1) {
+      close(write_to_child_);
+    }
+    if (write_to_parent_ != -1 && read_from_child_ != -1) {
+      close(read_from_child_);
+    }
+    if (err_write_ != -1 && err_read_ != -1) {
+      close(err_read_);
+    }
+  }
+
+  void close_parent_fds()
+  {
+    if (write_to_child_ != -1)  close(write_to_child_);
+    if (read_from_child_ != -1) close(read_from_child_);
+    if (err_read_ != -1)        close(err_read_);
+  }
+
+  void close_child_fds()
+  {
+    if (write_to_parent_ != -1)  close(write_to_parent_);
+    if (read_from_parent_ != -1) close(read_from_parent_);
+    if (err_write_ != -1)        close(err_write_);
+  }
+
+  FILE* input()  { return input_.get(); }
+  FILE* output() { return output_.get(); }
+  FILE* error()  { return error_.get(); }
+
+  void input(FILE* fp)  { input_.reset(fp); }
+  void output(FILE* fp) { output_.reset(fp); }
+  void error(FILE* fp)  { error_.reset(fp); }
+
+  void set_out_buf_cap(size_t cap) { comm_.set_out_buf_cap(cap); }
+  void set_err_buf_cap(size_t cap) { comm_.set_err_buf_cap(cap); }
+
+  // Records the current time in `tp`, unless compiled out
+  static void mark(SpawnStats::time_point& tp)
+  {
+    if (STATS_ENABLED) tp = std::chrono::steady_clock::now();
+  }
+
+public: /* Communication forwarding API's */
+  int send(const char* msg, size_t length)
+  { return comm_.send(*this, msg, length); }
+
+  int send(const std::vector<char>& msg)
+  { return comm_.send(*this, msg); }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length)
+  { return comm_.communicate(*this, msg, length); }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg)
+  { return comm_.communicate(*this, msg); }
+
+#ifndef __USING_WINDOWS__
+  bool communicate_until(const char* msg, size_t length,
+                         std::chrono::steady_clock::time_point deadline,
+                         OutBuffer& obuf, ErrBuffer& ebuf)
+  { return comm_.communicate_until(*this, msg, length, deadline, obuf, ebuf); }
+#endif
+
+
+public:// Yes they are public
+
+  std::unique_ptr<FILE, FileCloser> input_;
+  std::unique_ptr<FILE, FileCloser> output_;
+  std::unique_ptr<FILE, FileCloser> error_;
+
+#ifdef __USING_WINDOWS__
+  HANDLE g_hChildStd_IN_Rd = nullptr;
+  HANDLE g_hChildStd_IN_Wr = nullptr;
+  HANDLE g_hChildStd_OUT_Rd = nullptr;
+  HANDLE g_hChildStd_OUT_Wr = nullptr;
+  HANDLE g_hChildStd_ERR_Rd = nullptr;
+  HANDLE g_hChildStd_ERR_Wr = nullptr;
+#endif
+
+  // Buffer size for the IO streams
+  int bufsiz_ = 0;
+
+  SpawnStats stats_;
+
+  // Pipes for communicating with child
+
+  // Emulates stdin
+  int write_to_child_   = -1; // Parent owned descriptor
+  int read_from_parent_ = -1; // Child owned descriptor
+
+  // Emulates stdout
+  int write_to_parent_ = -1; // Child owned descriptor
+  int read_from_child_ = -1; // Parent owned descriptor
+
+  // Emulates stderr
+  int err_write_ = -1; // Write error to parent (Child owned)
+  int err_read_  = -1; // Read error from child (Parent owned)
+
+private:
+  Communication comm_;
+};
+
+} // end namespace detail
+
+
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *    COMMAND PLANS
+ *-----------------------------------------------------------
+ */
+
+namespace detail
+{
+  struct SpawnAction {
+    enum Kind { PASS_FD, CLOSE_FDS, CHDIR, SETSID, PDEATHSIG };
+    Kind kind;
+    int fd;
+    int target;
+    const char* path;
+  };
+
+  /*!
+   * The immutable result of compiling a Command.
+   * All strings live in one arena which the pointer
+   * tables point into, so a plan is never copied.
+   */
+  struct SpawnPlan {
+    SpawnPlan() {}
+    SpawnPlan(const SpawnPlan&) = delete;
+    void operator=(const SpawnPlan&) = delete;
+
+    std::vector<char> arena;
+    std::vector<char*> argv;
+    // Empty if the child inherits the environment at spawn time
+    std::vector<char*> envp;
+    // Indices of the "{}" arguments
+    std::vector<size_t> slots;
+    // Resolved executable, null if it was not found
+    const char* path = nullptr;
+    int exe_fd = -1;
+    std::vector<SpawnAction> actions;
+    // Sorted targets of the PASS_FD actions
+    std::vector<int> keep_fds;
+    // Highest descriptor named by a PASS_FD action
+    int max_pass_fd = -1;
+    // Set right before exec
+    std::vector<rlimits::limit> limits;
+    SchedOptions sched;
+    bool session_leader = false;
+    // Cached MetricsRegistry id, -1 till the first spawn
+    mutable std::atomic<int> metric_id{-1};
+  };
+
+  // Options collected while building a Command
+  struct PlanOptions {
+    std::vector<std::string> argv_;
+    std::string exe_;
+    int exe_fd_ = -1;
+    std::string cwd_;
+    env_map_t env_;
+    std::vector<std::pair<int, int>> pass_;
+    std::vector<rlimits::limit> limits_;
+    SchedOptions sched_;
+    int pdeathsig_ = 0;
+    bool close_fds_ = false;
+    bool session_leader_ = false;
+    bool shell_ = false;
+
+    void set_option(executable&& e) { exe_ = std::move(e.arg_value); exe_fd_ = e.image_fd; }
+    void set_option(cwd&& c) { cwd_ = std::move(c.arg_value); }
+    void set_option(environment&& e) { env_ = std::move(e.env_); }
+    void set_option(pass_fds&& fds) { append_pass_fds(pass_, fds); }
+    void set_option(close_fds&& c) { close_fds_ = c.close_all; }
+    void set_option(session_leader&& sl) { session_leader_ = sl.leader_; }
+    void set_option(shell&& sh) { shell_ = sh.shell_; }
+    void set_option(rlimits&& lims) { limits_ = std::move(lims.limits_); }
+    void set_option(niceness&& n) { sched_.set(std::move(n)); }
+#ifdef __linux__
+    void set_option(pdeathsig&& sig) { pdeathsig_ = sig.sig_; }
+    void set_option(cpu_affinity&& aff) { sched_.set(std::move(aff)); }
+    void set_option(sched_policy&& pol) { sched_.set(std::move(pol)); }
+    void set_option(io_priority&& prio) { sched_.set(std::move(prio)); }
+#endif
+
+    void init() {}
+    template <typename F, typename... Args>
+    void init(F&& farg, Args&&... args)
+    {
+      set_option(std::forward<F>(farg));
+      init(std::forward<Args>(args)...);
+    }
+  };
+
+  inline std::shared_ptr<const SpawnPlan> compile_plan(PlanOptions& opts);
+
+  // Options which may still be given when a Command is spawned
+  template <typename T> struct is_spawn_option: std::false_type {};
+  template <> struct is_spawn_option<input>: std::true_type {};
+  template <> struct is_spawn_option<output>: std::true_type {};
+  template <> struct is_spawn_option<error>: std::true_type {};
+  template <> struct is_spawn_option<bufsize>: std::true_type {};
+  template <> struct is_spawn_option<defer_spawn>: std::true_type {};
+  template <> struct is_spawn_option<substitute>: std::true_type {};
+  template <> struct is_spawn_option<timeout>: std::true_type {};
+  template <> struct is_spawn_option<deadline>: std::true_type {};
+  template <> struct is_spawn_option<process_group>: std::true_type {};
+  template <> struct is_spawn_option<niceness>: std::true_type {};
+#ifdef __linux__
+  template <> struct is_spawn_option<cpu_affinity>: std::true_type {};
+  template <> struct is_spawn_option<sched_policy>: std::true_type {};
+  template <> struct is_spawn_option<io_priority>: std::true_type {};
+#endif
+
+  template <typename... T> struct all_spawn_options;
+
+  template <>
+  struct all_spawn_options<> {
+    static constexpr bool value = true;
+  };
+
+  template <typename H, typename... T>
+  struct all_spawn_options<H, T...> {
+    static constexpr bool value =
+      is_spawn_option<typename std::decay<H>::type>::value &&
+      all_spawn_options<T...>::value;
+  };
+}
+
+/*!
+ * class: Command
+ * A command compiled once into an immutable spawn plan, for
+ * commands which are run over and over. Splitting, PATH lookup,
+ * building argv and the environment and checking the options
+ * are all done up front. Spawning a plan then only creates the
+ * requested pipes and, on linux, uses a vfork style clone which
+ * does not copy the page tables of the parent.
+ *
+ * Accepts executable, cwd, environment, pass_fds, close_fds,
+ * session_leader, shell, pdeathsig, rlimits and the scheduling
+ * options (niceness, cpu_affinity, sched_policy, io_priority),
+ * which may also be given per spawn. The environment, if given, is merged
+ * with the one of the parent at the time the Command is built.
+ * Arguments which are exactly "{}" are placeholders, filled per
+ * spawn with the substitute option.
+ *
+ * A Command can be shared between threads and spawned from
+ * several of them at once.
+ *
+ * Eg:
+ *   Command gzip({"gzip", "-k", "{}"}, cwd{"/var/log/app"});
+ *   for (auto f : files) Popen(gzip, substitute{f}).wait();
+ *   auto out = check_output(Command({"uname", "-r"}));
+ */
+class Command
+{
+public:
+  template <typename... Args>
+  explicit Command(const std::string& cmd_args, Args&&... args)
+  {
+    detail::PlanOptions opts;
+    opts.argv_ = util::split(cmd_args);
+    opts.init(std::forward<Args>(args)...);
+    plan_ = detail::compile_plan(opts);
+  }
+
+  template <typename... Args>
+  explicit Command(std::initializer_list<const char*> cmd_args, Args&&... args)
+  {
+    detail::PlanOptions opts;
+    opts.argv_.assign(cmd_args.begin(), cmd_args.end());
+    opts.init(std::forward<Args>(args)...);
+    plan_ = detail::compile_plan(opts);
+  }
+
+  template <typename... Args>
+  explicit Command(std::vector<std::string> cmd_args, Args&&... args)
+  {
+    detail::PlanOptions opts;
+    opts.argv_ = std::move(cmd_args);
+    opts.init(std::forward<Args>(args)...);
+    plan_ = detail::compile_plan(opts);
+  }
+
+  // The resolved executable, empty if it was not found
+  std::string path() const { return plan_->path ? plan_->path : ""; }
+
+  // Number of "{}" placeholders
+  size_t slots() const { return plan_->slots.size(); }
+
+private:
+  friend class Popen;
+  std::shared_ptr<const detail::SpawnPlan> plan_;
+};
+
+namespace detail
+{
+  inline std::shared_ptr<const SpawnPlan> compile_plan(PlanOptions& opts)
+  {
+    auto& argv = opts.argv_;
+    if (opts.shell_) {
+      argv = shell_argv(util::join(argv), opts.exe_.empty(), opts.env_);
+    }
+    if (opts.exe_.length()) argv.insert(argv.begin(), opts.exe_);
+    if (argv.empty()) throw std::runtime_error("Command: no program given");
+
+    std::string path;
+    if (opts.exe_fd_ == -1) {
+      const char* path_env = getenv("PATH");
+      path = util::find_executable(argv[0], path_env ? path_env : "/bin:/usr/bin");
+    }
+
+    std::vector<std::string> envs;
+    if (opts.env_.size()) {
+      for (char** e = environ; *e; e++) {
+        const char* eq = strchr(*e, '=');
+        if (eq && opts.env_.count(std::string(*e, eq - *e))) continue;
+        envs.push_back(*e);
+      }
+      for (auto& kv : opts.env_) envs.push_back(kv.first + "=" + kv.second);
+    }
+
+    std::shared_ptr<SpawnPlan> plan(new SpawnPlan);
+    auto& arena = plan->arena;
+    size_t total = path.size() + opts.cwd_.size() + 2;
+    for (auto& a : argv) total += a.size() + 1;
+    for (auto& e : envs) total += e.size() + 1;
+    arena.reserve(total);
+
+    auto intern = [&arena](const std::string& str) {
+      size_t off = arena.size();
+      arena.insert(arena.end(), str.begin(), str.end());
+      arena.push_back('\0');
+      return off;
+    };
+    std::vector<size_t> argv_off, env_off;
+    for (auto& a : argv) argv_off.push_back(intern(a));
+    for (auto& e : envs) env_off.push_back(intern(e));
+    size_t path_off = intern(path);
+    size_t cwd_off = intern(opts.cwd_);
+
+    for (size_t i = 0; i < argv.size(); i++) {
+      plan->argv.push_back(&arena[argv_off[i]]);
+      if (argv[i] == "{}") plan->slots.push_back(i);
+    }
+    plan->argv.push_back(nullptr);
+    if (envs.size()) {
+      for (auto off : env_off) plan->envp.push_back(&arena[off]);
+      plan->envp.push_back(nullptr);
+    }
+    if (path.size()) plan->path = &arena[path_off];
+    plan->exe_fd = opts.exe_fd_;
+
+    for (auto& fds : opts.pass_) {
+      plan->actions.push_back({SpawnAction::PASS_FD, fds.first, fds.second, nullptr});
+      plan->keep_fds.push_back(fds.second);
+      plan->max_pass_fd = std::max({plan->max_pass_fd, fds.first, fds.second});
+    }
+    std::sort(plan->keep_fds.begin(), plan->keep_fds.end());
+    if (opts.close_fds_) {
+      plan->actions.push_back({SpawnAction::CLOSE_FDS, -1, -1, nullptr});
+    }
+    if (opts.cwd_.size()) {
+      plan->actions.push_back({SpawnAction::CHDIR, -1, -1, &arena[cwd_off]});
+    }
+    if (opts.session_leader_) {
+      plan->actions.push_back({SpawnAction::SETSID, -1, -1, nullptr});
+    }
+    if (opts.pdeathsig_) {
+      plan->actions.push_back({SpawnAction::PDEATHSIG, opts.pdeathsig_, -1, nullptr});
+    }
+    plan->limits = std::move(opts.limits_);
+    plan->sched = std::move(opts.sched_);
+    plan->session_leader = opts.session_leader_;
+    return plan;
+  }
+
+  // What the child of a plan spawn gets from its parent
+  struct SpawnContext {
+    const SpawnPlan* plan;
+    char* const* argv;
+    int stdio[3];
+    int err_fd;
+    // Group to join as by process_group, -1 for none
+    int pgid;
+    // The spawning process, for PDEATHSIG
+    pid_t parent;
+    // Placement given when spawning, applied after the one of
+    // the plan, null if none
+    const SchedOptions* sched;
+    // Signal mask to restore before exec
+    sigset_t mask;
+  };
+
+  /*!
+   * Reads the SpawnError a failed child writes on the error
+   * pipe. Returns false if the pipe was closed by exec.
+   */
+  inline bool read_spawn_error(int fd, SpawnError& err)
+  {
+    ssize_t n;
+    do {
+      n = read(fd, &err, sizeof(err));
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof(err);
+  }
+
+  inline void close_fd_range(int lo, int hi)
+  {
+#if defined(__linux__) && defined(SYS_close_range)
+    if (lo < hi && syscall(SYS_close_range, lo, hi - 1, 0) == 0) return;
+#endif
+    for (int fd = lo; fd < hi; fd++) close(fd);
+  }
+
+  /*!
+   * Runs in the child of a plan spawn. On linux it shares the
+   * memory of the suspended parent, so it must not allocate or
+   * touch any lock: only system calls on data prepared by the
+   * parent are made here.
+   */
+  inline int spawn_child(void* arg)
+  {
+    auto ctx = static_cast<SpawnContext*>(arg);
+    auto plan = ctx->plan;
+    int err_fd = ctx->err_fd;
+    int exe_fd = plan->exe_fd;
+    int stage = SPAWN_DUP2;
+
+    // Handlers of the parent must not run in the child
+    for (int sig = 1; sig < NSIG; sig++) {
+      struct sigaction sa;
+      if (sigaction(sig, nullptr, &sa) != 0) continue;
+      if (!(sa.sa_flags & SA_SIGINFO) && sa.sa_handler == SIG_IGN) continue;
+      if (!(sa.sa_flags & SA_SIGINFO) && sa.sa_handler == SIG_DFL) continue;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = SIG_DFL;
+      sigaction(sig, &sa, nullptr);
+    }
+
+    int io[3] = {ctx->stdio[0], ctx->stdio[1], ctx->stdio[2]};
+    if (io[1] == 0) io[1] = dup(io[1]);
+    if (io[2] == 0 || io[2] == 1) io[2] = dup(io[2]);
+    for (int i = 0; i < 3; i++) {
+      if (io[i] == -1) continue;
+      if (io[i] == i) {
+        if (fcntl(i, F_SETFD, 0) == -1) goto fail;
+      } else if (dup2(io[i], i) == -1) {
+        goto fail;
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      if (io[i] > 2) close(io[i]);
+    }
+
+    stage = SPAWN_PASS_FDS;
+    if (plan->max_pass_fd >= 0) {
+      auto& keep = plan->keep_fds;
+      // Staged above the targets, the error pipe and the image
+      int above = std::max(std::max(plan->max_pass_fd, err_fd), exe_fd) + 1;
+      if (std::binary_search(keep.begin(), keep.end(), err_fd)) {
+        err_fd = fcntl(err_fd, F_DUPFD_CLOEXEC, above);
+        if (err_fd == -1) {
+          err_fd = ctx->err_fd;
+          goto fail;
+        }
+        above = err_fd + 1;
+      }
+      if (exe_fd != -1 && std::binary_search(keep.begin(), keep.end(), exe_fd)) {
+        exe_fd = fcntl(exe_fd, F_DUPFD_CLOEXEC, above);
+        if (exe_fd == -1) goto fail;
+        above = exe_fd + 1;
+      }
+      // Move every source above all the targets first, as
+      // in Child::execute_child, then into place
+      int n = 0;
+      for (auto& a : plan->actions) {
+        if (a.kind != SpawnAction::PASS_FD) continue;
+        if (dup2(a.fd, above + n++) == -1) goto fail;
+      }
+      n = 0;
+      for (auto& a : plan->actions) {
+        if (a.kind != SpawnAction::PASS_FD) continue;
+        if (dup2(above + n, a.target) == -1) goto fail;
+        close(above + n++);
+      }
+    }
+
+    for (auto& a : plan->actions) {
+      switch (a.kind) {
+      case SpawnAction::PASS_FD:
+        break;
+      case SpawnAction::CLOSE_FDS: {
+        stage = SPAWN_CLOSE_FDS;
+        int max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd == -1) goto fail;
+        // Besides the passed descriptors, the error pipe and
+        // the image to exec are kept, merged in order
+        int extra[2] = {std::min(err_fd, exe_fd), std::max(err_fd, exe_fd)};
+        auto& keep = plan->keep_fds;
+        size_t k = 0, e = 0;
+        int lo = 3;
+        while (k < keep.size() || e < 2) {
+          int fd = (e < 2 && (k == keep.size() || extra[e] < keep[k])) ? extra[e++] : keep[k++];
+          if (fd < lo) continue;
+          close_fd_range(lo, fd);
+          lo = fd + 1;
+        }
+        close_fd_range(lo, max_fd);
+        break;
+      }
+      case SpawnAction::CHDIR:
+        stage = SPAWN_CHDIR;
+        if (chdir(a.path) == -1) goto fail;
+        break;
+      case SpawnAction::SETSID:
+        stage = SPAWN_SETSID;
+        if (setsid() == -1) goto fail;
+        break;
+      case SpawnAction::PDEATHSIG:
+        stage = SPAWN_PDEATHSIG;
+#ifdef __linux__
+        if (prctl(PR_SET_PDEATHSIG, a.fd, 0, 0, 0) == -1) goto fail;
+        // The parent may have died before the prctl
+        if (getppid() != ctx->parent) kill(getpid(), a.fd);
+#endif
+        break;
+      }
+    }
+
+    if (ctx->pgid != -1) {
+      stage = SPAWN_SETPGID;
+      if (setpgid(0, ctx->pgid) == -1) goto fail;
+    }
+
+    stage = SPAWN_SCHED;
+    if (plan->sched.apply() == -1) goto fail;
+    if (ctx->sched && ctx->sched->apply() == -1) goto fail;
+
+    stage = SPAWN_RLIMIT;
+    for (auto& l : plan->limits) {
+      struct rlimit rl = {l.soft, l.hard};
+      if (setrlimit(l.resource, &rl) == -1) goto fail;
+    }
+
+    sigprocmask(SIG_SETMASK, &ctx->mask, nullptr);
+    stage = SPAWN_EXEC;
+    {
+      char* const* envp = plan->envp.empty() ? environ : plan->envp.data();
+#ifdef __linux__
+      if (exe_fd != -1) fexecve(exe_fd, ctx->argv, envp);
+      else
+#endif
+      if (plan->path) execve(plan->path, ctx->argv, envp);
+      else errno = ENOENT;
+    }
+
+  fail:
+    SpawnError rep;
+    rep.stage = stage;
+    rep.err = errno;
+    util::write_n(err_fd, reinterpret_cast<const char*>(&rep), sizeof(rep));
+    _exit(EXIT_FAILURE);
+    return 0;
+  }
+
+#ifdef __linux__
+  // Stack of the vfork style child, one per spawning thread
+  static const size_t SPAWN_STACK_BYTES = 64 * 1024;
+
+  /*!
+   * The children spawned by a Popen and not reaped yet, which
+   * kill_tree tells apart from the orphans handed to a subreaper.
+   * A spawn holds `spawning` for reading till its child is added,
+   * kill_tree holds it for writing while it looks for orphans.
+   */
+  struct PopenChildren {
+    PopenChildren() { pthread_rwlock_init(&spawning, nullptr); }
+
+    pthread_rwlock_t spawning;
+    std::mutex mtx;
+    std::set<int> pids;
+
+    void add(int pid)
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      pids.insert(pid);
+    }
+    void remove(int pid)
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      pids.erase(pid);
+    }
+    bool has(int pid)
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      return pids.count(pid) != 0;
+    }
+  };
+
+  // Never destroyed, children may be reaped at exit
+  inline PopenChildren& popen_children()
+  {
+    static PopenChildren* children = new PopenChildren;
+    return *children;
+  }
+
+  // Holds PopenChildren::spawning for its scope
+  struct SpawnLock {
+    explicit SpawnLock(bool write)
+    {
+      auto lock = &popen_children().spawning;
+      if (write) pthread_rwlock_wrlock(lock);
+      else pthread_rwlock_rdlock(lock);
+    }
+    ~SpawnLock() { pthread_rwlock_unlock(&popen_children().spawning); }
+    SpawnLock(const SpawnLock&) = delete;
+    void operator=(const SpawnLock&) = delete;
+  };
+#endif
+
+  /*!
+   * Starts the child of a plan and returns its pid once it has
+   * exec'd or failed. All signals are blocked meanwhile so that
+   * no handler of the parent runs on the child's side.
+   */
+  inline pid_t spawn_plan(SpawnContext& ctx)
+  {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &ctx.mask);
+
+#ifdef __linux__
+    static thread_local std::unique_ptr<char[]> stack(new char[SPAWN_STACK_BYTES]);
+    auto top = reinterpret_cast<uintptr_t>(stack.get() + SPAWN_STACK_BYTES) & ~uintptr_t(15);
+    pid_t pid = clone(spawn_child, reinterpret_cast<void*>(top),
+                      CLONE_VM | CLONE_VFORK | SIGCHLD, &ctx);
+#else
+    pid_t pid = fork();
+    if (pid == 0) spawn_child(&ctx);
+#endif
+    int err = errno;
+    pthread_sigmask(SIG_SETMASK, &ctx.mask, nullptr);
+    if (pid == -1) throw OSError("clone failed", err);
+    return pid;
+  }
+}
+#endif
+
+
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        METRICS
+ *-----------------------------------------------------------
+ */
+
+/*!
+ * Latencies as recorded by the MetricsRegistry, in buckets
+ * which grow by powers of two split in 4, so within 25% of
+ * the value, from 1us up to 25 days. `buckets` holds the count
+ * of each bucket, not a cumulative one.
+ */
+struct HistogramSnapshot
+{
+  static const int SUB_BITS = 2;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int BUCKETS = SUB_BUCKETS * 42;
+
+  uint64_t count = 0;
+  double sum = 0;                 // Seconds
+  std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+
+  // Bucket holding a latency of `us` microseconds
+  static int bucket_of(uint64_t us)
+  {
+    if (us < static_cast<uint64_t>(SUB_BUCKETS)) return static_cast<int>(us);
+    int msb = 63;
+    while (!(us >> msb)) msb--;
+    int shift = msb - SUB_BITS;
+    int idx = (shift + 1) * SUB_BUCKETS + static_cast<int>((us >> shift) - SUB_BUCKETS);
+    return std::min(idx, BUCKETS - 1);
+  }
+
+  // Highest latency of bucket `idx`, in seconds
+  static double upper_bound(int idx)
+  {
+    if (idx < SUB_BUCKETS) return idx / 1e6;
+    int shift = idx / SUB_BUCKETS - 1;
+    uint64_t us = ((static_cast<uint64_t>(SUB_BUCKETS + idx % SUB_BUCKETS) + 1) << shift) - 1;
+    return us / 1e6;
+  }
+
+  // Upper bound of the bucket holding the `q` quantile, 0 if empty
+  double quantile(double q) const
+  {
+    if (!count) return 0;
+    uint64_t rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= rank) return upper_bound(i);
+    }
+    return upper_bound(BUCKETS - 1);
+  }
+};
+
+/*!
+ * What the MetricsRegistry has seen of one executable.
+ */
+struct ExeMetrics
+{
+  uint64_t spawns = 0;              // Children spawned
+  uint64_t reaped = 0;
+  std::map<int, uint64_t> failures; // Failed spawns, by errno
+  std::map<int, uint64_t> exits;    // Exit codes of the reaped children
+  std::map<int, uint64_t> signals;  // Signals they died of
+  HistogramSnapshot spawn_time;     // Till exec
+  HistogramSnapshot run_time;       // From exec till reaped
+  HistogramSnapshot wall_time;      // From the spawn till reaped
+
+  // Key of the codes counted together once an executable has
+  // seen too many different ones
+  enum { OTHER_CODE = -1 };
+
+  // Children spawned but not reaped yet
+  uint64_t live() const { return spawns - std::min(spawns, reaped); }
+};
+
+using MetricsSnapshot = std::map<std::string, ExeMetrics>;
+
+enum MetricsFormat {
+  METRICS_PROMETHEUS,   // Prometheus text exposition format
+  METRICS_JSON,
+};
+
+namespace detail
+{
+  // Counters of one executable in one thread. Only the owning
+  // thread writes them, relaxed, so that nothing is shared on
+  // the hot path; readers add up the shards.
+  struct MetricSeries {
+    // Counts by errno, exit code or signal in N slots, claimed
+    // by the first code that needs one. Once they are taken
+    // the other codes are counted under OTHER_CODE.
+    template <int N>
+    struct CodeCounts {
+      std::atomic<int> codes[N];
+      std::atomic<uint64_t> counts[N] = {};
+      std::atomic<uint64_t> other{0};
+
+      CodeCounts()
+      {
+        for (auto& c : codes) c.store(NO_CODE, std::memory_order_relaxed);
+      }
+
+      void record(int code)
+      {
+        for (int i = 0; i < N; i++) {
+          int c = codes[i].load(std::memory_order_relaxed);
+          if (c == code) return bump(counts[i]);
+          if (c == NO_CODE) {
+            bump(counts[i]);
+            // Readers skip the slot till its code is set
+            codes[i].store(code, std::memory_order_release);
+            return;
+          }
+        }
+        bump(other);
+      }
+
+      void add_to(std::map<int, uint64_t>& dst) const
+      {
+        for (int i = 0; i < N; i++) {
+          int c = codes[i].load(std::memory_order_acquire);
+          if (c != NO_CODE) dst[c] += counts[i].load(std::memory_order_relaxed);
+        }
+        uint64_t v = other.load(std::memory_order_relaxed);
+        if (v) dst[ExeMetrics::OTHER_CODE] += v;
+      }
+    };
+    static const int NO_CODE = INT_MIN;
+
+    struct Histogram {
+      std::atomic<uint64_t> count{0};
+      std::atomic<uint64_t> sum_us{0};
+      std::atomic<uint64_t> buckets[HistogramSnapshot::BUCKETS] = {};
+
+      void record(SpawnStats::time_point from, SpawnStats::time_point to)
+      {
+        if (from == SpawnStats::time_point() || to == SpawnStats::time_point()) return;
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+        uint64_t v = static_cast<uint64_t>(std::max<long long>(us, 0));
+        bump(count);
+        bump(sum_us, v);
+        bump(buckets[HistogramSnapshot::bucket_of(v)]);
+      }
+
+      void add_to(HistogramSnapshot& snap) const
+      {
+        snap.count += count.load(std::memory_order_relaxed);
+        snap.sum += sum_us.load(std::memory_order_relaxed) / 1e6;
+        for (int i = 0; i < HistogramSnapshot::BUCKETS; i++) {
+          snap.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+        }
+      }
+    };
+
+    // Single writer, so a load and a store do
+    static void bump(std::atomic<uint64_t>& c, uint64_t n = 1)
+    {
+      c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> spawns{0};
+    std::atomic<uint64_t> reaped{0};
+    CodeCounts<4> failures;
+    CodeCounts<8> exits;
+    CodeCounts<4> signals;
+    Histogram spawn_time;
+    Histogram run_time;
+    Histogram wall_time;
+
+    void add_to(ExeMetrics& m) const
+    {
+      m.spawns += spawns.load(std::memory_order_relaxed);
+      m.reaped += reaped.load(std::memory_order_relaxed);
+      failures.add_to(m.failures);
+      exits.add_to(m.exits);
+      signals.add_to(m.signals);
+      spawn_time.add_to(m.spawn_time);
+      run_time.add_to(m.run_time);
+      wall_time.add_to(m.wall_time);
+    }
+  };
+
+  // The series of one thread, indexed by the id of the executable
+  struct MetricShard {
+    std::mutex mtx;   // Taken by readers, and by the owner to grow
+    std::vector<std::unique_ptr<MetricSeries>> series;
+  };
+}
+
+/*!
+ * class: MetricsRegistry
+ * Aggregated metrics of all the children spawned by this process,
+ * keyed by the base name of their executable, or of the program
+ * a shell{true} command starts with: spawns, failed spawns by
+ * errno, live children, exit codes and signals, and histograms
+ * of the time to exec, the run time and the wall time. Past
+ * MAX_EXECUTABLES names, the new ones are all keyed "other".
+ * The latencies come from Popen::stats(), so they are not
+ * recorded with SUBPROCESS_NO_STATS. Everything is compiled out
+ * with SUBPROCESS_NO_METRICS.
+ *
+ * Each thread records into its own shard with relaxed atomics,
+ * and the shards are summed when read. Only the first event of
+ * an executable in a thread takes a lock.
+ *
+ * Eg:
+ *   auto& reg = MetricsRegistry::global();
+ *   reg.write("/run/app/subprocess.prom", METRICS_PROMETHEUS);
+ *   auto snap = reg.snapshot();
+ *   std::cout << snap["gzip"].wall_time.quantile(0.99) << std::endl;
+ */
+class MetricsRegistry
+{
+public:
+  // Never destroyed, so that threads exiting late can still fold
+  // their shard into it
+  static MetricsRegistry& global()
+  {
+    static MetricsRegistry* reg = new MetricsRegistry;
+    return *reg;
+  }
+
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  void operator=(const MetricsRegistry&) = delete;
+
+  // Executables beyond that many are all recorded as "other"
+  static const int MAX_EXECUTABLES = 128;
+
+  // The id under which the executable `exe` is recorded
+  int id_of(const std::string& exe);
+
+  void on_spawn(int id);
+  void on_failure(int id, int err);
+  // `code` is the exit code, or the signal with `signaled`
+  void on_reap(int id, int code, bool signaled, const SpawnStats& st);
+
+  MetricsSnapshot snapshot();
+
+  std::string render(MetricsFormat fmt);
+  // Writes the metrics out, to a file through a rename so that
+  // a reader never sees it half written. Throws OSError.
+  void write(int fd, MetricsFormat fmt);
+  void write(const std::string& path, MetricsFormat fmt);
+
+private:
+  MetricsRegistry() {}
+
+  // Folds the shard of an exiting thread into retired_
+  struct ShardOwner {
+    std::shared_ptr<detail::MetricShard> shard = std::make_shared<detail::MetricShard>();
+    ~ShardOwner() { MetricsRegistry::global().retire(shard); }
+  };
+
+  detail::MetricSeries& series(int id);
+  void retire(const std::shared_ptr<detail::MetricShard>& shard);
+
+private:
+  std::mutex mtx_;
+  std::vector<std::string> names_;
+  std::map<std::string, int> ids_;
+  std::vector<std::weak_ptr<detail::MetricShard>> shards_;
+  MetricsSnapshot retired_;
+};
+
+namespace util
+{
+  // Escapes `str` for a Prometheus label value or a JSON string
+  static inline std::string escape_label(const std::string& str)
+  {
+    std::string res;
+    for (char c : str) {
+      if (c == '\\' || c == '"') res += '\\';
+      if (c == '\n') {
+        res += "\\n";
+        continue;
+      }
+      if (static_cast<unsigned char>(c) < 0x20) continue;
+      res += c;
+    }
+    return res;
+  }
+
+  // Writes `data` to `path` through a temporary file and a
+  // rename, so that a reader never sees it half written.
+  // Throws OSError.
+  static inline void replace_file(const std::string& path, const std::string& data)
+  {
+    static std::atomic<unsigned> counter{0};
+    auto tmp = path + ".tmp." + std::to_string(getpid()) + "." +
+               std::to_string(counter++);
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) throw OSError("open failed", errno);
+    if (write_n(fd, data.data(), data.size()) != static_cast<int>(data.size())) {
+      int err = errno;
+      close(fd);
+      unlink(tmp.c_str());
+      throw OSError("write failed", err);
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) == -1) {
+      int err = errno;
+      unlink(tmp.c_str());
+      throw OSError("rename failed", err);
+    }
+  }
+}
+
+inline int MetricsRegistry::id_of(const std::string& exe)
+{
+  auto slash = exe.rfind('/');
+  std::string name = slash == std::string::npos ? exe : exe.substr(slash + 1);
+  // Only holds the names with an id of their own, so it
+  // stays as small as the registry
+  static thread_local std::unordered_map<std::string, int> cache;
+  auto it = cache.find(name);
+  if (it != cache.end()) return it->second;
+
+  std::lock_guard<std::mutex> lk(mtx_);
+  auto found = ids_.find(name);
+  if (found == ids_.end()) {
+    if (names_.size() >= static_cast<size_t>(MAX_EXECUTABLES)) name = "other";
+    found = ids_.emplace(name, static_cast<int>(names_.size())).first;
+    if (found->second == static_cast<int>(names_.size())) names_.push_back(name);
+  }
+  if (name != "other") cache.emplace(name, found->second);
+  return found->second;
+}
+
+inline detail::MetricSeries& MetricsRegistry::series(int id)
+{
+  static thread_local ShardOwner owner;
+  auto& shard = *owner.shard;
+  if (id >= static_cast<int>(shard.series.size()) || !shard.series[id]) {
+    if (shard.series.empty()) {
+      std::lock_guard<std::mutex> lk(mtx_);
+      shards_.push_back(owner.shard);
+    }
+    std::lock_guard<std::mutex> lk(shard.mtx);
+    if (id >= static_cast<int>(shard.series.size())) shard.series.resize(id + 1);
+    shard.series[id].reset(new detail::MetricSeries);
+  }
+  return *shard.series[id];
+}
+
+inline void MetricsRegistry::retire(const std::shared_ptr<detail::MetricShard>& shard)
+{
+  std::lock_guard<std::mutex> lk(mtx_);
+  std::lock_guard<std::mutex> slk(shard->mtx);
+  for (size_t id = 0; id < shard->series.size(); id++) {
+    if (shard->series[id]) shard->series[id]->add_to(retired_[names_[id]]);
+  }
+  shard->series.clear();
+}
+
+inline void MetricsRegistry::on_spawn(int id)
+{
+  detail::MetricSeries::bump(series(id).spawns);
+}
+
+inline void MetricsRegistry::on_failure(int id, int err)
+{
+  series(id).failures.record(err);
+}
+
+inline void MetricsRegistry::on_reap(int id, int code, bool signaled, const SpawnStats& st)
+{
+  auto& s = series(id);
+  detail::MetricSeries::bump(s.reaped);
+  if (signaled) s.signals.record(code);
+  else s.exits.record(code);
+  s.spawn_time.record(st.start, st.exec);
+  s.run_time.record(st.exec, st.reaped);
+  s.wall_time.record(st.start, st.reaped);
+}
+
+inline MetricsSnapshot MetricsRegistry::snapshot()
+{
+  std::lock_guard<std::mutex> lk(mtx_);
+  MetricsSnapshot snap = retired_;
+  for (auto it = shards_.begin(); it != shards_.end(); ) {
+    auto shard = it->lock();
+    if (!shard) {
+      it = shards_.erase(it);
+      continue;
+    }
+    std::lock_guard<std::mutex> slk(shard->mtx);
+    for (size_t id = 0; id < shard->series.size(); id++) {
+      if (shard->series[id]) shard->series[id]->add_to(snap[names_[id]]);
+    }
+    ++it;
+  }
+  return snap;
+}
+
+inline std::string MetricsRegistry::render(MetricsFormat fmt)
+{
+  auto snap = snapshot();
+  std::ostringstream out;
+  out.precision(9);
+
+  auto code_label = [](int code) {
+    return code == ExeMetrics::OTHER_CODE ? std::string("other") : std::to_string(code);
+  };
+
+  if (fmt == METRICS_JSON) {
+    auto codes = [&out, &code_label](const std::map<int, uint64_t>& m) {
+      out << "{";
+      const char* sep = "";
+      for (auto& kv : m) {
+        out << sep << "\"" << code_label(kv.first) << "\": " << kv.second;
+        sep = ", ";
+      }
+      out << "}";
+    };
+    auto hist = [&out](const HistogramSnapshot& h) {
+      out << "{\"count\": " << h.count << ", \"sum\": " << h.sum
+          << ", \"p50\": " << h.quantile(0.5) << ", \"p90\": " << h.quantile(0.9)
+          << ", \"p99\": " << h.quantile(0.99) << ", \"buckets\": [";
+      const char* sep = "";
+      for (int i = 0; i < HistogramSnapshot::BUCKETS; i++) {
+        if (!h.buckets[i]) continue;
+        out << sep << "[" << HistogramSnapshot::upper_bound(i) << ", " << h.buckets[i] << "]";
+        sep = ", ";
+      }
+      out << "]}";
+    };
+    out << "{";
+    const char* sep = "";
+    for (auto& kv : snap) {
+      auto& m = kv.second;
+      out << sep << "\n  \"" << util::escape_label(kv.first) << "\": {"
+          << "\"spawns\": " << m.spawns << ", \"live\": " << m.live()
+          << ", \"failures\": ";
+      codes(m.failures);
+      out << ", \"exits\": ";
+      codes(m.exits);
+      out << ", \"signals\": ";
+      codes(m.signals);
+      out << ", \"spawn_seconds\": ";
+      hist(m.spawn_time);
+      out << ", \"run_seconds\": ";
+      hist(m.run_time);
+      out << ", \"wall_seconds\": ";
+      hist(m.wall_time);
+      out << "}";
+      sep = ",";
+    }
+    out << "\n}\n";
+    return out.str();
+  }
+
+  auto header = [&out](const char* name, const char* type, const char* help) {
+    out << "# HELP subprocess_" << name << " " << help << "\n"
+        << "# TYPE subprocess_" << name << " " << type << "\n";
+  };
+  auto codes = [&out, &snap, &code_label](const char* name, const char* label,
+                                          std::map<int, uint64_t> ExeMetrics::*field) {
+    for (auto& kv : snap) {
+      for (auto& c : kv.second.*field) {
+        out << "subprocess_" << name << "{exe=\"" << util::escape_label(kv.first)
+            << "\"," << label << "=\"" << code_label(c.first) << "\"} " << c.second << "\n";
+      }
+    }
+  };
+  // Every series lists the same buckets, so that they can be
+  // aggregated: the last one of every other power of two, from
+  // 7us on. The counts are cumulative as Prometheus expects.
+  auto hist = [&out, &snap](const char* name, HistogramSnapshot ExeMetrics::*field) {
+    const int step = 2 * HistogramSnapshot::SUB_BUCKETS;
+    for (auto& kv : snap) {
+      auto& h = kv.second.*field;
+      auto exe = util::escape_label(kv.first);
+      uint64_t cum = 0;
+      int i = 0;
+      for (int le = step - 1; le < HistogramSnapshot::BUCKETS; le += step) {
+        for (; i <= le; i++) cum += h.buckets[i];
+        out << "subprocess_" << name << "_bucket{exe=\"" << exe << "\",le=\""
+            << HistogramSnapshot::upper_bound(le) << "\"} " << cum << "\n";
+      }
+      out << "subprocess_" << name << "_bucket{exe=\"" << exe << "\",le=\"+Inf\"} "
+          << h.count << "\n"
+          << "subprocess_" << name << "_sum{exe=\"" << exe << "\"} " << h.sum << "\n"
+          << "subprocess_" << name << "_count{exe=\"" << exe << "\"} " << h.count << "\n";
+    }
+  };
+
+  header("spawns_total", "counter", "Children spawned.");
+  for (auto& kv : snap) {
+    out << "subprocess_spawns_total{exe=\"" << util::escape_label(kv.first) << "\"} "
+        << kv.second.spawns << "\n";
+  }
+  header("spawn_failures_total", "counter", "Failed spawns by errno.");
+  codes("spawn_failures_total", "errno", &ExeMetrics::failures);
+  header("live_children", "gauge", "Children spawned and not reaped yet.");
+  for (auto& kv : snap) {
+    out << "subprocess_live_children{exe=\"" << util::escape_label(kv.first) << "\"} "
+        << kv.second.live() << "\n";
+  }
+  header("exits_total", "counter", "Reaped children by exit code.");
+  codes("exits_total", "code", &ExeMetrics::exits);
+  header("signals_total", "counter", "Reaped children by the signal they died of.");
+  codes("signals_total", "signal", &ExeMetrics::signals);
+  header("spawn_seconds", "histogram", "Time from the spawn till exec.");
+  hist("spawn_seconds", &ExeMetrics::spawn_time);
+  header("run_seconds", "histogram", "Time from exec till the child is reaped.");
+  hist("run_seconds", &ExeMetrics::run_time);
+  header("wall_seconds", "histogram", "Time from the spawn till the child is reaped.");
+  hist("wall_seconds", &ExeMetrics::wall_time);
+  return out.str();
+}
+
+inline void MetricsRegistry::write(int fd, MetricsFormat fmt)
+{
+  auto text = render(fmt);
+  if (util::write_n(fd, text.data(), text.size()) != static_cast<int>(text.size())) {
+    throw OSError("write failed", errno);
+  }
+}
+
+inline void MetricsRegistry::write(const std::string& path, MetricsFormat fmt)
+{
+  util::replace_file(path, render(fmt));
+}
+#endif
+
+
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        TRACING
+ *-----------------------------------------------------------
+ */
+
+namespace detail
+{
+  // What the Tracer keeps of one event. Trivially copyable,
+  // so that recording it does not allocate.
+  struct TraceRecord {
+    enum Kind { SPAWN, FAILURE, EXIT, LINK };
+
+    int kind = SPAWN;
+    int pid = -1;
+    // Exit code or signal of EXIT, errno of FAILURE
+    int code = 0;
+    // SpawnStage of FAILURE
+    int stage = 0;
+    bool signaled = false;
+    // Upstream stage of LINK, and when it was spawned
+    int peer = -1;
+    SpawnStats::time_point peer_start;
+    char exe[48] = {};
+    SpawnStats stats;
+  };
+
+  struct TraceSlot {
+    std::atomic<bool> ready{false};
+    TraceRecord rec;
+  };
+}
+
+/*!
+ * class: Tracer
+ * Records the children spawned by this process on a timeline,
+ * written out as Chrome trace-event JSON, which chrome://tracing
+ * and Perfetto load. Each child gets a track with the spawn till
+ * exec, the run till it was reaped, its first byte and EOF on
+ * stdout, its exit status and the bytes sent and read. The stages
+ * of a pipeline are linked by arrows, see Popen::trace_after.
+ * The times come from Popen::stats(), so nothing is recorded
+ * with SUBPROCESS_NO_STATS.
+ *
+ * The records go into a buffer of fixed capacity, allocated by
+ * the first start() and kept till clear(). Each thread claims
+ * slots in chunks and fills them without locking; once the
+ * buffer is full, records are dropped and counted.
+ *
+ * Eg:
+ *   Tracer::global().start();
+ *   pipeline("cat file", "sort", "uniq -c");
+ *   Tracer::global().stop();
+ *   Tracer::global().write("subprocess.trace.json");
+ */
+class Tracer
+{
+public:
+  static const size_t DEFAULT_CAPACITY = 1 << 14;
+  // Slots claimed by a thread at a time
+  static const size_t CHUNK = 32;
+
+  // Never destroyed, the buffer is shared by all the threads
+  static Tracer& global()
+  {
+    static Tracer* tracer = new Tracer;
+    return *tracer;
+  }
+
+  Tracer(const Tracer&) = delete;
+  void operator=(const Tracer&) = delete;
+
+  // Starts recording. `capacity` is only used when there is no
+  // buffer yet, the records are kept over stop() and start().
+  void start(size_t capacity = DEFAULT_CAPACITY);
+  void stop() { enabled_.store(false, std::memory_order_relaxed); }
+  // Stops recording, waits for the records being written and
+  // frees the buffer along with all the records
+  void clear();
+  bool enabled() const noexcept { return enabled_.load(std::memory_order_acquire); }
+
+  // Records dropped as the buffer was full
+  size_t dropped() const noexcept { return dropped_.load(std::memory_order_relaxed); }
+
+  std::string render();
+  // Writes the trace to `path` through a rename. Throws OSError.
+  void write(const std::string& path);
+
+  void on_spawn(const char* exe, int pid, const SpawnStats& st);
+  void on_failure(const char* exe, int pid, int stage, int err, const SpawnStats& st);
+  void on_exit(int pid, int code, bool signaled, const SpawnStats& st);
+  void on_link(int from, SpawnStats::time_point from_start,
+               int to, SpawnStats::time_point to_start);
+
+private:
+  Tracer() {}
+
+  // A free slot of the buffer, null if it is full
+  detail::TraceSlot* claim();
+  // Fills a free slot with `fill` if recording
+  template <typename Fill>
+  void record(Fill fill);
+
+private:
+  std::mutex mtx_;
+  std::unique_ptr<detail::TraceSlot[]> slots_;
+  size_t capacity_ = 0;
+  std::atomic<bool> enabled_{false};
+  std::atomic<size_t> claimed_{0};
+  std::atomic<size_t> dropped_{0};
+  // Threads inside record(), waited for by clear()
+  std::atomic<int> writers_{0};
+  // Bumped by clear(), so that the threads drop the chunks
+  // they claimed from the previous buffer
+  std::atomic<unsigned> generation_{0};
+};
+
+inline void Tracer::start(size_t capacity)
+{
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (!slots_) {
+    capacity_ = std::max<size_t>(capacity, 1);
+    slots_.reset(new detail::TraceSlot[capacity_]);
+  }
+  enabled_.store(true, std::memory_order_release);
+}
+
+inline void Tracer::clear()
+{
+  std::lock_guard<std::mutex> lk(mtx_);
+  enabled_.store(false);
+  while (writers_.load()) std::this_thread::yield();
+  slots_.reset();
+  capacity_ = 0;
+  claimed_.store(0, std::memory_order_relaxed);
+  dropped_.store(0, std::memory_order_relaxed);
+  generation_.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline detail::TraceSlot* Tracer::claim()
+{
+  static thread_local size_t next = 0, end = 0;
+  static thread_local unsigned gen = 0;
+  unsigned cur = generation_.load(std::memory_order_relaxed);
+  if (gen != cur) {
+    next = end = 0;
+    gen = cur;
+  }
+  if (next == end) {
+    size_t at = claimed_.fetch_add(CHUNK, std::memory_order_relaxed);
+    if (at >= capacity_) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    next = at;
+    end = std::min(at + CHUNK, capacity_);
+  }
+  return &slots_[next++];
+}
+
+template <typename Fill>
+inline void Tracer::record(Fill fill)
+{
+  // Both sequentially consistent, so that clear() either sees
+  // this thread or makes it see recording stopped
+  writers_.fetch_add(1);
+  if (enabled_.load()) {
+    auto slot = claim();
+    if (slot) {
+      fill(slot->rec);
+      slot->ready.store(true, std::memory_order_release);
+    }
+  }
+  writers_.fetch_sub(1, std::memory_order_release);
+}
+
+inline void Tracer::on_spawn(const char* exe, int pid, const SpawnStats& st)
+{
+  if (!STATS_ENABLED || !enabled()) return;
+  record([&](detail::TraceRecord& rec) {
+    rec.kind = detail::TraceRecord::SPAWN;
+    rec.pid = pid;
+    std::strncpy(rec.exe, exe, sizeof(rec.exe) - 1);
+    rec.stats = st;
+  });
+}
+
+inline void Tracer::on_failure(const char* exe, int pid, int stage, int err,
+                               const SpawnStats& st)
+{
+  if (!STATS_ENABLED || !enabled()) return;
+  record([&](detail::TraceRecord& rec) {
+    rec.kind = detail::TraceRecord::FAILURE;
+    rec.pid = pid;
+    rec.code = err;
+    rec.stage = stage;
+    std::strncpy(rec.exe, exe, sizeof(rec.exe) - 1);
+    rec.stats = st;
+  });
+}
+
+inline void Tracer::on_exit(int pid, int code, bool signaled, const SpawnStats& st)
+{
+  if (!STATS_ENABLED || !enabled()) return;
+  record([&](detail::TraceRecord& rec) {
+    rec.kind = detail::TraceRecord::EXIT;
+    rec.pid = pid;
+    rec.code = code;
+    rec.signaled = signaled;
+    rec.stats = st;
+  });
+}
+
+inline void Tracer::on_link(int from, SpawnStats::time_point from_start,
+                            int to, SpawnStats::time_point to_start)
+{
+  if (!STATS_ENABLED || !enabled()) return;
+  record([&](detail::TraceRecord& rec) {
+    rec.kind = detail::TraceRecord::LINK;
+    rec.pid = to;
+    rec.peer = from;
+    rec.peer_start = from_start;
+    rec.stats.start = to_start;
+  });
+}
+
+inline std::string Tracer::render()
+{
+  std::vector<detail::TraceRecord> recs;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    size_t n = std::min(claimed_.load(std::memory_order_relaxed), capacity_);
+    for (size_t i = 0; i < n; i++) {
+      if (slots_[i].ready.load(std::memory_order_acquire)) recs.push_back(slots_[i].rec);
+    }
+  }
+
+  int self = getpid();
+  std::ostringstream out;
+  out << std::fixed;
+  out.precision(3);
+  auto us = [](SpawnStats::time_point tp) {
+    return std::chrono::duration<double, std::micro>(tp.time_since_epoch()).count();
+  };
+  auto set = [](SpawnStats::time_point tp) { return tp != SpawnStats::time_point(); };
+  const char* sep = "\n";
+  // Starts an event on the track of the child `pid`
+  auto event = [&](const char* name, const char* ph, int pid, SpawnStats::time_point ts) {
+    out << sep << "{\"name\": \"" << name << "\", \"cat\": \"subprocess\", \"ph\": \""
+        << ph << "\", \"pid\": " << self << ", \"tid\": " << pid << ", \"ts\": " << us(ts);
+    sep = ",\n";
+  };
+
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  out << sep << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << self
+      << ", \"args\": {\"name\": \"subprocess " << self << "\"}}";
+  sep = ",\n";
+  size_t flow = 0;
+  for (auto& r : recs) {
+    auto& st = r.stats;
+    auto exe = util::escape_label(r.exe);
+    switch (r.kind) {
+    case detail::TraceRecord::SPAWN:
+      out << sep << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << self
+          << ", \"tid\": " << r.pid << ", \"args\": {\"name\": \"" << exe << " ["
+          << r.pid << "]\"}}";
+      if (!set(st.start) || !set(st.exec)) break;
+      event("spawn", "X", r.pid, st.start);
+      out << ", \"dur\": " << us(st.exec) - us(st.start)
+          << ", \"args\": {\"exe\": \"" << exe << "\", \"fork_us\": "
+          << (set(st.forked) ? us(st.forked) - us(st.start) : -1) << "}}";
+      break;
+    case detail::TraceRecord::FAILURE: {
+      if (!set(st.start)) break;
+      SpawnError err;
+      err.stage = r.stage;
+      err.err = r.code;
+      event("spawn failed", "i", r.pid, set(st.reaped) ? st.reaped : st.start);
+      out << ", \"s\": \"t\", \"args\": {\"exe\": \"" << exe << "\", \"errno\": "
+          << r.code << ", \"error\": \"" << util::escape_label(err.message()) << "\"}}";
+      break;
+    }
+    case detail::TraceRecord::EXIT:
+      if (set(st.exec) && set(st.reaped)) {
+        event("run", "X", r.pid, st.exec);
+        out << ", \"dur\": " << us(st.reaped) - us(st.exec)
+            << ", \"args\": {\"" << (r.signaled ? "signal" : "exit_code") << "\": " << r.code
+            << ", \"bytes_in\": " << st.bytes_in << ", \"bytes_out\": " << st.bytes_out
+            << ", \"bytes_err\": " << st.bytes_err << "}}";
+      }
+      if (set(st.first_byte)) {
+        event("first byte", "i", r.pid, st.first_byte);
+        out << ", \"s\": \"t\"}";
+      }
+      if (set(st.eof)) {
+        event("eof", "i", r.pid, st.eof);
+        out << ", \"s\": \"t\"}";
+      }
+      break;
+    case detail::TraceRecord::LINK:
+      if (!set(r.peer_start) || !set(st.start)) break;
+      // From the spawn slice of the upstream stage
+      // to the one of this stage
+      flow++;
+      event("pipe", "s", r.peer, r.peer_start);
+      out << ", \"id\": " << flow << "}";
+      event("pipe", "f", r.pid, st.start);
+      out << ", \"bp\": \"e\", \"id\": " << flow << "}";
+      break;
+    }
+  }
+  out << "\n]}\n";
+  return out.str();
+}
+
+inline void Tracer::write(const std::string& path)
+{
+  util::replace_file(path, render());
+}
+#endif
+
+
+/*!
+ * class: Popen
+ * This is the single most important class in the whole library
+ * and glues together all the helper classes to provide a common
+ * interface to the client.
+ *
+ * API's provided by the class:
+ * 1. Popen({"cmd"}, output{..}, error{..}, cwd{..}, ....)
+ *    Command provided as a sequence.
+ * 2. Popen("cmd arg1"m output{..}, error{..}, cwd{..}, ....)
+ *    Command provided in a single string.
+ * 3. wait()             - Wait for the child to exit.
+ * 4. retcode()          - The return code of the exited child.
+ * 5. pid()              - PID of the spawned child.
+ * 6. poll()             - Check the status of the running child.
+ * 7. kill(sig_num)      - Kill the child, or its whole group with `process_group`
+ *                         or `session_leader`. SIGTERM used by default.
+ * 8. send(...)          - Send input to the input channel of the child.
+ * 9. communicate(...)   - Get the output/error from the child and close the channels
+ *                         from the parent side.
+ *10. input()            - Get the input channel/File pointer. Can be used for
+ *                         cutomizing the way of sending input to child.
+ *11. output()           - Get the output channel/File pointer. Usually used
+                           in case of redirection. See piping examples.
+ *12. error()            - Get the error channel/File poiner. Usually used
+                           in case of redirection.
+ *13. start_process()    - Start the child process. Only to be used when
+ *                         `defer_spawn` option was provided in Popen constructor.
+ *14. shm_input()        - Get the shared memory ring feeding the child. Only
+ *                         available with the `shm_channel` option.
+ *15. shm_output()       - Get the shared memory ring the child writes to.
+ *16. wait(timeout)      - Same as wait(), but terminates the child and throws
+ *                         TimeoutExpired if it has not exited in time.
+ *17. communicate(..., timeout)
+ *                       - Same as communicate(...), with a timeout as for wait.
+ *18. kill_tree()        - Kill the child with all its descendants and reap it.
+ *19. resource_usage()   - CPU time, peak RSS, faults and context switches
+ *                         of the child, once it is reaped.
+ *20. exceeded_rlimit()  - The resource limit the child was killed for, if any.
+ *21. suspend()/resume() - Stop the child, or its group, and continue it.
+ *                         pgid() gives the group.
+ *22. stats()            - When the child was spawned, exec'd, first wrote,
+ *                         was reaped, and the bytes through its pipes.
+ *23. trace_after()      - Link the child to the one feeding it in the Tracer.
+ */
+class Popen
+{
+public:
+  friend struct detail::ArgumentDeducer;
+  friend class detail::Child;
+
+  template <typename... Args>
+  Popen(const std::string& cmd_args, Args&& ...args)
+  {
+    config().vargs_ = util::split(cmd_args);
+    init_args(std::forward<Args>(args)...);
+
+    // Setup the communication channels of the Popen class
+    stream_.setup_comm_channels();
+
+    if (!defer_process_start_) execute_process();
+  }
+
+  template <typename... Args>
+  Popen(std::initializer_list<const char*> cmd_args, Args&& ...args)
+  {
+    auto& vargs = config().vargs_;
+    vargs.insert(vargs.end(), cmd_args.begin(), cmd_args.end());
+    init_args(std::forward<Args>(args)...);
+
+    // Setup the communication channels of the Popen class
+    stream_.setup_comm_channels();
+
+    if (!defer_process_start_) execute_process();
+  }
+
+  template <typename... Args>
+  Popen(std::vector<std::string> vargs, Args &&... args)
+  {
+    config().vargs_ = std::move(vargs);
+    init_args(std::forward<Args>(args)...);
+
+    // Setup the communication channels of the Popen class
+    stream_.setup_comm_channels();
+
+    if (!defer_process_start_) execute_process();
+  }
+
+#ifndef __USING_WINDOWS__
+  // Spawns a compiled Command. Only the stream options,
+  // bufsize, defer_spawn and substitute may be given.
+  template <typename... Args>
+  Popen(const Command& cmd, Args&&... args): plan_(cmd.plan_)
+  {
+    static_assert(detail::all_spawn_options<Args...>::value,
+                  "Option not allowed when spawning a Command");
+    init_args(std::forward<Args>(args)...);
+    session_leader_ = plan_->session_leader;
+
+    // Setup the communication channels of the Popen class
+    stream_.setup_comm_channels();
+
+    if (!defer_process_start_) execute_process();
+  }
+#endif
+
+/*
+  ~Popen()
+  {
+#ifdef __USING_WINDOWS__
+    CloseHandle(this->process_handle_);
+#endif
+  }
+*/
+
+  // A Popen can be moved, for instance within a std::vector,
+  // but not copied. A moved-from Popen must not be used.
+  Popen(Popen&&) = default;
+  Popen& operator=(Popen&&) = default;
+
+  void start_process() noexcept(false);
+
+  /*!
+   * Same as start_process, but a failure to spawn the child is
+   * returned instead of thrown, and the child is reaped.
+   * Meant for hot paths where failures are expected.
+   */
+  SpawnError start_process(std::nothrow_t) noexcept;
+
+  int pid() const noexcept { return child_pid_; }
+
+#ifndef __USING_WINDOWS__
+  // Process group signalled along with the child, -1 if none
+  int pgid() const noexcept { return pgid_; }
+#endif
+
+  int retcode() const noexcept { return retcode_; }
+
+  // Filled by wait4 when the child is reaped by wait() or poll()
+  const ResourceUsage& resource_usage() const noexcept { return usage_; }
+
+  // Timings of the phases of the child and bytes moved
+  // through its pipes, see SpawnStats
+  const SpawnStats& stats() const noexcept { return stream_.stats_; }
+
+#ifndef __USING_WINDOWS__
+  // Draws an arrow from `upstream` to this child in the
+  // Tracer, as the next stage of a pipeline. Both are to
+  // be spawned already.
+  void trace_after(const Popen& upstream);
+#endif
+
+#ifndef __USING_WINDOWS__
+  /*!
+   * The resource of the rlimits option which the reaped child
+   * was most likely killed for crossing, -1 if none. Inferred
+   * from how it died: SIGXCPU, or SIGKILL once near the soft
+   * limit, for RLIMIT_CPU, SIGXFSZ for RLIMIT_FSIZE, and SIGSEGV,
+   * SIGBUS or SIGABRT for the first of RLIMIT_AS, RLIMIT_DATA
+   * and RLIMIT_STACK which was set, as that is how a failed
+   * allocation usually ends.
+   */
+  int exceeded_rlimit() const noexcept;
+#endif
+
+  int wait() noexcept(false);
+
+#ifndef __USING_WINDOWS__
+  int wait(std::chrono::milliseconds timeout) noexcept(false)
+  { return wait_until(std::chrono::steady_clock::now() + timeout); }
+#endif
+
+  int poll() noexcept(false);
+
+  // Does not fail, Caller is expected to recheck the
+  // status with a call to poll()
+  void kill(int sig_num = 9);
+
+#ifndef __USING_WINDOWS__
+  /*!
+   * Stops the child with SIGSTOP, along with its process
+   * group if it has one, till resume() is called. It keeps
+   * its memory and state meanwhile. A suspended child which
+   * is sent another signal by kill() is resumed, so that it
+   * can act on it. That holds as well for a child stopped by
+   * anyone else, such as a LoadShedder.
+   */
+  void suspend();
+  void resume();
+  // True once suspended, or while the child is stopped
+  bool suspended() const noexcept;
+#endif
+
+#ifdef __linux__
+  /*!
+   * SIGKILLs the child and every live descendant of it, which
+   * are found in /proc and stopped first so that the tree
+   * cannot grow meanwhile, along with its process group if it
+   * has one. The child is reaped and its retcode returned.
+   * If this process is a subreaper (see set_child_subreaper)
+   * the killed descendants are reaped as well, else init
+   * reaps them. The descendants orphaned before the call are
+   * then children of this process: all its children started
+   * after this one and not spawned by a Popen are taken for
+   * such, children forked by other means included.
+   */
+  int kill_tree() noexcept(false);
+#endif
+
+  void set_out_buf_cap(size_t cap) { stream_.set_out_buf_cap(cap); }
+
+  void set_err_buf_cap(size_t cap) { stream_.set_err_buf_cap(cap); }
+
+  int send(const char* msg, size_t length)
+  { return stream_.send(msg, length); }
+
+  int send(const std::string& msg)
+  { return send(msg.c_str(), msg.size()); }
+
+  int send(const std::vector<char>& msg)
+  { return stream_.send(msg); }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length)
+  {
+#ifndef __USING_WINDOWS__
+    if (has_deadline()) return communicate_until(msg, length, deadline_);
+#endif
+    auto res = stream_.communicate(msg, length);
+    retcode_ = wait();
+    return res;
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const std::string& msg)
+  {
+    return communicate(msg.c_str(), msg.size());
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg)
+  {
+    return communicate(msg.data(), msg.size());
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate()
+  {
+    return communicate(nullptr, 0);
+  }
+
+#ifndef __USING_WINDOWS__
+  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length,
+                                              std::chrono::milliseconds timeout)
+  {
+    return communicate_until(msg, length, std::chrono::steady_clock::now() + timeout);
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const std::string& msg,
+                                              std::chrono::milliseconds timeout)
+  {
+    return communicate(msg.c_str(), msg.size(), timeout);
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg,
+                                              std::chrono::milliseconds timeout)
+  {
+    return communicate(msg.data(), msg.size(), timeout);
+  }
+
+  std::pair<OutBuffer, ErrBuffer> communicate(std::chrono::milliseconds timeout)
+  {
+    return communicate(nullptr, 0, timeout);
+  }
+#endif
+
+  FILE* input()  { return stream_.input(); }
+  FILE* output() { return stream_.output();}
+  FILE* error()  { return stream_.error(); }
+
+  /// Stream close APIs
+  void close_input()  { stream_.input_.reset();  }
+  void close_output() { stream_.output_.reset(); }
+  void close_error()  { stream_.error_.reset();  }
+
+#ifdef __linux__
+  ShmRing* shm_input()  { return shm_ ? &shm_->input() : nullptr; }
+  ShmRing* shm_output() { return shm_ ? &shm_->output() : nullptr; }
+#endif
+
+private:
+  template <typename F, typename... Args>
+  void init_args(F&& farg, Args&&... args);
+  void init_args();
+  void populate_c_argv();
+  detail::SpawnConfig& config()
+  {
+    if (!config_) config_.reset(new detail::SpawnConfig);
+    return *config_;
+  }
+  void execute_process() noexcept(false);
+  // Reaps the child, blocking till it exits
+  int reap() noexcept(false);
+#ifndef __USING_WINDOWS__
+  bool has_deadline() const
+  { return deadline_ != std::chrono::steady_clock::time_point(); }
+  int wait_until(std::chrono::steady_clock::time_point deadline) noexcept(false);
+  std::pair<OutBuffer, ErrBuffer> communicate_until(
+      const char* msg, size_t length, std::chrono::steady_clock::time_point deadline);
+  // SIGTERM, then SIGKILL after the grace period, and reap
+  void terminate_child();
+#endif
+  // Spawns the child. Setup errors are thrown, errors
+  // reported by the child are returned.
+  SpawnError spawn() noexcept(false);
+  SpawnError spawn_process() noexcept(false);
+#ifndef __USING_WINDOWS__
+  SpawnError spawn_plan() noexcept(false);
+  // Name the child is recorded under in the MetricsRegistry
+  int metric_id();
+  // Executable of the child to spawn, "" once it is spawned
+  const char* exe_name() const;
+  // Reports the exec'd child to the probes and the Tracer
+  void record_spawn();
+  // Reports the reaped child to the probes, the MetricsRegistry
+  // and the Tracer
+  void record_exit(int status);
+#endif
+
+private:
+  detail::Streams stream_;
+
+#ifdef __USING_WINDOWS__
+  HANDLE process_handle_;
+  std::future<void> cleanup_future_;
+#endif
+
+  // Released once the child is spawned
+  std::unique_ptr<detail::SpawnConfig> config_;
+#ifndef __USING_WINDOWS__
+  // Set when spawning a Command, till it is spawned
+  std::shared_ptr<const detail::SpawnPlan> plan_;
+#endif
+#ifdef __linux__
+  std::shared_ptr<ShmChannel> shm_;
+#endif
+
+#ifndef __USING_WINDOWS__
+  // Set by the timeout and deadline options
+  std::chrono::steady_clock::time_point deadline_;
+  int kill_grace_ms_ = DEFAULT_KILL_GRACE_MS;
+#endif
+
+  // Pid of the child process
+  int child_pid_ = -1;
+#ifndef __USING_WINDOWS__
+  // Process group kill() signals, -1 if none. Before the
+  // spawn, as given by process_group.
+  int pgid_ = -1;
+#endif
+
+  int retcode_ = -1;
+  ResourceUsage usage_;
+#ifndef __USING_WINDOWS__
+  // Signal the reaped child died of, 0 if none
+  int term_sig_ = 0;
+  // MetricsRegistry id of the running child, -1 if none
+  int metric_id_ = -1;
+  // As given by rlimits, kept for exceeded_rlimit()
+  std::vector<rlimits::limit> rlimits_;
+#endif
+
+  bool defer_process_start_ = false;
+  bool session_leader_ = false;
+  bool child_created_ = false;
+  // Stopped by suspend()
+  bool suspended_ = false;
+};
+
+inline void Popen::init_args() {
+  if (config_) populate_c_argv();
+}
+
+template <typename F, typename... Args>
+inline void Popen::init_args(F&& farg, Args&&... args)
+{
+  detail::ArgumentDeducer argd(this);
+  argd.set_option(std::forward<F>(farg));
+  init_args(std::forward<Args>(args)...);
+}
+
+inline void Popen::populate_c_argv()
+{
+  auto& cfg = config();
+  cfg.cargv_.clear();
+  cfg.cargv_.reserve(cfg.vargs_.size() + 1);
+  for (auto& arg : cfg.vargs_) cfg.cargv_.push_back(&arg[0]);
+  cfg.cargv_.push_back(nullptr);
+}
+
+inline void Popen::start_process() noexcept(false)
+{
+  // The process was started/tried to be started
+  // in the constructor itself.
+  // For explicitly calling this API to start the
+  // process, 'defer_spawn' argument must be set to
+  // true in the constructor.
+  if (!defer_process_start_) {
+    assert (0);
+    return;
+  }
+  execute_process();
+}
+
+inline int Popen::wait() noexcept(false)
+{
+#ifndef __USING_WINDOWS__
+  if (has_deadline()) return wait_until(deadline_);
+#endif
+  return reap();
+}
+
+inline int Popen::reap() noexcept(false)
+{
+#ifdef __USING_WINDOWS__
+  int ret = WaitForSingleObject(process_handle_, INFINITE);
+  detail::Streams::mark(stream_.stats_.reaped);
+
+  return 0;
+#else
+  int ret, status;
+  struct rusage ru;
+  std::tie(ret, status) = util::wait_for_child_exit(pid(), &ru);
+  if (ret == -1) {
+    if (errno != ECHILD) throw OSError("waitpid failed", errno);
+    return 0;
+  }
+  usage_ = util::to_resource_usage(ru);
+  detail::Streams::mark(stream_.stats_.reaped);
+  term_sig_ = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+  record_exit(status);
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  if (WIFSIGNALED(status)) return WTERMSIG(status);
+  else return 255;
+
+  return 0;
+#endif
+}
+
+#ifndef __USING_WINDOWS__
+inline int Popen::wait_until(std::chrono::steady_clock::time_point deadline) noexcept(false)
+{
+  if (!util::wait_for_child_exit_until(child_pid_, deadline)) {
+    terminate_child();
+    throw TimeoutExpired("Command timed out", retcode_, {}, {});
+  }
+  retcode_ = reap();
+  return retcode_;
+}
+
+inline std::pair<OutBuffer, ErrBuffer>
+Popen::communicate_until(const char* msg, size_t length,
+                         std::chrono::steady_clock::time_point deadline)
+{
+  std::pair<OutBuffer, ErrBuffer> res;
+  if (stream_.communicate_until(msg, length, deadline, res.first, res.second) &&
+      util::wait_for_child_exit_until(child_pid_, deadline)) {
+    retcode_ = reap();
+    return res;
+  }
+  terminate_child();
+  // Pick up what the child wrote while going down, without
+  // waiting on a descendant which may still hold the pipes
+  stream_.communicate_until(nullptr, 0, std::chrono::steady_clock::now(),
+                            res.first, res.second);
+  close_input();
+  close_output();
+  close_error();
+  auto& out = res.first;
+  auto& err = res.second;
+  throw TimeoutExpired("Command timed out", retcode_,
+                       std::vector<char>(out.buf.begin(), out.buf.begin() + out.length),
+                       std::vector<char>(err.buf.begin(), err.buf.begin() + err.length));
+}
+
+inline void Popen::terminate_child()
+{
+  kill(SIGTERM);
+  auto grace_end = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(kill_grace_ms_);
+  bool exited = util::wait_for_child_exit_until(child_pid_, grace_end);
+  // The child is not reaped yet, so its group cannot have been
+  // reused: kill what is left of the group as well.
+  if (!exited || pgid_ > 0) kill(SIGKILL);
+  retcode_ = reap();
+}
+#endif
+
+inline int Popen::poll() noexcept(false)
+{
+#ifdef __USING_WINDOWS__
+  int ret = WaitForSingleObject(process_handle_, 0);
+  if (ret != WAIT_OBJECT_0) return -1;
+
+  DWORD dretcode_;
+  if (FALSE == GetExitCodeProcess(process_handle_, &dretcode_))
+      throw OSError("GetExitCodeProcess", 0);
+
+  retcode_ = (int)dretcode_;
+  CloseHandle(process_handle_);
+
+  return retcode_;
+#else
+  if (!child_created_) return -1; // TODO: ??
+
+  int status;
+  struct rusage ru;
+
+  // Returns zero if child is still running
+  int ret = wait4(child_pid_, &status, WNOHANG, &ru);
+  if (ret == 0) return -1;
+
+  if (ret == child_pid_) {
+    usage_ = util::to_resource_usage(ru);
+    detail::Streams::mark(stream_.stats_.reaped);
+    term_sig_ = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    record_exit(status);
+    if (WIFSIGNALED(status)) {
+      retcode_ = WTERMSIG(status);
+    } else if (WIFEXITED(status)) {
+      retcode_ = WEXITSTATUS(status);
+    } else {
+      retcode_ = 255;
+    }
+    return retcode_;
+  }
+
+  if (ret == -1) {
+    // From subprocess.py
+    // This happens if SIGCHLD is set to be ignored
+    // or waiting for child process has otherwise been disabled
+    // for our process. This child is dead, we cannot get the
+    // status.
+    if (errno == ECHILD) retcode_ = 0;
+    else throw OSError("waitpid failed", errno);
+  } else {
+    retcode_ = ret;
+  }
+
+  return retcode_;
+#endif
+}
+
+inline void Popen::kill(int sig_num)
+{
+#ifdef __USING_WINDOWS__
+  if (!TerminateProcess(this->process_handle_, (UINT)sig_num)) {
+    throw OSError("TerminateProcess", 0);
+  }
+#else
+  if (pgid_ > 0) killpg(pgid_, sig_num);
+  else ::kill(child_pid_, sig_num);
+  if (sig_num == SIGSTOP) return;
+  if (suspended_ || (sig_num != SIGCONT && suspended())) {
+    suspended_ = false;
+    if (sig_num != SIGCONT) kill(SIGCONT);
+  }
+#endif
+}
+
+#ifndef __USING_WINDOWS__
+inline bool Popen::suspended() const noexcept
+{
+  if (suspended_) return true;
+  return child_pid_ > 0 && retcode_ == -1 && util::child_stopped(child_pid_);
+}
+
+inline void Popen::suspend()
+{
+  kill(SIGSTOP);
+  suspended_ = true;
+}
+
+inline void Popen::resume()
+{
+  kill(SIGCONT);
+}
+#endif
+
+#ifndef __USING_WINDOWS__
+inline int Popen::exceeded_rlimit() const noexcept
+{
+  auto find = [this](int res) -> const rlimits::limit* {
+    for (auto& l : rlimits_) {
+      if (l.resource == res) return &l;
+    }
+    return nullptr;
+  };
+
+  const rlimits::limit* cpu = find(RLIMIT_CPU);
+  switch (term_sig_) {
+  case SIGXCPU:
+    return cpu ? RLIMIT_CPU : -1;
+  case SIGKILL: {
+    // Sent once the hard limit is reached, right away when
+    // it equals the soft one. The CPU time in the rusage can
+    // fall well short of it on a busy host, so a quarter of
+    // the soft limit and two ticks are allowed for.
+    if (!cpu || cpu->soft == RLIM_INFINITY) return -1;
+    double tick = 1.0 / std::max(sysconf(_SC_CLK_TCK), 1L);
+    double soft = static_cast<double>(cpu->soft);
+    return usage_.cpu_time() >= soft * 0.75 - 2 * tick ? RLIMIT_CPU : -1;
+  }
+  case SIGXFSZ:
+    return find(RLIMIT_FSIZE) ? RLIMIT_FSIZE : -1;
+  case SIGSEGV:
+  case SIGBUS:
+  case SIGABRT:
+    for (int res : {RLIMIT_AS, RLIMIT_DATA, RLIMIT_STACK}) {
+      if (find(res)) return res;
+    }
+    return -1;
+  }
+  return -1;
+}
+#endif
+
+#ifdef __linux__
+inline int Popen::kill_tree() noexcept(false)
+{
+  // Not spawned, a kill(-1) would hit every process in reach
+  if (child_pid_ <= 0) return retcode_;
+
+  int subreaper = 0;
+  if (prctl(PR_GET_CHILD_SUBREAPER, &subreaper, 0, 0, 0) == -1) subreaper = 0;
+
+  std::vector<int> tree;
+  {
+    // A descendant whose parent died is our child now, and out of
+    // reach of the ppid links: it is told apart from the children
+    // of the other Popens, none of which can be in the making.
+    std::unique_ptr<detail::SpawnLock> lock;
+    if (subreaper) lock.reset(new detail::SpawnLock(true));
+    int self = getpid();
+    unsigned long long since = 0;
+    bool found_child = false;
+
+    std::set<int> seen;
+    ::kill(child_pid_, SIGSTOP);
+    while (true) {
+      auto links = util::read_proc_links();
+      std::vector<int> roots = {child_pid_};
+      if (subreaper) {
+        for (auto& l : links) {
+          if (l.pid == child_pid_) {
+            since = l.start;
+            found_child = true;
+          }
+        }
+        // Orphans of the tree started after the child
+        for (auto& l : links) {
+          if (!found_child || l.ppid != self || l.pid == child_pid_ || l.start < since) continue;
+          if (detail::popen_children().has(l.pid)) continue;
+          roots.push_back(l.pid);
+        }
+      }
+      bool grown = false;
+      auto found = util::list_descendants(links, roots);
+      found.insert(found.end(), roots.begin() + 1, roots.end());
+      for (int pid : found) {
+        if (!seen.insert(pid).second) continue;
+        ::kill(pid, SIGSTOP);
+        tree.push_back(pid);
+        grown = true;
+      }
+      if (!grown) break;
+    }
+
+    if (pgid_ > 0) killpg(pgid_, SIGKILL);
+    ::kill(child_pid_, SIGKILL);
+    for (int pid : tree) ::kill(pid, SIGKILL);
+  }
+  retcode_ = reap();
+  if (!subreaper) return retcode_;
+  // The descendants are handed to us as their parents die,
+  // so each is reaped once it is ours, or gone elsewhere
+  auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+  while (!tree.empty() && std::chrono::steady_clock::now() < give_up) {
+    for (auto it = tree.begin(); it != tree.end(); ) {
+      int ret = waitpid(*it, nullptr, WNOHANG);
+      if (ret == *it || (ret == -1 && ::kill(*it, 0) == -1)) it = tree.erase(it);
+      else ++it;
+    }
+    if (tree.size()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return retcode_;
+}
+
+/*!
+ * Makes this process the subreaper of its descendants
+ * (PR_SET_CHILD_SUBREAPER): those orphaned by the death of
+ * their parent are reparented to it instead of init. They
+ * stay in reach of the process so, and Popen::kill_tree
+ * reaps the ones it kills. Others it has to reap itself.
+ */
+inline void set_child_subreaper(bool on = true)
+{
+  if (prctl(PR_SET_CHILD_SUBREAPER, on ? 1 : 0, 0, 0, 0) == -1) {
+    throw OSError("prctl(PR_SET_CHILD_SUBREAPER) failed", errno);
+  }
+}
+#endif
+
+
+inline void Popen::execute_process() noexcept(false)
+{
+  auto err = spawn();
+  if (err) throw CalledProcessError(err.message(), retcode_);
+}
+
+inline SpawnError Popen::start_process(std::nothrow_t) noexcept
+{
+  assert (defer_process_start_);
+  try {
+    return spawn();
+  } catch (const OSError& e) {
+    SpawnError err;
+    err.stage = SPAWN_SETUP;
+    err.err = e.err_code;
+    return err;
+  } catch (...) {
+    SpawnError err;
+    err.stage = SPAWN_SETUP;
+    err.err = EINVAL;
+    return err;
+  }
+}
+
+inline SpawnError Popen::spawn() noexcept(false)
+{
+#ifndef __USING_WINDOWS__
+  int id = METRICS_ENABLED ? metric_id() : -1;
+#ifdef __linux__
+  // kill_tree must not find the child before it is added
+  detail::SpawnLock lock(false);
+#endif
+  SpawnError err;
+  try {
+    err = spawn_process();
+  } catch (const OSError& e) {
+    SUBPROCESS_PROBE4(spawn__failure, -1, exe_name(), SPAWN_SETUP, e.err_code);
+    if (METRICS_ENABLED) MetricsRegistry::global().on_failure(id, e.err_code);
+    Tracer::global().on_failure(exe_name(), -1, SPAWN_SETUP, e.err_code, stream_.stats_);
+    throw;
+  }
+  if (err) {
+    SUBPROCESS_PROBE4(spawn__failure, child_pid_, exe_name(), err.stage, err.err);
+    if (METRICS_ENABLED) MetricsRegistry::global().on_failure(id, err.err);
+    Tracer::global().on_failure(exe_name(), child_pid_, err.stage, err.err, stream_.stats_);
+    return err;
+  }
+#ifdef __linux__
+  detail::popen_children().add(child_pid_);
+#endif
+  if (METRICS_ENABLED) {
+    MetricsRegistry::global().on_spawn(id);
+    metric_id_ = id;
+  }
+  return err;
+#else
+  return spawn_process();
+#endif
+}
+
+#ifndef __USING_WINDOWS__
+inline int Popen::metric_id()
+{
+  auto& reg = MetricsRegistry::global();
+  // Till the spawn a shell{true} command is still the whole
+  // command line, which would give a key per command
+  if (!plan_ && config_ && config_->shell_ && config_->exe_name_.empty() && config_->vargs_.size()) {
+    return reg.id_of(util::shell_command_name(config_->vargs_[0]));
+  }
+  if (plan_) {
+    int id = plan_->metric_id.load(std::memory_order_relaxed);
+    if (id < 0) {
+      id = reg.id_of(exe_name());
+      plan_->metric_id.store(id, std::memory_order_relaxed);
+    }
+    return id;
+  }
+  return reg.id_of(exe_name());
+}
+
+inline const char* Popen::exe_name() const
+{
+  if (plan_) {
+    if (plan_->path) return plan_->path;
+    return plan_->argv[0] ? plan_->argv[0] : "";
+  }
+  if (!config_) return "";
+  if (config_->exe_name_.length()) return config_->exe_name_.c_str();
+  return config_->vargs_.empty() ? "" : config_->vargs_[0].c_str();
+}
+
+inline void Popen::record_spawn()
+{
+  SUBPROCESS_PROBE3(spawn, child_pid_, exe_name(),
+                    util::ns_between(stream_.stats_.start, stream_.stats_.exec));
+  Tracer::global().on_spawn(exe_name(), child_pid_, stream_.stats_);
+}
+
+inline void Popen::trace_after(const Popen& upstream)
+{
+  Tracer::global().on_link(upstream.pid(), upstream.stream_.stats_.start,
+                           child_pid_, stream_.stats_.start);
+}
+
+inline void Popen::record_exit(int status)
+{
+  bool signaled = WIFSIGNALED(status);
+  int code = signaled ? WTERMSIG(status) : WEXITSTATUS(status);
+  SUBPROCESS_PROBE4(exit, child_pid_, code, signaled,
+                    util::ns_between(stream_.stats_.start, stream_.stats_.reaped));
+  Tracer::global().on_exit(child_pid_, code, signaled, stream_.stats_);
+#ifdef __linux__
+  detail::popen_children().remove(child_pid_);
+#endif
+  if (!METRICS_ENABLED || metric_id_ < 0) return;
+  MetricsRegistry::global().on_reap(metric_id_, code, signaled, stream_.stats_);
+  metric_id_ = -1;
+}
+#endif
+
+inline SpawnError Popen::spawn_process() noexcept(false)
+{
+  detail::Streams::mark(stream_.stats_.start);
+#ifndef __USING_WINDOWS__
+  if (config_ && config_->timeout_.count()) {
+    auto at = std::chrono::steady_clock::now() + config_->timeout_;
+    if (!has_deadline() || at < deadline_) deadline_ = at;
+  }
+  if (plan_) return spawn_plan();
+#endif
+  auto& cfg = config();
+
+#ifdef __USING_WINDOWS__
+  if (cfg.shell_) {
+    throw OSError("shell not currently supported on windows", 0);
+  }
+
+  void* environment_string_table_ptr = nullptr;
+  env_vector_t environment_string_vector;
+  if(cfg.env_.size()){
+	  environment_string_vector = util::CreateUpdatedWindowsEnvironmentVector(cfg.env_);
+	  environment_string_table_ptr = (void*)environment_string_vector.data();
+  }
+
+  if (cfg.exe_name_.length()) {
+    cfg.vargs_.insert(cfg.vargs_.begin(), cfg.exe_name_);
+    populate_c_argv();
+  }
+  cfg.exe_name_ = cfg.vargs_[0];
+
+  std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+  std::wstring argument;
+  std::wstring command_line;
+
+  for (auto arg : cfg.vargs_) {
+    argument = converter.from_bytes(arg);
+    util::quote_argument(argument, command_line, false);
+    command_line += L" ";
+  }
+
+  // CreateProcessW can modify szCmdLine so we allocate needed memory
+  wchar_t *szCmdline = new wchar_t[command_line.size() + 1];
+  wcscpy_s(szCmdline, command_line.size() + 1, command_line.c_str());
+  PROCESS_INFORMATION piProcInfo;
+  STARTUPINFOW siStartInfo;
+  BOOL bSuccess = FALSE;
+  DWORD creation_flags = CREATE_UNICODE_ENVIRONMENT | CREATE_NO_WINDOW;
+
+  // Set up members of the PROCESS_INFORMATION structure.
+  ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+
+  // Set up members of the STARTUPINFOW structure.
+  // This structure specifies the STDIN and STDOUT handles for redirection.
+
+  ZeroMemory(&siStartInfo, sizeof(STARTUPINFOW));
+  siStartInfo.cb = sizeof(STARTUPINFOW);
+
+  siStartInfo.hStdError = this->stream_.g_hChildStd_ERR_Wr;
+  siStartInfo.hStdOutput = this->stream_.g_hChildStd_OUT_Wr;
+  siStartInfo.hStdInput = this->stream_.g_hChildStd_IN_Rd;
+
+  siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+
+  // Create the child process.
+  bSuccess = CreateProcessW(NULL,
+                            szCmdline,    // command line
+                            NULL,         // process security attributes
+                            NULL,         // primary thread security attributes
+                            TRUE,         // handles are inherited
+                            creation_flags,	// creation flags
+                            environment_string_table_ptr,  // use provided environment
+                            NULL,         // use parent's current directory
+                            &siStartInfo, // STARTUPINFOW pointer
+                            &piProcInfo); // receives PROCESS_INFORMATION
+
+  // If an error occurs, exit the application.
+  if (!bSuccess) {
+    DWORD errorMessageID = ::GetLastError();
+    throw CalledProcessError("CreateProcess failed: " + util::get_last_error(errorMessageID), errorMessageID);
+  }
+
+  CloseHandle(piProcInfo.hThread);
+  detail::Streams::mark(stream_.stats_.forked);
+  stream_.stats_.exec = stream_.stats_.forked;
+
+  /*
+    TODO: use common apis to close linux handles
+  */
+
+  this->process_handle_ = piProcInfo.hProcess;
+
+  // Handles are captured by value as the Popen may be moved
+  HANDLE process = this->process_handle_;
+  HANDLE err_wr = this->stream_.g_hChildStd_ERR_Wr;
+  HANDLE out_wr = this->stream_.g_hChildStd_OUT_Wr;
+  HANDLE in_rd = this->stream_.g_hChildStd_IN_Rd;
+  this->cleanup_future_ = std::async(std::launch::async, [=] {
+    WaitForSingleObject(process, INFINITE);
+
+    CloseHandle(err_wr);
+    CloseHandle(out_wr);
+    CloseHandle(in_rd);
+  });
+
+/*
+  NOTE: In the linux version, there is a check to make sure that the process
+        has been started. Here, we do nothing because CreateProcess will throw
+        if we fail to create the process.
+*/
+
+
+#else
+
+  if (cfg.subst_.size()) throw std::runtime_error("substitute is only valid with a Command");
+
+  int err_rd_pipe, err_wr_pipe;
+  std::tie(err_rd_pipe, err_wr_pipe) = util::pipe_cloexec();
+
+  if (cfg.shell_) {
+    auto new_cmd = util::join(cfg.vargs_);
+    cfg.vargs_ = detail::shell_argv(new_cmd, cfg.exe_name_.empty(), cfg.env_);
+    populate_c_argv();
+  }
+
+  if (cfg.exe_name_.length()) {
+    cfg.vargs_.insert(cfg.vargs_.begin(), cfg.exe_name_);
+    populate_c_argv();
+  }
+  cfg.exe_name_ = cfg.vargs_[0];
+
+  if (pgid_ != -1 && session_leader_) {
+    close(err_rd_pipe);
+    close(err_wr_pipe);
+    throw std::runtime_error("process_group cannot be combined with session_leader");
+  }
+  if (cfg.pdeathsig_) cfg.parent_pid_ = getpid();
+
+  child_pid_ = fork();
+
+  if (child_pid_ < 0) {
+    close(err_rd_pipe);
+    close(err_wr_pipe);
+    throw OSError("fork failed", errno);
+  }
+
+  child_created_ = true;
+
+  if (child_pid_ == 0)
+  {
+    // Close descriptors belonging to parent
+    stream_.close_parent_fds();
+
+    //Close the read end of the error pipe
+    close(err_rd_pipe);
+
+    detail::Child chld(this, err_wr_pipe);
+    chld.execute_child();
+  }
+  else
+  {
+    close (err_wr_pipe);// close child side of pipe, else get stuck in read below
+    detail::Streams::mark(stream_.stats_.forked);
+    if (pgid_ == 0 || session_leader_) pgid_ = child_pid_;
+    rlimits_ = std::move(cfg.rlimits_);
+
+    stream_.close_child_fds();
+#ifdef __linux__
+    if (shm_) {
+      shm_->release_fd();
+      shm_->set_peer(child_pid_, true);
+    }
+#endif
+
+    SpawnError err;
+    bool failed = detail::read_spawn_error(err_rd_pipe, err);
+    close(err_rd_pipe);
+
+    if (failed) {
+      // Call waitpid to reap the child process
+      // waitpid suspends the calling process until the
+      // child terminates.
+      retcode_ = wait();
+      stream_.cleanup_fds();
+      return err;
+    }
+    detail::Streams::mark(stream_.stats_.exec);
+    record_spawn();
+  }
+#endif
+
+  // Only needed to spawn the child
+  config_.reset();
+  return SpawnError();
+}
+
+#ifndef __USING_WINDOWS__
+inline SpawnError Popen::spawn_plan() noexcept(false)
+{
+  static const std::vector<const char*> no_subst;
+  auto& subst = config_ ? config_->subst_ : no_subst;
+  if (subst.size() != plan_->slots.size()) {
+    throw std::runtime_error("substitute: expected " +
+                             std::to_string(plan_->slots.size()) + " values");
+  }
+
+  char* const* argv = plan_->argv.data();
+  if (subst.size()) {
+    // Reused so that only the first spawn of a thread allocates
+    static thread_local std::vector<char*> scratch;
+    scratch.assign(plan_->argv.begin(), plan_->argv.end());
+    for (size_t i = 0; i < subst.size(); i++) {
+      scratch[plan_->slots[i]] = const_cast<char*>(subst[i]);
+    }
+    argv = scratch.data();
+  }
+
+  int err_rd_pipe, err_wr_pipe;
+  std::tie(err_rd_pipe, err_wr_pipe) = util::pipe_cloexec();
+
+  detail::SpawnContext ctx;
+  ctx.plan = plan_.get();
+  ctx.argv = argv;
+  ctx.stdio[0] = stream_.read_from_parent_;
+  ctx.stdio[1] = stream_.write_to_parent_;
+  ctx.stdio[2] = stream_.err_write_;
+  ctx.err_fd = err_wr_pipe;
+  ctx.pgid = pgid_;
+  ctx.parent = getpid();
+  ctx.sched = config_ ? &config_->sched_ : nullptr;
+  if (pgid_ != -1 && plan_->session_leader) {
+    close(err_rd_pipe);
+    close(err_wr_pipe);
+    throw std::runtime_error("process_group cannot be combined with session_leader");
+  }
+
+  try {
+    child_pid_ = detail::spawn_plan(ctx);
+  } catch (...) {
+    close(err_rd_pipe);
+    close(err_wr_pipe);
+    throw;
+  }
+  child_created_ = true;
+  detail::Streams::mark(stream_.stats_.forked);
+  if (pgid_ == 0 || session_leader_) pgid_ = child_pid_;
+  rlimits_ = plan_->limits;
+
+  close(err_wr_pipe);
+  stream_.close_child_fds();
+
+  SpawnError err;
+  bool failed = detail::read_spawn_error(err_rd_pipe, err);
+  close(err_rd_pipe);
+
+  if (failed) {
+    retcode_ = wait();
+    stream_.cleanup_fds();
+    return err;
+  }
+  detail::Streams::mark(stream_.stats_.exec);
+  record_spawn();
+  config_.reset();
+  plan_.reset();
+  return SpawnError();
+}
+#endif
+
+namespace detail {
+
+  inline void ArgumentDeducer::set_option(executable&& exe) {
+    popen_->config().exe_name_ = std::move(exe.arg_value);
+    popen_->config().exe_fd_ = exe.image_fd;
+  }
+
+  inline void ArgumentDeducer::set_option(cwd&& cwdir) {
+    popen_->config().cwd_ = std::move(cwdir.arg_value);
+  }
+
+  inline void ArgumentDeducer::set_option(bufsize&& bsiz) {
+    popen_->stream_.bufsiz_ = bsiz.bufsiz;
+  }
+
+  inline void ArgumentDeducer::set_option(environment&& env) {
+    popen_->config().env_ = std::move(env.env_);
+  }
+
+  inline void ArgumentDeducer::set_option(defer_spawn&& defer) {
+    popen_->defer_process_start_ = defer.defer;
+  }
+
+  inline void ArgumentDeducer::set_option(shell&& sh) {
+    popen_->config().shell_ = sh.shell_;
+  }
+
+  inline void ArgumentDeducer::set_option(session_leader&& sleader) {
+    popen_->session_leader_ = sleader.leader_;
+  }
+
+#ifndef __USING_WINDOWS__
+  inline void ArgumentDeducer::set_option(timeout&& tmo) {
+    popen_->config().timeout_ = tmo.limit_;
+    popen_->kill_grace_ms_ = static_cast<int>(tmo.grace_.count());
+  }
+
+  inline void ArgumentDeducer::set_option(deadline&& dl) {
+    popen_->deadline_ = dl.at_;
+    popen_->kill_grace_ms_ = static_cast<int>(dl.grace_.count());
+  }
+
+  inline void ArgumentDeducer::set_option(rlimits&& lims) {
+    popen_->config().rlimits_ = std::move(lims.limits_);
+  }
+
+  inline void ArgumentDeducer::set_option(niceness&& n) {
+    popen_->config().sched_.set(std::move(n));
+  }
+
+  inline void ArgumentDeducer::set_option(process_group&& pg) {
+    if (pg.pgid_ < 0) throw std::runtime_error("process_group: invalid pgid");
+    popen_->pgid_ = pg.pgid_;
+  }
+#endif
+
+  inline void ArgumentDeducer::set_option(input&& inp) {
+    if (inp.rd_ch_ != -1) popen_->stream_.read_from_parent_ = inp.rd_ch_;
+    if (inp.wr_ch_ != -1) popen_->stream_.write_to_child_ = inp.wr_ch_;
+  }
+
+  inline void ArgumentDeducer::set_option(output&& out) {
+    if (out.wr_ch_ != -1) popen_->stream_.write_to_parent_ = out.wr_ch_;
+    if (out.rd_ch_ != -1) popen_->stream_.read_from_child_ = out.rd_ch_;
+  }
+
+  inline void ArgumentDeducer::set_option(error&& err) {
+    if (err.deferred_) {
+      if (popen_->stream_.write_to_parent_) {
+        popen_->stream_.err_write_ = popen_->stream_.write_to_parent_;
+      } else {
+        throw std::runtime_error("Set output before redirecting error to output");
+      }
+    }
+    if (err.wr_ch_ != -1) popen_->stream_.err_write_ = err.wr_ch_;
+    if (err.rd_ch_ != -1) popen_->stream_.err_read_ = err.rd_ch_;
+  }
+
+  inline void ArgumentDeducer::set_option(close_fds&& cfds) {
+    popen_->config().close_fds_ = cfds.close_all;
+  }
+
+  inline void ArgumentDeducer::set_option(pass_fds&& fds) {
+    append_pass_fds(popen_->config().pass_fds_, fds);
+  }
+
+#ifndef __USING_WINDOWS__
+  inline void ArgumentDeducer::set_option(substitute&& subst) {
+    popen_->config().subst_ = std::move(subst.values);
+  }
+#endif
+
+  inline void ArgumentDeducer::set_option(preexec_func&& prefunc) {
+    popen_->config().preexec_fn_ = std::move(prefunc);
+    popen_->config().has_preexec_fn_ = true;
+  }
+
+#ifdef __linux__
+  inline void ArgumentDeducer::set_option(shm_channel&& shm) {
+    popen_->shm_ = ShmChannel::create(shm.capacity);
+    int fd = popen_->shm_->fd();
+    set_option(pass_fds{{fd, fd}});
+  }
+
+  inline void ArgumentDeducer::set_option(pdeathsig&& sig) {
+    popen_->config().pdeathsig_ = sig.sig_;
+  }
+
+  inline void ArgumentDeducer::set_option(cpu_affinity&& aff) {
+    popen_->config().sched_.set(std::move(aff));
+  }
+
+  inline void ArgumentDeducer::set_option(sched_policy&& pol) {
+    popen_->config().sched_.set(std::move(pol));
+  }
+
+  inline void ArgumentDeducer::set_option(io_priority&& prio) {
+    popen_->config().sched_.set(std::move(prio));
+  }
+#endif
+
+
+  inline void Child::execute_child() {
+#ifndef __USING_WINDOWS__
+    int sys_ret = -1;
+    auto& stream = parent_->stream_;
+    auto& cfg = *parent_->config_;
+    // The step being taken, reported to the parent on failure
+    int stage = SPAWN_DUP2;
+
+    try {
+      if (stream.write_to_parent_ == 0)
+        stream.write_to_parent_ = dup(stream.write_to_parent_);
+
+      if (stream.err_write_ == 0 || stream.err_write_ == 1)
+        stream.err_write_ = dup(stream.err_write_);
+
+      // Make the child owned descriptors as the
+      // stdin, stdout and stderr for the child process
+      auto _dup2_ = [](int fd, int to_fd) {
+        if (fd == to_fd) {
+          // dup2 syscall does not reset the
+          // CLOEXEC flag if the descriptors
+          // provided to it are same.
+          // But, we need to reset the CLOEXEC
+          // flag as the provided descriptors
+          // are now going to be the standard
+          // input, output and error
+          util::set_clo_on_exec(fd, false);
+        } else if(fd != -1) {
+          int res = dup2(fd, to_fd);
+          if (res == -1) throw OSError("dup2 failed", errno);
+        }
+      };
+
+      // Create the standard streams
+      _dup2_(stream.read_from_parent_, 0); // Input stream
+      _dup2_(stream.write_to_parent_,  1); // Output stream
+      _dup2_(stream.err_write_,        2); // Error stream
+
+      // Close the duped descriptors
+      if (stream.read_from_parent_ != -1 && stream.read_from_parent_ > 2)
+        close(stream.read_from_parent_);
+
+      if (stream.write_to_parent_ != -1 && stream.write_to_parent_ > 2)
+        close(stream.write_to_parent_);
+
+      if (stream.err_write_ != -1 && stream.err_write_ > 2)
+        close(stream.err_write_);
+
+      // Wire the descriptors requested with pass_fds
+      stage = SPAWN_PASS_FDS;
+      auto& pass = cfg.pass_fds_;
+      if (!pass.empty()) {
+        int above = err_wr_pipe_;
+        for (auto& fds : pass) above = std::max(above, fds.second);
+        above++;
+
+        // Keep the error pipe clear of the target numbers
+        for (auto& fds : pass) {
+          if (fds.second != err_wr_pipe_) continue;
+          int fd = fcntl(err_wr_pipe_, F_DUPFD_CLOEXEC, above);
+          if (fd == -1) throw OSError("fcntl failed", errno);
+          err_wr_pipe_ = fd;
+          above = fd + 1;
+        }
+        // And the image to exec
+        for (auto& fds : pass) {
+          if (cfg.exe_fd_ == -1 || fds.second != cfg.exe_fd_) continue;
+          int fd = fcntl(cfg.exe_fd_, F_DUPFD_CLOEXEC, above);
+          if (fd == -1) throw OSError("fcntl failed", errno);
+          cfg.exe_fd_ = fd;
+          above = fd + 1;
+        }
+
+        // A source may be another entry's target, so
+        // first move every source above all the targets
+        std::vector<int> moved;
+        for (auto& fds : pass) {
+          int fd = fcntl(fds.first, F_DUPFD_CLOEXEC, above);
+          if (fd == -1) throw OSError("fcntl failed", errno);
+          moved.push_back(fd);
+        }
+        for (size_t i = 0; i < pass.size(); i++) {
+          // dup2 leaves the target without CLOEXEC
+          if (dup2(moved[i], pass[i].second) == -1) throw OSError("dup2 failed", errno);
+          close(moved[i]);
+        }
+      }
+
+      // Close all the inherited fd's except the error write pipe,
+      // the image to exec and the passed descriptors
+      if (cfg.close_fds_) {
+        stage = SPAWN_CLOSE_FDS;
+        int max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd == -1) throw OSError("sysconf failed", errno);
+
+        for (int i = 3; i < max_fd; i++) {
+          if (i == err_wr_pipe_ || i == cfg.exe_fd_) continue;
+          bool passed = false;
+          for (auto& fds : pass) passed = passed || fds.second == i;
+          if (!passed) close(i);
+        }
+      }
+
+#ifdef __linux__
+      // Tell the exec'd image where its shared memory channel is
+      if (parent_->shm_) {
+        setenv(SHM_FD_ENV, std::to_string(parent_->shm_->fd()).c_str(), 1);
+      }
+#endif
+
+      // Change the working directory if provided
+      if (cfg.cwd_.length()) {
+        stage = SPAWN_CHDIR;
+        sys_ret = chdir(cfg.cwd_.c_str());
+        if (sys_ret == -1) throw OSError("chdir failed", errno);
+      }
+
+      if (cfg.has_preexec_fn_) {
+        stage = SPAWN_PREEXEC;
+        cfg.preexec_fn_();
+      }
+
+      if (parent_->session_leader_) {
+        stage = SPAWN_SETSID;
+        sys_ret = setsid();
+        if (sys_ret == -1) throw OSError("setsid failed", errno);
+      }
+
+      if (parent_->pgid_ != -1) {
+        stage = SPAWN_SETPGID;
+        sys_ret = setpgid(0, parent_->pgid_);
+        if (sys_ret == -1) throw OSError("setpgid failed", errno);
+      }
+
+#ifdef __linux__
+      if (cfg.pdeathsig_) {
+        stage = SPAWN_PDEATHSIG;
+        sys_ret = prctl(PR_SET_PDEATHSIG, cfg.pdeathsig_, 0, 0, 0);
+        if (sys_ret == -1) throw OSError("prctl failed", errno);
+        // The parent may have died before the prctl
+        if (getppid() != cfg.parent_pid_) kill(getpid(), cfg.pdeathsig_);
+      }
+#endif
+
+      stage = SPAWN_SCHED;
+      sys_ret = cfg.sched_.apply();
+      if (sys_ret == -1) throw OSError("scheduling setup failed", errno);
+
+      // Last, so that the steps above are not limited
+      stage = SPAWN_RLIMIT;
+      for (auto& l : cfg.rlimits_) {
+        struct rlimit rl = {l.soft, l.hard};
+        sys_ret = setrlimit(l.resource, &rl);
+        if (sys_ret == -1) throw OSError("setrlimit failed", errno);
+      }
+
+      // Replace the current image with the executable
+      stage = SPAWN_EXEC;
+      if (cfg.env_.size()) {
+        for (auto& kv : cfg.env_) {
+          setenv(kv.first.c_str(), kv.second.c_str(), 1);
+        }
+      }
+#ifdef __linux__
+      if (cfg.exe_fd_ != -1)
+        sys_ret = fexecve(cfg.exe_fd_, cfg.cargv_.data(), environ);
+      else
+#endif
+        sys_ret = execvp(cfg.exe_name_.c_str(), cfg.cargv_.data());
+
+      if (sys_ret == -1) throw OSError("execve failed", errno);
+
+    } catch (const OSError& exp) {
+      // Report the failed step and its errno, the parent
+      // rebuilds the message from them
+      SpawnError err;
+      err.stage = stage;
+      err.err = exp.err_code;
+      SUBPROCESS_PROBE2(child__error, stage, exp.err_code);
+      util::write_n(err_wr_pipe_, reinterpret_cast<const char*>(&err), sizeof(err));
+    }
+
+    // Calling application would not get this
+    // exit failure
+    _exit (EXIT_FAILURE);
+#endif
+  }
+
+
+  inline void Streams::setup_comm_channels()
+  {
+#ifdef __USING_WINDOWS__
+    util::configure_pipe(&this->g_hChildStd_IN_Rd, &this->g_hChildStd_IN_Wr, &this->g_hChildStd_IN_Wr);
+    this->input(util::file_from_handle(this->g_hChildStd_IN_Wr, "w"));
+    this->write_to_child_ = _fileno(this->input());
+
+    util::configure_pipe(&this->g_hChildStd_OUT_Rd, &this->g_hChildStd_OUT_Wr, &this->g_hChildStd_OUT_Rd);
+    this->output(util::file_from_handle(this->g_hChildStd_OUT_Rd, "r"));
+    this->read_from_child_ = _fileno(this->output());
+
+    util::configure_pipe(&this->g_hChildStd_ERR_Rd, &this->g_hChildStd_ERR_Wr, &this->g_hChildStd_ERR_Rd);
+    this->error(util::file_from_handle(this->g_hChildStd_ERR_Rd, "r"));
+    this->err_read_ = _fileno(this->error());
+#else
+
+    if (write_to_child_ != -1)  input(fdopen(write_to_child_, "wb"));
+    if (read_from_child_ != -1) output(fdopen(read_from_child_, "rb"));
+    if (err_read_ != -1)        error(fdopen(err_read_, "rb"));
+
+    auto handles = {input(), output(), error()};
+
+    for (auto& h : handles) {
+      if (h == nullptr) continue;
+      switch (bufsiz_) {
+      case 0:
+        setvbuf(h, nullptr, _IONBF, BUFSIZ);
+        break;
+      case 1:
+        setvbuf(h, nullptr, _IONBF, BUFSIZ);
+        break;
+      default:
+        setvbuf(h, nullptr, _IOFBF, bufsiz_);
+      };
+    }
+  #endif
+  }
+
+  inline void Communication::wait_first_byte(Streams& stream)
+  {
+#ifndef __USING_WINDOWS__
+    if (!STATS_ENABLED) return;
+    struct pollfd pfd = {fileno(stream.output()), POLLIN, 0};
+    int ret;
+    do {
+      ret = ::poll(&pfd, 1, -1);
+    } while (ret == -1 && errno == EINTR);
+    // Only POLLHUP is set at EOF
+    if (ret == 1 && (pfd.revents & POLLIN)) Streams::mark(stream.stats_.first_byte);
+#endif
+  }
+
+  inline int Communication::send(Streams& stream, const char* msg, size_t length)
+  {
+    if (stream.input() == nullptr) return -1;
+#ifdef SUBPROCESS_HAVE_PROBES
+    std::chrono::steady_clock::time_point start;
+    if (SUBPROCESS_PROBE_ENABLED(send)) start = std::chrono::steady_clock::now();
+#endif
+    int wbytes = std::fwrite(msg, sizeof(char), length, stream.input());
+    if (STATS_ENABLED) stream.stats_.bytes_in += wbytes;
+    SUBPROCESS_PROBE3(send, fileno(stream.input()), wbytes,
+                      util::ns_between(start, std::chrono::steady_clock::now()));
+    return wbytes;
+  }
+
+  inline int Communication::send(Streams& stream, const std::vector<char>& msg)
+  {
+    return send(stream, msg.data(), msg.size());
+  }
+
+  inline std::pair<OutBuffer, ErrBuffer>
+  Communication::communicate(Streams& stream, const char* msg, size_t length)
+  {
+    // Optimization from subprocess.py
+    // If we are using one pipe, or no pipe
+    // at all, using select() or threads is unnecessary.
+    auto hndls = {stream.input(), stream.output(), stream.error()};
+    int count = std::count(std::begin(hndls), std::end(hndls), nullptr);
+    const int len_conv = length;
+
+    if (count >= 2) {
+      OutBuffer obuf;
+      ErrBuffer ebuf;
+      if (stream.input()) {
+        if (msg) {
+          int wbytes = std::fwrite(msg, sizeof(char), length, stream.input());
+          if (STATS_ENABLED) stream.stats_.bytes_in += wbytes;
+          if (wbytes < len_conv) {
+            if (errno != EPIPE && errno != EINVAL) {
+              throw OSError("fwrite error", errno);
+            }
+          }
+        }
+        // Close the input stream
+        stream.input_.reset();
+      } else if (stream.output()) {
+        // Read till EOF
+        // ATTN: This could be blocking, if the process
+        // at the other end screws up, we get screwed as well.
+        // Give a timeout to bound it, see communicate_until.
+        obuf.add_cap(out_buf_cap_);
+
+        wait_first_byte(stream);
+        int rbytes = util::read_all(
+                            stream.output(),
+                            obuf.buf);
+
+        if (rbytes == -1) {
+          throw OSError("read to obuf failed", errno);
+        }
+
+        obuf.length = rbytes;
+        Streams::mark(stream.stats_.eof);
+        if (STATS_ENABLED) stream.stats_.bytes_out += rbytes;
+        // Close the output stream
+        stream.output_.reset();
+
+      } else if (stream.error()) {
+        // Same screwness applies here as well
+        ebuf.add_cap(err_buf_cap_);
+
+        int rbytes = util::read_atmost_n(
+                                  stream.error(),
+                                  ebuf.buf.data(),
+                                  ebuf.buf.size());
+
+        if (rbytes == -1) {
+          throw OSError("read to ebuf failed", errno);
+        }
+
+        ebuf.length = rbytes;
+        if (STATS_ENABLED) stream.stats_.bytes_err += rbytes;
+        // Close the error stream
+        stream.error_.reset();
+      }
+      return std::make_pair(std::move(obuf), std::move(ebuf));
+    }
+
+    return communicate_threaded(stream, msg, length);
+  }
+
+
+  inline std::pair<OutBuffer, ErrBuffer>
+  Communication::communicate_threaded(Streams& stream, const char* msg, size_t length)
+  {
+    OutBuffer obuf;
+    ErrBuffer ebuf;
+    std::future<int> out_fut, err_fut;
+    const int length_conv = length;
+
+    if (stream.output()) {
+      obuf.add_cap(out_buf_cap_);
+
+      out_fut = std::async(std::launch::async,
+                          [&obuf, &stream] {
+                            wait_first_byte(stream);
+                            int res = util::read_all(stream.output(), obuf.buf);
+                            Streams::mark(stream.stats_.eof);
+                            return res;
+                          });
+    }
+    if (stream.error()) {
+      ebuf.add_cap(err_buf_cap_);
+
+      err_fut = std::async(std::launch::async,
+                          [&ebuf, &stream] {
+                            return util::read_all(stream.error(), ebuf.buf);
+                          });
+    }
+    if (stream.input()) {
+      if (msg) {
+        int wbytes = std::fwrite(msg, sizeof(char), length, stream.input());
+        if (STATS_ENABLED) stream.stats_.bytes_in += wbytes;
+        if (wbytes < length_conv) {
+          if (errno != EPIPE && errno != EINVAL) {
+            throw OSError("fwrite error", errno);
+          }
+        }
+      }
+      stream.input_.reset();
+    }
+
+    if (out_fut.valid()) {
+      int res = out_fut.get();
+      if (res != -1) obuf.length = res;
+      else obuf.length = 0;
+    }
+    if (err_fut.valid()) {
+      int res = err_fut.get();
+      if (res != -1) ebuf.length = res;
+      else ebuf.length = 0;
+    }
+    if (STATS_ENABLED) {
+      stream.stats_.bytes_out += obuf.length;
+      stream.stats_.bytes_err += ebuf.length;
+    }
+
+    return std::make_pair(std::move(obuf), std::move(ebuf));
+  }
+
+#ifndef __USING_WINDOWS__
+  inline bool Communication::communicate_until(
+      Streams& stream, const char* msg, size_t length,
+      std::chrono::steady_clock::time_point deadline,
+      OutBuffer& obuf, ErrBuffer& ebuf)
+  {
+    using clock = std::chrono::steady_clock;
+    size_t written = 0;
+
+    if (stream.input()) {
+      // Whatever send() left buffered goes first
+      std::fflush(stream.input());
+      if (!msg || !length) {
+        stream.input_.reset();
+      } else {
+        int fd = fileno(stream.input());
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      }
+    }
+
+    // Reads what is available on `fp` into `buf`, growing it
+    // to have `room` free. Returns false on EOF.
+    auto drain = [](FILE* fp, Buffer& buf, size_t cap, size_t room) -> bool {
+      if (buf.buf.size() - buf.length < room) {
+        buf.buf.resize(std::max(std::max(cap, buf.buf.size() * 2), buf.length + room));
+      }
+      ssize_t rbytes = read(fileno(fp), buf.buf.data() + buf.length,
+                            buf.buf.size() - buf.length);
+      if (rbytes == -1) {
+        if (errno == EINTR || errno == EAGAIN) return true;
+        throw OSError("read failed", errno);
+      }
+      buf.length += rbytes;
+      return rbytes != 0;
+    };
+
+    while (stream.input() || stream.output() || stream.error()) {
+      struct pollfd fds[3];
+      FILE* files[3] = {stream.input(), stream.output(), stream.error()};
+      int nfds = 0;
+      for (int i = 0; i < 3; i++) {
+        if (!files[i]) continue;
+        fds[nfds].fd = fileno(files[i]);
+        fds[nfds].events = i == 0 ? POLLOUT : POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+      }
+
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - clock::now()).count() + 1;
+      int ret = ::poll(fds, nfds, static_cast<int>(std::max<long long>(0,
+                                    std::min<long long>(ms, 60000))));
+      if (ret == -1) {
+        if (errno == EINTR) continue;
+        throw OSError("poll failed", errno);
+      }
+      if (ret == 0) {
+        if (clock::now() >= deadline) break;
+        continue;
+      }
+
+      // Once past the deadline only a single sweep is made, with
+      // room for a full pipe, so a writer cannot keep us here
+      bool last = clock::now() >= deadline;
+      size_t room = last ? 65536 : 512;
+      int idx = 0;
+      for (int i = 0; i < 3; i++) {
+        if (!files[i]) continue;
+        short revents = fds[idx++].revents;
+        if (!revents) continue;
+        if (i == 0) {
+          ssize_t wbytes = write(fileno(files[0]), msg + written, length - written);
+          if (wbytes == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            if (errno != EPIPE) throw OSError("write failed", errno);
+            wbytes = length - written;
+          }
+          written += wbytes;
+          if (STATS_ENABLED) stream.stats_.bytes_in += wbytes;
+          if (written == length) stream.input_.reset();
+        } else if (i == 1) {
+          size_t before = obuf.length;
+          bool open = drain(files[1], obuf, out_buf_cap_, room);
+          if (STATS_ENABLED) {
+            auto& st = stream.stats_;
+            if (obuf.length > before && st.first_byte == SpawnStats::time_point()) {
+              Streams::mark(st.first_byte);
+            }
+            st.bytes_out += obuf.length - before;
+            if (!open) Streams::mark(st.eof);
+          }
+          if (!open) stream.output_.reset();
+        } else {
+          size_t before = ebuf.length;
+          if (!drain(files[2], ebuf, err_buf_cap_, room)) stream.error_.reset();
+          if (STATS_ENABLED) stream.stats_.bytes_err += ebuf.length - before;
+        }
+      }
+      if (last) break;
+    }
+    obuf.buf.resize(obuf.length);
+    ebuf.buf.resize(ebuf.length);
+    return !(stream.input() || stream.output() || stream.error());
+  }
+#endif
+
+} // end namespace detail
+
+
+
+// Convenience Functions
+//
+//
+namespace detail
+{
+  template<typename F, typename... Args>
+  OutBuffer check_output_impl(F& farg, Args&&... args)
+  {
+    static_assert(!detail::has_type<output, detail::param_pack<Args...>>::value, "output not allowed in args");
+    auto p = Popen(std::forward<F>(farg), std::forward<Args>(args)..., output{PIPE});
+    auto res = p.communicate();
+    auto retcode = p.retcode();
+    if (retcode > 0) {
+      throw CalledProcessError("Command failed : Non zero retcode", retcode);
+    }
+    return std::move(res.first);
+  }
+
+  template<typename F, typename... Args>
+  int call_impl(F& farg, Args&&... args)
+  {
+    return Popen(std::forward<F>(farg), std::forward<Args>(args)...).wait();
+  }
+
+  inline SpawnError make_spawn_error(int stage, int err)
+  {
+    SpawnError e;
+    e.stage = stage;
+    e.err = err;
+    return e;
+  }
+
+  // Starts a deferred Popen and runs it to completion
+  inline void try_run(Popen& p, bool capture, ProcessResult& res)
+  {
+    res.error = p.start_process(std::nothrow);
+    if (res.error) return;
+    try {
+      if (capture) {
+        res.output = std::move(p.communicate().first);
+        res.retcode = p.retcode();
+      } else {
+        res.retcode = p.wait();
+      }
+      res.usage = p.resource_usage();
+    } catch (const OSError& e) {
+      res.error = make_spawn_error(SPAWN_IO, e.err_code);
+      p.kill();
+      p.wait();
+#ifndef __USING_WINDOWS__
+    } catch (TimeoutExpired& e) {
+      // The child was terminated and reaped already
+      res.error = make_spawn_error(SPAWN_IO, ETIMEDOUT);
+      res.usage = p.resource_usage();
+      res.output.length = e.output.size();
+      res.output.buf = std::move(e.output);
+#endif
+    }
+  }
+
+  template<typename F, typename... Args>
+  ProcessResult try_check_output_impl(F& farg, Args&&... args)
+  {
+    static_assert(!detail::has_type<output, detail::param_pack<Args...>>::value, "output not allowed in args");
+    static_assert(!detail::has_type<defer_spawn, detail::param_pack<Args...>>::value, "defer_spawn not allowed in args");
+    ProcessResult res;
+    try {
+      auto p = Popen(std::forward<F>(farg), std::forward<Args>(args)...,
+                     output{PIPE}, defer_spawn{true});
+      try_run(p, true, res);
+    } catch (const OSError& e) {
+      res.error = make_spawn_error(SPAWN_SETUP, e.err_code);
+    }
+    return res;
+  }
+
+  template<typename F, typename... Args>
+  ProcessResult try_call_impl(F& farg, Args&&... args)
+  {
+    static_assert(!detail::has_type<defer_spawn, detail::param_pack<Args...>>::value, "defer_spawn not allowed in args");
+    ProcessResult res;
+    try {
+      auto p = Popen(std::forward<F>(farg), std::forward<Args>(args)..., defer_spawn{true});
+      try_run(p, false, res);
+    } catch (const OSError& e) {
+      res.error = make_spawn_error(SPAWN_SETUP, e.err_code);
+    }
+    return res;
+  }
+
+  static inline void pipeline_impl(std::vector<Popen>& cmds)
+  {
+    /* EMPTY IMPL */
+  }
+
+  template<typename... Args>
+  static inline void pipeline_impl(std::vector<Popen>& cmds,
+                                   const std::string& cmd,
+                                   Args&&... args)
+  {
+    if (cmds.size() == 0) {
+      cmds.emplace_back(cmd, output{PIPE}, defer_spawn{true});
+    } else {
+      cmds.emplace_back(cmd, input{cmds.back().output()}, output{PIPE}, defer_spawn{true});
+    }
+
+    pipeline_impl(cmds, std::forward<Args>(args)...);
+  }
+
+#ifndef __USING_WINDOWS__
+  static inline void grouped_pipeline_impl(std::vector<Popen>&, int)
+  {
+    /* EMPTY IMPL */
+  }
+
+  // Spawns each stage right away, so that the later stages
+  // can join the process group of the first
+  template<typename... Args>
+  static inline void grouped_pipeline_impl(std::vector<Popen>& cmds, int pgid,
+                                           const std::string& cmd,
+                                           Args&&... args)
+  {
+    if (cmds.size() == 0) {
+      cmds.emplace_back(cmd, output{PIPE}, process_group{pgid});
+    } else {
+      cmds.emplace_back(cmd, input{cmds.back().output()}, output{PIPE},
+                        process_group{pgid});
+    }
+
+    grouped_pipeline_impl(cmds, pgid ? pgid : cmds.front().pid(),
+                          std::forward<Args>(args)...);
+  }
+#endif
+
+}
+
+/*-----------------------------------------------------------
+ *        CONVIENIENCE FUNCTIONS
+ *-----------------------------------------------------------
+ */
+
+
+/*!
+ * Run the command with arguments and wait for it to complete.
+ * The parameters passed to the argument are exactly the same
+ * one would use for Popen constructors.
+ */
+template<typename... Args>
+int call(std::initializer_list<const char*> plist, Args&&... args)
+{
+  return (detail::call_impl(plist, std::forward<Args>(args)...));
+}
+
+template<typename... Args>
+int call(const std::string& arg, Args&&... args)
+{
+  return (detail::call_impl(arg, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+int call(std::vector<std::string> plist, Args &&... args)
+{
+  return (detail::call_impl(plist, std::forward<Args>(args)...));
+}
+
+#ifndef __USING_WINDOWS__
+template <typename... Args>
+int call(const Command& cmd, Args &&... args)
+{
+  return (detail::call_impl(cmd, std::forward<Args>(args)...));
+}
+#endif
+
+
+/*!
+ * Same as check_output, but nothing is thrown when the command
+ * fails: the exit status, the output and, if the child could not
+ * be spawned or talked to, the failed step with its errno are all
+ * returned in a ProcessResult. Meant for hot paths such as health
+ * checks where a non-zero exit is normal.
+ * Only invalid arguments are still reported by exceptions.
+ *
+ * Eg: auto res = try_check_output({"pgrep", "nginx"});
+ *     if (res.error) log(res.error.message());
+ *     else if (res.retcode == 0) ...
+ */
+template <typename... Args>
+ProcessResult try_check_output(std::initializer_list<const char*> plist, Args&&... args)
+{
+  return (detail::try_check_output_impl(plist, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+ProcessResult try_check_output(const std::string& arg, Args&&... args)
+{
+  return (detail::try_check_output_impl(arg, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+ProcessResult try_check_output(std::vector<std::string> plist, Args&&... args)
+{
+  return (detail::try_check_output_impl(plist, std::forward<Args>(args)...));
+}
+
+#ifndef __USING_WINDOWS__
+template <typename... Args>
+ProcessResult try_check_output(const Command& cmd, Args&&... args)
+{
+  return (detail::try_check_output_impl(cmd, std::forward<Args>(args)...));
+}
+#endif
+
+/*!
+ * Same as call, returning a ProcessResult rather than throwing.
+ * The output of the child is not captured.
+ */
+template <typename... Args>
+ProcessResult try_call(std::initializer_list<const char*> plist, Args&&... args)
+{
+  return (detail::try_call_impl(plist, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+ProcessResult try_call(const std::string& arg, Args&&... args)
+{
+  return (detail::try_call_impl(arg, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+ProcessResult try_call(std::vector<std::string> plist, Args&&... args)
+{
+  return (detail::try_call_impl(plist, std::forward<Args>(args)...));
+}
+
+#ifndef __USING_WINDOWS__
+template <typename... Args>
+ProcessResult try_call(const Command& cmd, Args&&... args)
+{
+  return (detail::try_call_impl(cmd, std::forward<Args>(args)...));
+}
+#endif
+
+
+/*!
+ * Run the command with arguments and wait for it to complete.
+ * If the exit code was non-zero it raises a CalledProcessError.
+ * The arguments are the same as for the Popen constructor.
+ */
+template <typename... Args>
+OutBuffer check_output(std::initializer_list<const char*> plist, Args&&... args)
+{
+  return (detail::check_output_impl(plist, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+OutBuffer check_output(const std::string& arg, Args&&... args)
+{
+  return (detail::check_output_impl(arg, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+OutBuffer check_output(std::vector<std::string> plist, Args &&... args)
+{
+  return (detail::check_output_impl(plist, std::forward<Args>(args)...));
+}
+
+#ifndef __USING_WINDOWS__
+template <typename... Args>
+OutBuffer check_output(const Command& cmd, Args &&... args)
+{
+  return (detail::check_output_impl(cmd, std::forward<Args>(args)...));
+}
+#endif
+
+
+/*!
+ * An easy way to pipeline easy commands.
+ * Provide the commands that needs to be pipelined in the order they
+ * would appear in a regular command.
+ * It would wait for the last command provided in the pipeline
+ * to finish, reap the earlier ones and then return the OutBuffer.
+ */
+template<typename... Args>
+// Args expected to be flat commands using string instead of initializer_list
+OutBuffer pipeline(Args&&... args)
+{
+  std::vector<Popen> pcmds;
+  detail::pipeline_impl(pcmds, std::forward<Args>(args)...);
+
+  for (auto& p : pcmds) p.start_process();
+#ifndef __USING_WINDOWS__
+  for (size_t i = 1; i < pcmds.size(); i++) pcmds[i].trace_after(pcmds[i - 1]);
+#endif
+  auto res = pcmds.back().communicate().first;
+  // The earlier stages are done once the last is
+  for (auto& p : pcmds) p.wait();
+  return res;
+}
+
+#ifndef __USING_WINDOWS__
+/*!
+ * Same as pipeline, but all the stages are put in one
+ * process group, `pg` or a new one led by the first stage,
+ * and every stage is waited for.
+ *
+ * Eg: pipeline(process_group{}, "cat file", "sort", "uniq")
+ */
+template<typename... Args>
+OutBuffer pipeline(process_group pg, Args&&... args)
+{
+  std::vector<Popen> pcmds;
+  detail::grouped_pipeline_impl(pcmds, pg.pgid_, std::forward<Args>(args)...);
+  for (size_t i = 1; i < pcmds.size(); i++) pcmds[i].trace_after(pcmds[i - 1]);
+
+  auto res = pcmds.back().communicate().first;
+  // Reap the earlier stages, which are done once the last is
+  for (auto& p : pcmds) p.wait();
+  return res;
+}
+#endif
+
 
-//----
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        CONCURRENCY CONTROL
+ *-----------------------------------------------------------
+ */
 
 /*!
- * A helper class to Popen class for setting
- * options as provided in the Popen constructor
- * or in check_ouput arguments.
- * This design allows us to _not_ have any fixed position
- * to any arguments and specify them in a way similar to what
- * can be done in python.
+ * Snapshot of the host load as seen in /proc.
+ * Fields which could not be read are left at -1.
  */
-struct ArgumentDeducer
+struct HostPressure {
+  double load1 = -1;            // 1 minute load average
+  double cpu_some = -1;         // PSI "some avg10" of /proc/pressure/cpu
+  double memory_some = -1;      // PSI "some avg10" of /proc/pressure/memory
+  double io_some = -1;          // PSI "some avg10" of /proc/pressure/io
+  long long mem_available_kb = -1;
+};
+
+namespace util
 {
-  ArgumentDeducer(Popen* p): popen_(p) {}
+  /*!
+   * Function: read_psi_some
+   * Reads the "some avg10" value out of a PSI file
+   * like /proc/pressure/cpu.
+   * Returns -1 if the file is not available.
+   */
+  static inline double read_psi_some(const char* path)
+  {
+    double val = -1;
+    FILE* fp = fopen(path, "r");
+    if (!fp) return val;
+    if (fscanf(fp, "some avg10=%lf", &val) != 1) val = -1;
+    fclose(fp);
+    return val;
+  }
 
-  void set_option(executable&& exe);
-  void set_option(cwd&& cwdir);
-  void set_option(bufsize&& bsiz);
-  void set_option(environment&& env);
-  void set_option(defer_spawn&& defer);
-  void set_option(shell&& sh);
-  void set_option(input&& inp);
-  void set_option(output&& out);
-  void set_option(error&& err);
-  void set_option(close_fds&& cfds);
-  void set_option(preexec_func&& prefunc);
-  void set_option(session_leader&& sleader);
+  /*!
+   * Function: read_host_pressure
+   * Samples the load average, the pressure stall information
+   * and the available memory of the host.
+   * Everything is read from procfs, so all the values stay
+   * at -1 on platforms without it.
+   */
+  static inline HostPressure read_host_pressure()
+  {
+    HostPressure hp;
+    FILE* fp = fopen("/proc/loadavg", "r");
+    if (fp) {
+      if (fscanf(fp, "%lf", &hp.load1) != 1) hp.load1 = -1;
+      fclose(fp);
+    }
 
-private:
-  Popen* popen_ = nullptr;
+    hp.cpu_some = read_psi_some("/proc/pressure/cpu");
+    hp.memory_some = read_psi_some("/proc/pressure/memory");
+    hp.io_some = read_psi_some("/proc/pressure/io");
+
+    fp = fopen("/proc/meminfo", "r");
+    if (fp) {
+      char line[256];
+      while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "MemAvailable: %lld kB", &hp.mem_available_kb) == 1) break;
+      }
+      fclose(fp);
+    }
+    return hp;
+  }
+}
+
+/*!
+ * The host is considered under pressure by the ConcurrencyController
+ * once any of these is crossed.
+ * A value <= 0 disables the corresponding check.
+ */
+struct LoadThresholds {
+  double cpu_pressure = 25;        // PSI some avg10, percent
+  double memory_pressure = 10;     // PSI some avg10, percent
+  double io_pressure = 40;         // PSI some avg10, percent
+  double load_per_cpu = 1.5;       // load1 / number of cpus
+  long long min_mem_available_kb = 256 * 1024;
+  double max_latency = 0;          // Smoothed job run time in seconds
 };
 
 /*!
- * A helper class to Popen.
- * This takes care of all the fork-exec logic
- * in the execute_child API.
+ * class: ConcurrencyController
+ * Bounds the number of concurrently running children of the
+ * parallel API's (parallel_pipe, TaskGraph) and adapts the bound
+ * to the load of the host with AIMD:
+ *  - Every completed job adds 1/limit to the limit if the limit
+ *    was the bottleneck.
+ *  - The limit is halved when the host is found under pressure,
+ *    at most once per sampling interval.
+ * The host is sampled from /proc at most once per `sample_interval`
+ * when a job completes, so there is no background thread.
+ *
+ * A job start which does not fit in the limit is delayed till
+ * enough of the running jobs have completed.
+ * With `min_jobs == max_jobs` the limit is fixed and the host
+ * is never sampled.
  */
-class Child
+class ConcurrencyController
 {
 public:
-  Child(Popen* p, int err_wr_pipe):
-    parent_(p),
-    err_wr_pipe_(err_wr_pipe)
+  using clock = std::chrono::steady_clock;
+
+  ConcurrencyController(size_t min_jobs, size_t max_jobs,
+                        LoadThresholds thresholds = LoadThresholds()):
+    min_jobs_(std::max<size_t>(min_jobs, 1)),
+    max_jobs_(std::max(max_jobs, std::max<size_t>(min_jobs, 1))),
+    limit_(max_jobs_),
+    thresholds_(thresholds)
   {}
 
-  void execute_child();
+  void operator=(const ConcurrencyController&) = delete;
 
-private:
-  // Lets call it parent even though
-  // technically a bit incorrect
-  Popen* parent_ = nullptr;
-  int err_wr_pipe_ = -1;
-};
+  // Blocks till `n` jobs can be started within the current limit.
+  // A batch bigger than the limit is let through only when nothing
+  // else is running.
+  void acquire(size_t n = 1)
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    cv_.wait(lk, [this, n] { return fits(n); });
+    running_ += n;
+  }
 
-// Fwd Decl.
-class Streams;
+  // Same as acquire, but does not wait
+  bool try_acquire(size_t n = 1)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!fits(n)) return false;
+    running_ += n;
+    return true;
+  }
 
-/*!
- * A helper class to Streams.
- * This takes care of management of communicating
- * with the child process with the means of the correct
- * file descriptor.
- */
-class Communication
-{
-public:
-  Communication(Streams* stream): stream_(stream)
-  {}
-  void operator=(const Communication&) = delete;
-public:
-  int send(const char* msg, size_t length);
-  int send(const std::vector<char>& msg);
+  // Marks a job as done. `latency` is its run time in seconds,
+  // negative if it did not run at all.
+  void release(double latency)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (running_) running_--;
+    if (min_jobs_ != max_jobs_) adjust(latency);
+    cv_.notify_all();
+  }
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length);
-  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg)
-  { return communicate(msg.data(), msg.size()); }
+  size_t limit() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return current_limit();
+  }
 
-  void set_out_buf_cap(size_t cap) { out_buf_cap_ = cap; }
-  void set_err_buf_cap(size_t cap) { err_buf_cap_ = cap; }
+  size_t running() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return running_;
+  }
+
+  size_t min_jobs() const { return min_jobs_; }
+  size_t max_jobs() const { return max_jobs_; }
+
+  HostPressure last_sample() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return sample_;
+  }
+
+  void set_sample_interval(std::chrono::milliseconds ms) { sample_interval_ = ms; }
 
 private:
-  std::pair<OutBuffer, ErrBuffer> communicate_threaded(
-      const char* msg, size_t length);
+  size_t current_limit() const { return static_cast<size_t>(limit_); }
+
+  bool fits(size_t n) const
+  {
+    return running_ == 0 || running_ + n <= current_limit();
+  }
+
+  bool overloaded() const
+  {
+    const auto& t = thresholds_;
+    const auto& s = sample_;
+    unsigned ncpu = std::max(std::thread::hardware_concurrency(), 1u);
+
+    if (t.cpu_pressure > 0 && s.cpu_some > t.cpu_pressure) return true;
+    if (t.memory_pressure > 0 && s.memory_some > t.memory_pressure) return true;
+    if (t.io_pressure > 0 && s.io_some > t.io_pressure) return true;
+    if (t.load_per_cpu > 0 && s.load1 > t.load_per_cpu * ncpu) return true;
+    if (t.min_mem_available_kb > 0 && s.mem_available_kb >= 0 &&
+        s.mem_available_kb < t.min_mem_available_kb) return true;
+    if (t.max_latency > 0 && latency_ > t.max_latency) return true;
+    return false;
+  }
+
+  void adjust(double latency)
+  {
+    if (latency >= 0) {
+      latency_ = latency_ < 0 ? latency : 0.8 * latency_ + 0.2 * latency;
+    }
+
+    auto now = clock::now();
+    if (now - last_sample_ >= sample_interval_) {
+      sample_ = util::read_host_pressure();
+      last_sample_ = now;
+    }
+
+    if (overloaded()) {
+      if (now - last_decrease_ >= sample_interval_) {
+        limit_ = std::max<double>(min_jobs_, limit_ / 2);
+        last_decrease_ = now;
+      }
+    } else if (running_ + 1 >= current_limit()) {
+      limit_ = std::min<double>(max_jobs_, limit_ + 1.0 / limit_);
+    }
+  }
 
 private:
-  Streams* stream_;
-  size_t out_buf_cap_ = DEFAULT_BUF_CAP_BYTES;
-  size_t err_buf_cap_ = DEFAULT_BUF_CAP_BYTES;
+  const size_t min_jobs_;
+  const size_t max_jobs_;
+  double limit_;
+  LoadThresholds thresholds_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable cv_;
+  size_t running_ = 0;
+
+  double latency_ = -1;
+  HostPressure sample_;
+  std::chrono::milliseconds sample_interval_{250};
+  clock::time_point last_sample_;
+  clock::time_point last_decrease_;
 };
+#endif
 
 
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        LOAD SHEDDING
+ *-----------------------------------------------------------
+ */
 
 /*!
- * This is a helper class to Popen.
- * It takes care of management of all the file descriptors
- * and file pointers.
- * It dispatches of the communication aspects to the
- * Communication class.
- * Read through the data members to understand about the
- * various file descriptors used.
+ * When a LoadShedder suspends and resumes children, as PSI
+ * "some avg10" of /proc/pressure/cpu, in percent. The gap
+ * between the two keeps it from flapping.
  */
-class Streams
+struct ShedThresholds {
+  double suspend_above = 40;
+  double resume_below = 10;
+};
+
+/*!
+ * class: LoadShedder
+ * Suspends low priority children while the host is under CPU
+ * pressure and resumes them once it has subsided, so that their
+ * work is paused instead of lost.
+ *
+ * The CPU pressure is read every `interval` from a background
+ * thread. Above `suspend_above` the running child of lowest
+ * priority is suspended, below `resume_below` the suspended one
+ * of highest priority is resumed. One child is acted on per
+ * interval, so that the load is shed gradually. Without PSI
+ * nothing is ever suspended.
+ * With a zero `interval` no thread is started and update() has
+ * to be called with the pressure instead.
+ *
+ * Children are stopped as with Popen::suspend(), group included.
+ * Their Popen sees them as suspended(), and resumes them when
+ * it kills them. The shedder holds a pidfd of each child, so
+ * that it never signals an unrelated process which reused the
+ * pid: children must be added before they are reaped. Children
+ * which have exited are dropped, and the ones still suspended
+ * are resumed when the shedder is destroyed.
+ *
+ * Eg:
+ *   LoadShedder shed;
+ *   auto idx = Popen({"./reindex"}, process_group{});
+ *   shed.add(idx, 0);
+ *   auto gc = Popen({"./compact"});
+ *   shed.add(gc, 1);  // Suspended after reindex
+ */
+class LoadShedder
 {
 public:
-  Streams():comm_(this) {}
-  void operator=(const Streams&) = delete;
+  explicit LoadShedder(ShedThresholds thresholds = ShedThresholds(),
+                       std::chrono::milliseconds interval = std::chrono::milliseconds(1000)):
+    thresholds_(thresholds),
+    interval_(interval)
+  {
+    if (interval_.count() > 0) thread_ = std::thread(&LoadShedder::run, this);
+  }
 
-public:
-  void setup_comm_channels();
+  ~LoadShedder()
+  {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+    resume_all();
+    for (auto& c : children_) close_pidfd(c);
+  }
 
-  void cleanup_fds()
+  LoadShedder(const LoadShedder&) = delete;
+  void operator=(const LoadShedder&) = delete;
+
+  // Children of lower `priority` are suspended first
+  void add(const Popen& p, int priority)
   {
-    if (write_to_child_ != -1 && read_from_parent_ != -1) {
-      close(write_to_child_);
+    Child c = {p.pid(), p.pgid(), -1, priority, false};
+#ifdef SYS_pidfd_open
+    c.pidfd = syscall(SYS_pidfd_open, c.pid, 0);
+#endif
+    std::lock_guard<std::mutex> lk(mtx_);
+    children_.push_back(c);
+  }
+
+  // Stops managing the child, resuming it if it is suspended
+  void remove(const Popen& p)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (auto it = children_.begin(); it != children_.end(); ++it) {
+      if (it->pid != p.pid()) continue;
+      if (it->suspended) signal(*it, SIGCONT);
+      close_pidfd(*it);
+      children_.erase(it);
+      return;
     }
-    if (write_to_parent_ != -1 && read_from_child_ != -1) {
-      close(read_from_child_);
+  }
+
+  // Acts once on the given CPU pressure
+  void update(double cpu_pressure);
+
+  void resume_all()
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (auto& c : children_) {
+      if (c.suspended) signal(c, SIGCONT);
+      c.suspended = false;
     }
-    if (err_write_ != -1 && err_read_ != -1) {
-      close(err_read_);
+  }
+
+  bool is_suspended(const Popen& p) const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (auto& c : children_) {
+      if (c.pid == p.pid()) return c.suspended;
     }
+    return false;
   }
 
-  void close_parent_fds()
+  size_t suspended_count() const
   {
-    if (write_to_child_ != -1)  close(write_to_child_);
-    if (read_from_child_ != -1) close(read_from_child_);
-    if (err_read_ != -1)        close(err_read_);
+    std::lock_guard<std::mutex> lk(mtx_);
+    size_t n = 0;
+    for (auto& c : children_) n += c.suspended;
+    return n;
   }
 
-  void close_child_fds()
+private:
+  struct Child {
+    int pid;
+    int pgid;
+    int pidfd;
+    int priority;
+    bool suspended;
+  };
+
+  // True once the child has exited, reaped or not
+  static bool exited(const Child& c)
   {
-    if (write_to_parent_ != -1)  close(write_to_parent_);
-    if (read_from_parent_ != -1) close(read_from_parent_);
-    if (err_write_ != -1)        close(err_write_);
+    if (c.pidfd != -1) {
+      struct pollfd pfd = {c.pidfd, POLLIN, 0};
+      return ::poll(&pfd, 1, 0) != 0;
+    }
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, c.pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 ||
+           info.si_pid != 0;
   }
 
-  FILE* input()  { return input_.get(); }
-  FILE* output() { return output_.get(); }
-  FILE* error()  { return error_.get(); }
+  // Signals the child through its pidfd, then the rest of
+  // its group, which is there as long as the child is
+  static void signal(const Child& c, int sig)
+  {
+    if (exited(c)) return;
+#ifdef SYS_pidfd_send_signal
+    if (c.pidfd != -1) syscall(SYS_pidfd_send_signal, c.pidfd, sig, nullptr, 0);
+#endif
+    if (c.pgid > 0) killpg(c.pgid, sig);
+    else if (c.pidfd == -1) ::kill(c.pid, sig);
+  }
 
-  void input(FILE* fp)  { input_.reset(fp, fclose); }
-  void output(FILE* fp) { output_.reset(fp, fclose); }
-  void error(FILE* fp)  { error_.reset(fp, fclose); }
+  static void close_pidfd(Child& c)
+  {
+    if (c.pidfd != -1) close(c.pidfd);
+    c.pidfd = -1;
+  }
 
-  void set_out_buf_cap(size_t cap) { comm_.set_out_buf_cap(cap); }
-  void set_err_buf_cap(size_t cap) { comm_.set_err_buf_cap(cap); }
+  void run();
 
-public: /* Communication forwarding API's */
-  int send(const char* msg, size_t length)
-  { return comm_.send(msg, length); }
+private:
+  ShedThresholds thresholds_;
+  std::chrono::milliseconds interval_;
 
-  int send(const std::vector<char>& msg)
-  { return comm_.send(msg); }
+  mutable std::mutex mtx_;
+  std::condition_variable cv_;
+  std::vector<Child> children_;
+  bool stop_ = false;
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length)
-  { return comm_.communicate(msg, length); }
+  std::thread thread_;
+};
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg)
-  { return comm_.communicate(msg); }
+inline void LoadShedder::update(double cpu_pressure)
+{
+  std::lock_guard<std::mutex> lk(mtx_);
+  // Drop the children which are gone, before their pid is reused
+  children_.erase(std::remove_if(children_.begin(), children_.end(), [](Child& c) {
+    if (!exited(c)) return false;
+    close_pidfd(c);
+    return true;
+  }), children_.end());
+
+  Child* pick = nullptr;
+  if (cpu_pressure > thresholds_.suspend_above) {
+    for (auto& c : children_) {
+      if (!c.suspended && (!pick || c.priority < pick->priority)) pick = &c;
+    }
+    if (pick) {
+      signal(*pick, SIGSTOP);
+      pick->suspended = true;
+    }
+  } else if (cpu_pressure < thresholds_.resume_below) {
+    for (auto& c : children_) {
+      if (c.suspended && (!pick || c.priority > pick->priority)) pick = &c;
+    }
+    if (pick) {
+      signal(*pick, SIGCONT);
+      pick->suspended = false;
+    }
+  }
+}
 
+inline void LoadShedder::run()
+{
+  std::unique_lock<std::mutex> lk(mtx_);
+  while (!cv_.wait_for(lk, interval_, [this] { return stop_; })) {
+    lk.unlock();
+    update(util::read_psi_some("/proc/pressure/cpu"));
+    lk.lock();
+  }
+}
+#endif
 
-public:// Yes they are public
 
-  std::shared_ptr<FILE> input_  = nullptr;
-  std::shared_ptr<FILE> output_ = nullptr;
-  std::shared_ptr<FILE> error_  = nullptr;
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        PARALLEL PIPE
+ *-----------------------------------------------------------
+ */
 
-#ifdef __USING_WINDOWS__
-  HANDLE g_hChildStd_IN_Rd = nullptr;
-  HANDLE g_hChildStd_IN_Wr = nullptr;
-  HANDLE g_hChildStd_OUT_Rd = nullptr;
-  HANDLE g_hChildStd_OUT_Wr = nullptr;
-  HANDLE g_hChildStd_ERR_Rd = nullptr;
-  HANDLE g_hChildStd_ERR_Wr = nullptr;
-#endif
+// Default size of a block handed to one child by parallel_pipe.
+// The actual block is extended till the next record delimiter.
+static const size_t DEFAULT_PIPE_BLOCK_BYTES = 1 << 20;
 
-  // Buffer size for the IO streams
-  int bufsiz_ = 0;
+/*!
+ * How the blocks of a parallel_pipe are assigned to the job slots.
+ * ROUND_ROBIN  : Block `i` always goes to slot `i % max_jobs`.
+ * LEAST_LOADED : A slot picks up the next pending block as soon
+ *                as it is done with its previous one.
+ */
+enum DispatchPolicy {
+  ROUND_ROBIN = 1,
+  LEAST_LOADED,
+};
 
-  // Pipes for communicating with child
+namespace detail
+{
+  struct PipeBlock {
+    off_t offset;
+    size_t length;
+  };
 
-  // Emulates stdin
-  int write_to_child_   = -1; // Parent owned descriptor
-  int read_from_parent_ = -1; // Child owned descriptor
+  /*!
+   * Splits `total` bytes into blocks of about `block_size` bytes.
+   * Every block, except possibly the last one, ends right after a
+   * record delimiter. `find_delim(pos)` must return the position
+   * of the first delimiter at or after `pos`, or -1 if there is none.
+   */
+  template <typename FindDelim>
+  std::vector<PipeBlock> split_blocks(size_t total, size_t block_size,
+                                      FindDelim find_delim)
+  {
+    std::vector<PipeBlock> blocks;
+    if (block_size == 0) block_size = DEFAULT_PIPE_BLOCK_BYTES;
+    size_t start = 0;
+
+    while (start < total) {
+      size_t end = total;
+      if (total - start > block_size) {
+        off_t pos = find_delim(start + block_size - 1);
+        if (pos != -1) end = pos + 1;
+      }
+      blocks.push_back(PipeBlock{(off_t)start, end - start});
+      start = end;
+    }
+    return blocks;
+  }
 
-  // Emulates stdout
-  int write_to_parent_ = -1; // Child owned descriptor
-  int read_from_child_ = -1; // Parent owned descriptor
+  /*!
+   * Blocks SIGPIPE for the calling thread so that writing to a
+   * child which has exited fails with EPIPE instead of killing
+   * the whole process. The previous mask is saved in `old`.
+   */
+  inline void block_sigpipe(sigset_t* old = nullptr)
+  {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+  }
+
+  // Discards the SIGPIPE left pending by a failed write
+  inline void consume_sigpipe()
+  {
+    sigset_t pending, set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE)) {
+      int sig;
+      sigwait(&set, &sig);
+    }
+  }
+
+  /*!
+   * Runs one instance of `cmd`, feeds it the block either from
+   * `data` or, when `data` is null, from the file `file_fd`,
+   * and collects its output in `obuf`.
+   * Returns the exit status of the child.
+   */
+  inline int run_pipe_block(const std::vector<std::string>& cmd,
+                            const char* data, int file_fd,
+                            const PipeBlock& blk, OutBuffer& obuf)
+  {
+    Popen p(cmd, input{PIPE}, output{PIPE});
+    obuf.add_cap(DEFAULT_BUF_CAP_BYTES);
+
+    FILE* out = p.output();
+    auto out_fut = std::async(std::launch::async,
+                              [&obuf, out] {
+                                return util::read_all(out, obuf.buf);
+                              });
+
+    // Only around the write, the children must not inherit it
+    sigset_t old_mask;
+    block_sigpipe(&old_mask);
+    int in_fd = fileno(p.input());
+    ssize_t wbytes = data ?
+      util::write_n(in_fd, data + blk.offset, blk.length) :
+      util::send_file_range(file_fd, blk.offset, blk.length, in_fd);
+    int wr_errno = errno;
+    if (wbytes == -1 && wr_errno == EPIPE) consume_sigpipe();
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    p.close_input();
+
+    int rbytes = out_fut.get();
+    obuf.length = rbytes == -1 ? 0 : rbytes;
+    int retcode = p.wait();
+
+    if (wbytes == -1 && wr_errno != EPIPE) {
+      throw OSError("write to child failed", wr_errno);
+    }
+    return retcode;
+  }
+
+  inline OutBuffer parallel_pipe_impl(const std::vector<std::string>& cmd,
+                                      const char* data, int file_fd,
+                                      const std::vector<PipeBlock>& blocks,
+                                      ConcurrencyController& ctrl,
+                                      DispatchPolicy policy)
+  {
+    using clock = std::chrono::steady_clock;
+    std::vector<OutBuffer> outputs(blocks.size());
+    std::vector<int> retcodes(blocks.size(), 0);
+    std::atomic<size_t> next_block{0};
+    std::exception_ptr failure;
+    std::mutex failure_mtx;
+
+    // The controller decides how many of the slots run at a time
+    size_t max_jobs = std::min(ctrl.max_jobs(), blocks.size());
+
+    auto worker = [&](size_t slot) {
+      try {
+        size_t idx = slot;
+        while (true) {
+          if (policy == LEAST_LOADED) idx = next_block++;
+          if (idx >= blocks.size()) break;
+
+          ctrl.acquire();
+          auto start = clock::now();
+          try {
+            retcodes[idx] = run_pipe_block(cmd, data, file_fd,
+                                           blocks[idx], outputs[idx]);
+          } catch (...) {
+            ctrl.release(-1);
+            throw;
+          }
+          ctrl.release(std::chrono::duration<double>(clock::now() - start).count());
+
+          if (policy == ROUND_ROBIN) idx += max_jobs;
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lk(failure_mtx);
+        if (!failure) failure = std::current_exception();
+      }
+    };
 
-  // Emulates stderr
-  int err_write_ = -1; // Write error to parent (Child owned)
-  int err_read_  = -1; // Read error from child (Parent owned)
+    std::vector<std::thread> slots;
+    for (size_t i = 1; i < max_jobs; i++) slots.emplace_back(worker, i);
+    if (max_jobs) worker(0);
+    for (auto& t : slots) t.join();
 
-private:
-  Communication comm_;
-};
+    if (failure) std::rethrow_exception(failure);
 
-} // end namespace detail
+    for (auto retcode : retcodes) {
+      if (retcode > 0) {
+        throw CalledProcessError("Command failed : Non zero retcode", retcode);
+      }
+    }
 
+    // Reassemble the output in the original block order
+    OutBuffer res;
+    size_t total = 0;
+    for (auto& ob : outputs) total += ob.length;
+    res.buf.resize(total);
+    for (auto& ob : outputs) {
+      if (ob.length == 0) continue;
+      std::memcpy(res.buf.data() + res.length, ob.buf.data(), ob.length);
+      res.length += ob.length;
+    }
+    return res;
+  }
+}
 
+/*!
+ * Runs the filter `cmd` over `data` similar to `parallel --pipe`.
+ * The input is split into blocks of about `block_size` bytes
+ * at `delim` record boundaries, each block is fed to the stdin
+ * of its own child and the outputs are concatenated in the
+ * original block order.
+ * The number of children running at a time is decided by `ctrl`.
+ * If any of the children exit with non zero retcode a
+ * CalledProcessError is raised.
+ */
+inline OutBuffer parallel_pipe(const std::vector<std::string>& cmd,
+                               const char* data, size_t length,
+                               ConcurrencyController& ctrl,
+                               size_t block_size = DEFAULT_PIPE_BLOCK_BYTES,
+                               char delim = '\n',
+                               DispatchPolicy policy = LEAST_LOADED)
+{
+  auto blocks = detail::split_blocks(length, block_size,
+                  [data, length, delim](size_t pos) -> off_t {
+                    auto p = static_cast<const char*>(
+                        std::memchr(data + pos, delim, length - pos));
+                    return p ? p - data : -1;
+                  });
+  return detail::parallel_pipe_impl(cmd, data, -1, blocks, ctrl, policy);
+}
 
 /*!
- * class: Popen
- * This is the single most important class in the whole library
- * and glues together all the helper classes to provide a common
- * interface to the client.
+ * Same as above with at the most `max_jobs` children at a time.
  *
- * API's provided by the class:
- * 1. Popen({"cmd"}, output{..}, error{..}, cwd{..}, ....)
- *    Command provided as a sequence.
- * 2. Popen("cmd arg1"m output{..}, error{..}, cwd{..}, ....)
- *    Command provided in a single string.
- * 3. wait()             - Wait for the child to exit.
- * 4. retcode()          - The return code of the exited child.
- * 5. pid()              - PID of the spawned child.
- * 6. poll()             - Check the status of the running child.
- * 7. kill(sig_num)      - Kill the child. SIGTERM used by default.
- * 8. send(...)          - Send input to the input channel of the child.
- * 9. communicate(...)   - Get the output/error from the child and close the channels
- *                         from the parent side.
- *10. input()            - Get the input channel/File pointer. Can be used for
- *                         cutomizing the way of sending input to child.
- *11. output()           - Get the output channel/File pointer. Usually used
-                           in case of redirection. See piping examples.
- *12. error()            - Get the error channel/File poiner. Usually used
-                           in case of redirection.
- *13. start_process()    - Start the child process. Only to be used when
- *                         `defer_spawn` option was provided in Popen constructor.
+ * Eg: parallel_pipe({"grep", "-c", "foo"}, buf.data(), buf.size(), 4);
  */
-class Popen
+inline OutBuffer parallel_pipe(const std::vector<std::string>& cmd,
+                               const char* data, size_t length,
+                               size_t max_jobs,
+                               size_t block_size = DEFAULT_PIPE_BLOCK_BYTES,
+                               char delim = '\n',
+                               DispatchPolicy policy = LEAST_LOADED)
 {
-public:
-  friend struct detail::ArgumentDeducer;
-  friend class detail::Child;
+  ConcurrencyController ctrl(max_jobs, max_jobs);
+  return parallel_pipe(cmd, data, length, ctrl, block_size, delim, policy);
+}
 
-  template <typename... Args>
-  Popen(const std::string& cmd_args, Args&& ...args):
-    args_(cmd_args)
-  {
-    vargs_ = util::split(cmd_args);
-    init_args(std::forward<Args>(args)...);
+/*!
+ * Same as above, but the input is read from the file `filename`.
+ * Each child is fed its block straight from the file offset range,
+ * without copying it through user space where the platform allows.
+ */
+inline OutBuffer parallel_pipe_file(const std::vector<std::string>& cmd,
+                                    const std::string& filename,
+                                    ConcurrencyController& ctrl,
+                                    size_t block_size = DEFAULT_PIPE_BLOCK_BYTES,
+                                    char delim = '\n',
+                                    DispatchPolicy policy = LEAST_LOADED)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) throw OSError("File not found: ", errno);
+  util::set_clo_on_exec(fd);
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int err = errno;
+    close(fd);
+    throw OSError("fstat failed", err);
+  }
 
-    // Setup the communication channels of the Popen class
-    stream_.setup_comm_channels();
+  auto find_delim = [fd, delim, &st](size_t pos) -> off_t {
+    char buf[4096];
+    while ((off_t)pos < st.st_size) {
+      ssize_t rd = pread(fd, buf, sizeof(buf), pos);
+      if (rd <= 0) {
+        if (rd == -1 && errno == EINTR) continue;
+        break;
+      }
+      auto p = static_cast<const char*>(std::memchr(buf, delim, rd));
+      if (p) return pos + (p - buf);
+      pos += rd;
+    }
+    return -1;
+  };
 
-    if (!defer_process_start_) execute_process();
+  try {
+    auto blocks = detail::split_blocks(st.st_size, block_size, find_delim);
+    auto res = detail::parallel_pipe_impl(cmd, nullptr, fd, blocks,
+                                          ctrl, policy);
+    close(fd);
+    return res;
+  } catch (...) {
+    close(fd);
+    throw;
   }
+}
 
-  template <typename... Args>
-  Popen(std::initializer_list<const char*> cmd_args, Args&& ...args)
-  {
-    vargs_.insert(vargs_.end(), cmd_args.begin(), cmd_args.end());
-    init_args(std::forward<Args>(args)...);
+inline OutBuffer parallel_pipe_file(const std::vector<std::string>& cmd,
+                                    const std::string& filename,
+                                    size_t max_jobs,
+                                    size_t block_size = DEFAULT_PIPE_BLOCK_BYTES,
+                                    char delim = '\n',
+                                    DispatchPolicy policy = LEAST_LOADED)
+{
+  ConcurrencyController ctrl(max_jobs, max_jobs);
+  return parallel_pipe_file(cmd, filename, ctrl, block_size, delim, policy);
+}
+#endif
 
-    // Setup the communication channels of the Popen class
-    stream_.setup_comm_channels();
 
-    if (!defer_process_start_) execute_process();
-  }
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        TASK GRAPH
+ *-----------------------------------------------------------
+ */
 
-  template <typename... Args>
-  Popen(std::vector<std::string> vargs_, Args &&... args) : vargs_(vargs_)
-  {
-    init_args(std::forward<Args>(args)...);
+/*!
+ * Final state of a task after TaskGraph::run.
+ */
+enum TaskState {
+  TASK_PENDING = 0,
+  TASK_SUCCEEDED,
+  TASK_FAILED,   // Non zero retcode or failed to spawn
+  TASK_SKIPPED,  // One of its dependencies failed or was skipped
+};
 
-    // Setup the communication channels of the Popen class
-    stream_.setup_comm_channels();
+struct TaskResult {
+  TaskState state = TASK_PENDING;
+  int retcode = -1;
+  // Wall clock run time of the task in seconds
+  double seconds = 0;
+};
 
-    if (!defer_process_start_) execute_process();
+/*!
+ * class: TaskGraph
+ * Runs a DAG of commands with a bound on the number of
+ * concurrently running children.
+ *
+ * Tasks whose dependencies have all succeeded are started in the
+ * order of their longest remaining critical path, estimated from
+ * the durations observed in the previous runs (see `durations()`).
+ * A task which fails causes all its dependents to be skipped.
+ *
+ * `add_pipe(a, b)` connects the stdout of `a` to the stdin of `b`.
+ * Tasks connected by pipes form a chain which is spawned together.
+ *
+ * Eg:
+ *   TaskGraph g;
+ *   auto gen = g.add_task("gen", {"./gen.sh"});
+ *   auto cc  = g.add_task("cc",  {"make", "all"});
+ *   g.add_dependency(gen, cc);
+ *   auto res = g.run(4);
+ */
+class TaskGraph
+{
+public:
+  size_t add_task(const std::string& name, std::vector<std::string> argv,
+                  const std::string& cwd = "",
+                  const env_map_t& env = env_map_t())
+  {
+    Task t;
+    t.name = name;
+    t.argv = std::move(argv);
+    t.cwd = cwd;
+    t.env = env;
+    tasks_.push_back(std::move(t));
+    return tasks_.size() - 1;
   }
 
-/*
-  ~Popen()
+  // `after` is started only once `before` has exited successfully
+  void add_dependency(size_t before, size_t after)
   {
-#ifdef __USING_WINDOWS__
-    CloseHandle(this->process_handle_);
-#endif
+    check_task(before);
+    check_task(after);
+    tasks_[after].deps.push_back(before);
   }
-*/
 
-  void start_process() noexcept(false);
+  // Output of `from` is fed as the input of `to`
+  void add_pipe(size_t from, size_t to)
+  {
+    check_task(from);
+    check_task(to);
+    if (tasks_[from].pipe_to != NONE || tasks_[to].pipe_from != NONE) {
+      throw std::runtime_error("Task can have only one pipe on each side");
+    }
+    tasks_[from].pipe_to = to;
+    tasks_[to].pipe_from = from;
+  }
 
-  int pid() const noexcept { return child_pid_; }
+  size_t size() const { return tasks_.size(); }
 
-  int retcode() const noexcept { return retcode_; }
+  // Historical run time of the tasks in seconds, keyed by task name.
+  // Updated at the end of every run. Can be seeded by the caller.
+  std::map<std::string, double>& durations() { return durations_; }
 
-  int wait() noexcept(false);
+  // Runs the graph with at the most `max_jobs` children at a time
+  std::vector<TaskResult> run(size_t max_jobs)
+  {
+    ConcurrencyController ctrl(max_jobs, max_jobs);
+    return run(ctrl);
+  }
 
-  int poll() noexcept(false);
+  // Runs the graph with the number of children decided by `ctrl`
+  std::vector<TaskResult> run(ConcurrencyController& ctrl);
 
-  // Does not fail, Caller is expected to recheck the
-  // status with a call to poll()
-  void kill(int sig_num = 9);
+private:
+  enum : size_t { NONE = static_cast<size_t>(-1) };
+
+  struct Task {
+    std::string name;
+    std::vector<std::string> argv;
+    std::string cwd;
+    env_map_t env;
+    std::vector<size_t> deps;
+    size_t pipe_from = NONE;
+    size_t pipe_to = NONE;
+  };
 
-  void set_out_buf_cap(size_t cap) { stream_.set_out_buf_cap(cap); }
+  // Tasks connected by pipes are scheduled as one group
+  struct Group {
+    std::vector<size_t> members;   // In the order of the pipe chain
+    std::vector<size_t> succs;
+    size_t waiting_on = 0;         // Number of unfinished predecessors
+    size_t running = 0;
+    double critical_path = 0;
+    bool skipped = false;
+    bool done = false;
+  };
 
-  void set_err_buf_cap(size_t cap) { stream_.set_err_buf_cap(cap); }
+  void check_task(size_t id) const
+  {
+    if (id >= tasks_.size()) throw std::out_of_range("Invalid task id");
+  }
 
-  int send(const char* msg, size_t length)
-  { return stream_.send(msg, length); }
+  double estimate(const Task& t) const
+  {
+    auto it = durations_.find(t.name);
+    return it == durations_.end() ? 1.0 : it->second;
+  }
 
-  int send(const std::string& msg)
-  { return send(msg.c_str(), msg.size()); }
+  std::vector<Group> build_groups(std::vector<size_t>& group_of) const;
 
-  int send(const std::vector<char>& msg)
-  { return stream_.send(msg); }
+private:
+  std::vector<Task> tasks_;
+  std::map<std::string, double> durations_;
+};
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const char* msg, size_t length)
-  {
-    auto res = stream_.communicate(msg, length);
-    retcode_ = wait();
-    return res;
+inline std::vector<TaskGraph::Group>
+TaskGraph::build_groups(std::vector<size_t>& group_of) const
+{
+  std::vector<Group> groups;
+  group_of.assign(tasks_.size(), NONE);
+
+  for (size_t i = 0; i < tasks_.size(); i++) {
+    if (tasks_[i].pipe_from != NONE) continue;
+    Group g;
+    for (size_t t = i; t != NONE; t = tasks_[t].pipe_to) {
+      group_of[t] = groups.size();
+      g.members.push_back(t);
+    }
+    groups.push_back(std::move(g));
   }
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const std::string& msg)
-  {
-    return communicate(msg.c_str(), msg.size());
+  for (size_t i = 0; i < tasks_.size(); i++) {
+    if (group_of[i] == NONE) throw std::runtime_error("Cycle in task pipes");
+    for (auto d : tasks_[i].deps) {
+      if (group_of[d] == group_of[i]) {
+        throw std::runtime_error("Cycle in task dependencies");
+      }
+      groups[group_of[d]].succs.push_back(group_of[i]);
+    }
   }
 
-  std::pair<OutBuffer, ErrBuffer> communicate(const std::vector<char>& msg)
-  {
-    auto res = stream_.communicate(msg);
-    retcode_ = wait();
-    return res;
+  for (auto& g : groups) {
+    std::sort(g.succs.begin(), g.succs.end());
+    g.succs.erase(std::unique(g.succs.begin(), g.succs.end()), g.succs.end());
+  }
+  for (auto& g : groups) {
+    for (auto s : g.succs) groups[s].waiting_on++;
   }
 
-  std::pair<OutBuffer, ErrBuffer> communicate()
-  {
-    return communicate(nullptr, 0);
+  // Topological order, to detect cycles and to compute the
+  // critical path of each group from its successors
+  std::vector<size_t> order;
+  std::vector<size_t> indeg(groups.size());
+  for (size_t i = 0; i < groups.size(); i++) {
+    indeg[i] = groups[i].waiting_on;
+    if (indeg[i] == 0) order.push_back(i);
+  }
+  for (size_t i = 0; i < order.size(); i++) {
+    for (auto s : groups[order[i]].succs) {
+      if (--indeg[s] == 0) order.push_back(s);
+    }
+  }
+  if (order.size() != groups.size()) {
+    throw std::runtime_error("Cycle in task dependencies");
   }
 
-  FILE* input()  { return stream_.input(); }
-  FILE* output() { return stream_.output();}
-  FILE* error()  { return stream_.error(); }
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    auto& g = groups[*it];
+    double own = 0, rest = 0;
+    for (auto m : g.members) own = std::max(own, estimate(tasks_[m]));
+    for (auto s : g.succs) rest = std::max(rest, groups[s].critical_path);
+    g.critical_path = own + rest;
+  }
+  return groups;
+}
 
-  /// Stream close APIs
-  void close_input()  { stream_.input_.reset();  }
-  void close_output() { stream_.output_.reset(); }
-  void close_error()  { stream_.error_.reset();  }
+inline std::vector<TaskResult> TaskGraph::run(ConcurrencyController& ctrl)
+{
+  using clock = std::chrono::steady_clock;
 
-private:
-  template <typename F, typename... Args>
-  void init_args(F&& farg, Args&&... args);
-  void init_args();
-  void populate_c_argv();
-  void execute_process() noexcept(false);
+  std::vector<size_t> group_of;
+  auto groups = build_groups(group_of);
+  std::vector<TaskResult> results(tasks_.size());
 
-private:
-  detail::Streams stream_;
+  std::vector<std::unique_ptr<Popen>> procs(tasks_.size());
+  std::vector<clock::time_point> started(tasks_.size());
+  std::vector<std::thread> waiters;
 
-#ifdef __USING_WINDOWS__
-  HANDLE process_handle_;
-  std::future<void> cleanup_future_;
-#endif
+  // Exit notifications from the waiter threads
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::queue<std::pair<size_t, int>> exited;
 
-  bool defer_process_start_ = false;
-  bool close_fds_ = false;
-  bool has_preexec_fn_ = false;
-  bool shell_ = false;
-  bool session_leader_ = false;
+  std::priority_queue<std::pair<double, size_t>> ready;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (groups[i].waiting_on == 0) ready.emplace(groups[i].critical_path, i);
+  }
 
-  std::string exe_name_;
-  std::string cwd_;
-  env_map_t env_;
-  preexec_func preexec_fn_;
+  size_t running = 0;
+  size_t done = 0;
+
+  // Marks the group and everything reachable from it as skipped
+  std::function<void(size_t)> skip = [&](size_t gid) {
+    auto& g = groups[gid];
+    if (g.done) return;
+    g.done = g.skipped = true;
+    done++;
+    for (auto m : g.members) results[m].state = TASK_SKIPPED;
+    for (auto s : g.succs) skip(s);
+  };
 
-  // Command in string format
-  std::string args_;
-  // Comamnd provided as sequence
-  std::vector<std::string> vargs_;
-  std::vector<char*> cargv_;
+  auto finish = [&](size_t gid) {
+    auto& g = groups[gid];
+    g.done = true;
+    done++;
+    bool ok = true;
+    for (auto m : g.members) ok = ok && results[m].state == TASK_SUCCEEDED;
+    for (auto s : g.succs) {
+      if (!ok) skip(s);
+      else if (--groups[s].waiting_on == 0 && !groups[s].done) {
+        ready.emplace(groups[s].critical_path, s);
+      }
+    }
+  };
 
-  bool child_created_ = false;
-  // Pid of the child process
-  int child_pid_ = -1;
+  auto launch = [&](size_t gid) {
+    auto& g = groups[gid];
+    Popen* prev = nullptr;
+    bool broken = false;
+    for (auto m : g.members) {
+      auto& t = tasks_[m];
+      if (broken) {
+        // An earlier member of the chain failed to spawn
+        results[m].state = TASK_SKIPPED;
+        ctrl.release(-1);
+        continue;
+      }
+      try {
+        output out = t.pipe_to != NONE ? output{PIPE} : output{-1};
+        // The child stage gets its own copy of the reading end,
+        // which the Popen closes once it is spawned
+        int upstream = -1;
+        if (prev) {
+          upstream = fcntl(fileno(prev->output()), F_DUPFD_CLOEXEC, 3);
+          if (upstream == -1) throw OSError("fcntl failed", errno);
+        }
+        input in{upstream};
+        started[m] = clock::now();
+        procs[m].reset(new Popen(t.argv, cwd{t.cwd}, environment{t.env},
+                                 std::move(in), std::move(out)));
+      } catch (std::exception&) {
+        results[m].state = TASK_FAILED;
+        ctrl.release(-1);
+        if (prev) prev->close_output();
+        broken = true;
+        continue;
+      }
+      // Only the next child reads from the pipe now
+      if (prev) prev->close_output();
+      prev = procs[m].get();
+
+      g.running++;
+      running++;
+      waiters.emplace_back([&mtx, &cv, &exited, prev, m] {
+        int retcode = -1;
+        try {
+          retcode = prev->wait();
+        } catch (OSError&) {}
+        std::lock_guard<std::mutex> lk(mtx);
+        exited.emplace(m, retcode);
+        cv.notify_one();
+      });
+    }
+    if (g.running == 0) finish(gid);
+  };
 
-  int retcode_ = -1;
-};
+  while (done < groups.size()) {
+    while (!ready.empty()) {
+      auto gid = ready.top().second;
+      auto nprocs = groups[gid].members.size();
+      // Wait for the controller only if there is nothing else
+      // to wait for, else we could miss the exit notifications
+      if (running == 0) ctrl.acquire(nprocs);
+      else if (!ctrl.try_acquire(nprocs)) break;
+      ready.pop();
+      launch(gid);
+    }
+    if (running == 0) continue;
+
+    std::unique_lock<std::mutex> lk(mtx);
+    cv.wait(lk, [&exited] { return !exited.empty(); });
+    while (!exited.empty()) {
+      size_t m; int retcode;
+      std::tie(m, retcode) = exited.front();
+      exited.pop();
+
+      auto& res = results[m];
+      res.retcode = retcode;
+      res.state = retcode == 0 ? TASK_SUCCEEDED : TASK_FAILED;
+      res.seconds = std::chrono::duration<double>(
+                        clock::now() - started[m]).count();
+      running--;
+      ctrl.release(res.seconds);
+
+      auto gid = group_of[m];
+      if (--groups[gid].running == 0) {
+        lk.unlock();
+        finish(gid);
+        lk.lock();
+      }
+    }
+  }
 
-inline void Popen::init_args() {
-  populate_c_argv();
-}
+  for (auto& w : waiters) w.join();
 
-template <typename F, typename... Args>
-inline void Popen::init_args(F&& farg, Args&&... args)
-{
-  detail::ArgumentDeducer argd(this);
-  argd.set_option(std::forward<F>(farg));
-  init_args(std::forward<Args>(args)...);
+  // Exponentially weighted history of the task run times
+  for (size_t i = 0; i < tasks_.size(); i++) {
+    if (results[i].state != TASK_SUCCEEDED) continue;
+    auto it = durations_.find(tasks_[i].name);
+    if (it == durations_.end()) durations_[tasks_[i].name] = results[i].seconds;
+    else it->second = 0.7 * it->second + 0.3 * results[i].seconds;
+  }
+  return results;
 }
+#endif
 
-inline void Popen::populate_c_argv()
-{
-  cargv_.clear();
-  cargv_.reserve(vargs_.size() + 1);
-  for (auto& arg : vargs_) cargv_.push_back(&arg[0]);
-  cargv_.push_back(nullptr);
-}
 
-inline void Popen::start_process() noexcept(false)
-{
-  // The process was started/tried to be started
-  // in the constructor itself.
-  // For explicitly calling this API to start the
-  // process, 'defer_spawn' argument must be set to
-  // true in the constructor.
-  if (!defer_process_start_) {
-    assert (0);
-    return;
-  }
-  execute_process();
-}
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        HEDGED EXECUTION
+ *-----------------------------------------------------------
+ */
 
-inline int Popen::wait() noexcept(false)
+/*!
+ * Counters of the hedged_check_output calls made by the process.
+ * hedged     : Calls which launched a duplicate child.
+ * hedge_wins : Calls where the duplicate finished first.
+ */
+struct HedgeStats {
+  uint64_t calls = 0;
+  uint64_t hedged = 0;
+  uint64_t hedge_wins = 0;
+
+  double hedge_rate() const { return calls ? (double)hedged / calls : 0; }
+  double win_rate() const { return hedged ? (double)hedge_wins / hedged : 0; }
+};
+
+/*!
+ * class: HedgePolicy
+ * Decides after how long a duplicate is launched.
+ * Till `min_samples` calls have been recorded the initial
+ * delay is used, after that the p95 of the last `window`
+ * latencies of the first attempt, from its launch to its exit.
+ */
+class HedgePolicy
 {
-#ifdef __USING_WINDOWS__
-  int ret = WaitForSingleObject(process_handle_, INFINITE);
+public:
+  explicit HedgePolicy(std::chrono::milliseconds initial,
+                       size_t window = 128, size_t min_samples = 20):
+    initial_(initial),
+    window_(std::max<size_t>(window, 1)),
+    min_samples_(min_samples)
+  {}
 
-  return 0;
-#else
-  int ret, status;
-  std::tie(ret, status) = util::wait_for_child_exit(pid());
-  if (ret == -1) {
-    if (errno != ECHILD) throw OSError("waitpid failed", errno);
-    return 0;
+  std::chrono::milliseconds delay() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (history_.size() < std::max<size_t>(min_samples_, 1)) return initial_;
+    std::vector<std::chrono::milliseconds> sorted(history_);
+    size_t idx = (sorted.size() * 95) / 100;
+    if (idx >= sorted.size()) idx = sorted.size() - 1;
+    std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    return sorted[idx];
   }
-  if (WIFEXITED(status)) return WEXITSTATUS(status);
-  if (WIFSIGNALED(status)) return WTERMSIG(status);
-  else return 255;
 
-  return 0;
-#endif
-}
+  void record(std::chrono::milliseconds latency)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (history_.size() < window_) history_.push_back(latency);
+    else history_[next_++ % window_] = latency;
+  }
 
-inline int Popen::poll() noexcept(false)
+private:
+  std::chrono::milliseconds initial_;
+  size_t window_;
+  size_t min_samples_;
+
+  mutable std::mutex mtx_;
+  std::vector<std::chrono::milliseconds> history_;
+  size_t next_ = 0;
+};
+
+namespace detail
 {
-#ifdef __USING_WINDOWS__
-  int ret = WaitForSingleObject(process_handle_, 0);
-  if (ret != WAIT_OBJECT_0) return -1;
+  struct HedgeCounters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> hedged{0};
+    std::atomic<uint64_t> hedge_wins{0};
+  };
 
-  DWORD dretcode_;
-  if (FALSE == GetExitCodeProcess(process_handle_, &dretcode_))
-      throw OSError("GetExitCodeProcess", 0);
+  inline HedgeCounters& hedge_counters()
+  {
+    static HedgeCounters counters;
+    return counters;
+  }
 
-  retcode_ = (int)dretcode_;
-  CloseHandle(process_handle_);
+  // Shared between the caller and the threads running the attempts
+  struct HedgeState {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int pids[2] = {-1, -1};
+    bool exited[2] = {false, false};
+    std::chrono::steady_clock::time_point exit_time[2];
+    int launched = 0;
+    int finished = 0;
+    int winner = -1;
+    int retcode = -1;
+    OutBuffer obuf;
+    std::exception_ptr error;
+  };
 
-  return retcode_;
-#else
-  if (!child_created_) return -1; // TODO: ??
+  inline void run_hedge_attempt(const std::vector<std::string>& cmd, int idx,
+                                std::shared_ptr<HedgeState> st)
+  {
+    try {
+      // Session leader, so that the whole process group
+      // of the losing attempt can be killed
+      Popen p(cmd, output{PIPE}, session_leader{true});
+      {
+        std::lock_guard<std::mutex> lk(st->mtx);
+        st->pids[idx] = p.pid();
+        if (st->winner != -1) p.kill(SIGKILL);
+      }
 
-  int status;
+      OutBuffer obuf(DEFAULT_BUF_CAP_BYTES);
+      int rbytes = util::read_all(p.output(), obuf.buf);
+      obuf.length = rbytes == -1 ? 0 : rbytes;
+      p.close_output();
 
-  // Returns zero if child is still running
-  int ret = waitpid(child_pid_, &status, WNOHANG);
-  if (ret == 0) return -1;
+      {
+        // Wait for the exit without reaping, so that the pid
+        // stays valid to be killed till it is marked exited
+        siginfo_t info;
+        while (waitid(P_PID, p.pid(), &info, WEXITED | WNOWAIT) == -1 && errno == EINTR);
+        std::lock_guard<std::mutex> lk(st->mtx);
+        st->exited[idx] = true;
+        st->exit_time[idx] = std::chrono::steady_clock::now();
+      }
+      int retcode = p.wait();
 
-  if (ret == child_pid_) {
-    if (WIFSIGNALED(status)) {
-      retcode_ = WTERMSIG(status);
-    } else if (WIFEXITED(status)) {
-      retcode_ = WEXITSTATUS(status);
-    } else {
-      retcode_ = 255;
+      std::lock_guard<std::mutex> lk(st->mtx);
+      if (st->winner == -1) {
+        st->winner = idx;
+        st->retcode = retcode;
+        st->obuf = std::move(obuf);
+      }
+      st->finished++;
+      st->cv.notify_all();
+
+    } catch (...) {
+      std::lock_guard<std::mutex> lk(st->mtx);
+      if (!st->error) st->error = std::current_exception();
+      st->finished++;
+      st->cv.notify_all();
     }
-    return retcode_;
-  }
-
-  if (ret == -1) {
-    // From subprocess.py
-    // This happens if SIGCHLD is set to be ignored
-    // or waiting for child process has otherwise been disabled
-    // for our process. This child is dead, we cannot get the
-    // status.
-    if (errno == ECHILD) retcode_ = 0;
-    else throw OSError("waitpid failed", errno);
-  } else {
-    retcode_ = ret;
   }
-
-  return retcode_;
-#endif
 }
 
-inline void Popen::kill(int sig_num)
+/*!
+ * Returns the counters of all the hedged calls made so far.
+ */
+inline HedgeStats hedge_stats()
 {
-#ifdef __USING_WINDOWS__
-  if (!TerminateProcess(this->process_handle_, (UINT)sig_num)) {
-    throw OSError("TerminateProcess", 0);
-  }
-#else
-  if (session_leader_) killpg(child_pid_, sig_num);
-  else ::kill(child_pid_, sig_num);
-#endif
+  auto& c = detail::hedge_counters();
+  HedgeStats s;
+  s.calls = c.calls.load(std::memory_order_relaxed);
+  s.hedged = c.hedged.load(std::memory_order_relaxed);
+  s.hedge_wins = c.hedge_wins.load(std::memory_order_relaxed);
+  return s;
 }
 
-
-inline void Popen::execute_process() noexcept(false)
+/*!
+ * Same as check_output, but if the command has not finished
+ * after `policy.delay()`, a duplicate of it is launched.
+ * The output of whichever finishes first is returned and the
+ * process group of the other one is killed.
+ * Use only with commands which are safe to run twice.
+ */
+inline OutBuffer hedged_check_output(const std::vector<std::string>& cmd,
+                                     HedgePolicy& policy)
 {
-#ifdef __USING_WINDOWS__
-  if (this->shell_) {
-    throw OSError("shell not currently supported on windows", 0);
+  using clock = std::chrono::steady_clock;
+  auto& counters = detail::hedge_counters();
+  counters.calls++;
+
+  auto st = std::make_shared<detail::HedgeState>();
+  auto start = clock::now();
+  std::thread attempts[2];
+
+  std::unique_lock<std::mutex> lk(st->mtx);
+  st->launched = 1;
+  attempts[0] = std::thread(detail::run_hedge_attempt, std::cref(cmd), 0, st);
+
+  bool done = st->cv.wait_for(lk, policy.delay(),
+                              [&st] { return st->finished > 0; });
+  if (!done) {
+    counters.hedged++;
+    st->launched = 2;
+    attempts[1] = std::thread(detail::run_hedge_attempt, std::cref(cmd), 1, st);
   }
 
-  void* environment_string_table_ptr = nullptr;
-  env_vector_t environment_string_vector;
-  if(this->env_.size()){
-	  environment_string_vector = util::CreateUpdatedWindowsEnvironmentVector(env_);
-	  environment_string_table_ptr = (void*)environment_string_vector.data();
+  st->cv.wait(lk, [&st] {
+    return st->winner != -1 || st->finished == st->launched;
+  });
+
+  // The policy learns the latency of the first attempt alone,
+  // the hedge must not feed into the delay it is launched after.
+  // When the duplicate won, the first one ran at least till then.
+  auto primary_latency = st->winner == 0 ? st->exit_time[0] - start
+                                          : clock::now() - start;
+
+  // Kill the loser, even if its output is done, unless it
+  // has exited already and may be reaped
+  for (int i = 0; i < st->launched; i++) {
+    if (i == st->winner || st->pids[i] == -1 || st->exited[i]) continue;
+    killpg(st->pids[i], SIGKILL);
   }
+  lk.unlock();
 
-  if (exe_name_.length()) {
-    this->vargs_.insert(this->vargs_.begin(), this->exe_name_);
-    this->populate_c_argv();
+  for (auto& t : attempts) {
+    if (t.joinable()) t.join();
   }
-  this->exe_name_ = vargs_[0];
 
-  std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-  std::wstring argument;
-  std::wstring command_line;
+  if (st->winner == -1) std::rethrow_exception(st->error);
+  if (st->winner == 1) counters.hedge_wins++;
 
-  for (auto arg : this->vargs_) {
-    argument = converter.from_bytes(arg);
-    util::quote_argument(argument, command_line, false);
-    command_line += L" ";
-  }
+  policy.record(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    primary_latency));
 
-  // CreateProcessW can modify szCmdLine so we allocate needed memory
-  wchar_t *szCmdline = new wchar_t[command_line.size() + 1];
-  wcscpy_s(szCmdline, command_line.size() + 1, command_line.c_str());
-  PROCESS_INFORMATION piProcInfo;
-  STARTUPINFOW siStartInfo;
-  BOOL bSuccess = FALSE;
-  DWORD creation_flags = CREATE_UNICODE_ENVIRONMENT | CREATE_NO_WINDOW;
+  if (st->retcode > 0) {
+    throw CalledProcessError("Command failed : Non zero retcode", st->retcode);
+  }
+  return std::move(st->obuf);
+}
 
-  // Set up members of the PROCESS_INFORMATION structure.
-  ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+/*!
+ * Same as above with a fixed delay of `hedge_after`.
+ *
+ * Eg: hedged_check_output({"stat", "/mnt/nfs/x"}, std::chrono::milliseconds(50));
+ */
+inline OutBuffer hedged_check_output(const std::vector<std::string>& cmd,
+                                     std::chrono::milliseconds hedge_after)
+{
+  HedgePolicy policy(hedge_after, 1, static_cast<size_t>(-1));
+  return hedged_check_output(cmd, policy);
+}
+#endif
 
-  // Set up members of the STARTUPINFOW structure.
-  // This structure specifies the STDIN and STDOUT handles for redirection.
 
-  ZeroMemory(&siStartInfo, sizeof(STARTUPINFOW));
-  siStartInfo.cb = sizeof(STARTUPINFOW);
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        SINGLE FLIGHT
+ *-----------------------------------------------------------
+ */
 
-  siStartInfo.hStdError = this->stream_.g_hChildStd_ERR_Wr;
-  siStartInfo.hStdOutput = this->stream_.g_hChildStd_OUT_Wr;
-  siStartInfo.hStdInput = this->stream_.g_hChildStd_IN_Rd;
+/*!
+ * A plain description of a command and its input.
+ * Used by the API's which need to compare or remember
+ * commands, unlike the Popen options which are consumed
+ * when the process is created.
+ */
+struct CommandSpec
+{
+  CommandSpec() {}
+  CommandSpec(std::vector<std::string> args): argv(std::move(args)) {}
+  CommandSpec(std::initializer_list<const char*> args):
+    argv(args.begin(), args.end()) {}
+
+  std::vector<std::string> argv;
+  std::string cwd;
+  env_map_t env;
+  // Data written to the stdin of the child
+  std::string input;
+};
 
-  siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
+namespace detail
+{
+  inline void append_key_field(std::string& key, const std::string& field)
+  {
+    key += std::to_string(field.size());
+    key += ':';
+    key += field;
+  }
 
-  // Create the child process.
-  bSuccess = CreateProcessW(NULL,
-                            szCmdline,    // command line
-                            NULL,         // process security attributes
-                            NULL,         // primary thread security attributes
-                            TRUE,         // handles are inherited
-                            creation_flags,	// creation flags
-                            environment_string_table_ptr,  // use provided environment
-                            NULL,         // use parent's current directory
-                            &siStartInfo, // STARTUPINFOW pointer
-                            &piProcInfo); // receives PROCESS_INFORMATION
+  /*!
+   * Builds an unambiguous key out of the argv, cwd and environment
+   * of the command and the length and SHA-256 digest of its input,
+   * which keeps the key small however large the input is.
+   */
+  inline std::string command_key(const CommandSpec& cmd)
+  {
+    std::string key;
+    for (auto& arg : cmd.argv) append_key_field(key, arg);
+    key += '|';
+    append_key_field(key, cmd.cwd);
+    key += '|';
+    for (auto& kv : cmd.env) {
+      append_key_field(key, kv.first);
+      append_key_field(key, kv.second);
+    }
+    key += '|';
+    key += std::to_string(cmd.input.size());
+    key += ':';
+    key += util::sha256(cmd.input.data(), cmd.input.size());
+    return key;
+  }
 
-  // If an error occurs, exit the application.
-  if (!bSuccess) {
-    DWORD errorMessageID = ::GetLastError();
-    throw CalledProcessError("CreateProcess failed: " + util::get_last_error(errorMessageID), errorMessageID);
+  /*!
+   * Runs the command to completion as check_output does.
+   */
+  inline OutBuffer check_output_spec(const CommandSpec& cmd)
+  {
+    input in = cmd.input.empty() ? input{-1} : input{PIPE};
+    Popen p(cmd.argv, cwd{cmd.cwd}, environment{cmd.env},
+            std::move(in), output{PIPE});
+    auto res = p.communicate(cmd.input.data(), cmd.input.size());
+    if (p.retcode() > 0) {
+      throw CalledProcessError("Command failed : Non zero retcode", p.retcode());
+    }
+    return std::move(res.first);
   }
+}
 
-  CloseHandle(piProcInfo.hThread);
+/*!
+ * class: SingleFlight
+ * Deduplicates identical commands run concurrently.
+ * While a command is running, all the other callers asking for
+ * the same command (same argv, cwd, environment and input) wait
+ * for it and get the same output buffer instead of spawning a
+ * child of their own. A failure is delivered to all of them.
+ * Once the command completes, the next call spawns afresh.
+ *
+ * Eg:
+ *   SingleFlight sf;
+ *   CommandSpec cmd({"git", "rev-parse", "HEAD"});
+ *   cmd.cwd = repo_dir;
+ *   auto out = sf.check_output(cmd); // shared_ptr<const OutBuffer>
+ */
+class SingleFlight
+{
+public:
+  using result_type = std::shared_ptr<const OutBuffer>;
 
-  /*
-    TODO: use common apis to close linux handles
-  */
+  SingleFlight() {}
+  void operator=(const SingleFlight&) = delete;
 
-  this->process_handle_ = piProcInfo.hProcess;
+  result_type check_output(const CommandSpec& cmd)
+  {
+    auto key = detail::command_key(cmd);
+    std::promise<result_type> prom;
+    std::shared_future<result_type> running;
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      auto it = inflight_.find(key);
+      if (it != inflight_.end()) {
+        running = it->second;
+        shared_++;
+      } else {
+        inflight_.emplace(key, prom.get_future().share());
+        spawned_++;
+      }
+    }
+    // Wait for the leader outside of the lock
+    if (running.valid()) return running.get();
 
-  this->cleanup_future_ = std::async(std::launch::async, [this] {
-    WaitForSingleObject(this->process_handle_, INFINITE);
+    try {
+      auto res = std::make_shared<const OutBuffer>(detail::check_output_spec(cmd));
+      forget(key);
+      prom.set_value(res);
+      return res;
+    } catch (...) {
+      forget(key);
+      prom.set_exception(std::current_exception());
+      throw;
+    }
+  }
 
-    CloseHandle(this->stream_.g_hChildStd_ERR_Wr);
-    CloseHandle(this->stream_.g_hChildStd_OUT_Wr);
-    CloseHandle(this->stream_.g_hChildStd_IN_Rd);
-  });
+  // Number of children spawned
+  size_t spawned() const { return spawned_; }
+  // Number of calls which were served by an already running child
+  size_t shared() const { return shared_; }
 
-/*
-  NOTE: In the linux version, there is a check to make sure that the process
-        has been started. Here, we do nothing because CreateProcess will throw
-        if we fail to create the process.
-*/
+private:
+  void forget(const std::string& key)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    inflight_.erase(key);
+  }
 
+private:
+  std::mutex mtx_;
+  std::map<std::string, std::shared_future<result_type>> inflight_;
+  std::atomic<size_t> spawned_{0};
+  std::atomic<size_t> shared_{0};
+};
+#endif
 
-#else
 
-  int err_rd_pipe, err_wr_pipe;
-  std::tie(err_rd_pipe, err_wr_pipe) = util::pipe_cloexec();
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        RESULT CACHE
+ *-----------------------------------------------------------
+ */
 
-  if (shell_) {
-    auto new_cmd = util::join(vargs_);
-    vargs_.clear();
-    vargs_.insert(vargs_.begin(), {"/bin/sh", "-c"});
-    vargs_.push_back(new_cmd);
-    populate_c_argv();
-  }
+struct CacheStats {
+  uint64_t hits = 0;          // Served from memory
+  uint64_t disk_hits = 0;     // Served from the disk tier
+  uint64_t misses = 0;        // Command had to be run
+  uint64_t evictions = 0;     // Dropped from memory for space
+  uint64_t invalidations = 0; // Dropped because of TTL or watched files
+};
 
-  if (exe_name_.length()) {
-    vargs_.insert(vargs_.begin(), exe_name_);
-    populate_c_argv();
+namespace util
+{
+  /*!
+   * Function: file_signature
+   * Returns a string which changes whenever the file at `path`
+   * is modified or replaced: its inode, size and mtime.
+   * Returns "-" if the file does not exist.
+   */
+  static inline std::string file_signature(const std::string& path)
+  {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) return "-";
+    std::string sig = std::to_string(st.st_ino) + "." +
+                      std::to_string(st.st_size) + "." +
+                      std::to_string(st.st_mtime);
+#ifdef __linux__
+    sig += "." + std::to_string(st.st_mtim.tv_nsec);
+#endif
+    return sig;
   }
-  exe_name_ = vargs_[0];
+}
 
-  child_pid_ = fork();
+/*!
+ * class: ResultCache
+ * Memoizes the output of deterministic commands.
+ *
+ * The key is made of the resolved executable and its file signature
+ * (so that upgrading the tool invalidates the results), the argv,
+ * the cwd, the values of the environment variables registered with
+ * `key_env` and a digest of the input.
+ *
+ * Results are kept in an LRU of `max_entries` in memory. With
+ * `set_disk_dir` they are also stored on disk, named after the
+ * digest of the key, so that they survive the process. The disk
+ * tier is not bounded: expired entries are only overwritten, and
+ * pruning the directory is left to the caller.
+ * The filesystem is only touched without holding the lock, so a
+ * slow one does not stall callers served from memory.
+ * Entries expire after the TTL if one is set, and all of them are
+ * invalidated when any of the files registered with `watch_file`
+ * changes.
+ * Only successful runs are cached.
+ *
+ * Eg:
+ *   ResultCache cache(128);
+ *   cache.set_disk_dir("/var/cache/myapp/cmd");
+ *   cache.key_env("PKG_CONFIG_PATH");
+ *   auto out = cache.check_output(CommandSpec({"pkg-config", "--libs", "zlib"}));
+ */
+class ResultCache
+{
+public:
+  using result_type = std::shared_ptr<const OutBuffer>;
 
-  if (child_pid_ < 0) {
-    close(err_rd_pipe);
-    close(err_wr_pipe);
-    throw OSError("fork failed", errno);
-  }
+  explicit ResultCache(size_t max_entries = 256):
+    max_entries_(std::max<size_t>(max_entries, 1))
+  {}
 
-  child_created_ = true;
+  void operator=(const ResultCache&) = delete;
 
-  if (child_pid_ == 0)
+  // Enables the on disk tier. The directory must exist.
+  void set_disk_dir(const std::string& dir)
   {
-    // Close descriptors belonging to parent
-    stream_.close_parent_fds();
+    std::lock_guard<std::mutex> lk(mtx_);
+    disk_dir_ = dir;
+  }
 
-    //Close the read end of the error pipe
-    close(err_rd_pipe);
+  // Entries older than `ttl` are not used. Zero means no expiry.
+  void set_ttl(std::chrono::seconds ttl)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    ttl_ = ttl;
+  }
 
-    detail::Child chld(this, err_wr_pipe);
-    chld.execute_child();
+  void watch_file(const std::string& path)
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    watched_.push_back(path);
   }
-  else
+
+  void key_env(const std::string& name)
   {
-    close (err_wr_pipe);// close child side of pipe, else get stuck in read below
+    std::lock_guard<std::mutex> lk(mtx_);
+    key_env_.push_back(name);
+  }
 
-    stream_.close_child_fds();
+  result_type check_output(const CommandSpec& cmd);
 
-    try {
-      char err_buf[SP_MAX_ERR_BUF_SIZ] = {0,};
+  void clear()
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    lru_.clear();
+    index_.clear();
+  }
 
-      FILE* err_fp = fdopen(err_rd_pipe, "r");
-      if (!err_fp) {
-          close(err_rd_pipe);
-          throw OSError("fdopen failed", errno);
-      }
-      int read_bytes = util::read_atmost_n(err_fp, err_buf, SP_MAX_ERR_BUF_SIZ);
-      fclose(err_fp);
+  CacheStats stats() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return stats_;
+  }
 
-      if (read_bytes || strlen(err_buf)) {
-        // Call waitpid to reap the child process
-        // waitpid suspends the calling process until the
-        // child terminates.
-        int retcode = wait();
+private:
+  using clock = std::chrono::system_clock;
 
-        // Throw whatever information we have about child failure
-        throw CalledProcessError(err_buf, retcode);
-      }
-    } catch (std::exception& exp) {
-      stream_.cleanup_fds();
-      throw;
-    }
+  struct Entry {
+    std::string key;
+    result_type value;
+    clock::time_point created;
+    std::string watch_sig;
+  };
 
-  }
-#endif
-}
+  // Both stat files, so they are given copies of the settings
+  // and called without holding the lock
+  static std::string make_key(const CommandSpec& cmd,
+                              const std::vector<std::string>& key_env);
+  static std::string watch_signature(const std::vector<std::string>& watched);
+  bool expired(clock::time_point created, const std::string& watch_sig,
+               const std::string& cur_sig) const;
+
+  // The disk tier does not touch the members, so that it can
+  // be used without holding the lock
+  static std::string disk_path(const std::string& dir, const std::string& key);
+  static result_type disk_load(const std::string& dir, const std::string& key,
+                               clock::time_point& created, std::string& sig);
+  static void disk_store(const std::string& dir, const std::string& key,
+                         const OutBuffer& obuf, clock::time_point created,
+                         const std::string& sig);
+  void insert(const std::string& key, result_type value,
+              clock::time_point created, const std::string& sig);
 
-namespace detail {
+private:
+  size_t max_entries_;
+  std::string disk_dir_;
+  std::chrono::seconds ttl_{0};
+  std::vector<std::string> watched_;
+  std::vector<std::string> key_env_;
+
+  mutable std::mutex mtx_;
+  std::list<Entry> lru_; // Most recently used first
+  std::map<std::string, std::list<Entry>::iterator> index_;
+  CacheStats stats_;
+};
 
-  inline void ArgumentDeducer::set_option(executable&& exe) {
-    popen_->exe_name_ = std::move(exe.arg_value);
-  }
+inline std::string ResultCache::make_key(const CommandSpec& cmd,
+                                         const std::vector<std::string>& key_env)
+{
+  auto env_value = [&cmd](const std::string& name) -> std::string {
+    auto it = cmd.env.find(name);
+    if (it != cmd.env.end()) return it->second;
+    const char* val = getenv(name.c_str());
+    return val ? std::string(val) : std::string("\x01unset");
+  };
 
-  inline void ArgumentDeducer::set_option(cwd&& cwdir) {
-    popen_->cwd_ = std::move(cwdir.arg_value);
+  std::string exe;
+  if (!cmd.argv.empty()) {
+    exe = util::find_executable(cmd.argv[0], env_value("PATH"));
+    if (!exe.empty() && exe[0] != '/' && !cmd.cwd.empty()) {
+      exe = cmd.cwd + "/" + exe;
+    }
   }
 
-  inline void ArgumentDeducer::set_option(bufsize&& bsiz) {
-    popen_->stream_.bufsiz_ = bsiz.bufsiz;
+  std::string key = detail::command_key(cmd);
+  key += '|';
+  detail::append_key_field(key, exe);
+  detail::append_key_field(key, util::file_signature(exe));
+  key += '|';
+  for (auto& name : key_env) {
+    detail::append_key_field(key, name);
+    detail::append_key_field(key, env_value(name));
   }
+  return key;
+}
 
-  inline void ArgumentDeducer::set_option(environment&& env) {
-    popen_->env_ = std::move(env.env_);
+inline std::string ResultCache::watch_signature(const std::vector<std::string>& watched)
+{
+  std::string sig;
+  for (auto& path : watched) {
+    sig += util::file_signature(path);
+    sig += ';';
   }
+  return sig;
+}
 
-  inline void ArgumentDeducer::set_option(defer_spawn&& defer) {
-    popen_->defer_process_start_ = defer.defer;
-  }
+inline bool ResultCache::expired(clock::time_point created,
+                                 const std::string& watch_sig,
+                                 const std::string& cur_sig) const
+{
+  if (watch_sig != cur_sig) return true;
+  return ttl_.count() && clock::now() - created > ttl_;
+}
 
-  inline void ArgumentDeducer::set_option(shell&& sh) {
-    popen_->shell_ = sh.shell_;
+inline std::string ResultCache::disk_path(const std::string& dir, const std::string& key)
+{
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           (unsigned long long)util::fnv1a(key.data(), key.size()),
+           (unsigned long long)util::fnv1a(key.data(), key.size(),
+                                           0x84222325cbf29ce4ULL));
+  return dir + "/" + hex;
+}
+
+/*
+ * The on disk format is:
+ *   <created, seconds since epoch>\n<length of watch sig>\n<watch sig>
+ *   <length of key>\n<key><output bytes till the end of file>
+ * The full key is stored so that digest collisions are detected.
+ */
+inline ResultCache::result_type
+ResultCache::disk_load(const std::string& dir, const std::string& key,
+                       clock::time_point& created, std::string& sig)
+{
+  FILE* fp = fopen(disk_path(dir, key).c_str(), "rb");
+  if (!fp) return nullptr;
+
+  std::unique_ptr<FILE, int(*)(FILE*)> guard(fp, fclose);
+  long long secs = 0;
+  size_t sig_len = 0, key_len = 0;
+
+  if (fscanf(fp, "%lld\n%zu\n", &secs, &sig_len) != 2) return nullptr;
+  sig.assign(sig_len, '\0');
+  if (sig_len && fread(&sig[0], 1, sig_len, fp) != sig_len) return nullptr;
+  if (fscanf(fp, "%zu\n", &key_len) != 1 || key_len != key.size()) return nullptr;
+  std::string stored_key(key_len, '\0');
+  if (fread(&stored_key[0], 1, key_len, fp) != key_len) return nullptr;
+  if (stored_key != key) return nullptr;
+  created = clock::time_point(std::chrono::seconds(secs));
+
+  std::shared_ptr<OutBuffer> obuf(new OutBuffer(DEFAULT_BUF_CAP_BYTES));
+  while (true) {
+    size_t rd = fread(obuf->buf.data() + obuf->length, 1,
+                      obuf->buf.size() - obuf->length, fp);
+    obuf->length += rd;
+    if (rd == 0) break;
+    if (obuf->length == obuf->buf.size()) obuf->buf.resize(obuf->buf.size() * 2);
   }
+  obuf->buf.resize(obuf->length);
+  return obuf;
+}
 
-  inline void ArgumentDeducer::set_option(session_leader&& sleader) {
-    popen_->session_leader_ = sleader.leader_;
+inline void ResultCache::disk_store(const std::string& dir, const std::string& key,
+                                    const OutBuffer& obuf, clock::time_point created,
+                                    const std::string& sig)
+{
+  auto path = disk_path(dir, key);
+  static std::atomic<unsigned> counter{0};
+  auto tmp = path + ".tmp." + std::to_string(getpid()) + "." +
+             std::to_string(counter++);
+
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp) return;
+  auto secs = std::chrono::duration_cast<std::chrono::seconds>(
+                  created.time_since_epoch()).count();
+  bool ok = fprintf(fp, "%lld\n%zu\n", (long long)secs, sig.size()) > 0 &&
+            fwrite(sig.data(), 1, sig.size(), fp) == sig.size() &&
+            fprintf(fp, "%zu\n", key.size()) > 0 &&
+            fwrite(key.data(), 1, key.size(), fp) == key.size() &&
+            fwrite(obuf.buf.data(), 1, obuf.length, fp) == obuf.length;
+  ok = (fclose(fp) == 0) && ok;
+
+  // Publish atomically, readers see either nothing or the whole entry
+  if (!ok || rename(tmp.c_str(), path.c_str()) == -1) unlink(tmp.c_str());
+}
+
+inline void ResultCache::insert(const std::string& key, result_type value,
+                                clock::time_point created, const std::string& sig)
+{
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    lru_.erase(it->second);
+    index_.erase(it);
   }
+  lru_.push_front(Entry{key, std::move(value), created, sig});
+  index_[key] = lru_.begin();
 
-  inline void ArgumentDeducer::set_option(input&& inp) {
-    if (inp.rd_ch_ != -1) popen_->stream_.read_from_parent_ = inp.rd_ch_;
-    if (inp.wr_ch_ != -1) popen_->stream_.write_to_child_ = inp.wr_ch_;
+  while (lru_.size() > max_entries_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+    stats_.evictions++;
   }
+}
 
-  inline void ArgumentDeducer::set_option(output&& out) {
-    if (out.wr_ch_ != -1) popen_->stream_.write_to_parent_ = out.wr_ch_;
-    if (out.rd_ch_ != -1) popen_->stream_.read_from_child_ = out.rd_ch_;
+inline ResultCache::result_type ResultCache::check_output(const CommandSpec& cmd)
+{
+  std::string disk_dir;
+  std::vector<std::string> watched, key_env;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    disk_dir = disk_dir_;
+    watched = watched_;
+    key_env = key_env_;
   }
+  auto key = make_key(cmd, key_env);
+  auto sig = watch_signature(watched);
 
-  inline void ArgumentDeducer::set_option(error&& err) {
-    if (err.deferred_) {
-      if (popen_->stream_.write_to_parent_) {
-        popen_->stream_.err_write_ = popen_->stream_.write_to_parent_;
-      } else {
-        throw std::runtime_error("Set output before redirecting error to output");
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      auto& e = *it->second;
+      if (!expired(e.created, e.watch_sig, sig)) {
+        stats_.hits++;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return e.value;
       }
+      stats_.invalidations++;
+      lru_.erase(it->second);
+      index_.erase(it);
     }
-    if (err.wr_ch_ != -1) popen_->stream_.err_write_ = err.wr_ch_;
-    if (err.rd_ch_ != -1) popen_->stream_.err_read_ = err.rd_ch_;
   }
 
-  inline void ArgumentDeducer::set_option(close_fds&& cfds) {
-    popen_->close_fds_ = cfds.close_all;
+  // The disk is read and written, and the command run,
+  // without holding the lock either
+  if (!disk_dir.empty()) {
+    clock::time_point created;
+    std::string stored_sig;
+    auto res = disk_load(disk_dir, key, created, stored_sig);
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (res && !expired(created, stored_sig, sig)) {
+      stats_.disk_hits++;
+      insert(key, res, created, stored_sig);
+      return res;
+    }
+    stats_.misses++;
+  } else {
+    std::lock_guard<std::mutex> lk(mtx_);
+    stats_.misses++;
   }
 
-  inline void ArgumentDeducer::set_option(preexec_func&& prefunc) {
-    popen_->preexec_fn_ = std::move(prefunc);
-    popen_->has_preexec_fn_ = true;
+  auto created = clock::now();
+  auto res = std::make_shared<const OutBuffer>(detail::check_output_spec(cmd));
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    insert(key, res, created, sig);
   }
+  if (!disk_dir.empty()) disk_store(disk_dir, key, *res, created, sig);
+  return res;
+}
+#endif
 
 
-  inline void Child::execute_child() {
 #ifndef __USING_WINDOWS__
-    int sys_ret = -1;
-    auto& stream = parent_->stream_;
+/*-----------------------------------------------------------
+ *        FRAMING
+ *-----------------------------------------------------------
+ */
 
-    try {
-      if (stream.write_to_parent_ == 0)
-        stream.write_to_parent_ = dup(stream.write_to_parent_);
+/*!
+ * class: FrameCodec
+ * Interface for delimiting messages exchanged with a
+ * long lived child over its stdin/stdout.
+ */
+class FrameCodec
+{
+public:
+  virtual ~FrameCodec() {}
 
-      if (stream.err_write_ == 0 || stream.err_write_ == 1)
-        stream.err_write_ = dup(stream.err_write_);
+  // Appends the framed message to `out`
+  virtual void encode(const char* msg, size_t length, std::string& out) const = 0;
 
-      // Make the child owned descriptors as the
-      // stdin, stdout and stderr for the child process
-      auto _dup2_ = [](int fd, int to_fd) {
-        if (fd == to_fd) {
-          // dup2 syscall does not reset the
-          // CLOEXEC flag if the descriptors
-          // provided to it are same.
-          // But, we need to reset the CLOEXEC
-          // flag as the provided descriptors
-          // are now going to be the standard
-          // input, output and error
-          util::set_clo_on_exec(fd, false);
-        } else if(fd != -1) {
-          int res = dup2(fd, to_fd);
-          if (res == -1) throw OSError("dup2 failed", errno);
-        }
-      };
+  // Tries to extract one message from the start of `data`.
+  // Returns the number of bytes consumed, or 0 if `data` does not
+  // hold a complete frame yet. Throws std::runtime_error for
+  // malformed input.
+  virtual size_t decode(const char* data, size_t length, std::string& msg) const = 0;
+};
 
-      // Create the standard streams
-      _dup2_(stream.read_from_parent_, 0); // Input stream
-      _dup2_(stream.write_to_parent_,  1); // Output stream
-      _dup2_(stream.err_write_,        2); // Error stream
+/*!
+ * Messages terminated by a delimiter, '\n' by default.
+ * The messages must not contain the delimiter.
+ */
+class LineCodec: public FrameCodec
+{
+public:
+  explicit LineCodec(char delim = '\n'): delim_(delim) {}
 
-      // Close the duped descriptors
-      if (stream.read_from_parent_ != -1 && stream.read_from_parent_ > 2)
-        close(stream.read_from_parent_);
+  void encode(const char* msg, size_t length, std::string& out) const override
+  {
+    out.append(msg, length);
+    out.push_back(delim_);
+  }
 
-      if (stream.write_to_parent_ != -1 && stream.write_to_parent_ > 2)
-        close(stream.write_to_parent_);
+  size_t decode(const char* data, size_t length, std::string& msg) const override
+  {
+    auto end = static_cast<const char*>(std::memchr(data, delim_, length));
+    if (!end) return 0;
+    msg.assign(data, end - data);
+    return end - data + 1;
+  }
 
-      if (stream.err_write_ != -1 && stream.err_write_ > 2)
-        close(stream.err_write_);
+private:
+  char delim_;
+};
 
-      // Close all the inherited fd's except the error write pipe
-      if (parent_->close_fds_) {
-        int max_fd = sysconf(_SC_OPEN_MAX);
-        if (max_fd == -1) throw OSError("sysconf failed", errno);
+/*!
+ * Messages prefixed by their length as a 4 byte
+ * big endian integer. Any payload is allowed.
+ */
+class LengthPrefixCodec: public FrameCodec
+{
+public:
+  void encode(const char* msg, size_t length, std::string& out) const override
+  {
+    if (length > 0xffffffffULL) throw std::runtime_error("Frame too long");
+    uint32_t len = static_cast<uint32_t>(length);
+    char hdr[4] = { char(len >> 24), char(len >> 16), char(len >> 8), char(len) };
+    out.append(hdr, 4);
+    out.append(msg, length);
+  }
 
-        for (int i = 3; i < max_fd; i++) {
-          if (i == err_wr_pipe_) continue;
-          close(i);
-        }
-      }
+  size_t decode(const char* data, size_t length, std::string& msg) const override
+  {
+    if (length < 4) return 0;
+    auto b = reinterpret_cast<const unsigned char*>(data);
+    size_t len = (size_t(b[0]) << 24) | (size_t(b[1]) << 16) |
+                 (size_t(b[2]) << 8) | size_t(b[3]);
+    if (length - 4 < len) return 0;
+    msg.assign(data + 4, len);
+    return len + 4;
+  }
+};
 
-      // Change the working directory if provided
-      if (parent_->cwd_.length()) {
-        sys_ret = chdir(parent_->cwd_.c_str());
-        if (sys_ret == -1) throw OSError("chdir failed", errno);
-      }
+/*!
+ * NUL terminated messages.
+ */
+class NulCodec: public LineCodec
+{
+public:
+  NulCodec(): LineCodec('\0') {}
+};
 
-      if (parent_->has_preexec_fn_) {
-        parent_->preexec_fn_();
-      }
+/*!
+ * Messages encoded as netstrings: "<length>:<payload>,"
+ */
+class NetstringCodec: public FrameCodec
+{
+public:
+  void encode(const char* msg, size_t length, std::string& out) const override
+  {
+    out += std::to_string(length);
+    out.push_back(':');
+    out.append(msg, length);
+    out.push_back(',');
+  }
 
-      if (parent_->session_leader_) {
-        sys_ret = setsid();
-        if (sys_ret == -1) throw OSError("setsid failed", errno);
+  size_t decode(const char* data, size_t length, std::string& msg) const override
+  {
+    size_t len = 0, i = 0;
+    for (; i < length && data[i] != ':'; i++) {
+      if (data[i] < '0' || data[i] > '9' || i >= 10) {
+        throw std::runtime_error("Malformed netstring");
       }
+      len = len * 10 + (data[i] - '0');
+    }
+    if (i == length) return 0;
+    if (length - i - 1 < len + 1) return 0;
+    if (data[i + 1 + len] != ',') throw std::runtime_error("Malformed netstring");
+    msg.assign(data + i + 1, len);
+    return i + len + 2;
+  }
+};
 
-      // Replace the current image with the executable
-      if (parent_->env_.size()) {
-        for (auto& kv : parent_->env_) {
-          setenv(kv.first.c_str(), kv.second.c_str(), 1);
+namespace detail
+{
+  /*!
+   * Reads frames out of a descriptor with its own buffering,
+   * as the stdio streams of Popen are unbuffered.
+   */
+  class FrameReader
+  {
+  public:
+    FrameReader(int fd, const FrameCodec& codec):
+      fd_(fd), codec_(codec), buf_(DEFAULT_BUF_CAP_BYTES)
+    {}
+
+    // Tries to extract a frame from the already read data
+    bool buffered(std::string& msg)
+    {
+      size_t used = codec_.decode(buf_.data() + start_, end_ - start_, msg);
+      if (used == 0) return false;
+      start_ += used;
+      return true;
+    }
+
+    // Reads whatever is available, without blocking if the
+    // descriptor is non blocking. Returns false on EOF or error.
+    bool fill()
+    {
+      if (start_ == end_) start_ = end_ = 0;
+      if (end_ == buf_.size()) {
+        if (start_) {
+          std::memmove(buf_.data(), buf_.data() + start_, end_ - start_);
+          end_ -= start_;
+          start_ = 0;
+        } else {
+          buf_.resize(buf_.size() * 2);
         }
-        sys_ret = execvp(parent_->exe_name_.c_str(), parent_->cargv_.data());
-      } else {
-        sys_ret = execvp(parent_->exe_name_.c_str(), parent_->cargv_.data());
       }
+      while (true) {
+        ssize_t rd = read(fd_, buf_.data() + end_, buf_.size() - end_);
+        if (rd == -1 && errno == EINTR) continue;
+        if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (rd <= 0) return false;
+        end_ += rd;
+        return true;
+      }
+    }
 
-      if (sys_ret == -1) throw OSError("execve failed", errno);
-
-    } catch (const OSError& exp) {
-      // Just write the exception message
-      // TODO: Give back stack trace ?
-      std::string err_msg(exp.what());
-      //ATTN: Can we do something on error here ?
-      util::write_n(err_wr_pipe_, err_msg.c_str(), err_msg.length());
+    // Blocks till a complete frame is read.
+    // Returns false if the child closed its end before that.
+    bool next(std::string& msg)
+    {
+      while (!buffered(msg)) {
+        if (!fill()) return false;
+      }
+      return true;
     }
 
-    // Calling application would not get this
-    // exit failure
-    _exit (EXIT_FAILURE);
-#endif
-  }
+  private:
+    int fd_;
+    const FrameCodec& codec_;
+    std::vector<char> buf_;
+    size_t start_ = 0;
+    size_t end_ = 0;
+  };
 
+  /*!
+   * Closes the input of the child, letting it exit on EOF.
+   * The child is killed if it is still around after `grace`.
+   */
+  inline int shutdown_child(Popen& p, std::chrono::milliseconds grace)
+  {
+    p.close_input();
+    auto deadline = std::chrono::steady_clock::now() + grace;
+    while (p.poll() == -1) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        p.kill(SIGKILL);
+        return p.wait();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return p.retcode();
+  }
+}
 
-  inline void Streams::setup_comm_channels()
+namespace util
+{
+  /*!
+   * Function: read_rss_kb
+   * Returns the resident set size of the process `pid` in KB,
+   * or -1 if it could not be read (only available on linux).
+   */
+  static inline long read_rss_kb(int pid)
   {
-#ifdef __USING_WINDOWS__
-    util::configure_pipe(&this->g_hChildStd_IN_Rd, &this->g_hChildStd_IN_Wr, &this->g_hChildStd_IN_Wr);
-    this->input(util::file_from_handle(this->g_hChildStd_IN_Wr, "w"));
-    this->write_to_child_ = _fileno(this->input());
+    auto path = "/proc/" + std::to_string(pid) + "/statm";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) return -1;
+    long size = 0, resident = -1;
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(fp);
+    if (resident == -1) return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+  }
+}
 
-    util::configure_pipe(&this->g_hChildStd_OUT_Rd, &this->g_hChildStd_OUT_Wr, &this->g_hChildStd_OUT_Rd);
-    this->output(util::file_from_handle(this->g_hChildStd_OUT_Rd, "r"));
-    this->read_from_child_ = _fileno(this->output());
 
-    util::configure_pipe(&this->g_hChildStd_ERR_Rd, &this->g_hChildStd_ERR_Wr, &this->g_hChildStd_ERR_Rd);
-    this->error(util::file_from_handle(this->g_hChildStd_ERR_Rd, "r"));
-    this->err_read_ = _fileno(this->error());
-#else
+/*-----------------------------------------------------------
+ *        PROCESS POOL
+ *-----------------------------------------------------------
+ */
 
-    if (write_to_child_ != -1)  input(fdopen(write_to_child_, "wb"));
-    if (read_from_child_ != -1) output(fdopen(read_from_child_, "rb"));
-    if (err_read_ != -1)        error(fdopen(err_read_, "rb"));
+/*!
+ * Limits after which a worker of a ProcessPool is replaced
+ * by a fresh one. Zero disables the limit.
+ */
+struct PoolLimits {
+  size_t max_requests = 0;   // Requests served by one worker
+  long max_rss_kb = 0;       // Resident memory of a worker
+};
 
-    auto handles = {input(), output(), error()};
+struct PoolStats {
+  uint64_t requests = 0;
+  uint64_t failures = 0;     // Requests lost to a crashed worker
+  uint64_t restarts = 0;     // Workers replaced after a crash
+  uint64_t recycles = 0;     // Workers replaced after hitting a limit
+};
 
-    for (auto& h : handles) {
-      if (h == nullptr) continue;
-      switch (bufsiz_) {
-      case 0:
-        setvbuf(h, nullptr, _IONBF, BUFSIZ);
-        break;
-      case 1:
-        setvbuf(h, nullptr, _IONBF, BUFSIZ);
-        break;
-      default:
-        setvbuf(h, nullptr, _IOFBF, bufsiz_);
-      };
+/*!
+ * class: ProcessPool
+ * Keeps `nworkers` long lived instances of `cmd` and dispatches
+ * requests to them. Each request is written framed by the codec
+ * to the stdin of an idle worker and the reply is read back from
+ * its stdout, one request at a time per worker.
+ *
+ * A worker which dies is restarted, the request it was serving
+ * fails with a CalledProcessError. Workers are recycled after
+ * the configured number of requests or resident memory.
+ * On destruction the pending requests are served, then the
+ * workers get EOF on their stdin and are killed if they do not
+ * exit in time.
+ *
+ * Eg:
+ *   ProcessPool pool({"python3", "worker.py"}, 4);
+ *   auto reply = pool.submit("{\"op\": \"ping\"}");
+ *   std::cout << reply.get() << std::endl;
+ */
+class ProcessPool
+{
+public:
+  ProcessPool(std::vector<std::string> cmd, size_t nworkers,
+              std::shared_ptr<const FrameCodec> codec = std::make_shared<LineCodec>(),
+              PoolLimits limits = PoolLimits()):
+    cmd_(std::move(cmd)),
+    codec_(std::move(codec)),
+    limits_(limits)
+  {
+    for (size_t i = 0; i < std::max<size_t>(nworkers, 1); i++) {
+      threads_.emplace_back(&ProcessPool::worker_loop, this);
     }
-  #endif
   }
 
-  inline int Communication::send(const char* msg, size_t length)
+  ~ProcessPool()
   {
-    if (stream_->input() == nullptr) return -1;
-    return std::fwrite(msg, sizeof(char), length, stream_->input());
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
   }
 
-  inline int Communication::send(const std::vector<char>& msg)
+  void operator=(const ProcessPool&) = delete;
+
+  std::future<std::string> submit(std::string request)
   {
-    return send(msg.data(), msg.size());
+    Request req;
+    req.payload = std::move(request);
+    auto fut = req.reply.get_future();
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      if (stop_) throw std::runtime_error("ProcessPool is shutting down");
+      queue_.push(std::move(req));
+    }
+    cv_.notify_one();
+    return fut;
   }
 
-  inline std::pair<OutBuffer, ErrBuffer>
-  Communication::communicate(const char* msg, size_t length)
+  PoolStats stats() const
   {
-    // Optimization from subprocess.py
-    // If we are using one pipe, or no pipe
-    // at all, using select() or threads is unnecessary.
-    auto hndls = {stream_->input(), stream_->output(), stream_->error()};
-    int count = std::count(std::begin(hndls), std::end(hndls), nullptr);
-    const int len_conv = length;
-
-    if (count >= 2) {
-      OutBuffer obuf;
-      ErrBuffer ebuf;
-      if (stream_->input()) {
-        if (msg) {
-          int wbytes = std::fwrite(msg, sizeof(char), length, stream_->input());
-          if (wbytes < len_conv) {
-            if (errno != EPIPE && errno != EINVAL) {
-              throw OSError("fwrite error", errno);
-            }
-          }
-        }
-        // Close the input stream
-        stream_->input_.reset();
-      } else if (stream_->output()) {
-        // Read till EOF
-        // ATTN: This could be blocking, if the process
-        // at the other end screws up, we get screwed as well
-        obuf.add_cap(out_buf_cap_);
-
-        int rbytes = util::read_all(
-                            stream_->output(),
-                            obuf.buf);
-
-        if (rbytes == -1) {
-          throw OSError("read to obuf failed", errno);
-        }
+    std::lock_guard<std::mutex> lk(mtx_);
+    return stats_;
+  }
 
-        obuf.length = rbytes;
-        // Close the output stream
-        stream_->output_.reset();
+private:
+  struct Request {
+    std::string payload;
+    std::promise<std::string> reply;
+  };
 
-      } else if (stream_->error()) {
-        // Same screwness applies here as well
-        ebuf.add_cap(err_buf_cap_);
+  struct Worker {
+    std::unique_ptr<Popen> proc;
+    std::unique_ptr<detail::FrameReader> reader;
+    size_t served = 0;
+  };
 
-        int rbytes = util::read_atmost_n(
-                                  stream_->error(),
-                                  ebuf.buf.data(),
-                                  ebuf.buf.size());
+  void start(Worker& w)
+  {
+    w.proc.reset(new Popen(cmd_, input{PIPE}, output{PIPE}));
+    w.reader.reset(new detail::FrameReader(fileno(w.proc->output()), *codec_));
+    w.served = 0;
+  }
 
-        if (rbytes == -1) {
-          throw OSError("read to ebuf failed", errno);
-        }
+  void stop(Worker& w)
+  {
+    if (!w.proc) return;
+    w.reader.reset();
+    try {
+      detail::shutdown_child(*w.proc, std::chrono::milliseconds(1000));
+    } catch (OSError&) {}
+    w.proc.reset();
+  }
 
-        ebuf.length = rbytes;
-        // Close the error stream
-        stream_->error_.reset();
-      }
-      return std::make_pair(std::move(obuf), std::move(ebuf));
+  // Returns false if the worker died before replying
+  bool serve(Worker& w, Request& req, std::string& reply, std::exception_ptr& err)
+  {
+    std::string frame;
+    codec_->encode(req.payload.data(), req.payload.size(), frame);
+
+    if (util::write_n(fileno(w.proc->input()), frame.data(), frame.size()) == -1) {
+      detail::consume_sigpipe();
+    } else if (w.reader->next(reply)) {
+      return true;
     }
 
-    return communicate_threaded(msg, length);
+    int retcode = -1;
+    try {
+      w.proc->close_input();
+      retcode = w.proc->wait();
+    } catch (OSError&) {}
+    err = std::make_exception_ptr(CalledProcessError("Pool worker exited", retcode));
+    return false;
   }
 
-
-  inline std::pair<OutBuffer, ErrBuffer>
-  Communication::communicate_threaded(const char* msg, size_t length)
+  void worker_loop()
   {
-    OutBuffer obuf;
-    ErrBuffer ebuf;
-    std::future<int> out_fut, err_fut;
-    const int length_conv = length;
+    detail::block_sigpipe();
+    Worker w;
 
-    if (stream_->output()) {
-      obuf.add_cap(out_buf_cap_);
+    while (true) {
+      Request req;
+      {
+        std::unique_lock<std::mutex> lk(mtx_);
+        cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) break;
+        req = std::move(queue_.front());
+        queue_.pop();
+      }
 
-      out_fut = std::async(std::launch::async,
-                          [&obuf, this] {
-                            return util::read_all(this->stream_->output(), obuf.buf);
-                          });
-    }
-    if (stream_->error()) {
-      ebuf.add_cap(err_buf_cap_);
+      try {
+        if (!w.proc) start(w);
+      } catch (...) {
+        req.reply.set_exception(std::current_exception());
+        continue;
+      }
 
-      err_fut = std::async(std::launch::async,
-                          [&ebuf, this] {
-                            return util::read_all(this->stream_->error(), ebuf.buf);
-                          });
-    }
-    if (stream_->input()) {
-      if (msg) {
-        int wbytes = std::fwrite(msg, sizeof(char), length, stream_->input());
-        if (wbytes < length_conv) {
-          if (errno != EPIPE && errno != EINVAL) {
-            throw OSError("fwrite error", errno);
-          }
+      std::string reply;
+      std::exception_ptr err;
+      bool ok = serve(w, req, reply, err);
+      bool recycle = false;
+      if (ok) {
+        w.served++;
+        recycle = (limits_.max_requests && w.served >= limits_.max_requests) ||
+                  (limits_.max_rss_kb &&
+                   util::read_rss_kb(w.proc->pid()) > limits_.max_rss_kb);
+      }
+
+      {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stats_.requests++;
+        if (!ok) {
+          stats_.failures++;
+          stats_.restarts++;
         }
+        if (recycle) stats_.recycles++;
       }
-      stream_->input_.reset();
-    }
 
-    if (out_fut.valid()) {
-      int res = out_fut.get();
-      if (res != -1) obuf.length = res;
-      else obuf.length = 0;
-    }
-    if (err_fut.valid()) {
-      int res = err_fut.get();
-      if (res != -1) ebuf.length = res;
-      else ebuf.length = 0;
-    }
+      // Stats are updated first so that they are
+      // consistent with what the caller has seen
+      if (ok) req.reply.set_value(std::move(reply));
+      else req.reply.set_exception(err);
 
-    return std::make_pair(std::move(obuf), std::move(ebuf));
+      if (!ok) {
+        w.reader.reset();
+        w.proc.reset();
+      } else if (recycle) {
+        stop(w);
+      }
+    }
+    stop(w);
   }
 
-} // end namespace detail
+private:
+  std::vector<std::string> cmd_;
+  std::shared_ptr<const FrameCodec> codec_;
+  PoolLimits limits_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable cv_;
+  std::queue<Request> queue_;
+  bool stop_ = false;
+  PoolStats stats_;
 
+  std::vector<std::thread> threads_;
+};
+#endif
 
 
-// Convenience Functions
-//
-//
-namespace detail
+#ifndef __USING_WINDOWS__
+/*-----------------------------------------------------------
+ *        COPROCESS
+ *-----------------------------------------------------------
+ */
+
+/*!
+ * How the replies of a Coprocess are matched to the requests.
+ * IN_ORDER        : The child replies to the requests in the order
+ *                   it received them.
+ * BY_SEQUENCE_ID  : Each request is sent as "<id> <payload>" and
+ *                   the child replies with "<id> <reply>", in any order.
+ */
+enum ReplyOrder {
+  IN_ORDER = 1,
+  BY_SEQUENCE_ID,
+};
+
+/*!
+ * class: Coprocess
+ * Pipelined request/reply channel to one long lived child.
+ * Unlike ProcessPool, any number of requests can be in flight
+ * at a time: a writer thread pushes the framed requests to the
+ * stdin of the child as they are made, and a reader thread matches
+ * the replies read from its stdout to the pending requests.
+ *
+ * A request with a timeout fails with TimeoutExpired if its reply
+ * has not arrived in time; a late reply is then dropped.
+ * If the child exits, all pending requests fail with CalledProcessError.
+ *
+ * Eg:
+ *   Coprocess co({"./resolver"}, std::make_shared<NetstringCodec>());
+ *   auto a = co.call("host-a");
+ *   auto b = co.call("host-b", std::chrono::milliseconds(100));
+ *   std::cout << a.get() << b.get() << std::endl;
+ */
+class Coprocess
 {
-  template<typename F, typename... Args>
-  OutBuffer check_output_impl(F& farg, Args&&... args)
+public:
+  using clock = std::chrono::steady_clock;
+
+  Coprocess(std::vector<std::string> cmd,
+            std::shared_ptr<const FrameCodec> codec = std::make_shared<LineCodec>(),
+            ReplyOrder order = IN_ORDER):
+    codec_(std::move(codec)),
+    order_(order),
+    proc_(cmd, input{PIPE}, output{PIPE}),
+    reader_(fileno(proc_.output()), *codec_)
   {
-    static_assert(!detail::has_type<output, detail::param_pack<Args...>>::value, "output not allowed in args");
-    auto p = Popen(std::forward<F>(farg), std::forward<Args>(args)..., output{PIPE});
-    auto res = p.communicate();
-    auto retcode = p.retcode();
-    if (retcode > 0) {
-      throw CalledProcessError("Command failed : Non zero retcode", retcode);
-    }
-    return std::move(res.first);
+    std::tie(wake_rd_, wake_wr_) = util::pipe_cloexec();
+    writer_thread_ = std::thread(&Coprocess::writer_loop, this);
+    reader_thread_ = std::thread(&Coprocess::reader_loop, this);
   }
 
-  template<typename F, typename... Args>
-  int call_impl(F& farg, Args&&... args)
+  ~Coprocess()
   {
-    return Popen(std::forward<F>(farg), std::forward<Args>(args)...).wait();
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      stop_ = true;
+      write_cv_.notify_all();
+      // The writer flushes the queue, unless the child stopped
+      // reading: it is then woken up to give up on the write
+      write_cv_.wait_for(lk, std::chrono::milliseconds(1000),
+                         [this] { return writer_done_; });
+    }
+    char c = 0;
+    util::write_n(wake_wr_, &c, 1);
+    writer_thread_.join();
+    close(wake_rd_);
+    close(wake_wr_);
+    try {
+      detail::shutdown_child(proc_, std::chrono::milliseconds(1000));
+    } catch (OSError&) {}
+    reader_thread_.join();
   }
 
-  static inline void pipeline_impl(std::vector<Popen>& cmds)
+  void operator=(const Coprocess&) = delete;
+
+  // A zero timeout waits for the reply forever
+  std::future<std::string> call(const std::string& request,
+                                std::chrono::milliseconds timeout =
+                                    std::chrono::milliseconds(0));
+
+  int pid() const noexcept { return proc_.pid(); }
+
+  // Number of requests waiting for their reply
+  size_t in_flight() const
   {
-    /* EMPTY IMPL */
+    std::lock_guard<std::mutex> lk(mtx_);
+    return pending_.size();
   }
 
-  template<typename... Args>
-  static inline void pipeline_impl(std::vector<Popen>& cmds,
-                                   const std::string& cmd,
-                                   Args&&... args)
+private:
+  struct Pending {
+    std::promise<std::string> reply;
+    clock::time_point deadline;
+  };
+
+  void writer_loop();
+  // Writes all of `frame` to `fd`, false if the child is gone
+  // or the destructor gave up on it
+  bool write_frame(int fd, const std::string& frame);
+  void reader_loop();
+  void dispatch(const std::string& frame);
+  void fail_all(std::exception_ptr err);
+
+private:
+  std::shared_ptr<const FrameCodec> codec_;
+  ReplyOrder order_;
+  Popen proc_;
+  detail::FrameReader reader_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable write_cv_;
+  std::queue<std::string> write_queue_;
+  bool stop_ = false;
+  bool closed_ = false;
+  bool writer_done_ = false;
+  // Written to by the destructor to interrupt the writer
+  int wake_rd_ = -1;
+  int wake_wr_ = -1;
+
+  uint64_t next_seq_ = 0;
+  std::map<uint64_t, Pending> pending_;
+  std::queue<uint64_t> order_queue_;  // For IN_ORDER replies
+  std::set<std::pair<clock::time_point, uint64_t>> deadlines_;
+
+  std::thread writer_thread_;
+  std::thread reader_thread_;
+};
+
+inline std::future<std::string>
+Coprocess::call(const std::string& request, std::chrono::milliseconds timeout)
+{
+  Pending p;
+  auto fut = p.reply.get_future();
   {
-    if (cmds.size() == 0) {
-      cmds.emplace_back(cmd, output{PIPE}, defer_spawn{true});
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (closed_ || stop_) {
+      p.reply.set_exception(std::make_exception_ptr(
+          CalledProcessError("Coprocess exited", -1)));
+      return fut;
+    }
+
+    uint64_t seq = next_seq_++;
+    std::string frame;
+    if (order_ == BY_SEQUENCE_ID) {
+      std::string tagged = std::to_string(seq) + " " + request;
+      codec_->encode(tagged.data(), tagged.size(), frame);
     } else {
-      cmds.emplace_back(cmd, input{cmds.back().output()}, output{PIPE}, defer_spawn{true});
+      codec_->encode(request.data(), request.size(), frame);
+      order_queue_.push(seq);
     }
 
-    pipeline_impl(cmds, std::forward<Args>(args)...);
+    if (timeout.count()) {
+      p.deadline = clock::now() + timeout;
+      deadlines_.emplace(p.deadline, seq);
+    }
+    pending_.emplace(seq, std::move(p));
+    write_queue_.push(std::move(frame));
   }
+  write_cv_.notify_one();
+  return fut;
+}
 
+inline bool Coprocess::write_frame(int fd, const std::string& frame)
+{
+  size_t off = 0;
+  while (off < frame.size()) {
+    ssize_t n = ::write(fd, frame.data() + off, frame.size() - off);
+    if (n > 0) {
+      off += n;
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN) return false;
+    struct pollfd pfd[2] = {{fd, POLLOUT, 0}, {wake_rd_, POLLIN, 0}};
+    if (::poll(pfd, 2, -1) == -1 && errno != EINTR) return false;
+    if (pfd[1].revents) return false;
+  }
+  return true;
 }
 
-/*-----------------------------------------------------------
- *        CONVIENIENCE FUNCTIONS
- *-----------------------------------------------------------
- */
+inline void Coprocess::writer_loop()
+{
+  detail::block_sigpipe();
+  int fd = fileno(proc_.input());
+  // Non-blocking, so that a child which stopped reading
+  // cannot hold up the destructor
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  while (true) {
+    std::string frame;
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      write_cv_.wait(lk, [this] { return stop_ || !write_queue_.empty(); });
+      if (write_queue_.empty()) break;
+      frame = std::move(write_queue_.front());
+      write_queue_.pop();
+    }
+    if (!write_frame(fd, frame)) {
+      // The child is gone, the reader fails the pending requests
+      detail::consume_sigpipe();
+      std::lock_guard<std::mutex> lk(mtx_);
+      std::queue<std::string>().swap(write_queue_);
+      closed_ = true;
+    }
+  }
 
+  std::lock_guard<std::mutex> lk(mtx_);
+  writer_done_ = true;
+  write_cv_.notify_all();
+}
 
-/*!
- * Run the command with arguments and wait for it to complete.
- * The parameters passed to the argument are exactly the same
- * one would use for Popen constructors.
- */
-template<typename... Args>
-int call(std::initializer_list<const char*> plist, Args&&... args)
+inline void Coprocess::dispatch(const std::string& frame)
 {
-  return (detail::call_impl(plist, std::forward<Args>(args)...));
+  uint64_t seq = 0;
+  std::string reply;
+
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (order_ == BY_SEQUENCE_ID) {
+    auto sp = frame.find(' ');
+    if (sp == std::string::npos || sp == 0) return;
+    for (size_t i = 0; i < sp; i++) {
+      if (frame[i] < '0' || frame[i] > '9') return;
+      seq = seq * 10 + (frame[i] - '0');
+    }
+    reply = frame.substr(sp + 1);
+  } else {
+    if (order_queue_.empty()) return;
+    seq = order_queue_.front();
+    order_queue_.pop();
+    reply = frame;
+  }
+
+  // Not found if the request has already timed out
+  auto it = pending_.find(seq);
+  if (it == pending_.end()) return;
+  if (it->second.deadline != clock::time_point()) {
+    deadlines_.erase(std::make_pair(it->second.deadline, seq));
+  }
+  it->second.reply.set_value(std::move(reply));
+  pending_.erase(it);
 }
 
-template<typename... Args>
-int call(const std::string& arg, Args&&... args)
+inline void Coprocess::fail_all(std::exception_ptr err)
 {
-  return (detail::call_impl(arg, std::forward<Args>(args)...));
+  std::lock_guard<std::mutex> lk(mtx_);
+  closed_ = true;
+  for (auto& kv : pending_) kv.second.reply.set_exception(err);
+  pending_.clear();
+  deadlines_.clear();
 }
 
-template <typename... Args>
-int call(std::vector<std::string> plist, Args &&... args)
+inline void Coprocess::reader_loop()
 {
-  return (detail::call_impl(plist, std::forward<Args>(args)...));
+  int fd = fileno(proc_.output());
+  std::string frame;
+
+  try {
+    while (true) {
+      int timeout_ms = -1;
+      {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto now = clock::now();
+        // Fail the requests whose deadline has passed
+        while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+          auto seq = deadlines_.begin()->second;
+          deadlines_.erase(deadlines_.begin());
+          auto it = pending_.find(seq);
+          if (it == pending_.end()) continue;
+          it->second.reply.set_exception(std::make_exception_ptr(
+              TimeoutExpired("Coprocess request timed out")));
+          pending_.erase(it);
+        }
+        if (!deadlines_.empty()) {
+          auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          deadlines_.begin()->first - now).count();
+          timeout_ms = static_cast<int>(std::min<long long>(wait + 1, 60000));
+        }
+      }
+
+      struct pollfd pfd = {fd, POLLIN, 0};
+      int ret = ::poll(&pfd, 1, timeout_ms);
+      if (ret == -1 && errno != EINTR) throw OSError("poll failed", errno);
+      if (ret <= 0) continue;
+
+      if (!reader_.fill()) break;
+      while (reader_.buffered(frame)) dispatch(frame);
+    }
+  } catch (...) {
+    fail_all(std::current_exception());
+    return;
+  }
+
+  // The child is reaped by the destructor, its status is not known yet
+  fail_all(std::make_exception_ptr(CalledProcessError("Coprocess exited", -1)));
 }
+#endif
 
 
+#ifdef __linux__
+/*-----------------------------------------------------------
+ *        RESOURCE SAMPLING
+ *-----------------------------------------------------------
+ */
+
 /*!
- * Run the command with arguments and wait for it to complete.
- * If the exit code was non-zero it raises a CalledProcessError.
- * The arguments are the same as for the Popen constructor.
+ * What a ResourceSampler read from /proc about a running
+ * child. Fields which could not be read are left at -1.
  */
-template <typename... Args>
-OutBuffer check_output(std::initializer_list<const char*> plist, Args&&... args)
-{
-  return (detail::check_output_impl(plist, std::forward<Args>(args)...));
-}
+struct ProcSample {
+  double cpu_time = -1;         // User + system CPU time, seconds
+  long rss_kb = -1;             // VmRSS
+  long peak_rss_kb = -1;        // VmHWM
+  long threads = -1;
+  long long read_bytes = -1;    // Storage I/O, from /proc/<pid>/io
+  long long write_bytes = -1;
+};
 
-template <typename... Args>
-OutBuffer check_output(const std::string& arg, Args&&... args)
+namespace util
 {
-  return (detail::check_output_impl(arg, std::forward<Args>(args)...));
-}
+  /*!
+   * Function: read_proc_sample
+   * Reads the CPU time, memory, thread count and I/O of
+   * the process `pid` from its stat, status and io files.
+   * Returns false if the process is gone.
+   */
+  static inline bool read_proc_sample(int pid, ProcSample& smp)
+  {
+    char path[64], line[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return false;
+    bool ok = fgets(line, sizeof(line), fp) != nullptr;
+    fclose(fp);
+    // The command name may hold anything, parse past it
+    const char* rparen = ok ? strrchr(line, ')') : nullptr;
+    unsigned long utime, stime;
+    if (!rparen || sscanf(rparen + 1,
+                          " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                          " %lu %lu %*d %*d %*d %*d %ld",
+                          &utime, &stime, &smp.threads) != 3) {
+      return false;
+    }
+    static const long ticks = sysconf(_SC_CLK_TCK);
+    smp.cpu_time = static_cast<double>(utime + stime) / ticks;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r"))) {
+      while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld kB", &smp.rss_kb) == 1) continue;
+        sscanf(line, "VmHWM: %ld kB", &smp.peak_rss_kb);
+      }
+      fclose(fp);
+    }
 
-template <typename... Args>
-OutBuffer check_output(std::vector<std::string> plist, Args &&... args)
-{
-  return (detail::check_output_impl(plist, std::forward<Args>(args)...));
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    if ((fp = fopen(path, "r"))) {
+      while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "read_bytes: %lld", &smp.read_bytes) == 1) continue;
+        sscanf(line, "write_bytes: %lld", &smp.write_bytes);
+      }
+      fclose(fp);
+    }
+    return true;
+  }
 }
 
+/*!
+ * Limits a ResourceSampler enforces on the child: `signal` is
+ * sent to it the first time a sample crosses one of them.
+ * A value <= 0 disables the corresponding check.
+ */
+struct WatchdogLimits {
+  long max_rss_kb = 0;
+  double max_cpu_time = 0;      // User + system CPU time, seconds
+  int signal = SIGKILL;
+};
 
 /*!
- * An easy way to pipeline easy commands.
- * Provide the commands that needs to be pipelined in the order they
- * would appear in a regular command.
- * It would wait for the last command provided in the pipeline
- * to finish and then return the OutBuffer.
+ * class: ResourceSampler
+ * Samples /proc for a running child every `interval` from a
+ * background thread, keeping the last sample and the peak of
+ * each field, and kills the child when it crosses the given
+ * WatchdogLimits. Sampling stops once the child has exited.
+ *
+ * Only the child itself is sampled, not its descendants.
+ * The sampler must be created before the child is reaped: it
+ * holds a pidfd of the child, so that it can neither sample
+ * nor signal an unrelated process which reused its pid.
+ *
+ * Eg:
+ *   auto p = Popen({"./convert", "big.tif"});
+ *   WatchdogLimits lim;
+ *   lim.max_rss_kb = 2 * 1024 * 1024;
+ *   ResourceSampler smp(p, std::chrono::milliseconds(50), lim);
+ *   p.wait();
+ *   if (smp.tripped()) std::cerr << "convert used too much memory\n";
  */
-template<typename... Args>
-// Args expected to be flat commands using string instead of initializer_list
-OutBuffer pipeline(Args&&... args)
+class ResourceSampler
 {
-  std::vector<Popen> pcmds;
-  detail::pipeline_impl(pcmds, std::forward<Args>(args)...);
+public:
+  ResourceSampler(const Popen& p,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(100),
+                  WatchdogLimits limits = WatchdogLimits()):
+    pid_(p.pid()),
+    interval_(interval),
+    limits_(limits)
+  {
+#ifdef SYS_pidfd_open
+    pidfd_ = syscall(SYS_pidfd_open, pid_, 0);
+#endif
+    thread_ = std::thread(&ResourceSampler::run, this);
+  }
 
-  for (auto& p : pcmds) p.start_process();
-  return (pcmds.back().communicate().first);
+  ~ResourceSampler()
+  {
+    stop();
+    if (pidfd_ != -1) close(pidfd_);
+  }
+
+  ResourceSampler(const ResourceSampler&) = delete;
+  void operator=(const ResourceSampler&) = delete;
+
+  // Stops sampling, returns once the thread is done
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  ProcSample last() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return last_;
+  }
+
+  ProcSample peak() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return peak_;
+  }
+
+  size_t samples() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return samples_;
+  }
+
+  // True if the watchdog signalled the child
+  bool tripped() const
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return tripped_;
+  }
+
+private:
+  bool child_exited() const;
+  void signal_child(int sig) const;
+  void run();
+
+private:
+  int pid_;
+  int pidfd_ = -1;
+  std::chrono::milliseconds interval_;
+  WatchdogLimits limits_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  bool tripped_ = false;
+  size_t samples_ = 0;
+  ProcSample last_;
+  ProcSample peak_;
+
+  std::thread thread_;
+};
+
+inline bool ResourceSampler::child_exited() const
+{
+  if (pidfd_ == -1) return ::kill(pid_, 0) == -1;
+  struct pollfd pfd = {pidfd_, POLLIN, 0};
+  return ::poll(&pfd, 1, 0) != 0;
+}
+
+inline void ResourceSampler::signal_child(int sig) const
+{
+#ifdef SYS_pidfd_send_signal
+  if (pidfd_ != -1) {
+    syscall(SYS_pidfd_send_signal, pidfd_, sig, nullptr, 0);
+    return;
+  }
+#endif
+  ::kill(pid_, sig);
+}
+
+inline void ResourceSampler::run()
+{
+  std::unique_lock<std::mutex> lk(mtx_);
+  while (!stop_) {
+    lk.unlock();
+    ProcSample smp;
+    bool ok = !child_exited() && util::read_proc_sample(pid_, smp);
+    // The child may have exited while it was read
+    if (ok && child_exited()) ok = false;
+    lk.lock();
+    if (!ok) break;
+
+    last_ = smp;
+    samples_++;
+    peak_.cpu_time = std::max(peak_.cpu_time, smp.cpu_time);
+    peak_.rss_kb = std::max(peak_.rss_kb, smp.rss_kb);
+    peak_.peak_rss_kb = std::max(peak_.peak_rss_kb, smp.peak_rss_kb);
+    peak_.threads = std::max(peak_.threads, smp.threads);
+    peak_.read_bytes = std::max(peak_.read_bytes, smp.read_bytes);
+    peak_.write_bytes = std::max(peak_.write_bytes, smp.write_bytes);
+
+    if (!tripped_ &&
+        ((limits_.max_rss_kb > 0 && smp.rss_kb > limits_.max_rss_kb) ||
+         (limits_.max_cpu_time > 0 && smp.cpu_time > limits_.max_cpu_time))) {
+      tripped_ = true;
+      signal_child(limits_.signal);
+    }
+    cv_.wait_for(lk, interval_, [this] { return stop_; });
+  }
 }
+#endif
 
 }
 
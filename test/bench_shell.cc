@@ -0,0 +1,33 @@
+// Compares the spawn rate of shell{true} commands which take the
+// fast path against always going through /bin/sh -c.
+// Not run as a test: build the bench_shell target and run it.
+#include <chrono>
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+template <typename F>
+static double spawns_per_sec(int n, F spawn)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) spawn();
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return n / secs.count();
+}
+
+int main(int argc, char* argv[]) {
+  int n = argc > 1 ? std::atoi(argv[1]) : 500;
+
+  auto fast = spawns_per_sec(n, [] {
+    sp::Popen("true", sp::shell{true}).wait();
+  });
+  auto via_sh = spawns_per_sec(n, [] {
+    sp::Popen({"/bin/sh", "-c", "true"}).wait();
+  });
+
+  std::cout << "fast path: " << fast << " spawns/s" << std::endl;
+  std::cout << "/bin/sh:   " << via_sh << " spawns/s" << std::endl;
+  std::cout << "speedup:   " << fast / via_sh << "x" << std::endl;
+  return 0;
+}
@@ -0,0 +1,43 @@
+// Stand-in for the systemtap <sys/sdt.h>, used by test_probes:
+// each probe hit is recorded along with its arguments.
+#ifndef SUBPROCESS_TEST_FAKE_SDT_H
+#define SUBPROCESS_TEST_FAKE_SDT_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ProbeHit
+{
+  std::string name;
+  std::vector<std::string> args;
+};
+
+inline std::mutex& probe_mutex()
+{
+  static std::mutex mtx;
+  return mtx;
+}
+
+inline std::vector<ProbeHit>& probe_hits()
+{
+  static std::vector<ProbeHit> hits;
+  return hits;
+}
+
+inline std::string probe_arg(const char* s) { return s; }
+template <typename T> std::string probe_arg(T v) { return std::to_string(v); }
+
+inline void probe_hit(const char* name, std::vector<std::string> args)
+{
+  std::lock_guard<std::mutex> lk(probe_mutex());
+  probe_hits().push_back({name, std::move(args)});
+}
+
+#define STAP_PROBE2(p, n, a, b) probe_hit(#n, {probe_arg(a), probe_arg(b)})
+#define STAP_PROBE3(p, n, a, b, c) \
+  probe_hit(#n, {probe_arg(a), probe_arg(b), probe_arg(c)})
+#define STAP_PROBE4(p, n, a, b, c, d) \
+  probe_hit(#n, {probe_arg(a), probe_arg(b), probe_arg(c), probe_arg(d)})
+
+#endif
@@ -0,0 +1,152 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+static std::string str(const sp::OutBuffer& obuf)
+{
+  return std::string(obuf.buf.data(), obuf.length);
+}
+
+void test_command_repeat()
+{
+  std::cout << "Test::test_command_repeat" << std::endl;
+  sp::Command echo({"echo", "item", "{}"});
+  assert(echo.slots() == 1);
+  assert(echo.path().find("/echo") != std::string::npos);
+
+  for (int i = 0; i < 100; i++) {
+    auto s = std::to_string(i);
+    auto p = sp::Popen(echo, sp::substitute{s.c_str()}, sp::output{sp::PIPE});
+    assert(str(p.communicate().first) == "item " + s + "\n");
+    assert(p.retcode() == 0);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_options()
+{
+  std::cout << "Test::test_command_options" << std::endl;
+  sp::Command show({"echo $PWD $PLAN_VAR"}, sp::shell{true}, sp::cwd{"/tmp"},
+                   sp::environment{{{"PLAN_VAR", "set"}}});
+  assert(str(sp::check_output(show)) == "/tmp set\n");
+
+  sp::Command fail({"sh", "-c", "exit 4"});
+  assert(sp::call(fail) == 4);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_errors()
+{
+  std::cout << "Test::test_command_errors" << std::endl;
+  sp::Command missing({"no-such-binary-anywhere", "x"});
+  assert(missing.path().empty());
+  try {
+    sp::Popen p(missing);
+    assert(false);
+  } catch (sp::CalledProcessError& e) {
+    assert(std::string(e.what()) == "execve failed: No such file or directory");
+  }
+
+  sp::Command baddir({"true"}, sp::cwd{"/no/such/dir"});
+  try {
+    sp::Popen p(baddir);
+    assert(false);
+  } catch (sp::CalledProcessError& e) {
+    assert(std::string(e.what()).find("chdir failed") == 0);
+  }
+
+  sp::Command two({"echo", "{}", "{}"});
+  bool caught = false;
+  try {
+    sp::Popen p(two, sp::substitute{"one"});
+  } catch (std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_pass_fds()
+{
+  std::cout << "Test::test_command_pass_fds" << std::endl;
+  int fds[2];
+  assert(pipe(fds) == 0);
+  sp::Command cmd({"/bin/sh", "-c", "echo passed >&9"},
+                  sp::pass_fds{{fds[1], 9}}, sp::close_fds{true});
+  assert(sp::call(cmd) == 0);
+  close(fds[1]);
+
+  char buf[32] = {0};
+  assert(read(fds[0], buf, sizeof(buf)) == 7);
+  assert(std::string(buf) == "passed\n");
+  close(fds[0]);
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifdef __linux__
+void test_command_pass_fds_image()
+{
+  std::cout << "Test::test_command_pass_fds_image" << std::endl;
+  // Push the image above the descriptors of the spawn, so
+  // that the staging of the passed fds would land on it
+  std::vector<int> filler;
+  for (int i = 0; i < 32; i++) filler.push_back(dup(0));
+  std::ifstream in("/bin/echo", std::ios::binary);
+  static const std::string image((std::istreambuf_iterator<char>(in)),
+                                 std::istreambuf_iterator<char>());
+  sp::memory_image img(image.data(), image.size(), "echo");
+  int exe_fd = sp::detail::memory_image_fd(img);
+  for (int fd : filler) close(fd);
+
+  for (int target : {exe_fd - 1, exe_fd}) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    sp::Command cmd({"image"}, sp::executable{img},
+                    sp::pass_fds{{fds[1], target}}, sp::close_fds{true});
+    auto out = sp::check_output(cmd);
+    assert(str(out) == "image\n");
+    close(fds[0]);
+    close(fds[1]);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+void test_command_threads()
+{
+  std::cout << "Test::test_command_threads" << std::endl;
+  sp::Command cat({"cat"});
+  std::vector<std::thread> threads;
+  std::atomic<int> ok(0);
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&cat, &ok, t] {
+      for (int i = 0; i < 20; i++) {
+        auto msg = std::to_string(t) + ":" + std::to_string(i);
+        auto p = sp::Popen(cat, sp::input{sp::PIPE}, sp::output{sp::PIPE});
+        if (str(p.communicate(msg).first) == msg) ok++;
+      }
+    });
+  }
+  for (auto& th : threads) th.join();
+  assert(ok == 80);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_command_repeat();
+  test_command_options();
+  test_command_errors();
+  test_command_pass_fds();
+#ifdef __linux__
+  test_command_pass_fds_image();
+#endif
+  test_command_threads();
+#endif
+  return 0;
+}
@@ -0,0 +1,205 @@
+#include <iostream>
+#include <set>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+static const char* echo_worker =
+  "while read l; do [ \"$l\" = die ] && exit 3; echo \"$$:$l\"; done";
+
+static std::string payload(const std::string& reply)
+{
+  return reply.substr(reply.find(':') + 1);
+}
+
+void test_pool_basic()
+{
+  std::cout << "Test::test_pool_basic" << std::endl;
+  sp::ProcessPool pool({"/bin/sh", "-c", echo_worker}, 3);
+
+  std::vector<std::future<std::string>> replies;
+  for (int i = 0; i < 50; i++) replies.push_back(pool.submit(std::to_string(i)));
+  for (int i = 0; i < 50; i++) assert(payload(replies[i].get()) == std::to_string(i));
+  assert(pool.stats().requests == 50);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_pool_restart()
+{
+  std::cout << "Test::test_pool_restart" << std::endl;
+  sp::ProcessPool pool({"/bin/sh", "-c", echo_worker}, 1);
+
+  auto bad = pool.submit("die");
+  bool caught = false;
+  try {
+    bad.get();
+  } catch (sp::CalledProcessError& e) {
+    assert(e.retcode == 3);
+    caught = true;
+  }
+  assert(caught);
+  assert(payload(pool.submit("after").get()) == "after");
+  assert(pool.stats().restarts == 1);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_pool_recycle()
+{
+  std::cout << "Test::test_pool_recycle" << std::endl;
+  sp::PoolLimits limits;
+  limits.max_requests = 2;
+  sp::ProcessPool pool({"/bin/sh", "-c", echo_worker}, 1,
+                       std::make_shared<sp::LineCodec>(), limits);
+
+  std::set<std::string> pids;
+  for (int i = 0; i < 6; i++) {
+    auto reply = pool.submit("x").get();
+    pids.insert(reply.substr(0, reply.find(':')));
+  }
+  assert(pids.size() == 3);
+  assert(pool.stats().recycles == 3);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_length_prefix_codec()
+{
+  std::cout << "Test::test_length_prefix_codec" << std::endl;
+  sp::LengthPrefixCodec codec;
+  std::string wire, msg;
+  codec.encode("ab\ncd", 5, wire);
+  codec.encode("", 0, wire);
+  assert(wire.size() == 13);
+
+  size_t used = codec.decode(wire.data(), 6, msg);
+  assert(used == 0);
+  used = codec.decode(wire.data(), wire.size(), msg);
+  assert(used == 9 && msg == "ab\ncd");
+  used = codec.decode(wire.data() + 9, wire.size() - 9, msg);
+  assert(used == 4 && msg.empty());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_coprocess_pipelined()
+{
+  std::cout << "Test::test_coprocess_pipelined" << std::endl;
+  sp::Coprocess co({"/bin/sh", "-c", "while read l; do echo \"re:$l\"; done"});
+
+  std::vector<std::future<std::string>> replies;
+  for (int i = 0; i < 200; i++) replies.push_back(co.call(std::to_string(i)));
+  for (int i = 0; i < 200; i++) assert(replies[i].get() == "re:" + std::to_string(i));
+  assert(co.in_flight() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_coprocess_sequence_id()
+{
+  std::cout << "Test::test_coprocess_sequence_id" << std::endl;
+  // Replies to the even requests are delayed till the next
+  // odd one, so they come back out of order.
+  const char* script =
+    "held=; while read id msg; do"
+    "  if [ -z \"$held\" ]; then held=\"$id $msg\"; continue; fi;"
+    "  echo \"$id odd-$msg\"; set -- $held; echo \"$1 even-$2\"; held=;"
+    " done";
+  sp::Coprocess co({"/bin/sh", "-c", script},
+                   std::make_shared<sp::LineCodec>(), sp::BY_SEQUENCE_ID);
+  auto a = co.call("a");
+  auto b = co.call("b");
+  assert(b.get() == "odd-b");
+  assert(a.get() == "even-a");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_coprocess_timeout()
+{
+  std::cout << "Test::test_coprocess_timeout" << std::endl;
+  sp::Coprocess co({"/bin/sh", "-c", "while read l; do sleep 1; echo \"$l\"; done"});
+  auto slow = co.call("x", std::chrono::milliseconds(100));
+  auto ok = co.call("y");
+
+  bool caught = false;
+  try {
+    slow.get();
+  } catch (sp::TimeoutExpired&) {
+    caught = true;
+  }
+  assert(caught);
+  // The late reply of the first request must not be
+  // delivered to the second one.
+  assert(ok.get() == "y");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_coprocess_exit()
+{
+  std::cout << "Test::test_coprocess_exit" << std::endl;
+  sp::Coprocess co({"/bin/sh", "-c", "head -c 1 > /dev/null; exit 2"},
+                   std::make_shared<sp::NetstringCodec>());
+  auto r = co.call("bye");
+  bool caught = false;
+  try {
+    r.get();
+  } catch (sp::CalledProcessError&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_coprocess_stuck_child()
+{
+  std::cout << "Test::test_coprocess_stuck_child" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  std::future<std::string> r;
+  {
+    // Never reads, so the writer blocks on a full pipe
+    sp::Coprocess co({"sleep", "30"});
+    r = co.call(std::string(1 << 20, 'x'));
+  }
+  auto took = std::chrono::steady_clock::now() - start;
+  assert(took < std::chrono::seconds(10));
+  bool caught = false;
+  try {
+    r.get();
+  } catch (sp::CalledProcessError&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_netstring_codec()
+{
+  std::cout << "Test::test_netstring_codec" << std::endl;
+  sp::NetstringCodec codec;
+  std::string wire, msg;
+  codec.encode("hello", 5, wire);
+  assert(wire == "5:hello,");
+  assert(codec.decode(wire.data(), 4, msg) == 0);
+  assert(codec.decode(wire.data(), wire.size(), msg) == 8 && msg == "hello");
+
+  bool caught = false;
+  try {
+    codec.decode("3:abc;", 6, msg);
+  } catch (std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_pool_basic();
+  test_pool_restart();
+  test_pool_recycle();
+  test_length_prefix_codec();
+  test_coprocess_pipelined();
+  test_coprocess_sequence_id();
+  test_coprocess_timeout();
+  test_coprocess_exit();
+  test_coprocess_stuck_child();
+  test_netstring_codec();
+#endif
+  return 0;
+}
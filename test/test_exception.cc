@@ -21,7 +21,62 @@ void test_exception()
   assert(caught);
 }
 
+#ifndef __USING_WINDOWS__
+void test_try_check_output()
+{
+  auto res = sp::try_check_output({"sh", "-c", "echo partial; exit 3"});
+  assert(!res.error);
+  assert(res.retcode == 3);
+  assert(!res.ok());
+  assert(std::string(res.output.buf.data(), res.output.length) == "partial\n");
+
+  res = sp::try_check_output("invalid_command");
+  assert(res.error);
+  assert(res.error.stage == sp::SPAWN_EXEC);
+  assert(res.error.code() == std::errc::no_such_file_or_directory);
+  assert(res.error.message() == "execve failed: No such file or directory");
+  assert(res.retcode == -1);
+
+  sp::Command missing({"invalid_command"});
+  res = sp::try_check_output(missing);
+  assert(res.error.stage == sp::SPAWN_EXEC && res.error.err == ENOENT);
+}
+
+void test_try_call()
+{
+  auto res = sp::try_call({"true"}, sp::cwd{"/no/such/dir"});
+  assert(res.error.stage == sp::SPAWN_CHDIR);
+  assert(res.error.err == ENOENT);
+
+  res = sp::try_call({"false"});
+  assert(!res.error && res.retcode == 1);
+
+  // The thrown message is built from the same report
+  try {
+    auto p = sp::Popen({"true"}, sp::cwd{"/no/such/dir"});
+    assert(false);
+  } catch (sp::CalledProcessError& e) {
+    assert(std::string(e.what()) == "chdir failed: No such file or directory");
+  }
+}
+
+void test_oserror_code()
+{
+  try {
+    sp::input in("/no/such/file");
+    assert(false);
+  } catch (sp::OSError& e) {
+    assert(e.err_code == ENOENT);
+  }
+}
+#endif
+
 int main() {
   test_exception();
+#ifndef __USING_WINDOWS__
+  test_try_check_output();
+  test_try_call();
+  test_oserror_code();
+#endif
   return 0;
 }
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+using std::chrono::milliseconds;
+
+void test_hedged_fast()
+{
+  std::cout << "Test::test_hedged_fast" << std::endl;
+  auto before = sp::hedge_stats();
+  auto obuf = sp::hedged_check_output({"echo", "fast"}, milliseconds(5000));
+  assert(std::string(obuf.buf.data(), obuf.length) == "fast\n");
+
+  auto after = sp::hedge_stats();
+  assert(after.calls == before.calls + 1);
+  assert(after.hedged == before.hedged);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_hedged_straggler()
+{
+  std::cout << "Test::test_hedged_straggler" << std::endl;
+  rmdir("hedge_lock");
+  auto before = sp::hedge_stats();
+  auto start = std::chrono::steady_clock::now();
+
+  // Only the first attempt gets the lock and stalls
+  auto obuf = sp::hedged_check_output(
+      {"/bin/sh", "-c", "if mkdir hedge_lock 2>/dev/null; then sleep 5; fi; echo done"},
+      milliseconds(100));
+
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  assert(elapsed < std::chrono::seconds(4));
+  assert(std::string(obuf.buf.data(), obuf.length) == "done\n");
+
+  auto after = sp::hedge_stats();
+  assert(after.hedged == before.hedged + 1);
+  assert(after.hedge_wins == before.hedge_wins + 1);
+  rmdir("hedge_lock");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_hedged_closed_output()
+{
+  std::cout << "Test::test_hedged_closed_output" << std::endl;
+  rmdir("hedge_lock");
+  auto start = std::chrono::steady_clock::now();
+
+  // The first attempt closes its output and then stalls
+  auto obuf = sp::hedged_check_output(
+      {"/bin/sh", "-c", "if mkdir hedge_lock 2>/dev/null; then exec >&-; sleep 5; fi; echo done"},
+      milliseconds(100));
+
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  assert(elapsed < std::chrono::seconds(4));
+  assert(std::string(obuf.buf.data(), obuf.length) == "done\n");
+  rmdir("hedge_lock");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_hedge_policy()
+{
+  std::cout << "Test::test_hedge_policy" << std::endl;
+  sp::HedgePolicy policy(milliseconds(200), 100, 10);
+  assert(policy.delay() == milliseconds(200));
+  for (int i = 1; i <= 100; i++) policy.record(milliseconds(i));
+  assert(policy.delay() == milliseconds(96));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_hedge_policy_learns()
+{
+  std::cout << "Test::test_hedge_policy_learns" << std::endl;
+  sp::HedgePolicy policy(milliseconds(5000), 10, 1);
+  sp::hedged_check_output({"sleep", "0.2"}, policy);
+  // Only the first attempt's latency is learned
+  assert(policy.delay() >= milliseconds(200));
+  assert(policy.delay() < milliseconds(2000));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_hedged_failure()
+{
+  std::cout << "Test::test_hedged_failure" << std::endl;
+  bool caught = false;
+  try {
+    sp::hedged_check_output({"/bin/false"}, milliseconds(1000));
+  } catch (sp::CalledProcessError& e) {
+    assert(e.retcode == 1);
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_hedged_fast();
+  test_hedged_straggler();
+  test_hedged_closed_output();
+  test_hedge_policy();
+  test_hedge_policy_learns();
+  test_hedged_failure();
+#endif
+  return 0;
+}
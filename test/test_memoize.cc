@@ -0,0 +1,139 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+void test_single_flight()
+{
+  std::cout << "Test::test_single_flight" << std::endl;
+  sp::SingleFlight sf;
+  sp::CommandSpec cmd({"/bin/sh", "-c", "sleep 0.5; echo $$"});
+
+  std::vector<sp::SingleFlight::result_type> results(6);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); i++) {
+    threads.emplace_back([&sf, &cmd, &results, i] {
+      results[i] = sf.check_output(cmd);
+    });
+  }
+  for (auto& t : threads) t.join();
+
+  assert(sf.spawned() == 1);
+  assert(sf.shared() == results.size() - 1);
+  for (auto& r : results) assert(r.get() == results[0].get());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_single_flight_key()
+{
+  std::cout << "Test::test_single_flight_key" << std::endl;
+  sp::SingleFlight sf;
+  sp::CommandSpec a({"cat"});
+  a.input = "one";
+  sp::CommandSpec b({"cat"});
+  b.input = "two";
+
+  auto ra = sf.check_output(a);
+  auto rb = sf.check_output(b);
+  assert(std::string(ra->buf.data(), ra->length) == "one");
+  assert(std::string(rb->buf.data(), rb->length) == "two");
+  assert(sf.spawned() == 2);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_single_flight_failure()
+{
+  std::cout << "Test::test_single_flight_failure" << std::endl;
+  sp::SingleFlight sf;
+  bool caught = false;
+  try {
+    sf.check_output(sp::CommandSpec({"/bin/false"}));
+  } catch (sp::CalledProcessError& e) {
+    assert(e.retcode == 1);
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_result_cache_memory()
+{
+  std::cout << "Test::test_result_cache_memory" << std::endl;
+  sp::ResultCache cache(2);
+  sp::CommandSpec date({"/bin/sh", "-c", "echo $$"});
+
+  auto r1 = cache.check_output(date);
+  auto r2 = cache.check_output(date);
+  assert(r1.get() == r2.get());
+  assert(cache.stats().hits == 1 && cache.stats().misses == 1);
+
+  // Different input is a different entry
+  sp::CommandSpec cat({"cat"});
+  cat.input = "a";
+  cache.check_output(cat);
+  cat.input = "b";
+  auto rb = cache.check_output(cat);
+  assert(std::string(rb->buf.data(), rb->length) == "b");
+  assert(cache.stats().evictions == 1);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_result_cache_watch()
+{
+  std::cout << "Test::test_result_cache_watch" << std::endl;
+  sp::ResultCache cache;
+  cache.watch_file("cache_watched.txt");
+  sp::CommandSpec cmd({"cat", "cache_watched.txt"});
+
+  sp::call({"/bin/sh", "-c", "echo one > cache_watched.txt"});
+  auto r1 = cache.check_output(cmd);
+  assert(std::string(r1->buf.data(), r1->length) == "one\n");
+
+  sp::call({"/bin/sh", "-c", "echo second > cache_watched.txt"});
+  auto r2 = cache.check_output(cmd);
+  assert(std::string(r2->buf.data(), r2->length) == "second\n");
+  assert(cache.stats().invalidations == 1);
+  std::remove("cache_watched.txt");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_result_cache_disk()
+{
+  std::cout << "Test::test_result_cache_disk" << std::endl;
+  sp::call({"rm", "-rf", "cache_dir"});
+  sp::call({"mkdir", "cache_dir"});
+  sp::CommandSpec cmd({"/bin/sh", "-c", "echo $$"});
+
+  sp::ResultCache::result_type first;
+  {
+    sp::ResultCache cache;
+    cache.set_disk_dir("cache_dir");
+    first = cache.check_output(cmd);
+  }
+
+  // A new cache picks the result from the disk
+  sp::ResultCache cache;
+  cache.set_disk_dir("cache_dir");
+  auto second = cache.check_output(cmd);
+  assert(cache.stats().disk_hits == 1);
+  assert(std::string(first->buf.data(), first->length) ==
+         std::string(second->buf.data(), second->length));
+
+  cache.set_ttl(std::chrono::seconds(3600));
+  cache.check_output(cmd);
+  assert(cache.stats().hits == 1);
+  sp::call({"rm", "-rf", "cache_dir"});
+  std::cout << "END_TEST" << std::endl;
+}
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_single_flight();
+  test_single_flight_key();
+  test_single_flight_failure();
+  test_result_cache_memory();
+  test_result_cache_watch();
+  test_result_cache_disk();
+#endif
+  return 0;
+}
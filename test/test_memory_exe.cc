@@ -0,0 +1,71 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifdef __linux__
+static std::string load(const char* path)
+{
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+void test_memory_image_exec()
+{
+  std::cout << "Test::test_memory_image_exec" << std::endl;
+  static const std::string image = load("/bin/echo");
+  assert(!image.empty());
+  sp::memory_image img(image.data(), image.size(), "echo");
+
+  for (int i = 0; i < 3; i++) {
+    auto obuf = sp::check_output({"hello", "memfd"}, sp::executable{img});
+    assert(std::string(obuf.buf.data(), obuf.length) == "hello memfd\n");
+  }
+  // The memfd is made once and sealed
+  int fd = sp::detail::memory_image_fd(img);
+  assert(fd == sp::detail::memory_image_fd(img));
+  int seals = fcntl(fd, F_GET_SEALS);
+  assert(seals & F_SEAL_WRITE);
+  assert(seals & F_SEAL_SEAL);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_memory_image_env()
+{
+  std::cout << "Test::test_memory_image_env" << std::endl;
+  static const std::string image = load("/usr/bin/env");
+  sp::memory_image img(image.data(), image.size(), "env");
+  auto obuf = sp::check_output({}, sp::executable{img},
+                               sp::environment{{{"MEMFD_TEST", "yes"}}});
+  std::string out(obuf.buf.data(), obuf.length);
+  assert(out.find("MEMFD_TEST=yes") != std::string::npos);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_memory_image_close_fds()
+{
+  std::cout << "Test::test_memory_image_close_fds" << std::endl;
+  static const std::string image = load("/bin/echo");
+  sp::memory_image img(image.data(), image.size(), "echo");
+  // The image must survive the closing of the inherited fds
+  auto obuf = sp::check_output({"hello"}, sp::executable{img}, sp::close_fds{true});
+  assert(std::string(obuf.buf.data(), obuf.length) == "hello\n");
+
+  sp::Command cmd({"hello"}, sp::executable{img}, sp::close_fds{true});
+  obuf = sp::check_output(cmd);
+  assert(std::string(obuf.buf.data(), obuf.length) == "hello\n");
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifdef __linux__
+  test_memory_image_exec();
+  test_memory_image_env();
+  test_memory_image_close_fds();
+#endif
+  return 0;
+}
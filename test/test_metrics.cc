@@ -0,0 +1,211 @@
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+sp::ExeMetrics metrics_of(const std::string& exe)
+{
+  return sp::MetricsRegistry::global().snapshot()[exe];
+}
+
+void test_buckets()
+{
+  std::cout << "Test::test_buckets" << std::endl;
+  int prev = -1;
+  for (uint64_t us : {0ull, 1ull, 3ull, 4ull, 5ull, 7ull, 8ull, 100ull, 1000ull,
+                      123456ull, 1ull << 40}) {
+    int idx = sp::HistogramSnapshot::bucket_of(us);
+    assert(idx >= prev);
+    assert(us <= sp::HistogramSnapshot::upper_bound(idx) * 1e6 + 0.5);
+    // Within 25% of the value
+    assert(sp::HistogramSnapshot::upper_bound(idx) * 1e6 <= us * 1.25 + 1);
+    prev = idx;
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_exits()
+{
+  std::cout << "Test::test_exits" << std::endl;
+  auto before = metrics_of("sh");
+  for (int i = 0; i < 2; i++) {
+    auto p = sp::Popen({"sh", "-c", "exit 3"});
+    assert(p.wait() == 3);
+  }
+  auto q = sp::Popen({"sh", "-c", "sleep 0.05"});
+  q.wait();
+  auto after = metrics_of("sh");
+  if (!sp::METRICS_ENABLED) {
+    assert(after.spawns == 0);
+    std::cout << "END_TEST" << std::endl;
+    return;
+  }
+  assert(after.spawns - before.spawns == 3);
+  assert(after.exits[3] - before.exits[3] == 2);
+  assert(after.exits[0] - before.exits[0] == 1);
+  assert(after.live() == before.live());
+  if (sp::STATS_ENABLED) {
+    assert(after.wall_time.count - before.wall_time.count == 3);
+    assert(after.run_time.count - before.run_time.count == 3);
+    assert(after.wall_time.sum - before.wall_time.sum >= 0.05);
+    assert(after.wall_time.quantile(1) >= 0.05);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_failures()
+{
+  std::cout << "Test::test_failures" << std::endl;
+  bool thrown = false;
+  try {
+    auto p = sp::Popen({"/no/such/exe"});
+  } catch (const sp::CalledProcessError&) {
+    thrown = true;
+  }
+  assert(thrown);
+  auto m = metrics_of("exe");
+  if (sp::METRICS_ENABLED) {
+    assert(m.failures[ENOENT] == 1);
+    assert(m.spawns == 0 && m.live() == 0);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_live_and_signals()
+{
+  std::cout << "Test::test_live_and_signals" << std::endl;
+  auto before = metrics_of("sleep");
+  auto p = sp::Popen({"sleep", "10"});
+  auto running = metrics_of("sleep");
+  p.kill(SIGKILL);
+  p.wait();
+  auto after = metrics_of("sleep");
+  if (sp::METRICS_ENABLED) {
+    assert(running.live() == before.live() + 1);
+    assert(after.live() == before.live());
+    assert(after.signals[SIGKILL] - before.signals[SIGKILL] == 1);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_threads()
+{
+  std::cout << "Test::test_threads" << std::endl;
+  auto before = metrics_of("true");
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([] {
+      for (int j = 0; j < 5; j++) sp::Popen({"true"}).wait();
+    });
+  }
+  for (auto& t : threads) t.join();
+  // The exited threads were folded into the registry
+  sp::Command cmd({"true"});
+  sp::Popen(cmd).wait();
+  auto after = metrics_of("true");
+  if (sp::METRICS_ENABLED) {
+    assert(after.spawns - before.spawns == 21);
+    assert(after.exits[0] - before.exits[0] == 21);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_export()
+{
+  std::cout << "Test::test_export" << std::endl;
+  sp::Popen({"sh", "-c", "exit 0"}).wait();
+  auto& reg = sp::MetricsRegistry::global();
+  auto prom = reg.render(sp::METRICS_PROMETHEUS);
+  auto json = reg.render(sp::METRICS_JSON);
+  if (sp::METRICS_ENABLED) {
+    assert(prom.find("# TYPE subprocess_wall_seconds histogram") != std::string::npos);
+    assert(prom.find("subprocess_spawns_total{exe=\"sh\"}") != std::string::npos);
+    assert(prom.find("subprocess_spawn_failures_total{exe=\"exe\",errno=\"2\"} 1") !=
+           std::string::npos);
+    assert(prom.find("subprocess_wall_seconds_bucket{exe=\"sh\",le=\"+Inf\"}") !=
+           std::string::npos);
+    assert(json.find("\"sh\": {\"spawns\": ") != std::string::npos);
+  }
+
+  const char* path = "metrics.prom";
+  reg.write(path, sp::METRICS_PROMETHEUS);
+  std::ifstream in(path);
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  assert(text.find("# TYPE subprocess_spawns_total counter") != std::string::npos);
+  std::remove(path);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_shell_key()
+{
+  std::cout << "Test::test_shell_key" << std::endl;
+  auto before = metrics_of("sleep");
+  sp::Popen({"sleep 0.01; exit 2"}, sp::shell{true}).wait();
+  sp::Popen({"FOO=1 exit 0"}, sp::shell{true}).wait();
+  auto snap = sp::MetricsRegistry::global().snapshot();
+  if (sp::METRICS_ENABLED) {
+    assert(snap["sleep"].exits[2] - before.exits[2] == 1);
+    assert(snap.count("sh"));
+    for (auto& kv : snap) assert(kv.first.find(' ') == std::string::npos);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_fixed_buckets()
+{
+  std::cout << "Test::test_fixed_buckets" << std::endl;
+  sp::Popen({"true"}).wait();
+  sp::Popen({"sleep", "0.02"}).wait();
+  auto prom = sp::MetricsRegistry::global().render(sp::METRICS_PROMETHEUS);
+  auto rungs = [&prom](const std::string& exe) {
+    std::vector<std::string> res;
+    auto prefix = "subprocess_wall_seconds_bucket{exe=\"" + exe + "\",le=\"";
+    for (auto pos = prom.find(prefix); pos != std::string::npos;
+         pos = prom.find(prefix, pos + 1)) {
+      auto start = pos + prefix.size();
+      res.push_back(prom.substr(start, prom.find('"', start) - start));
+    }
+    return res;
+  };
+  if (sp::METRICS_ENABLED) {
+    auto a = rungs("true"), b = rungs("sleep");
+    assert(a.size() > 10 && a == b);
+    assert(a.back() == "+Inf");
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_name_cap()
+{
+  std::cout << "Test::test_name_cap" << std::endl;
+  auto& reg = sp::MetricsRegistry::global();
+  std::set<int> ids;
+  for (int i = 0; i < sp::MetricsRegistry::MAX_EXECUTABLES + 10; i++) {
+    ids.insert(reg.id_of("/opt/bin/tool" + std::to_string(i)));
+  }
+  int other = reg.id_of("beyond-the-cap");
+  assert(static_cast<int>(ids.size()) <= sp::MetricsRegistry::MAX_EXECUTABLES + 1);
+  assert(ids.count(other));
+  assert(reg.id_of("another-one") == other);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_buckets();
+  test_exits();
+  test_failures();
+  test_live_and_signals();
+  test_threads();
+  test_export();
+  test_shell_key();
+  test_fixed_buckets();
+  test_name_cap();
+#endif
+  return 0;
+}
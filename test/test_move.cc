@@ -0,0 +1,64 @@
+#include <iostream>
+#include <type_traits>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+static_assert(std::is_nothrow_move_constructible<sp::Popen>::value,
+              "Popen must be cheaply movable");
+static_assert(!std::is_copy_constructible<sp::Popen>::value,
+              "Popen must not be copyable");
+
+#ifndef __USING_WINDOWS__
+void test_move_in_vector()
+{
+  std::cout << "Test::test_move_in_vector" << std::endl;
+  // No reserve: the vector reallocates and moves the live handles
+  std::vector<sp::Popen> procs;
+  for (int i = 0; i < 40; i++) {
+    procs.emplace_back(std::vector<std::string>{"cat"},
+                       sp::input{sp::PIPE}, sp::output{sp::PIPE});
+  }
+  for (size_t i = 0; i < procs.size(); i++) {
+    auto msg = "proc " + std::to_string(i);
+    auto out = procs[i].communicate(msg).first;
+    assert(std::string(out.buf.data(), out.length) == msg);
+    assert(procs[i].retcode() == 0);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_move_assign()
+{
+  std::cout << "Test::test_move_assign" << std::endl;
+  auto p = sp::Popen({"echo", "first"}, sp::output{sp::PIPE});
+  auto q = sp::Popen({"echo", "second"}, sp::output{sp::PIPE});
+  p.wait();
+  p = std::move(q);
+  auto out = p.communicate().first;
+  assert(std::string(out.buf.data(), out.length) == "second\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_move_deferred()
+{
+  std::cout << "Test::test_move_deferred" << std::endl;
+  // Spawn settings travel with the moved handle
+  auto p = sp::Popen({"pwd"}, sp::cwd{"/tmp"}, sp::output{sp::PIPE},
+                     sp::defer_spawn{true});
+  sp::Popen q(std::move(p));
+  q.start_process();
+  auto out = q.communicate().first;
+  assert(std::string(out.buf.data(), out.length) == "/tmp\n");
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_move_in_vector();
+  test_move_assign();
+  test_move_deferred();
+#endif
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <string>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+static std::string make_records(int n)
+{
+  std::string data;
+  for (int i = 0; i < n; i++) data += "record-" + std::to_string(i) + "\n";
+  return data;
+}
+
+void test_parallel_pipe_order()
+{
+  std::cout << "Test::test_parallel_pipe_order" << std::endl;
+  auto data = make_records(2000);
+  auto obuf = sp::parallel_pipe({"cat"}, data.data(), data.size(), 4, 1024);
+  assert(obuf.length == data.size());
+  assert(std::string(obuf.buf.data(), obuf.length) == data);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_parallel_pipe_round_robin()
+{
+  std::cout << "Test::test_parallel_pipe_round_robin" << std::endl;
+  auto data = make_records(500);
+  // Every block must be cut on a record boundary,
+  // so each child counts only whole lines.
+  auto obuf = sp::parallel_pipe({"wc", "-l"}, data.data(), data.size(),
+                                3, 700, '\n', sp::ROUND_ROBIN);
+  std::string out(obuf.buf.data(), obuf.length);
+  int total = 0;
+  for (auto& n : sp::util::split(out, "\n")) {
+    if (n.size()) total += std::stoi(n);
+  }
+  assert(total == 500);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_parallel_pipe_file()
+{
+  std::cout << "Test::test_parallel_pipe_file" << std::endl;
+  auto data = make_records(3000);
+  FILE* fp = fopen("parallel_input.txt", "w");
+  fwrite(data.data(), 1, data.size(), fp);
+  fclose(fp);
+
+  auto obuf = sp::parallel_pipe_file({"cat"}, "parallel_input.txt", 2, 4096);
+  assert(obuf.length == data.size());
+  assert(std::string(obuf.buf.data(), obuf.length) == data);
+  std::remove("parallel_input.txt");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_parallel_pipe_early_exit()
+{
+  std::cout << "Test::test_parallel_pipe_early_exit" << std::endl;
+  // Each child stops reading long before its block is written
+  auto data = make_records(300000);
+  auto obuf = sp::parallel_pipe({"head", "-c", "1"}, data.data(), data.size(), 2, 1 << 20);
+  assert(obuf.length == (data.size() + (1 << 20) - 1) >> 20);
+
+  FILE* fp = fopen("parallel_early.txt", "w");
+  fwrite(data.data(), 1, data.size(), fp);
+  fclose(fp);
+  obuf = sp::parallel_pipe_file({"head", "-c", "1"}, "parallel_early.txt", 2, 1 << 20);
+  std::remove("parallel_early.txt");
+  assert(obuf.length == (data.size() + (1 << 20) - 1) >> 20);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_parallel_pipe_failure()
+{
+  std::cout << "Test::test_parallel_pipe_failure" << std::endl;
+  auto data = make_records(10);
+  bool caught = false;
+  try {
+    sp::parallel_pipe({"grep", "no-such-record"}, data.data(), data.size(), 2);
+  } catch (sp::CalledProcessError& e) {
+    assert(e.retcode == 1);
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_parallel_pipe_controller()
+{
+  std::cout << "Test::test_parallel_pipe_controller" << std::endl;
+  auto hp = sp::util::read_host_pressure();
+  // Fields which could not be read are -1
+  assert(hp.load1 >= -1 && hp.cpu_some >= -1 && hp.mem_available_kb >= -1);
+
+  // Make every sample look overloaded so that the limit
+  // is driven down to the minimum.
+  sp::LoadThresholds th;
+  th.max_latency = 1e-9;
+  sp::ConcurrencyController ctrl(1, 8, th);
+  ctrl.set_sample_interval(std::chrono::milliseconds(0));
+  assert(ctrl.limit() == 8);
+
+  auto data = make_records(1000);
+  auto obuf = sp::parallel_pipe({"cat"}, data.data(), data.size(), ctrl, 512);
+  assert(std::string(obuf.buf.data(), obuf.length) == data);
+  assert(ctrl.limit() == 1);
+  assert(ctrl.running() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_parallel_pipe_order();
+  test_parallel_pipe_round_robin();
+  test_parallel_pipe_file();
+  test_parallel_pipe_failure();
+  test_parallel_pipe_early_exit();
+  test_parallel_pipe_controller();
+#endif
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+static std::string drain(int fd)
+{
+  std::string out;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) out.append(buf, n);
+  close(fd);
+  return out;
+}
+
+void test_pass_fds_remap()
+{
+  std::cout << "Test::test_pass_fds_remap" << std::endl;
+  int fds[2];
+  assert(pipe(fds) == 0);
+
+  auto p = sp::Popen({"/bin/sh", "-c", "echo hello >&7"},
+                     sp::pass_fds{{fds[1], 7}}, sp::close_fds{true});
+  close(fds[1]);
+  assert(p.wait() == 0);
+  assert(drain(fds[0]) == "hello\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_pass_fds_swap()
+{
+  std::cout << "Test::test_pass_fds_swap" << std::endl;
+  // Each source is the other entry's target
+  int a[2], b[2];
+  assert(pipe(a) == 0 && pipe(b) == 0);
+  std::string cmd = "echo one >&" + std::to_string(b[1]) +
+                    "; echo two >&" + std::to_string(a[1]);
+
+  auto p = sp::Popen({"/bin/sh", "-c", cmd.c_str()},
+                     sp::pass_fds{{a[1], b[1]}, {b[1], a[1]}});
+  close(a[1]);
+  close(b[1]);
+  assert(p.wait() == 0);
+  assert(drain(a[0]) == "one\n");
+  assert(drain(b[0]) == "two\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_pass_fds_invalid()
+{
+  std::cout << "Test::test_pass_fds_invalid" << std::endl;
+  bool caught = false;
+  try {
+    sp::Popen({"true"}, sp::pass_fds{{5, 1}});
+  } catch (std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_pass_fds_remap();
+  test_pass_fds_swap();
+  test_pass_fds_invalid();
+#endif
+  return 0;
+}
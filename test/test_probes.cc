@@ -0,0 +1,167 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifdef SUBPROCESS_HAVE_PROBES
+// Hits of the probe `name`, in order
+std::vector<ProbeHit> hits_of(const std::string& name)
+{
+  std::lock_guard<std::mutex> lk(probe_mutex());
+  std::vector<ProbeHit> res;
+  for (auto& h : probe_hits()) {
+    if (h.name == name) res.push_back(h);
+  }
+  return res;
+}
+
+void clear_hits()
+{
+  std::lock_guard<std::mutex> lk(probe_mutex());
+  probe_hits().clear();
+}
+
+void test_spawn_and_exit()
+{
+  std::cout << "Test::test_spawn_and_exit" << std::endl;
+  clear_hits();
+  auto p = sp::Popen({"sh", "-c", "exit 4"});
+  auto pid = std::to_string(p.pid());
+  assert(p.wait() == 4);
+
+  auto spawns = hits_of("spawn");
+  assert(spawns.size() == 1);
+  assert(spawns[0].args[0] == pid);
+  assert(spawns[0].args[1].find("sh") != std::string::npos);
+  auto exits = hits_of("exit");
+  assert(exits.size() == 1);
+  assert(exits[0].args[0] == pid);
+  assert(exits[0].args[1] == "4" && exits[0].args[2] == "0");
+  if (sp::STATS_ENABLED) {
+    assert(std::stoll(spawns[0].args[2]) >= 0);
+    assert(std::stoll(exits[0].args[3]) >= std::stoll(spawns[0].args[2]));
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_signaled()
+{
+  std::cout << "Test::test_signaled" << std::endl;
+  clear_hits();
+  auto p = sp::Popen({"sleep", "10"});
+  p.kill(SIGKILL);
+  p.wait();
+  auto exits = hits_of("exit");
+  assert(exits.size() == 1);
+  assert(exits[0].args[1] == std::to_string(SIGKILL) && exits[0].args[2] == "1");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_failure()
+{
+  std::cout << "Test::test_failure" << std::endl;
+  clear_hits();
+  bool thrown = false;
+  try {
+    auto p = sp::Popen({"/no/such/exe"});
+  } catch (const sp::CalledProcessError&) {
+    thrown = true;
+  }
+  assert(thrown);
+  auto fails = hits_of("spawn__failure");
+  assert(fails.size() == 1);
+  assert(fails[0].args[1] == "/no/such/exe");
+  assert(fails[0].args[3] == std::to_string(ENOENT));
+  assert(hits_of("spawn").empty());
+
+  clear_hits();
+  sp::Command cmd({"/no/such/exe"});
+  thrown = false;
+  try {
+    auto p = sp::Popen(cmd);
+  } catch (const std::exception&) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(hits_of("spawn__failure").size() == 1);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_io()
+{
+  std::cout << "Test::test_io" << std::endl;
+  clear_hits();
+  auto p = sp::Popen({"echo", "hello"}, sp::output{sp::PIPE});
+  auto out = p.communicate().first;
+  auto reads = hits_of("read");
+  assert(reads.size() == 1);
+  assert(reads[0].args[1] == "6" && std::stoll(reads[0].args[2]) >= 0);
+
+  auto q = sp::Popen({"cat"}, sp::input{sp::PIPE}, sp::output{"/dev/null"});
+  q.send("abcd", 4);
+  q.close_input();
+  q.wait();
+  auto sends = hits_of("send");
+  assert(sends.size() == 1 && sends[0].args[1] == "4");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command()
+{
+  std::cout << "Test::test_command" << std::endl;
+  clear_hits();
+  sp::Command cmd({"true"});
+  sp::Popen(cmd).wait();
+  auto spawns = hits_of("spawn");
+  assert(spawns.size() == 1);
+  assert(spawns[0].args[1].find("true") != std::string::npos);
+  assert(hits_of("exit").size() == 1);
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifdef _SDT_HAS_SEMAPHORES
+// Stands for a tracer attaching to all the probes, or detaching
+void set_semaphores(unsigned short value)
+{
+  subprocess_spawn_semaphore = value;
+  subprocess_spawn__failure_semaphore = value;
+  subprocess_child__error_semaphore = value;
+  subprocess_exit_semaphore = value;
+  subprocess_read_semaphore = value;
+  subprocess_send_semaphore = value;
+}
+
+void test_semaphores()
+{
+  std::cout << "Test::test_semaphores" << std::endl;
+  clear_hits();
+  set_semaphores(0);
+  auto p = sp::Popen({"echo", "hello"}, sp::output{sp::PIPE});
+  p.communicate();
+  assert(probe_hits().empty());
+
+  subprocess_exit_semaphore = 1;
+  sp::Popen({"true"}).wait();
+  assert(probe_hits().size() == 1 && hits_of("exit").size() == 1);
+  set_semaphores(1);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+#endif
+
+int main() {
+#ifdef SUBPROCESS_HAVE_PROBES
+#ifdef _SDT_HAS_SEMAPHORES
+  set_semaphores(1);
+#endif
+  test_spawn_and_exit();
+  test_signaled();
+  test_failure();
+  test_io();
+  test_command();
+#ifdef _SDT_HAS_SEMAPHORES
+  test_semaphores();
+#endif
+#endif
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include <iostream>
+#include <fstream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+// Field `n` of /proc/<pid>/stat, counting the pid as 1
+static long stat_field(const std::string& stat, int n)
+{
+  std::istringstream in(stat.substr(stat.rfind(')') + 2));
+  std::string tok;
+  for (int i = 3; i <= n; i++) in >> tok;
+  return std::stol(tok);
+}
+
+// Zombies count as dead, init may be slow to reap orphans
+static bool alive(int pid)
+{
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if (!std::getline(in, stat)) return false;
+  return stat.substr(stat.rfind(')') + 2, 1) != "Z";
+}
+
+void test_new_group()
+{
+  std::cout << "Test::test_new_group" << std::endl;
+  auto p = sp::Popen({"cat", "/proc/self/stat"}, sp::output{sp::PIPE},
+                     sp::process_group{});
+  auto out = p.communicate().first;
+  std::string stat(out.buf.data(), out.length);
+  assert(stat_field(stat, 5) == p.pid());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_join_group()
+{
+  std::cout << "Test::test_join_group" << std::endl;
+  auto leader = sp::Popen({"sleep", "10"}, sp::process_group{});
+  auto p = sp::Popen({"cat", "/proc/self/stat"}, sp::output{sp::PIPE},
+                     sp::process_group{leader.pid()});
+  auto out = p.communicate().first;
+  assert(stat_field(std::string(out.buf.data(), out.length), 5) == leader.pid());
+  leader.kill(SIGKILL);
+  leader.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_group_kill()
+{
+  std::cout << "Test::test_group_kill" << std::endl;
+  // The grandchild only dies with its group
+  auto p = sp::Popen({"sh", "-c", "sleep 30 & echo $!; wait"},
+                     sp::output{sp::PIPE}, sp::process_group{});
+  char line[32] = {0};
+  assert(fgets(line, sizeof(line), p.output()));
+  int grandchild = std::atoi(line);
+  p.kill(SIGTERM);
+  p.wait();
+  for (int i = 0; i < 200 && alive(grandchild); i++) usleep(5000);
+  assert(!alive(grandchild));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_grouped_pipeline()
+{
+  std::cout << "Test::test_grouped_pipeline" << std::endl;
+  auto out = sp::pipeline(sp::process_group{}, "cat /proc/self/stat", "cat");
+  std::string stat(out.buf.data(), out.length);
+  assert(stat_field(stat, 5) == std::stol(stat));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_bad_combination()
+{
+  std::cout << "Test::test_bad_combination" << std::endl;
+  try {
+    sp::Popen({"true"}, sp::process_group{}, sp::session_leader{true});
+    assert(false);
+  } catch (const std::runtime_error&) {
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifdef __linux__
+void test_pdeathsig()
+{
+  std::cout << "Test::test_pdeathsig" << std::endl;
+  auto p = sp::Popen({"cat", "/proc/self/status"}, sp::output{sp::PIPE},
+                     sp::pdeathsig{SIGTERM});
+  auto out = p.communicate().first;
+  // PDEATHSIG survives exec; it is not listed in status, so just
+  // check the child ran with the option set
+  assert(out.length > 0);
+  assert(p.retcode() == 0);
+
+  // Through a Command as well
+  sp::Command cmd({"true"}, sp::pdeathsig{});
+  assert(sp::call(cmd) == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_pdeathsig_fires()
+{
+  std::cout << "Test::test_pdeathsig_fires" << std::endl;
+  // The middle process spawns a child with pdeathsig and exits
+  int fds[2];
+  assert(pipe(fds) == 0);
+  pid_t mid = fork();
+  if (mid == 0) {
+    close(fds[0]);
+    auto p = sp::Popen({"sleep", "30"}, sp::pdeathsig{SIGKILL});
+    dprintf(fds[1], "%d\n", p.pid());
+    _exit(0);
+  }
+  close(fds[1]);
+  char line[32] = {0};
+  assert(read(fds[0], line, sizeof(line) - 1) > 0);
+  close(fds[0]);
+  waitpid(mid, nullptr, 0);
+  int orphan = std::atoi(line);
+  for (int i = 0; i < 200 && alive(orphan); i++) usleep(5000);
+  assert(!alive(orphan));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_tree()
+{
+  std::cout << "Test::test_kill_tree" << std::endl;
+  sp::set_child_subreaper();
+  // No group: a plain kill() would leave the descendants running
+  auto p = sp::Popen({"sh", "-c", "sh -c 'sleep 30 & echo $!; wait' & wait"},
+                     sp::output{sp::PIPE});
+  char line[32] = {0};
+  assert(fgets(line, sizeof(line), p.output()));
+  int grandchild = std::atoi(line);
+  assert(alive(grandchild));
+  assert(p.kill_tree() == SIGKILL);
+  // Reaped here as this process is a subreaper
+  assert(!alive(grandchild));
+  assert(sp::util::list_descendants(getpid()).empty());
+  sp::set_child_subreaper(false);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_tree_orphans()
+{
+  std::cout << "Test::test_kill_tree_orphans" << std::endl;
+  sp::set_child_subreaper();
+  auto other = sp::Popen({"sleep", "30"});
+  // The middle shell exits, its child is handed to this process
+  auto p = sp::Popen({"sh", "-c", "sh -c 'sleep 30 & echo $!'; exec sleep 30"},
+                     sp::output{sp::PIPE});
+  char line[32] = {0};
+  assert(fgets(line, sizeof(line), p.output()));
+  int orphan = std::atoi(line);
+  std::string stat;
+  for (int i = 0; i < 200; i++) {
+    std::ifstream in("/proc/" + std::to_string(orphan) + "/stat");
+    assert(std::getline(in, stat));
+    if (stat_field(stat, 4) == getpid()) break;
+    usleep(5000);
+  }
+  assert(stat_field(stat, 4) == getpid());
+
+  assert(p.kill_tree() == SIGKILL);
+  assert(!alive(orphan));
+  // The child of another Popen is left alone
+  assert(alive(other.pid()));
+  other.kill(SIGKILL);
+  other.wait();
+  sp::set_child_subreaper(false);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_tree_unspawned()
+{
+  std::cout << "Test::test_kill_tree_unspawned" << std::endl;
+  auto p = sp::Popen({"sleep", "1"}, sp::defer_spawn{true});
+  // Must not turn into a kill(-1)
+  assert(p.kill_tree() == -1);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_new_group();
+  test_join_group();
+  test_group_kill();
+  test_grouped_pipeline();
+  test_bad_combination();
+#ifdef __linux__
+  test_pdeathsig();
+  test_pdeathsig_fires();
+  test_kill_tree();
+  test_kill_tree_orphans();
+  test_kill_tree_unspawned();
+#endif
+#endif
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+static std::string str(const sp::Buffer& buf)
+{
+  return std::string(buf.buf.data(), buf.length);
+}
+
+void test_nofile()
+{
+  std::cout << "Test::test_nofile" << std::endl;
+  auto out = sp::check_output({"sh", "-c", "ulimit -n"},
+                              sp::rlimits{{RLIMIT_NOFILE, 64}});
+  assert(str(out) == "64\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_limits()
+{
+  std::cout << "Test::test_command_limits" << std::endl;
+  sp::Command cmd({"sh", "-c", "ulimit -c; ulimit -Hn"},
+                  sp::rlimits{{RLIMIT_CORE, 0}, {RLIMIT_NOFILE, 32, 48}});
+  assert(str(sp::check_output(cmd)) == "0\n48\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_cpu_limit()
+{
+  std::cout << "Test::test_cpu_limit" << std::endl;
+  // SIGXCPU at the soft limit, well before the hard one
+  auto p = sp::Popen({"sh", "-c", "while :; do :; done"},
+                     sp::rlimits{{RLIMIT_CPU, 1, 2}});
+  assert(p.wait() == SIGXCPU);
+  assert(p.exceeded_rlimit() == RLIMIT_CPU);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_cpu_hard_limit()
+{
+  std::cout << "Test::test_cpu_hard_limit" << std::endl;
+  // SIGKILL straight away, the CPU time in the rusage
+  // may be reported short of the limit
+  auto p = sp::Popen({"sh", "-c", "while :; do :; done"},
+                     sp::rlimits{{RLIMIT_CPU, 1}});
+  assert(p.wait() == SIGKILL);
+  assert(p.exceeded_rlimit() == RLIMIT_CPU);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_fsize_limit()
+{
+  std::cout << "Test::test_fsize_limit" << std::endl;
+  auto p = sp::Popen({"dd", "if=/dev/zero", "of=rlimit_fsize.txt", "bs=1000", "count=10"},
+                     sp::error{sp::PIPE}, sp::rlimits{{RLIMIT_FSIZE, 4000}});
+  assert(p.wait() == SIGXFSZ);
+  assert(p.exceeded_rlimit() == RLIMIT_FSIZE);
+  remove("rlimit_fsize.txt");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_not_exceeded()
+{
+  std::cout << "Test::test_not_exceeded" << std::endl;
+  auto p = sp::Popen({"sleep", "10"}, sp::rlimits{{RLIMIT_CPU, 10}});
+  p.kill(SIGKILL);
+  assert(p.wait() == SIGKILL);
+  assert(p.exceeded_rlimit() == -1);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_bad_limits()
+{
+  std::cout << "Test::test_bad_limits" << std::endl;
+  try {
+    sp::rlimits{{RLIMIT_CPU, 10, 5}};
+    assert(false);
+  } catch (const std::runtime_error&) {
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_nofile();
+  test_command_limits();
+  test_cpu_limit();
+  test_cpu_hard_limit();
+  test_fsize_limit();
+  test_not_exceeded();
+  test_bad_limits();
+#endif
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+using namespace std::chrono;
+
+#ifndef __USING_WINDOWS__
+// Keeps the CPU busy for a while
+static const char* spin = "i=0; while [ $i -lt 300000 ]; do i=$((i+1)); done";
+
+void test_wait_usage()
+{
+  std::cout << "Test::test_wait_usage" << std::endl;
+  auto p = sp::Popen({"sh", "-c", spin});
+  assert(p.resource_usage().cpu_time() == 0);
+  assert(p.wait() == 0);
+  auto& ru = p.resource_usage();
+  assert(ru.user_time > 0);
+  assert(ru.max_rss_kb > 0);
+  assert(ru.minor_faults > 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_poll_usage()
+{
+  std::cout << "Test::test_poll_usage" << std::endl;
+  auto p = sp::Popen({"sh", "-c", spin});
+  while (p.poll() == -1) std::this_thread::sleep_for(milliseconds(10));
+  assert(p.resource_usage().cpu_time() > 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_try_usage()
+{
+  std::cout << "Test::test_try_usage" << std::endl;
+  auto res = sp::try_check_output({"sh", "-c", spin});
+  assert(res.ok());
+  assert(res.usage.cpu_time() > 0);
+  assert(res.usage.max_rss_kb > 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifdef __linux__
+void test_sampler()
+{
+  std::cout << "Test::test_sampler" << std::endl;
+  auto p = sp::Popen({"sleep", "0.3"});
+  sp::ResourceSampler smp(p, milliseconds(20));
+  assert(p.wait() == 0);
+  smp.stop();
+  assert(smp.samples() > 0);
+  assert(smp.last().rss_kb > 0);
+  assert(smp.peak().threads == 1);
+  assert(!smp.tripped());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_watchdog_rss()
+{
+  std::cout << "Test::test_watchdog_rss" << std::endl;
+  sp::WatchdogLimits lim;
+  lim.max_rss_kb = 1;
+  auto start = steady_clock::now();
+  auto p = sp::Popen({"sleep", "10"});
+  sp::ResourceSampler smp(p, milliseconds(20), lim);
+  assert(p.wait() == SIGKILL);
+  assert(smp.tripped());
+  assert(steady_clock::now() - start < seconds(5));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_watchdog_cpu()
+{
+  std::cout << "Test::test_watchdog_cpu" << std::endl;
+  sp::WatchdogLimits lim;
+  lim.max_cpu_time = 0.1;
+  lim.signal = SIGTERM;
+  auto p = sp::Popen({"sh", "-c", "while :; do :; done"});
+  sp::ResourceSampler smp(p, milliseconds(20), lim);
+  assert(p.wait() == SIGTERM);
+  assert(smp.tripped());
+  assert(p.resource_usage().cpu_time() >= 0.1);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_wait_usage();
+  test_poll_usage();
+  test_try_usage();
+#ifdef __linux__
+  test_sampler();
+  test_watchdog_rss();
+  test_watchdog_cpu();
+#endif
+#endif
+  return 0;
+}
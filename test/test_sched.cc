@@ -0,0 +1,126 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+void test_niceness()
+{
+  std::cout << "Test::test_niceness" << std::endl;
+  auto p = sp::Popen({"sleep", "10"}, sp::niceness{7});
+  errno = 0;
+  assert(getpriority(PRIO_PROCESS, p.pid()) == 7 && errno == 0);
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifdef __linux__
+static std::vector<int> affinity_of(int pid)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  assert(sched_getaffinity(pid, sizeof(set), &set) == 0);
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+void test_affinity()
+{
+  std::cout << "Test::test_affinity" << std::endl;
+  int first = affinity_of(0).front();
+  auto p = sp::Popen({"sleep", "10"}, sp::cpu_affinity{first});
+  assert(affinity_of(p.pid()) == std::vector<int>{first});
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_spread()
+{
+  std::cout << "Test::test_spread" << std::endl;
+  auto allowed = affinity_of(0);
+  assert(sp::cpu_affinity::spread(0, 1).cpus_ == allowed);
+
+  // The slices cover the CPUs once
+  size_t n = std::max<size_t>(allowed.size() / 2, 1);
+  std::vector<int> all;
+  for (size_t i = 0; i < n; i++) {
+    auto cpus = sp::cpu_affinity::spread(i, n).cpus_;
+    assert(!cpus.empty());
+    all.insert(all.end(), cpus.begin(), cpus.end());
+  }
+  assert(all == allowed);
+
+  // More children than CPUs share them
+  auto many = sp::cpu_affinity::spread(allowed.size(), allowed.size() + 1).cpus_;
+  assert(many.size() == 1);
+
+  auto node = sp::cpu_affinity::spread_numa(0).cpus_;
+  assert(!node.empty());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_sched_policy()
+{
+  std::cout << "Test::test_sched_policy" << std::endl;
+  auto p = sp::Popen({"sleep", "10"}, sp::sched_policy{SCHED_IDLE});
+  assert(sched_getscheduler(p.pid()) == SCHED_IDLE);
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_io_priority()
+{
+  std::cout << "Test::test_io_priority" << std::endl;
+  auto p = sp::Popen({"sleep", "10"}, sp::io_priority{sp::IO_CLASS_BE, 6});
+  assert(syscall(SYS_ioprio_get, 1, p.pid()) == ((sp::IO_CLASS_BE << 13) | 6));
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_placement()
+{
+  std::cout << "Test::test_command_placement" << std::endl;
+  sp::Command cmd({"sleep", "10"}, sp::sched_policy{SCHED_BATCH});
+  // Per spawn options add to the ones of the command
+  int first = affinity_of(0).front();
+  auto p = sp::Popen(cmd, sp::niceness{3}, sp::cpu_affinity{first});
+  assert(sched_getscheduler(p.pid()) == SCHED_BATCH);
+  assert(getpriority(PRIO_PROCESS, p.pid()) == 3);
+  assert(affinity_of(p.pid()) == std::vector<int>{first});
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_bad_placement()
+{
+  std::cout << "Test::test_bad_placement" << std::endl;
+  auto res = sp::try_call({"true"}, sp::sched_policy{12345});
+  assert(res.error.stage == sp::SPAWN_SCHED);
+  assert(res.error.message().find("scheduling setup failed") == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_niceness();
+#ifdef __linux__
+  test_affinity();
+  test_spread();
+  test_sched_policy();
+  test_io_priority();
+  test_command_placement();
+  test_bad_placement();
+#endif
+#endif
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+void test_split_simple_command()
+{
+  std::cout << "Test::test_split_simple_command" << std::endl;
+  auto words = sp::util::split_simple_command("  ls\t-l  /tmp ");
+  assert((words == std::vector<std::string>{"ls", "-l", "/tmp"}));
+
+  assert(sp::util::split_simple_command("echo $HOME").empty());
+  assert(sp::util::split_simple_command("ls | wc -l").empty());
+  assert(sp::util::split_simple_command("echo 'a  b'").empty());
+  assert(sp::util::split_simple_command("ls *.cc").empty());
+  assert(sp::util::split_simple_command("cat < in").empty());
+  assert(sp::util::split_simple_command("true # comment").empty());
+  assert(sp::util::split_simple_command("cd /").empty());
+  assert(sp::util::split_simple_command("exit 3").empty());
+  assert(sp::util::split_simple_command("FOO=1 env").empty());
+  assert(sp::util::split_simple_command("   ").empty());
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_fast_path_output()
+{
+  std::cout << "Test::test_fast_path_output" << std::endl;
+  auto p = sp::Popen("echo hello   world", sp::shell{true}, sp::output{sp::PIPE});
+  auto out = p.communicate().first;
+  assert(std::string(out.buf.data(), out.length) == "hello world\n");
+  assert(p.retcode() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_shell_still_used()
+{
+  std::cout << "Test::test_shell_still_used" << std::endl;
+  auto out = sp::check_output("echo a | tr a b", sp::shell{true});
+  assert(std::string(out.buf.data(), out.length) == "b\n");
+
+  auto p = sp::Popen("exit 3", sp::shell{true});
+  assert(p.wait() == 3);
+
+  auto q = sp::Popen("FOO=bar env", sp::shell{true}, sp::output{sp::PIPE});
+  auto env = q.communicate().first;
+  assert(std::string(env.buf.data(), env.length).find("FOO=bar\n") != std::string::npos);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_missing_command()
+{
+  std::cout << "Test::test_missing_command" << std::endl;
+  // Not on PATH: the shell runs and reports "not found"
+  auto p = sp::Popen("no-such-command-xyz arg", sp::shell{true},
+                     sp::error{sp::PIPE});
+  p.communicate();
+  assert(p.retcode() == 127);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_fast_path()
+{
+  std::cout << "Test::test_command_fast_path" << std::endl;
+  sp::Command cmd("echo planned", sp::shell{true});
+  assert(cmd.path() != "/bin/sh");
+  auto out = sp::check_output(cmd);
+  assert(std::string(out.buf.data(), out.length) == "planned\n");
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_split_simple_command();
+  test_fast_path_output();
+  test_shell_still_used();
+  test_missing_command();
+  test_command_fast_path();
+#endif
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <cstring>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifdef __linux__
+// The child side: echo the input ring back, upper-cased
+static int echo_child()
+{
+  auto ch = sp::ShmChannel::attach_from_env();
+  char buf[4096];
+  size_t n;
+  while ((n = ch->input().read(buf, sizeof(buf)))) {
+    for (size_t i = 0; i < n; i++) buf[i] = toupper(buf[i]);
+    ch->output().write(buf, n);
+  }
+  ch->output().close();
+  return 0;
+}
+
+void test_shm_echo()
+{
+  std::cout << "Test::test_shm_echo" << std::endl;
+  // Small ring so that both sides wrap around and block
+  auto p = sp::Popen({"/proc/self/exe", "child"}, sp::shm_channel{8192});
+  assert(p.shm_input() && p.shm_output());
+
+  std::string data;
+  for (int i = 0; i < 100000; i++) data += "record-" + std::to_string(i) + "\n";
+
+  auto fut = std::async(std::launch::async, [&] {
+    size_t n = p.shm_input()->write(data.data(), data.size());
+    p.shm_input()->close();
+    return n;
+  });
+
+  std::string got(data.size(), '\0');
+  assert(p.shm_output()->read_n(&got[0], got.size()) == data.size());
+  assert(fut.get() == data.size());
+
+  char extra;
+  assert(p.shm_output()->read(&extra, 1) == 0);
+  assert(p.wait() == 0);
+
+  for (auto& c : data) c = toupper(c);
+  assert(got == data);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_shm_peer_exit()
+{
+  std::cout << "Test::test_shm_peer_exit" << std::endl;
+  // A child that never touches the channel must not hang the reader
+  auto p = sp::Popen({"true"}, sp::shm_channel{});
+  char buf[16];
+  assert(p.shm_output()->read(buf, sizeof(buf)) == 0);
+  assert(p.wait() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_shm_no_channel()
+{
+  std::cout << "Test::test_shm_no_channel" << std::endl;
+  auto p = sp::Popen({"true"});
+  assert(p.shm_input() == nullptr);
+  p.wait();
+  bool caught = false;
+  try {
+    sp::ShmChannel::attach_from_env();
+  } catch (std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+#ifdef __linux__
+  if (argc > 1 && strcmp(argv[1], "child") == 0) return echo_child();
+  test_shm_echo();
+  test_shm_peer_exit();
+  test_shm_no_channel();
+#endif
+  return 0;
+}
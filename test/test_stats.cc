@@ -0,0 +1,88 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+using namespace std::chrono;
+
+using stamp = sp::SpawnStats::time_point;
+
+void test_phases()
+{
+  std::cout << "Test::test_phases" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "sleep 0.1; echo hello"}, sp::output{sp::PIPE});
+  auto out = p.communicate().first;
+  auto& st = p.stats();
+  if (!sp::STATS_ENABLED) {
+    assert(st.start == stamp() && st.bytes_out == 0);
+    std::cout << "END_TEST" << std::endl;
+    return;
+  }
+  assert(st.start != stamp());
+  assert(st.start <= st.forked && st.forked <= st.exec);
+  assert(st.exec <= st.first_byte && st.first_byte <= st.eof);
+  assert(st.eof <= st.reaped);
+  // The child slept before writing
+  assert(sp::SpawnStats::seconds(st.exec, st.first_byte) >= 0.09);
+  assert(st.bytes_out == out.length && st.bytes_out == 6);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_byte_counts()
+{
+  std::cout << "Test::test_byte_counts" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "cat; echo oops >&2"}, sp::input{sp::PIPE},
+                     sp::output{sp::PIPE}, sp::error{sp::PIPE});
+  p.send("abc", 3);
+  auto res = p.communicate("defg", 4);
+  auto& st = p.stats();
+  assert(res.first.length == 7);
+  if (sp::STATS_ENABLED) {
+    assert(st.bytes_in == 7);
+    assert(st.bytes_out == 7);
+    assert(st.bytes_err == 5);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+#ifndef __USING_WINDOWS__
+void test_timed_communicate()
+{
+  std::cout << "Test::test_timed_communicate" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "echo out; echo error >&2"},
+                     sp::output{sp::PIPE}, sp::error{sp::PIPE});
+  p.communicate(seconds(5));
+  auto& st = p.stats();
+  if (sp::STATS_ENABLED) {
+    assert(st.bytes_out == 4 && st.bytes_err == 6);
+    assert(st.first_byte != stamp() && st.eof >= st.first_byte);
+    assert(st.reaped != stamp());
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_command_phases()
+{
+  std::cout << "Test::test_command_phases" << std::endl;
+  sp::Command cmd({"true"});
+  auto p = sp::Popen(cmd);
+  p.wait();
+  auto& st = p.stats();
+  if (sp::STATS_ENABLED) {
+    assert(sp::SpawnStats::seconds(st.start, st.exec) >= 0);
+    assert(sp::SpawnStats::seconds(st.exec, st.reaped) >= 0);
+    // Nothing was read
+    assert(sp::SpawnStats::seconds(st.exec, st.first_byte) == -1);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+  test_phases();
+  test_byte_counts();
+#ifndef __USING_WINDOWS__
+  test_timed_communicate();
+  test_command_phases();
+#endif
+  return 0;
+}
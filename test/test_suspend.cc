@@ -0,0 +1,162 @@
+#include <iostream>
+#include <fstream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+using namespace std::chrono;
+
+#ifndef __USING_WINDOWS__
+// State letter of /proc/<pid>/stat, 'T' when stopped
+static char state_of(int pid)
+{
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  std::getline(in, stat);
+  return stat[stat.rfind(')') + 2];
+}
+
+static bool wait_state(int pid, char state)
+{
+  for (int i = 0; i < 200; i++) {
+    if (state_of(pid) == state) return true;
+    std::this_thread::sleep_for(milliseconds(5));
+  }
+  return false;
+}
+
+void test_suspend_resume()
+{
+  std::cout << "Test::test_suspend_resume" << std::endl;
+  auto p = sp::Popen({"sleep", "0.2"});
+  p.suspend();
+  assert(p.suspended());
+  assert(wait_state(p.pid(), 'T'));
+  // Stopped, so it cannot finish meanwhile
+  std::this_thread::sleep_for(milliseconds(300));
+  assert(p.poll() == -1);
+  p.resume();
+  assert(!p.suspended());
+  assert(p.wait() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_suspend_group()
+{
+  std::cout << "Test::test_suspend_group" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "sleep 30 & echo $!; wait"},
+                     sp::output{sp::PIPE}, sp::process_group{});
+  char line[32] = {0};
+  assert(fgets(line, sizeof(line), p.output()));
+  int grandchild = std::atoi(line);
+  p.suspend();
+  assert(wait_state(grandchild, 'T'));
+  p.resume();
+  assert(wait_state(grandchild, 'S'));
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_suspended()
+{
+  std::cout << "Test::test_kill_suspended" << std::endl;
+  auto p = sp::Popen({"sleep", "30"});
+  p.suspend();
+  assert(wait_state(p.pid(), 'T'));
+  // SIGTERM is only acted on once the child runs again
+  p.kill(SIGTERM);
+  assert(!p.suspended());
+  assert(p.wait() == SIGTERM);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_load_shedder()
+{
+  std::cout << "Test::test_load_shedder" << std::endl;
+  sp::ShedThresholds th;
+  th.suspend_above = 40;
+  th.resume_below = 10;
+  sp::LoadShedder shed(th, milliseconds(0));
+
+  auto low = sp::Popen({"sleep", "30"});
+  auto high = sp::Popen({"sleep", "30"});
+  shed.add(high, 5);
+  shed.add(low, 1);
+
+  // Lowest priority first, one per update
+  shed.update(50);
+  assert(shed.is_suspended(low) && !shed.is_suspended(high));
+  assert(wait_state(low.pid(), 'T'));
+  shed.update(50);
+  assert(shed.suspended_count() == 2);
+
+  // Nothing happens in between the thresholds
+  shed.update(20);
+  assert(shed.suspended_count() == 2);
+
+  // Highest priority resumed first
+  shed.update(5);
+  assert(!shed.is_suspended(high) && shed.is_suspended(low));
+  assert(wait_state(high.pid(), 'S'));
+
+  // Reaped children are dropped
+  high.kill(SIGKILL);
+  high.wait();
+  shed.update(50);
+  assert(shed.suspended_count() == 1);
+
+  shed.remove(low);
+  assert(wait_state(low.pid(), 'S'));
+  low.kill(SIGKILL);
+  low.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_shed()
+{
+  std::cout << "Test::test_kill_shed" << std::endl;
+  sp::LoadShedder shed(sp::ShedThresholds(), milliseconds(0));
+  auto p = sp::Popen({"sleep", "30"}, sp::process_group{});
+  assert(p.pgid() == p.pid());
+  shed.add(p, 0);
+  shed.update(100);
+  assert(wait_state(p.pid(), 'T'));
+  // The Popen sees the stop, and SIGTERM resumes the child
+  assert(p.suspended());
+  p.kill(SIGTERM);
+  assert(!p.suspended());
+  assert(p.wait() == SIGTERM);
+  // Reaped, so it is dropped instead of being signalled
+  shed.update(0);
+  assert(shed.suspended_count() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_shedder_resumes_on_exit()
+{
+  std::cout << "Test::test_shedder_resumes_on_exit" << std::endl;
+  auto p = sp::Popen({"sleep", "30"});
+  {
+    sp::LoadShedder shed(sp::ShedThresholds(), milliseconds(0));
+    shed.add(p, 0);
+    shed.update(100);
+    assert(wait_state(p.pid(), 'T'));
+  }
+  assert(wait_state(p.pid(), 'S'));
+  p.kill(SIGKILL);
+  p.wait();
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_suspend_resume();
+  test_suspend_group();
+  test_kill_suspended();
+  test_load_shedder();
+  test_kill_shed();
+  test_shedder_resumes_on_exit();
+#endif
+  return 0;
+}
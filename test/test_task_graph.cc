@@ -0,0 +1,92 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+void test_task_graph_order()
+{
+  std::cout << "Test::test_task_graph_order" << std::endl;
+  sp::TaskGraph g;
+  auto a = g.add_task("a", {"/bin/sh", "-c", "echo a >> graph_order.txt"});
+  auto b = g.add_task("b", {"/bin/sh", "-c", "echo b >> graph_order.txt"});
+  auto c = g.add_task("c", {"/bin/sh", "-c", "echo c >> graph_order.txt"});
+  g.add_dependency(a, b);
+  g.add_dependency(b, c);
+
+  unlink("graph_order.txt");
+  auto res = g.run(4);
+  for (auto& r : res) assert(r.state == sp::TASK_SUCCEEDED);
+
+  auto obuf = sp::check_output({"cat", "graph_order.txt"});
+  assert(std::string(obuf.buf.data(), obuf.length) == "a\nb\nc\n");
+  unlink("graph_order.txt");
+  assert(g.durations().size() == 3);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_task_graph_failure_propagation()
+{
+  std::cout << "Test::test_task_graph_failure_propagation" << std::endl;
+  sp::TaskGraph g;
+  auto bad = g.add_task("bad", {"/bin/false"});
+  auto dep = g.add_task("dep", {"/bin/true"});
+  auto dep2 = g.add_task("dep2", {"/bin/true"});
+  auto other = g.add_task("other", {"/bin/true"});
+  auto missing = g.add_task("missing", {"no_such_command_for_graph"});
+  g.add_dependency(bad, dep);
+  g.add_dependency(dep, dep2);
+
+  auto res = g.run(2);
+  assert(res[bad].state == sp::TASK_FAILED && res[bad].retcode == 1);
+  assert(res[dep].state == sp::TASK_SKIPPED);
+  assert(res[dep2].state == sp::TASK_SKIPPED);
+  assert(res[other].state == sp::TASK_SUCCEEDED);
+  assert(res[missing].state == sp::TASK_FAILED);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_task_graph_pipe()
+{
+  std::cout << "Test::test_task_graph_pipe" << std::endl;
+  sp::TaskGraph g;
+  auto gen = g.add_task("gen", {"printf", "x\\ny\\nx\\n"});
+  auto filt = g.add_task("filter", {"/bin/sh", "-c", "grep -c x > graph_pipe.txt"});
+  g.add_pipe(gen, filt);
+
+  auto res = g.run(1);
+  assert(res[gen].state == sp::TASK_SUCCEEDED);
+  assert(res[filt].state == sp::TASK_SUCCEEDED);
+
+  auto obuf = sp::check_output({"cat", "graph_pipe.txt"});
+  assert(std::string(obuf.buf.data(), obuf.length) == "2\n");
+  unlink("graph_pipe.txt");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_task_graph_cycle()
+{
+  std::cout << "Test::test_task_graph_cycle" << std::endl;
+  sp::TaskGraph g;
+  auto a = g.add_task("a", {"/bin/true"});
+  auto b = g.add_task("b", {"/bin/true"});
+  g.add_dependency(a, b);
+  g.add_dependency(b, a);
+  bool caught = false;
+  try {
+    g.run(2);
+  } catch (std::runtime_error&) {
+    caught = true;
+  }
+  assert(caught);
+  std::cout << "END_TEST" << std::endl;
+}
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_task_graph_order();
+  test_task_graph_failure_propagation();
+  test_task_graph_pipe();
+  test_task_graph_cycle();
+#endif
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+using namespace std::chrono;
+
+#ifndef __USING_WINDOWS__
+void test_wait_timeout()
+{
+  std::cout << "Test::test_wait_timeout" << std::endl;
+  auto p = sp::Popen({"sleep", "10"});
+  auto start = steady_clock::now();
+  try {
+    p.wait(milliseconds(100));
+    assert(false);
+  } catch (const sp::TimeoutExpired& e) {
+    assert(e.retcode == SIGTERM);
+  }
+  assert(steady_clock::now() - start < seconds(2));
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_wait_in_time()
+{
+  std::cout << "Test::test_wait_in_time" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "exit 4"});
+  assert(p.wait(seconds(5)) == 4);
+  assert(p.retcode() == 4);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_kill_escalation()
+{
+  std::cout << "Test::test_kill_escalation" << std::endl;
+  // Ignores SIGTERM, so it takes SIGKILL after the grace period
+  auto p = sp::Popen({"sh", "-c", "trap '' TERM; echo ready; exec sleep 10"},
+                     sp::output{sp::PIPE},
+                     sp::timeout{milliseconds(300), milliseconds(100)});
+  try {
+    p.communicate();
+    assert(false);
+  } catch (const sp::TimeoutExpired& e) {
+    assert(e.retcode == SIGKILL);
+    assert(std::string(e.output.begin(), e.output.end()) == "ready\n");
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_communicate_partial_output()
+{
+  std::cout << "Test::test_communicate_partial_output" << std::endl;
+  auto p = sp::Popen({"sh", "-c", "echo out; echo err >&2; exec sleep 10"},
+                     sp::output{sp::PIPE}, sp::error{sp::PIPE});
+  try {
+    p.communicate(milliseconds(300));
+    assert(false);
+  } catch (const sp::TimeoutExpired& e) {
+    assert(std::string(e.output.begin(), e.output.end()) == "out\n");
+    assert(std::string(e.error.begin(), e.error.end()) == "err\n");
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_communicate_in_time()
+{
+  std::cout << "Test::test_communicate_in_time" << std::endl;
+  // Input larger than a pipe, echoed back while it is written
+  std::string msg(1 << 20, 'x');
+  auto p = sp::Popen({"cat"}, sp::input{sp::PIPE}, sp::output{sp::PIPE});
+  auto res = p.communicate(msg, seconds(10));
+  assert(res.first.length == msg.size());
+  assert(std::string(res.first.buf.data(), res.first.length) == msg);
+  assert(p.retcode() == 0);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_check_output_timeout()
+{
+  std::cout << "Test::test_check_output_timeout" << std::endl;
+  auto out = sp::check_output({"echo", "fast"}, sp::timeout{seconds(5)});
+  assert(std::string(out.buf.data(), out.length) == "fast\n");
+
+  try {
+    sp::check_output({"sleep", "10"}, sp::timeout{milliseconds(100)});
+    assert(false);
+  } catch (const sp::TimeoutExpired&) {
+  }
+
+  try {
+    sp::call({"sleep", "10"}, sp::deadline{steady_clock::now() + milliseconds(100)});
+    assert(false);
+  } catch (const sp::TimeoutExpired& e) {
+    assert(e.retcode == SIGTERM);
+  }
+
+  auto res = sp::try_check_output({"sh", "-c", "echo part; exec sleep 10"},
+                                  sp::timeout{milliseconds(300)});
+  assert(!res.ok());
+  assert(res.error.err == ETIMEDOUT);
+  assert(std::string(res.output.buf.data(), res.output.length) == "part\n");
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_session_timeout()
+{
+  std::cout << "Test::test_session_timeout" << std::endl;
+  // The grandchild holds the pipe open; it must die with its group
+  auto start = steady_clock::now();
+  auto p = sp::Popen({"sh", "-c", "sleep 10 & wait"}, sp::output{sp::PIPE},
+                     sp::session_leader{true}, sp::timeout{milliseconds(200)});
+  try {
+    p.communicate();
+    assert(false);
+  } catch (const sp::TimeoutExpired&) {
+  }
+  assert(steady_clock::now() - start < seconds(5));
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_wait_timeout();
+  test_wait_in_time();
+  test_kill_escalation();
+  test_communicate_partial_output();
+  test_communicate_in_time();
+  test_check_output_timeout();
+  test_session_timeout();
+#endif
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <fstream>
+#include <iostream>
+#include <subprocess.hpp>
+
+namespace sp = subprocess;
+
+#ifndef __USING_WINDOWS__
+size_t count_of(const std::string& text, const std::string& what)
+{
+  size_t n = 0;
+  for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1)) n++;
+  return n;
+}
+
+void test_timeline()
+{
+  std::cout << "Test::test_timeline" << std::endl;
+  auto& tracer = sp::Tracer::global();
+  // Room for two chunks, test_bounded fills the second
+  tracer.start(2 * sp::Tracer::CHUNK);
+  assert(tracer.enabled());
+
+  auto p = sp::Popen({"sh", "-c", "sleep 0.05; echo hello"}, sp::output{sp::PIPE});
+  p.communicate();
+  try {
+    sp::Popen({"/no/such/exe"});
+  } catch (const sp::CalledProcessError&) {
+  }
+  auto res = sp::pipeline("echo abc", "tr a-z A-Z", "cat");
+  assert(std::string(res.buf.data(), res.length) == "ABC\n");
+
+  auto trace = tracer.render();
+  if (!sp::STATS_ENABLED) {
+    assert(count_of(trace, "\"ph\": \"X\"") == 0);
+    std::cout << "END_TEST" << std::endl;
+    return;
+  }
+  assert(trace.find("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [") == 0);
+  assert(count_of(trace, "{") == count_of(trace, "}"));
+  // sh and the three stages
+  assert(count_of(trace, "\"name\": \"spawn\"") == 4);
+  assert(count_of(trace, "\"name\": \"thread_name\"") == 4);
+  // sh and all the stages were reaped
+  assert(count_of(trace, "\"name\": \"run\"") == 4);
+  assert(trace.find("\"exit_code\": 0, \"bytes_in\": 0, \"bytes_out\": 6") != std::string::npos);
+  assert(count_of(trace, "\"name\": \"first byte\"") == 2);
+  assert(trace.find("\"name\": \"spawn failed\"") != std::string::npos);
+  assert(trace.find("\"errno\": 2") != std::string::npos);
+  // The stages are linked by two arrows
+  assert(count_of(trace, "\"ph\": \"s\"") == 2);
+  assert(count_of(trace, "\"ph\": \"f\", \"pid\"") == 2);
+  assert(tracer.dropped() == 0);
+
+  const char* path = "subprocess.trace.json";
+  tracer.write(path);
+  std::ifstream in(path);
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  assert(text == tracer.render());
+  std::remove(path);
+
+  tracer.stop();
+  sp::Popen({"true"}).wait();
+  assert(count_of(tracer.render(), "\"name\": \"spawn\"") == 4);
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_bounded()
+{
+  std::cout << "Test::test_bounded" << std::endl;
+  auto& tracer = sp::Tracer::global();
+  tracer.start();
+  std::thread t([] {
+    for (size_t i = 0; i < sp::Tracer::CHUNK; i++) sp::Popen({"true"}).wait();
+  });
+  t.join();
+  auto trace = tracer.render();
+  tracer.stop();
+  if (sp::STATS_ENABLED) {
+    // The thread filled the second chunk, the buffer
+    // kept its capacity from the first start()
+    assert(tracer.dropped() == sp::Tracer::CHUNK);
+    assert(count_of(trace, "\"name\": \"spawn\"") == 4 + sp::Tracer::CHUNK / 2);
+  }
+  std::cout << "END_TEST" << std::endl;
+}
+
+void test_clear()
+{
+  std::cout << "Test::test_clear" << std::endl;
+  auto& tracer = sp::Tracer::global();
+  tracer.clear();
+  assert(!tracer.enabled());
+  assert(tracer.dropped() == 0);
+  assert(count_of(tracer.render(), "\"name\": \"spawn\"") == 0);
+
+  // A new buffer, the chunk this thread had claimed is gone
+  tracer.start(sp::Tracer::CHUNK);
+  sp::Popen({"true"}).wait();
+  tracer.stop();
+  auto trace = tracer.render();
+  if (sp::STATS_ENABLED) {
+    assert(count_of(trace, "\"name\": \"spawn\"") == 1);
+    assert(count_of(trace, "\"name\": \"run\"") == 1);
+    assert(tracer.dropped() == 0);
+  }
+  tracer.clear();
+  std::cout << "END_TEST" << std::endl;
+}
+#endif
+
+int main() {
+#ifndef __USING_WINDOWS__
+  test_timeline();
+  test_bounded();
+  test_clear();
+#endif
+  return 0;
+}